@@ -18,6 +18,7 @@
 #include "drivers/_avr.h"
 #include "drivers/_motors.h"
 #include "drivers/_lcd.h"
+#include "drivers/_efc.h"
 #include "drivers/_sensors.h"
 #include "drivers/_usb.h"
 #include "drivers/i2c.h"
@@ -34,6 +35,7 @@ static nx_closure_t shutdown_handler = NULL;
 
 static void core_init(void) {
   nx__aic_init();
+  nx__efc_init();
   nx_interrupts_enable();
   nx__systick_init();
   nx__sound_init();
@@ -84,6 +86,13 @@ void nx_core_register_shutdown_handler(nx_closure_t handler) {
   shutdown_handler = handler;
 }
 
+void nx_core_idle(void) {
+  /* The PMC turns the processor clock back on when an interrupt is
+   * raised.
+   */
+  *AT91C_PMC_SCDR = AT91C_PMC_PCK;
+}
+
 void nx__kernel_main(void) {
   core_init();
   check_boot_errors();
@@ -50,6 +50,19 @@ void nx_core_halt(void);
  */
 void nx_core_register_shutdown_handler(nx_closure_t handler);
 
+/** Stop the processor until the next interrupt.
+ *
+ * The processor clock is disabled, which saves power, while the master
+ * clock and the peripherals keep running. Any enabled interrupt turns
+ * the processor clock back on, and the system timer's interrupt comes
+ * at least every millisecond.
+ *
+ * @note If interrupts are disabled when this is called, the processor
+ * wakes up on the next interrupt but does not take it until they are
+ * enabled again.
+ */
+void nx_core_idle(void);
+
 /*@}*/
 /*@}*/
 
@@ -7,6 +7,11 @@
  */
 
 /* Driver for the NXT Embedded Flash Controller.
+ *
+ * Flash operations are queued and run one after the other by the
+ * controller. Each one is started as soon as the previous one is
+ * done, from the flash ready interrupt, so callers only block when
+ * they need the result.
  */
 
 #include "base/at91sam7s256.h"
@@ -15,71 +20,235 @@
 #include "base/nxt.h"
 #include "base/interrupts.h"
 #include "base/assert.h"
-#include "base/drivers/systick.h"
+#include "base/util.h"
 #include "base/drivers/_efc.h"
 
+#ifdef NX_HOST_BUILD
+#include "base/drivers/_efc_sim.h"
+#else
+/* MC register accessors. Host builds use the simulated register model
+ * instead.
+ */
+#define EFC_READ_FSR() (*AT91C_MC_FSR)
+#define EFC_WRITE_FCR(cmd) (*AT91C_MC_FCR = (cmd))
+#define EFC_FMR (*AT91C_MC_FMR)
+#endif
+
 #define EFC_WRITE ((EFC_WRITE_KEY << 24) + EFC_CMD_WP)
-#define EFC_THROTTLE_TIMER 2
+
+/* A queued page programming operation. */
+typedef struct {
+  U32 page;
+  U32 data[EFC_PAGE_WORDS];
+  bool erase; /* Erase the page before programming it? */
+  nx__efc_callback_t callback;
+} efc_op_t;
+
+static struct {
+  efc_op_t ops[EFC_QUEUE_SIZE];
+  volatile U8 head;     /* Oldest operation, running if busy. */
+  volatile U8 count;    /* Number of queued operations. */
+  volatile bool busy;   /* Is the controller running an operation? */
+  volatile bool error;  /* Did an operation fail since the last sync? */
+} efc_queue;
 
 void nx__efc_init(void) {
+  efc_queue.head = efc_queue.count = 0;
+  efc_queue.busy = efc_queue.error = FALSE;
+
+  /* The ready interrupt is only enabled while an operation runs. */
+  EFC_FMR &= ~AT91C_MC_FRDY;
 }
 
-static bool nx__efc_do_write(U32 page) {
-  U32 ret;
+/* Start the operation at the head of the queue, if any. Must be called
+ * with interrupts disabled, while the controller is ready.
+ */
+static void nx__efc_start(void) {
+  efc_op_t *op;
+  U8 i;
 
-  NX_ASSERT(page < EFC_PAGES);
+  if (efc_queue.count == 0) {
+    EFC_FMR &= ~AT91C_MC_FRDY;
+    return;
+  }
 
-  /* Trigger the flash write command. */
-  *AT91C_MC_FCR = EFC_WRITE + ((page & 0x000003FF) << 8);
+  op = &(efc_queue.ops[efc_queue.head]);
 
-  /* Wait for the command to complete. */
-  do {
-    ret = *AT91C_MC_FSR;
-  } while (!(ret & AT91C_MC_FRDY));
+  /* Write the page data to the flash in-memory mapping. */
+  for (i=0 ; i<EFC_PAGE_WORDS ; i++) {
+    FLASH_BASE_PTR[i+op->page*EFC_PAGE_WORDS] = op->data[i];
+  }
+
+  if (op->erase) {
+    EFC_FMR &= ~AT91C_MC_NEBP;
+  } else {
+    EFC_FMR |= AT91C_MC_NEBP;
+  }
+
+  /* Trigger the flash write command, and get notified when it's done. */
+  efc_queue.busy = TRUE;
+  EFC_WRITE_FCR(EFC_WRITE + ((op->page & 0x000003FF) << 8));
+  EFC_FMR |= AT91C_MC_FRDY;
+}
+
+void nx__efc_fast_update(void) {
+  nx__efc_callback_t callback;
+  bool success;
+  U32 status, page;
+
+  if (!efc_queue.busy) {
+    return;
+  }
 
   /* Check the command result by reading the status register
    * only once to avoid the bits being cleared.
    */
-  if (ret & AT91C_MC_LOCKE || ret & AT91C_MC_PROGE)
-    return FALSE;
+  status = EFC_READ_FSR();
+  if (!(status & AT91C_MC_FRDY)) {
+    return;
+  }
 
-  return TRUE;
-}
+  success = !(status & AT91C_MC_LOCKE || status & AT91C_MC_PROGE);
+  if (!success) {
+    efc_queue.error = TRUE;
+  }
+
+  page = efc_queue.ops[efc_queue.head].page;
+  callback = efc_queue.ops[efc_queue.head].callback;
 
-static inline void nx__efc_wait_for_flash(void) {
-  while (!(*AT91C_MC_FSR & AT91C_MC_FRDY));
+  efc_queue.head = (efc_queue.head + 1) % EFC_QUEUE_SIZE;
+  efc_queue.count--;
+  efc_queue.busy = FALSE;
+
+  nx__efc_start();
+
+  if (callback) {
+    callback(page, success);
+  }
 }
 
-/* Write one page at the given page number in the flash.
- * Use interrupt-driven flash programming ?
+/* Give the controller a chance to move on to the next operation.
+ * Polling, rather than only waiting for the interrupt, keeps the
+ * queue going when called with interrupts disabled.
  */
-bool nx__efc_write_page(U32 *data, U32 page) {
-  U8 i;
+static void nx__efc_poll(void) {
+  nx_interrupts_disable();
+  nx__efc_fast_update();
+  nx_interrupts_enable();
+}
+
+static void nx__efc_queue(U32 *data, U32 page, bool erase,
+                          nx__efc_callback_t callback) {
+  efc_op_t *op;
 
   NX_ASSERT(page < EFC_PAGES);
 
-  /* Wait for the flash to be ready. */
-  nx__efc_wait_for_flash();
-  nx_systick_wait_ms(EFC_THROTTLE_TIMER);
+  /* Wait for a free slot in the queue. */
+  for (;;) {
+    nx_interrupts_disable();
+    if (efc_queue.count < EFC_QUEUE_SIZE) {
+      break;
+    }
+
+    nx__efc_fast_update();
+    nx_interrupts_enable();
+  }
+
+  op = &(efc_queue.ops[(efc_queue.head + efc_queue.count) % EFC_QUEUE_SIZE]);
+  op->page = page;
+  op->erase = erase;
+  op->callback = callback;
+  memcpy(op->data, data, EFC_PAGE_BYTES);
+  efc_queue.count++;
+
+  if (!efc_queue.busy) {
+    nx__efc_start();
+  }
+
+  nx_interrupts_enable();
+}
+
+void nx__efc_write_page_async(U32 *data, U32 page,
+                              nx__efc_callback_t callback) {
+  nx__efc_queue(data, page, TRUE, callback);
+}
+
+void nx__efc_program_page_async(U32 *data, U32 page,
+                                nx__efc_callback_t callback) {
+  nx__efc_queue(data, page, FALSE, callback);
+}
+
+void nx__efc_erase_page_async(U32 page, U32 value,
+                              nx__efc_callback_t callback) {
+  U32 data[EFC_PAGE_WORDS];
+  U8 i;
 
-  /* Write the page data to the flash in-memory mapping. */
   for (i=0 ; i<EFC_PAGE_WORDS ; i++) {
-      FLASH_BASE_PTR[i+page*EFC_PAGE_WORDS] = data[i];
+    data[i] = value;
   }
 
-  return nx__efc_do_write(page);
+  nx__efc_write_page_async(data, page, callback);
+}
+
+bool nx__efc_ready(void) {
+  return efc_queue.count == 0;
+}
+
+void nx__efc_wait(void) {
+  while (efc_queue.count > 0) {
+    nx__efc_poll();
+  }
+}
+
+bool nx__efc_sync(void) {
+  bool success;
+
+  nx__efc_wait();
+
+  nx_interrupts_disable();
+  success = !efc_queue.error;
+  efc_queue.error = FALSE;
+  nx_interrupts_enable();
+
+  return success;
 }
 
-/* TODO: figure out if its faster or not to retrieve the
- * data or just a pointer, relative to the data retrieval
- * mechanism from the flash.
+/* Run one operation to completion, and report its own outcome only. */
+static bool nx__efc_run(U32 *data, U32 page, bool erase) {
+  bool earlier_error, success;
+
+  nx__efc_wait();
+  earlier_error = efc_queue.error;
+  efc_queue.error = FALSE;
+
+  nx__efc_queue(data, page, erase, NULL);
+  nx__efc_wait();
+
+  success = !efc_queue.error;
+  efc_queue.error = earlier_error;
+
+  return success;
+}
+
+/* Write one page at the given page number in the flash.
  */
+bool nx__efc_write_page(U32 *data, U32 page) {
+  return nx__efc_run(data, page, TRUE);
+}
+
+bool nx__efc_program_page(U32 *data, U32 page) {
+  return nx__efc_run(data, page, FALSE);
+}
+
 void nx__efc_read_page(U32 page, U32 *data) {
   U8 i;
 
   NX_ASSERT(page < EFC_PAGES);
 
-  nx_systick_wait_ms(EFC_THROTTLE_TIMER);
+  /* The flash can't be read while being programmed, and queued writes
+   * to that page must land first.
+   */
+  nx__efc_wait();
 
   for (i=0; i<EFC_PAGE_WORDS; i++) {
     data[i] = FLASH_BASE_PTR[page*EFC_PAGE_WORDS+i];
@@ -87,21 +256,14 @@ void nx__efc_read_page(U32 page, U32 *data) {
 }
 
 bool nx__efc_erase_page(U32 page, U32 value) {
+  U32 data[EFC_PAGE_WORDS];
   U8 i;
 
-  NX_ASSERT(page < EFC_PAGES);
-
-  /* Wait for the flash to be ready. */
-  nx__efc_wait_for_flash();
-  nx_systick_wait_ms(EFC_THROTTLE_TIMER);
-
-  /* Write the page data to the flash in-memory mapping. */
   for (i=0 ; i<EFC_PAGE_WORDS ; i++) {
-      FLASH_BASE_PTR[i+page*EFC_PAGE_WORDS] = value;
+    data[i] = value;
   }
 
-  return nx__efc_do_write(page);
+  return nx__efc_run(data, page, TRUE);
 }
 
 /* TODO: implement other flash operations? */
-
@@ -24,6 +24,11 @@
  *
  * The flash driver provides a software interface to the on-board
  * flash memory through the embedded flash controller.
+ *
+ * Page writes are queued and programmed in the background, each one
+ * being started from the flash ready interrupt of the previous
+ * one. The blocking functions simply queue their operation and wait
+ * for the queue to drain.
  */
 /*@{*/
 
@@ -57,29 +62,131 @@ typedef enum {
     EFC_CMD_SSB = 0x0F,
 } efc_cmd;
 
+/** Value of an erased flash word. Programming a page can only clear
+ * bits, so a page must read as this everywhere to be programmed
+ * without erasing it first.
+ */
+#define EFC_ERASED_WORD 0xFFFFFFFF
+
+/** Number of flash operations that can be queued. */
+#define EFC_QUEUE_SIZE 4
+
+#ifdef NX_HOST_BUILD
+/** On host builds, the flash is simulated in RAM. */
+extern volatile U32 nx__efc_sim_flash[];
+
+/** A usable pointer to the base address of the flash. */
+#define FLASH_BASE_PTR (nx__efc_sim_flash)
+#else
 /** A usable pointer to the base address of the flash. */
 #define FLASH_BASE_PTR ((volatile U32 *)AT91C_IFLASH)
+#endif
+
+/** Completion callback of a queued flash operation.
+ *
+ * @param page The page number of the completed operation.
+ * @param success FALSE if the controller reported a lock or
+ * programming error.
+ *
+ * @note Callbacks run in interrupt context.
+ */
+typedef void (*nx__efc_callback_t)(U32 page, bool success);
 
 /** Initialize the flash subsystem. */
 void nx__efc_init(void);
 
-/** Write a page to the flash.
+/** Move the operation queue forward if the controller is done. This
+ * is called from the system interrupt handler, which the flash ready
+ * interrupt shares with the system timer.
+ */
+void nx__efc_fast_update(void);
+
+/** Queue a page write to the flash.
+ *
+ * @param data A pointer to the 64 U32s of the page. The data is copied,
+ * so the buffer can be reused as soon as the function returns.
+ * @param page The page number in the flash memory.
+ * @param callback A function to call once the page is written, or NULL.
+ *
+ * @note This function returns immediately, unless the queue is full, in
+ * which case it waits for a slot.
+ */
+void nx__efc_write_page_async(U32 *data, U32 page,
+                              nx__efc_callback_t callback);
+
+/** Queue the programming of an erased page. This skips the erase step
+ * of a page write, which takes about half of its time.
+ *
+ * @param data A pointer to the 64 U32s of the page. The data is copied,
+ * so the buffer can be reused as soon as the function returns.
+ * @param page The page number in the flash memory.
+ * @param callback A function to call once the page is written, or NULL.
+ *
+ * @warning The page must be erased, that is read as EFC_ERASED_WORD
+ * everywhere, by the time the operation runs. Otherwise, the data ends
+ * up combined with the previous contents.
+ */
+void nx__efc_program_page_async(U32 *data, U32 page,
+                                nx__efc_callback_t callback);
+
+/** Queue a page erase to the given value.
+ *
+ * @param page The page number in the flash memory.
+ * @param value The value to set on the page (repeated EFC_PAGE_WORDS
+ * times).
+ * @param callback A function to call once the page is erased, or NULL.
+ *
+ * @note This function returns immediately, unless the queue is full, in
+ * which case it waits for a slot.
+ */
+void nx__efc_erase_page_async(U32 page, U32 value,
+                              nx__efc_callback_t callback);
+
+/** Check the readiness of the flash driver.
+ *
+ * @return TRUE if no operation is queued or running, FALSE otherwise.
+ */
+bool nx__efc_ready(void);
+
+/** Wait for all the queued operations to complete. The flash must not
+ * be read through FLASH_BASE_PTR while operations are pending.
+ */
+void nx__efc_wait(void);
+
+/** Wait for all the queued operations to complete, and report their
+ * outcome.
+ *
+ * @return FALSE if any queued operation failed since the last call to
+ * this function, TRUE otherwise.
+ */
+bool nx__efc_sync(void);
+
+/** Write a page to the flash, and wait for the write to complete.
  *
  * @param data A pointer to the 64 U32s of the page.
  * @param page The page number in the flash memory.
+ * @return TRUE if the page was successfully written.
  */
 bool nx__efc_write_page(U32 *data, U32 page);
 
-/** Read a page from the flash.
+/** Program an erased page, and wait for the write to complete.
  *
- * Actually, just retrieve a pointer to the data.
+ * @param data A pointer to the 64 U32s of the page.
+ * @param page The page number in the flash memory.
+ * @return TRUE if the page was successfully written.
+ *
+ * @see nx__efc_program_page_async
+ */
+bool nx__efc_program_page(U32 *data, U32 page);
+
+/** Read a page from the flash, once the queued operations are done.
  *
  * @param page The page number in the flash memory.
  * @param data A pointer to a 64 U32s long array for the page data.
  */
 void nx__efc_read_page(U32 page, U32 *data);
 
-/** Erase a page to the given value.
+/** Erase a page to the given value, and wait for the erase to complete.
  *
  * @param page The page number in tho flash memory.
  * @param value The value to set on the page (repeated EFC_PAGE_WORDS
@@ -0,0 +1,144 @@
+/* Copyright (c) 2008 the NxOS developers
+ *
+ * See AUTHORS for a full list of the developers.
+ *
+ * Redistribution of this file is permitted under
+ * the terms of the GNU Public License (GPL) version 2.
+ */
+
+/* Simulated MC flash registers, for host builds of the flash driver.
+ * This compiles to nothing in target builds.
+ */
+
+#ifdef NX_HOST_BUILD
+
+#include "base/at91sam7s256.h"
+
+#include "base/types.h"
+#include "base/drivers/_efc.h"
+#include "base/drivers/_efc_sim.h"
+
+/* Number of pages in one lock region. */
+#define EFC_SIM_REGION_PAGES (EFC_PAGES / EFC_LOCK_REGIONS)
+
+volatile U32 nx__efc_sim_flash[EFC_PAGES * EFC_PAGE_WORDS];
+
+efc_sim_t nx__efc_sim;
+
+/* What the flash cells hold. The driver stores the page data right
+ * into the flash array before the write command, as it loads the
+ * hardware latch buffer, so the cells are kept apart to be combined
+ * with it.
+ */
+static U32 efc_sim_cells[EFC_PAGES * EFC_PAGE_WORDS];
+
+void nx__efc_sim_reset(U32 latency) {
+  U32 i;
+
+  nx__efc_sim.fmr = 0;
+  nx__efc_sim.fsr = AT91C_MC_FRDY;
+  nx__efc_sim.latency = latency;
+  nx__efc_sim.remaining = 0;
+  nx__efc_sim.locked = 0;
+  nx__efc_sim.commands = 0;
+  nx__efc_sim.errors = 0;
+  nx__efc_sim.erases = 0;
+  nx__efc_sim.busy_us = 0;
+  nx__efc_sim.overwrites = 0;
+  nx__efc_sim.power_cut = 0;
+
+  for (i=0; i<EFC_PAGES * EFC_PAGE_WORDS; i++) {
+    efc_sim_cells[i] = nx__efc_sim_flash[i];
+  }
+}
+
+static void nx__efc_sim_step(void) {
+  if (nx__efc_sim.remaining > 0 && --nx__efc_sim.remaining == 0) {
+    nx__efc_sim.fsr |= AT91C_MC_FRDY;
+  }
+}
+
+U32 nx__efc_sim_read_fsr(void) {
+  U32 fsr = nx__efc_sim.fsr;
+
+  nx__efc_sim.fsr &= ~(AT91C_MC_LOCKE | AT91C_MC_PROGE);
+  nx__efc_sim_step();
+
+  return fsr;
+}
+
+void nx__efc_sim_write_fcr(U32 cmd) {
+  U32 page = (cmd >> 8) & 0x3FF, i;
+  bool overwrite = FALSE;
+
+  /* Commands are only accepted by an idle controller, with the right
+   * key. Only page writes are modelled.
+   */
+  if (!(nx__efc_sim.fsr & AT91C_MC_FRDY) || (cmd >> 24) != EFC_WRITE_KEY ||
+      (cmd & 0xF) != EFC_CMD_WP) {
+    nx__efc_sim.fsr |= AT91C_MC_PROGE;
+    nx__efc_sim.errors++;
+    return;
+  }
+
+  if (nx__efc_sim.locked & (1 << (page / EFC_SIM_REGION_PAGES))) {
+    nx__efc_sim.fsr |= AT91C_MC_LOCKE;
+    nx__efc_sim.errors++;
+    return;
+  }
+
+  /* Without power, the latch buffer is lost, and the cells are left
+   * as they are.
+   */
+  if (nx__efc_sim.power_cut > 0 &&
+      nx__efc_sim.commands + 1 >= nx__efc_sim.power_cut) {
+    for (i=page*EFC_PAGE_WORDS; i<(page+1)*EFC_PAGE_WORDS; i++) {
+      nx__efc_sim_flash[i] = efc_sim_cells[i];
+    }
+
+    return;
+  }
+
+  nx__efc_sim.commands++;
+  nx__efc_sim.busy_us += EFC_SIM_PROGRAM_US;
+
+  if (!(nx__efc_sim.fmr & AT91C_MC_NEBP)) {
+    nx__efc_sim.erases++;
+    nx__efc_sim.busy_us += EFC_SIM_ERASE_US;
+  }
+
+  /* Programming can only clear bits, unless the page is erased first. */
+  for (i=page*EFC_PAGE_WORDS; i<(page+1)*EFC_PAGE_WORDS; i++) {
+    U32 latch = nx__efc_sim_flash[i];
+
+    if (!(nx__efc_sim.fmr & AT91C_MC_NEBP)) {
+      efc_sim_cells[i] = latch;
+    } else {
+      overwrite |= (latch & ~efc_sim_cells[i]) != 0;
+      efc_sim_cells[i] &= latch;
+    }
+
+    nx__efc_sim_flash[i] = efc_sim_cells[i];
+  }
+
+  if (overwrite) {
+    nx__efc_sim.overwrites++;
+  }
+
+  if (nx__efc_sim.latency == 0) {
+    return;
+  }
+
+  nx__efc_sim.fsr &= ~AT91C_MC_FRDY;
+  nx__efc_sim.remaining = nx__efc_sim.latency;
+}
+
+void nx__efc_sim_tick(void) {
+  nx__efc_sim_step();
+
+  if ((nx__efc_sim.fmr & AT91C_MC_FRDY) && (nx__efc_sim.fsr & AT91C_MC_FRDY)) {
+    nx__efc_fast_update();
+  }
+}
+
+#endif /* NX_HOST_BUILD */
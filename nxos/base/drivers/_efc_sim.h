@@ -0,0 +1,97 @@
+/** @file _efc_sim.h
+ *  @brief Simulated Embedded Flash Controller registers.
+ *
+ * Host-side model of the memory controller flash registers.
+ */
+
+/* Copyright (c) 2008 the NxOS developers
+ *
+ * See AUTHORS for a full list of the developers.
+ *
+ * Redistribution of this file is permitted under
+ * the terms of the GNU Public License (GPL) version 2.
+ */
+
+#ifndef __NXOS_BASE_DRIVERS__EFC_SIM_H__
+#define __NXOS_BASE_DRIVERS__EFC_SIM_H__
+
+#include "base/types.h"
+
+/** @addtogroup driverinternal */
+/*@{*/
+
+/** @defgroup efcsim Simulated flash controller
+ *
+ * When built with NX_HOST_BUILD, the flash driver talks to this model
+ * instead of the memory controller registers, and the flash itself is
+ * a RAM array. This lets the driver and the file system run on the
+ * host.
+ *
+ * Time only moves forward when the model is stepped: every status
+ * register read is one step, and the host can step it explicitly with
+ * nx__efc_sim_tick(), which also delivers the flash ready interrupt.
+ */
+/*@{*/
+
+/** Modelled time to erase a page before programming it, in
+ * microseconds. Writes erase first unless the NEBP bit is set.
+ */
+#define EFC_SIM_ERASE_US 3000
+
+/** Modelled time to program a page, in microseconds. */
+#define EFC_SIM_PROGRAM_US 3000
+
+/** Simulated register file and model state. */
+typedef struct {
+  U32 fmr;       /**< Flash mode register. */
+  U32 fsr;       /**< Flash status register. */
+  U32 latency;   /**< Number of steps a command takes to complete. */
+  U32 remaining; /**< Steps left before the running command completes. */
+  U16 locked;    /**< Bitmap of the locked regions. */
+  U32 commands;  /**< Number of commands run so far. */
+  U32 errors;    /**< Number of commands rejected so far. */
+  U32 erases;    /**< Number of pages erased so far. */
+  U32 busy_us;   /**< Modelled flash busy time so far, in microseconds. */
+  U32 overwrites; /**< Number of pages programmed without an erase with
+                   * data setting bits the page had cleared. Like the
+                   * hardware, the model only clears them, so this
+                   * should stay at zero.
+                   */
+  U32 power_cut; /**< Number of the first command dropped as the
+                  * flash loses power, counting from 1, or 0. All
+                  * the following ones are dropped too.
+                  */
+} efc_sim_t;
+
+/** The simulated controller. */
+extern efc_sim_t nx__efc_sim;
+
+/** Reset the model to an idle controller. The flash contents are kept,
+ * and taken as what the flash cells hold.
+ *
+ * @param latency The number of steps each command takes.
+ */
+void nx__efc_sim_reset(U32 latency);
+
+/** Read the flash status register. Like the hardware, this clears the
+ * error bits, and it moves the model one step forward.
+ */
+U32 nx__efc_sim_read_fsr(void);
+
+/** Write the flash command register, starting a command. */
+void nx__efc_sim_write_fcr(U32 cmd);
+
+/** Move the model one step forward, and deliver the flash ready
+ * interrupt to the driver if it is enabled and pending.
+ */
+void nx__efc_sim_tick(void);
+
+/** MC register accessors used by the driver. */
+#define EFC_READ_FSR() nx__efc_sim_read_fsr()
+#define EFC_WRITE_FCR(cmd) nx__efc_sim_write_fcr(cmd)
+#define EFC_FMR (nx__efc_sim.fmr)
+
+/*@}*/
+/*@}*/
+
+#endif /* __NXOS_BASE_DRIVERS__EFC_SIM_H__ */
@@ -14,6 +14,7 @@
 #include "base/drivers/aic.h"
 #include "base/drivers/_avr.h"
 #include "base/drivers/_lcd.h"
+#include "base/drivers/_efc.h"
 
 #include "base/drivers/_systick.h"
 
@@ -57,6 +58,13 @@ static nx_closure_t scheduler_cb = NULL;
  */
 static bool scheduler_inhibit = FALSE;
 
+/* The scheduler hold. If TRUE, the high priority interrupt handler does
+ * not invoke the scheduler callback until the system time reaches
+ * scheduler_deadline.
+ */
+static volatile bool scheduler_held = FALSE;
+static U32 scheduler_deadline;
+
 /* Low priority handler, called 1000 times a second by the high
  * priority handler if a scheduler callback is registered.
  */
@@ -72,6 +80,17 @@ static void systick_sched(void) {
 /* High priority handler, called 1000 times a second */
 static void systick_isr(void) {
   U32 status;
+
+  /* The flash controller shares the system interrupt line with the
+   * PIT. Checking it on every system interrupt, and not only when it
+   * raised the line, also catches up on any missed ready edge.
+   */
+  nx__efc_fast_update();
+
+  /* Only count a tick if the PIT is the one that fired. */
+  if (!(*AT91C_PITC_PISR & AT91C_PITC_PITS))
+    return;
+
   /* The PIT's value register must be read to acknowledge the
    * interrupt.
    */
@@ -94,7 +113,10 @@ static void systick_isr(void) {
    */
   nx__lcd_fast_update();
 
-  if (!scheduler_inhibit)
+  if (scheduler_held && systick_time == scheduler_deadline)
+    scheduler_held = FALSE;
+
+  if (!scheduler_inhibit && !scheduler_held)
     nx_systick_call_scheduler();
 }
 
@@ -123,6 +145,24 @@ U32 nx_systick_get_ms(void) {
   return systick_time;
 }
 
+U32 nx_systick_get_cycles(void) {
+  U32 ms, piir;
+
+  nx_interrupts_disable();
+  ms = systick_time;
+  piir = *AT91C_PITC_PIIR;
+  nx_interrupts_enable();
+
+  /* Reading the image register does not acknowledge the PIT. Periods
+   * that ended since the last tick was counted are still in the
+   * counter field, and the time must include them.
+   */
+  ms += (piir & AT91C_PITC_PICNT) >> 20;
+
+  return ms * (NXT_CLOCK_FREQ / SYSIRQ_FREQ) +
+    (piir & AT91C_PITC_CPIV) * (NXT_CLOCK_FREQ / PIT_BASE_FREQUENCY);
+}
+
 void nx_systick_wait_ms(U32 ms) {
   U32 final = systick_time + ms;
 
@@ -142,6 +182,8 @@ void nx_systick_install_scheduler(nx_closure_t sched_cb) {
 }
 
 void nx_systick_call_scheduler(void) {
+  scheduler_held = FALSE;
+
   /* If the application kernel set a scheduling callback, trigger the
    * lower priority IRQ in which the scheduler runs.
    */
@@ -149,6 +191,20 @@ void nx_systick_call_scheduler(void) {
     nx_aic_set(SCHEDULER_SYSIRQ);
 }
 
+void nx_systick_hold_scheduler(U32 time) {
+  nx_interrupts_disable();
+
+  /* The deadline is matched exactly, one tick at a time, so it must be
+   * in the future.
+   */
+  if ((S32)(time - systick_time) > 0) {
+    scheduler_deadline = time;
+    scheduler_held = TRUE;
+  }
+
+  nx_interrupts_enable();
+}
+
 void nx_systick_mask_scheduler(void) {
   scheduler_inhibit = TRUE;
 }
@@ -30,6 +30,18 @@
 /** Return the number of milliseconds elapsed since bootup. */
 U32 nx_systick_get_ms(void);
 
+/** Return a cycle count, for timing short operations.
+ *
+ * The count is derived from the system time and the system timer's
+ * current period value. The timer runs at 1/16th of the master clock,
+ * so the count advances by steps of 16 cycles.
+ *
+ * @return The number of master clock cycles elapsed since bootup,
+ * modulo 2^32. It wraps around about every 89 seconds, so only
+ * differences between two close counts are meaningful.
+ */
+U32 nx_systick_get_cycles(void);
+
 /** Sleep for @a ms milliseconds.
  *
  * @param ms The number of milliseconds to sleep.
@@ -52,9 +64,10 @@ void nx_systick_wait_ns(U32 ns);
 /** Install @a scheduler_cb as the scheduler callback.
  *
  * The scheduler callback will be invoked every millisecond once it is
- * installed. The scheduler callback runs in a medium priority interrupt
- * handler (higher than all the device drivers expect for the AVR link
- * and system timer).
+ * installed, except while held by nx_systick_hold_scheduler(). The
+ * scheduler callback runs in a medium priority interrupt handler
+ * (higher than all the device drivers expect for the AVR link and
+ * system timer).
  *
  * @param scheduler_cb The scheduler callback to install.
  *
@@ -74,6 +87,23 @@ void nx_systick_install_scheduler(nx_closure_t scheduler_cb);
  */
 void nx_systick_call_scheduler(void);
 
+/** Skip the periodic scheduler callbacks until system time @a time.
+ *
+ * The system timer still interrupts every millisecond, to keep time
+ * and to keep the AVR link up. It no longer raises the scheduler
+ * interrupt on each tick, until the tick where the system time reaches
+ * @a time. A scheduler with nothing to do until some deadline, such as
+ * the next alarm of an idle system, can use this to save the work of
+ * the ticks in between.
+ *
+ * The hold also ends when nx_systick_call_scheduler() is called.
+ *
+ * @param time The system time, in milliseconds, of the next tick that
+ * calls the scheduler. If it is not in the future, the call has no
+ * effect.
+ */
+void nx_systick_hold_scheduler(U32 time);
+
 /** Inhibit the scheduler callback temporarily.
  *
  * This will simply prevent the systick driver from calling the
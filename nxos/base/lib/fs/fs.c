@@ -17,16 +17,65 @@
 #include "base/drivers/_efc.h"
 
 #include "base/lib/fs/fs.h"
+#include "base/lib/lz/lz.h"
 
 /* Magic marker. */
 #define FS_FILE_ORIGIN_MARKER 0x42
 
+/* Magic marker of a file's continuation extents. */
+#define FS_FILE_EXTENT_MARKER 0x43
+
+/* Magic marker of a new version of a file being written by
+ * nx_fs_replace().
+ */
+#define FS_FILE_SHADOW_MARKER 0x4E
+
+/* Magic marker of a complete new version of a file, waiting for the
+ * old one to be wiped. Each of the shadow, pending and origin markers
+ * only has bits cleared from the previous one, so that the header can
+ * go from one to the next with a page program, without an erase.
+ */
+#define FS_FILE_PENDING_MARKER 0x4A
+
+/* Magic marker of a continuation extent whose new size nx_fs_close()
+ * has not committed yet. Its sequence number word also holds its
+ * previous size. The marker and that word only have bits set over
+ * those of a continuation extent, which they go back to with a page
+ * program.
+ */
+#define FS_FILE_GROWING_MARKER 0x47
+
+/* Flags set in the marker of an extent's copy made by the background
+ * defragmentation. The copy is written with both, and clearing the
+ * copying flag once it is complete commits it over its source. The
+ * moved flag goes last, once the source is gone.
+ */
+#define FS_FILE_MOVED_FLAG 0x80
+#define FS_FILE_COPYING_FLAG 0x20
+#define FS_FILE_MOVE_MASK (FS_FILE_MOVED_FLAG | FS_FILE_COPYING_FLAG)
+
 /* File metadata size, in U32s. */
 #define FS_FILE_METADATA_SIZE 10
 
 /** Filename offset (in U32s) in the metadata. */
 #define FS_FILENAME_OFFSET 2
 
+/** Sequence number offset (in U32s) in a continuation extent's
+ * metadata.
+ */
+#define FS_EXTENT_SEQ_OFFSET 1
+
+/** Sequence number mask, and previous size shift, in a growing
+ * continuation extent's sequence number word.
+ */
+#define FS_EXTENT_SEQ_MASK 0xFF
+#define FS_EXTENT_OLD_SIZE_SHIFT 8
+
+/** Payload checksum offset (in U32s) in a file's first extent
+ * metadata.
+ */
+#define FS_FILE_CRC_OFFSET 1
+
 /** File metadata size, in bytes. */
 #define FS_FILE_METADATA_BYTES (FS_FILE_METADATA_SIZE * sizeof(U32))
 
@@ -37,11 +86,24 @@
 #define FS_FILE_PERMS_MASK 0x00F00000
 
 /** Mask to use on the first metadata U32 to get the file size. */
-#define FS_FILE_SIZE_MASK 0x000FFFFF
+#define FS_FILE_SIZE_MASK 0x0007FFFF
+
+/** Compressed file flag, in the first metadata U32. Files can't take
+ * more than the flash, so the size doesn't need that bit.
+ */
+#define FS_FILE_COMPRESSED_MASK 0x00080000
 
 #define FS_FILE_PERM_MASK_READWRITE (1 << 0)
 #define FS_FILE_PERM_MASK_EXECUTABLE (1 << 1)
 
+/** Payload checksum flag, stored with the file permissions. Files
+ * written before checksums were kept don't have it.
+ */
+#define FS_FILE_FLAG_CRC (1 << 2)
+
+/** Ring log flag, stored with the file permissions. */
+#define FS_FILE_FLAG_RING (1 << 3)
+
 /** U32 <-> char conversion union for filenames. */
 union U32tochar {
   char chars[FS_FILENAME_LENGTH];
@@ -64,11 +126,76 @@ static fs_file_t *nx_fs_get_file(fs_fd_t fd) {
   return &(fdset[fd]);
 }
 
-/* Determines if the given page contains a file origin marker.
+/* Returns the metadata of the given page, right on the flash. Queued
+ * flash writes are waited for first, as the flash cannot be read
+ * while it is being programmed.
+ */
+static volatile U32 *nx_fs_get_metadata(U32 page) {
+  nx__efc_wait();
+  return &(FLASH_BASE_PTR[page*EFC_PAGE_WORDS]);
+}
+
+/* Returns the marker byte found at the beginning of the given page.
+ */
+inline static U8 nx_fs_page_get_marker(U32 page) {
+  return (nx_fs_get_metadata(page)[0] & FS_FILE_ORIGIN_MASK) >> 24;
+}
+
+/* Returns the marker of the extent a header belongs to, given the
+ * marker byte found in the header, which may be that of a copy, or
+ * that of a growing continuation extent.
+ */
+inline static U8 nx_fs_marker_get_base(U8 marker) {
+  if (marker & FS_FILE_MOVED_FLAG) {
+    marker &= ~FS_FILE_MOVE_MASK;
+  }
+
+  if (marker == FS_FILE_GROWING_MARKER) {
+    return FS_FILE_EXTENT_MARKER;
+  }
+
+  return marker;
+}
+
+/* Determines if the header at @a metadata is that of a growing
+ * continuation extent.
+ */
+inline static bool nx_fs_metadata_is_growing(volatile U32 *metadata) {
+  U8 marker = (metadata[0] & FS_FILE_ORIGIN_MASK) >> 24;
+
+  if (marker & FS_FILE_MOVED_FLAG) {
+    marker &= ~FS_FILE_MOVE_MASK;
+  }
+
+  return marker == FS_FILE_GROWING_MARKER;
+}
+
+/* Returns the position of the continuation extent whose header is at
+ * @a metadata in its file's extent chain.
+ */
+inline static U32 nx_fs_get_extent_seq(volatile U32 *metadata) {
+  if (nx_fs_metadata_is_growing(metadata)) {
+    return metadata[FS_EXTENT_SEQ_OFFSET] & FS_EXTENT_SEQ_MASK;
+  }
+
+  return metadata[FS_EXTENT_SEQ_OFFSET];
+}
+
+/* Determines if the given first page word holds a file origin or a
+ * file extent marker.
+ */
+inline static bool nx_fs_word_has_magic(U32 word) {
+  U8 marker = nx_fs_marker_get_base((word & FS_FILE_ORIGIN_MASK) >> 24);
+
+  return marker == FS_FILE_ORIGIN_MARKER || marker == FS_FILE_EXTENT_MARKER ||
+    marker == FS_FILE_SHADOW_MARKER || marker == FS_FILE_PENDING_MARKER;
+}
+
+/* Determines if the given page contains a file origin or a file extent
+ * marker.
  */
 inline static bool nx_fs_page_has_magic(U32 page) {
-  return ((FLASH_BASE_PTR[page*EFC_PAGE_WORDS] & FS_FILE_ORIGIN_MASK) >> 24)
-    == FS_FILE_ORIGIN_MARKER;
+  return nx_fs_word_has_magic(nx_fs_get_metadata(page)[0]);
 }
 
 /* Returns the number of pages used by a file, given its size.
@@ -90,6 +217,95 @@ inline static size_t nx_fs_get_file_size_from_metadata(volatile U32 *metadata) {
   return *metadata & FS_FILE_SIZE_MASK;
 }
 
+inline static bool nx_fs_get_file_is_ring(volatile U32 *metadata) {
+  return ((*metadata >> 20) & FS_FILE_FLAG_RING) != 0;
+}
+
+inline static bool nx_fs_get_file_has_crc(volatile U32 *metadata) {
+  return ((*metadata >> 20) & FS_FILE_FLAG_CRC) != 0;
+}
+
+inline static bool nx_fs_get_file_is_compressed(volatile U32 *metadata) {
+  return (*metadata & FS_FILE_COMPRESSED_MASK) != 0;
+}
+
+/* Check the header at the beginning of @a metadata before trusting
+ * its size: a corrupted one would make the flash walks skip the wrong
+ * number of pages. The name must be NUL terminated and padded with
+ * zeros, and the flags and sequence number must be ones the file
+ * system writes.
+ */
+static bool nx_fs_metadata_is_valid(volatile U32 *metadata) {
+  U8 marker = nx_fs_marker_get_base((metadata[0] & FS_FILE_ORIGIN_MASK) >> 24);
+  U8 flags = (metadata[0] & FS_FILE_PERMS_MASK) >> 20;
+  volatile U8 *name = (volatile U8 *)(metadata + FS_FILENAME_OFFSET);
+  U32 i = 0;
+
+  if (name[0] == 0) {
+    return FALSE;
+  }
+
+  while (i < FS_FILENAME_LENGTH && name[i] != 0) {
+    i++;
+  }
+
+  if (i == FS_FILENAME_LENGTH) {
+    return FALSE;
+  }
+
+  while (i < FS_FILENAME_LENGTH) {
+    if (name[i++] != 0) {
+      return FALSE;
+    }
+  }
+
+  if (marker == FS_FILE_EXTENT_MARKER) {
+    return flags == 0 && !nx_fs_get_file_is_compressed(metadata) &&
+      nx_fs_get_extent_seq(metadata) > 0 &&
+      nx_fs_get_extent_seq(metadata) < FS_MAX_EXTENTS &&
+      (metadata[FS_EXTENT_SEQ_OFFSET] >> FS_EXTENT_OLD_SIZE_SHIFT) <=
+      FS_FILE_SIZE_MASK;
+  }
+
+  if ((flags & FS_FILE_PERM_MASK_READWRITE) &&
+      (flags & FS_FILE_PERM_MASK_EXECUTABLE)) {
+    return FALSE;
+  }
+
+  /* Ring logs are created whole, and have no checksum. */
+  if (flags & FS_FILE_FLAG_RING) {
+    return !(flags & FS_FILE_FLAG_CRC) &&
+      !nx_fs_get_file_is_compressed(metadata) &&
+      ((metadata[0] & FS_FILE_SIZE_MASK) + FS_FILE_METADATA_BYTES)
+      % EFC_PAGE_BYTES == 0;
+  }
+
+  return TRUE;
+}
+
+/* CRC-32 (IEEE 802.3) lookup table, a nibble at a time, which keeps
+ * it small.
+ */
+static const U32 fs_crc_table[16] = {
+  0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+  0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+  0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+  0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+/* Add @a len bytes to the running CRC-32 @a crc, which starts at 0. */
+static U32 nx_fs_crc_update(U32 crc, volatile U8 *data, size_t len) {
+  crc = ~crc;
+
+  while (len-- > 0) {
+    crc ^= *data++;
+    crc = (crc >> 4) ^ fs_crc_table[crc & 0xF];
+    crc = (crc >> 4) ^ fs_crc_table[crc & 0xF];
+  }
+
+  return ~crc;
+}
+
 static fs_perm_t nx_fs_get_file_perms_from_metadata(volatile U32 *metadata) {
   U8 perms = (*metadata & FS_FILE_PERMS_MASK) >> 20;
 
@@ -103,272 +319,2621 @@ static fs_perm_t nx_fs_get_file_perms_from_metadata(volatile U32 *metadata) {
   return FS_PERM_READONLY;
 }
 
-/* Find a file's origin on the file system by its name.
+/* Flash wear.
+ *
+ * The erases of each lock region of the flash are counted in RAM, and
+ * saved every FS_WEAR_SAVE_PERIOD erases to one of the wear table
+ * pages, at the end of the flash. The table pages are written in
+ * turn, and the most recent valid one is loaded at mount. Placement
+ * decisions avoid the regions that are ahead of the least erased one
+ * by more than FS_WEAR_SLACK erases.
+ *
+ * The table also records the version of the flash layout. Until a
+ * table of the current layout is found, the pages after FS_PAGE_END
+ * may still hold files from a layout that gave them to the file
+ * system, and the file system refuses to mount over them.
  */
-static fs_err_t nx_fs_find_file_origin(char *name, U32 *origin) {
-  U32 i;
 
-  for (i=FS_PAGE_START; i<FS_PAGE_END; i++) {
-    if (nx_fs_page_has_magic(i)) {
-      volatile U32 *metadata = &(FLASH_BASE_PTR[i*EFC_PAGE_WORDS]);
-      union U32tochar nameconv;
+/* Number of pages in a lock region. */
+#define FS_WEAR_REGION_PAGES (EFC_PAGES / EFC_LOCK_REGIONS)
 
-      memcpy(nameconv.integers,
-             (void *)(metadata + FS_FILENAME_OFFSET),
-             FS_FILENAME_LENGTH);
+/* Lock regions holding file system pages. */
+#define FS_WEAR_FIRST_REGION (FS_PAGE_START / FS_WEAR_REGION_PAGES)
+#define FS_WEAR_LAST_REGION ((FS_PAGE_END - 1) / FS_WEAR_REGION_PAGES)
 
-      if (streq(nameconv.chars, name)) {
-        *origin = i;
-        return FS_ERR_NO_ERROR;
-      }
+/* Wear table marker, stored with the table's sequence number. */
+#define FS_WEAR_MARKER 0x57
 
-      /* Otherwise jump over the file and continue searching. */
-      else {
-        i += nx_fs_get_file_page_count(
-          nx_fs_get_file_size_from_metadata(metadata)) - 1;
-      }
-    }
+/* Mask to use on the first wear table U32 to get the sequence number. */
+#define FS_WEAR_SEQ_MASK 0x00FFFFFF
+
+/* Offset (in U32s) of the layout version in a wear table page. */
+#define FS_WEAR_LAYOUT_OFFSET 2
+
+/* Version of the flash layout. Bump it when the use of the pages after
+ * FS_PAGE_END changes.
+ */
+#define FS_WEAR_LAYOUT 1
+
+/* Offset (in U32s) of the erase counts in a wear table page. */
+#define FS_WEAR_COUNTS_OFFSET 3
+
+/* Number of erases between two saves of the wear table. */
+#define FS_WEAR_SAVE_PERIOD 64
+
+static struct {
+  bool loaded;  /* Was the table loaded from the flash? */
+  bool layout;  /* Does the flash hold a table of the current layout? */
+  U32 seq;      /* Sequence number of the last saved table. */
+  U32 pending;  /* Erases counted since the last save. */
+  U32 min;      /* Lowest count of the regions with free pages, as of
+                 * the last placement decision. */
+  U32 counts[EFC_LOCK_REGIONS];
+} fs_wear;
+
+/* Checksum of a wear table page, stored in its second U32. */
+static U32 nx_fs_wear_checksum(volatile U32 *table) {
+  U32 sum = table[0] + table[FS_WEAR_LAYOUT_OFFSET], i;
+
+  for (i=0; i<EFC_LOCK_REGIONS; i++) {
+    sum += table[FS_WEAR_COUNTS_OFFSET + i];
   }
 
-  return FS_ERR_FILE_NOT_FOUND;
+  return ~sum;
 }
 
-/* Finds the last file origin on the flash.
- */
-static fs_err_t nx_fs_find_last_origin(U32 *origin) {
-  U32 candidate = 0, i;
+/* Load the most recent valid wear table, if not done yet. */
+static void nx_fs_wear_check(void) {
+  U32 i;
 
-  for (i=FS_PAGE_START; i<FS_PAGE_END; i++) {
-    if (nx_fs_page_has_magic(i)) {
-      volatile U32 *metadata = &(FLASH_BASE_PTR[i*EFC_PAGE_WORDS]);
+  if (fs_wear.loaded) {
+    return;
+  }
 
-      candidate = i;
-      i += nx_fs_get_file_page_count(
-        nx_fs_get_file_size_from_metadata(metadata)) - 1;
+  fs_wear.loaded = TRUE;
+  fs_wear.layout = FALSE;
+  fs_wear.seq = 0;
+  memset(fs_wear.counts, 0, sizeof(fs_wear.counts));
+
+  for (i=FS_WEAR_PAGE_START; i<EFC_PAGES; i++) {
+    volatile U32 *table = nx_fs_get_metadata(i);
+    U32 seq = table[0] & FS_WEAR_SEQ_MASK;
+
+    if ((table[0] >> 24) == FS_WEAR_MARKER &&
+        table[1] == nx_fs_wear_checksum(table) &&
+        table[FS_WEAR_LAYOUT_OFFSET] == FS_WEAR_LAYOUT && seq > fs_wear.seq) {
+      fs_wear.layout = TRUE;
+      fs_wear.seq = seq;
+      memcpy(fs_wear.counts, (void *)(table + FS_WEAR_COUNTS_OFFSET),
+             sizeof(fs_wear.counts));
     }
   }
+}
 
-  if (candidate) {
-    *origin = candidate;
-    return FS_ERR_NO_ERROR;
+/* Save the wear table to the next table page, in the background. */
+static void nx_fs_wear_save(void) {
+  U32 table[EFC_PAGE_WORDS] = {0};
+  U32 page;
+
+  fs_wear.seq++;
+  page = FS_WEAR_PAGE_START + fs_wear.seq % FS_WEAR_PAGES;
+
+  /* This write counts too. */
+  fs_wear.counts[page / FS_WEAR_REGION_PAGES]++;
+  fs_wear.pending = 0;
+  fs_wear.layout = TRUE;
+
+  table[0] = (FS_WEAR_MARKER << 24) | (fs_wear.seq & FS_WEAR_SEQ_MASK);
+  table[FS_WEAR_LAYOUT_OFFSET] = FS_WEAR_LAYOUT;
+  memcpy(table + FS_WEAR_COUNTS_OFFSET, fs_wear.counts,
+         sizeof(fs_wear.counts));
+  table[1] = nx_fs_wear_checksum(table);
+
+  nx__efc_write_page_async(table, page, NULL);
+}
+
+/* Count an erase of @a page. */
+static void nx_fs_wear_count(U32 page) {
+  nx_fs_wear_check();
+
+  fs_wear.counts[page / FS_WEAR_REGION_PAGES]++;
+
+  if (++fs_wear.pending >= FS_WEAR_SAVE_PERIOD) {
+    nx_fs_wear_save();
   }
+}
 
-  return FS_ERR_FILE_NOT_FOUND;
+/* Determines if the lock region of @a page was erased much more than
+ * the least erased one, as of the last nx_fs_map_update_wear().
+ */
+static bool nx_fs_wear_is_hot(U32 page) {
+  return fs_wear.counts[page / FS_WEAR_REGION_PAGES] >
+    fs_wear.min + FS_WEAR_SLACK;
 }
 
-static fs_err_t nx_fs_find_next_origin(U32 start, U32 *origin) {
+/* Determines if no file reaches past FS_PAGE_END. Only needed until the
+ * layout is recorded, the file system never places files there.
+ */
+static bool nx_fs_layout_is_clear(void) {
   U32 i;
 
-  for (i=start; i<FS_PAGE_END; i++) {
+  for (i=FS_PAGE_START; i<EFC_PAGES; i++) {
     if (nx_fs_page_has_magic(i)) {
-      *origin = i;
-      return FS_ERR_NO_ERROR;
+      volatile U32 *metadata = nx_fs_get_metadata(i);
+      U32 pages;
+
+      if (!nx_fs_metadata_is_valid(metadata)) {
+        continue;
+      }
+
+      pages = nx_fs_get_file_page_count(
+        nx_fs_get_file_size_from_metadata(metadata));
+      if (i + pages > FS_PAGE_END) {
+        return FALSE;
+      }
+
+      i += pages - 1;
     }
   }
 
-  return FS_ERR_FILE_NOT_FOUND;
+  return TRUE;
 }
 
-/* Serialize a file's metadata using the provided values and returns
- * the resulting U32s, ready to be stored on flash.
+/* Free page map.
+ *
+ * One bit per file system page, set when the page belongs to a file.
+ * The map is maintained alongside the file index and answers the
+ * "where is there room for N pages" questions without decoding any
+ * metadata.
  */
-static void nx_fs_create_metadata(fs_perm_t perms, char *name, size_t size,
-                                  U32 *metadata) {
-  union U32tochar nameconv;
 
-  memset(metadata, 0, FS_FILE_METADATA_BYTES);
-
-  memset(nameconv.chars, 0, 32);
-  memcpy(nameconv.chars, name, MIN(strlen(name), 31));
+/* Number of pages managed by the file system. */
+#define FS_PAGES (FS_PAGE_END - FS_PAGE_START)
 
-  /* Magic marker. */
-  metadata[0] = (FS_FILE_ORIGIN_MARKER << 24);
+/* Number of U32s in the page map. */
+#define FS_MAP_WORDS ((FS_PAGES + 31) / 32)
 
-  /* File permissions. */
-  switch (perms) {
-    case FS_PERM_READWRITE:
-      metadata[0] += (FS_FILE_PERM_MASK_READWRITE << 20);
-      break;
-    case FS_PERM_EXECUTABLE:
-      metadata[0] += (FS_FILE_PERM_MASK_EXECUTABLE << 20);
-      break;
-    default:
-      break;
-  }
+static U32 fs_page_map[FS_MAP_WORDS];
 
-  /* File size. */
-  metadata[0] += (size & FS_FILE_SIZE_MASK);
+/* Mark @a len pages starting at @a start as used or free. */
+static void nx_fs_map_mark(U32 start, U32 len, bool used) {
+  U32 i;
 
-  /* Insert here in metadata[1] what would be relevant (future). */
+  NX_ASSERT(start >= FS_PAGE_START);
+  NX_ASSERT(start + len <= FS_PAGE_END);
 
-  /* File name. */
-  memcpy(metadata + FS_FILENAME_OFFSET, nameconv.integers, FS_FILENAME_LENGTH);
+  for (i=start-FS_PAGE_START; i<start-FS_PAGE_START+len; i++) {
+    if (used) {
+      fs_page_map[i / 32] |= ((U32)1 << (i % 32));
+    } else {
+      fs_page_map[i / 32] &= ~((U32)1 << (i % 32));
+    }
+  }
 }
 
-static fs_err_t nx_fs_move_region_backwards(U32 source, U32 dest, U32 len) {
-  U32 data[EFC_PAGE_WORDS];
+/* Determines if the given page is marked as used. */
+static bool nx_fs_map_is_used(U32 page) {
+  U32 i = page - FS_PAGE_START;
 
-  while (len--) {
-    nx__efc_read_page(source, data);
+  return (fs_page_map[i / 32] >> (i % 32)) & 1;
+}
 
-    if (!nx__efc_write_page(data, dest)) {
-      return FS_ERR_FLASH_ERROR;
-    }
+/* Returns the first free page at or after @a start, or FS_PAGE_END. */
+static U32 nx_fs_map_next_free(U32 start) {
+  U32 i = start - FS_PAGE_START;
 
-    if (!nx__efc_erase_page(source, 0)) {
-      return FS_ERR_FLASH_ERROR;
+  while (i < FS_PAGES) {
+    /* Skip fully used words at once. */
+    if (i % 32 == 0 && fs_page_map[i / 32] == 0xFFFFFFFF) {
+      i += 32;
+    } else if (!((fs_page_map[i / 32] >> (i % 32)) & 1)) {
+      break;
+    } else {
+      i++;
     }
-
-    source++;
-    dest++;
   }
 
-  return FS_ERR_NO_ERROR;
+  return MIN(i, FS_PAGES) + FS_PAGE_START;
 }
 
-static fs_err_t nx_fs_move_region_forwards(U32 source, U32 dest, U32 len) {
-  U32 data[EFC_PAGE_WORDS];
-
-  while (len--) {
-    nx__efc_read_page(source + len, data);
-
-    if (!nx__efc_write_page(data, dest + len)) {
-      return FS_ERR_FLASH_ERROR;
-    }
+/* Returns the first used page at or after @a start, or FS_PAGE_END. */
+static U32 nx_fs_map_next_used(U32 start) {
+  U32 i = start - FS_PAGE_START;
 
-    if (!nx__efc_erase_page(source + len, 0)) {
-      return FS_ERR_FLASH_ERROR;
+  while (i < FS_PAGES) {
+    /* Skip fully free words at once. */
+    if (i % 32 == 0 && fs_page_map[i / 32] == 0) {
+      i += 32;
+    } else if ((fs_page_map[i / 32] >> (i % 32)) & 1) {
+      break;
+    } else {
+      i++;
     }
   }
 
-  return FS_ERR_NO_ERROR;
+  return MIN(i, FS_PAGES) + FS_PAGE_START;
 }
 
-/* Move a @a len long flash region starting at page @a source to @a dest.
- * Since pages are moved one after another, regions may overlap if the
- * destination is lower in the flash than the source, but not the other
- * way around. Note that this is asserted anyway to avoid data loss.
- * It is the responsibility of the caller to clean up the remaining
- * source region of any data he doesn't want to leave there (file origin
- * markers for example).
- *
- * @param source The source page number.
- * @param dest The destination page number.
- * @param len The region length.
+/* Update the reference the wear of a region is compared to: the
+ * erase count of the least erased region data can be placed in. The
+ * regions full of data that never changes would hold it down forever.
  */
-static fs_err_t nx_fs_move_region(U32 source, U32 dest, U32 len) {
-  NX_ASSERT(source < EFC_PAGES);
-  NX_ASSERT(dest < EFC_PAGES);
-  NX_ASSERT(len < EFC_PAGES);
+static void nx_fs_map_update_wear(void) {
+  U32 region, page;
+  bool found = FALSE;
 
-  if (source == dest) {
-    return FS_ERR_NO_ERROR;
-  } else if (dest < source) {
-    return nx_fs_move_region_backwards(source, dest, len);
-  } else {
-    return nx_fs_move_region_forwards(source, dest, len);
+  nx_fs_wear_check();
+
+  for (region=FS_WEAR_FIRST_REGION; region<=FS_WEAR_LAST_REGION; region++) {
+    page = MAX(region * FS_WEAR_REGION_PAGES, FS_PAGE_START);
+
+    if (nx_fs_map_next_free(page) < (region + 1) * FS_WEAR_REGION_PAGES &&
+        (!found || fs_wear.counts[region] < fs_wear.min)) {
+      fs_wear.min = fs_wear.counts[region];
+      found = TRUE;
+    }
   }
 }
 
-/* Relocate the given file to @a origin.
+/* Returns the first page of the free extent going from @a start to
+ * @a end from which @a len pages can be taken in a region that is not
+ * worn, or @a end if there is none.
  */
-static fs_err_t nx_fs_relocate_to_page(fs_file_t *file, U32 origin) {
-  fs_err_t err;
-  size_t n_pages;
-  U32 diff;
-
-  diff = origin - file->origin;
+static U32 nx_fs_map_skip_worn(U32 start, U32 end, U32 len) {
+  while (start + len <= end) {
+    if (!nx_fs_wear_is_hot(start)) {
+      return start;
+    }
 
-  /* Move the file's data. */
-  n_pages = nx_fs_get_file_page_count(file->size);
-  err = nx_fs_move_region(file->origin, origin, n_pages);
-  if (err != FS_ERR_NO_ERROR) {
-    return err;
+    start = (start / FS_WEAR_REGION_PAGES + 1) * FS_WEAR_REGION_PAGES;
   }
 
-  /* Set the file pages pointers to their respective new values. */
-  file->origin = origin;
-  file->rbuf.page += diff;
-  file->wbuf.page += diff;
-
-  return FS_ERR_NO_ERROR;
+  return end;
 }
 
-static fs_err_t nx_fs_relocate(fs_file_t *file) {
-  U32 origin, start;
-  size_t size;
+/* Find the smallest free extent of at least @a len pages. Worn
+ * regions are skipped, unless there is no room elsewhere.
+ */
+static fs_err_t nx_fs_map_find_hole(U32 len, U32 *origin) {
+  U32 start = FS_PAGE_START, best = 0, best_len = FS_PAGES + 1;
+  bool best_hot = TRUE;
 
-  size = nx_fs_get_file_page_count(file->size);
+  nx_fs_map_update_wear();
 
-  /* First, look at the end of the flash for free space. */
-  if (nx_fs_find_last_origin(&origin) == FS_ERR_NO_ERROR) {
-    origin += nx_fs_get_file_page_count(
-        nx_fs_get_file_size_from_metadata(
-          &(FLASH_BASE_PTR[origin*EFC_PAGE_WORDS])));
+  while ((start = nx_fs_map_next_free(start)) < FS_PAGE_END) {
+    U32 end = nx_fs_map_next_used(start);
+    U32 cool = nx_fs_map_skip_worn(start, end, len);
 
-    if (size < FS_PAGE_END - origin) {
-      return nx_fs_relocate_to_page(file, origin);
-    }
-  }
+    if (cool < end && (best_hot || end - cool < best_len)) {
+      best = cool;
+      best_len = end - cool;
+      best_hot = FALSE;
 
-  start = FS_PAGE_START;
-  while (nx_fs_find_next_origin(start, &origin) != FS_ERR_FILE_NOT_FOUND) {
-    if (size < origin - start || (origin == file->origin && file->origin - start > 0)) {
-      return nx_fs_relocate_to_page(file, origin);
+      if (best_len == len) {
+        break;
+      }
+    } else if (cool == end && best_hot && end - start >= len &&
+               end - start < best_len) {
+      best = start;
+      best_len = end - start;
     }
 
-    start = origin + nx_fs_get_file_page_count(
-        nx_fs_get_file_size_from_metadata(
-          &(FLASH_BASE_PTR[origin*EFC_PAGE_WORDS])));
+    start = end;
   }
 
-  return FS_ERR_NO_SPACE_LEFT_ON_DEVICE;
-}
+  if (best_len > FS_PAGES) {
+    return FS_ERR_NO_SPACE_LEFT_ON_DEVICE;
+  }
 
-/* Initialize the file system, most importantly check for file system
- * integrity?. */
-fs_err_t nx_fs_init(void) {
+  *origin = best;
   return FS_ERR_NO_ERROR;
 }
 
-/* Initializes the @a fd fdset slot with the file's metadata.
+/* Find the largest free extent. The pages of worn regions only count
+ * for half as much as the others.
  */
-static fs_err_t nx_fs_init_fd(U32 origin, fs_fd_t fd) {
-  volatile U32 *metadata = &(FLASH_BASE_PTR[origin*EFC_PAGE_WORDS]);
-  union U32tochar nameconv;
-  fs_file_t *file;
+static fs_err_t nx_fs_map_find_largest(U32 *origin) {
+  U32 start = FS_PAGE_START, best = 0, best_len = 0;
 
-  file = nx_fs_get_file(fd);
-  NX_ASSERT(file != NULL);
+  nx_fs_map_update_wear();
 
-  memcpy(nameconv.integers,
-         (void *)(metadata + FS_FILENAME_OFFSET),
-         FS_FILENAME_LENGTH);
+  while ((start = nx_fs_map_next_free(start)) < FS_PAGE_END) {
+    U32 end = nx_fs_map_next_used(start);
+    U32 cool = nx_fs_map_skip_worn(start, end, 1);
 
-  file->origin = origin;
-  memcpy(file->name, nameconv.chars, MIN(strlen(nameconv.chars), 31));
-  file->size = nx_fs_get_file_size_from_metadata(metadata);
-  file->perms = nx_fs_get_file_perms_from_metadata(metadata);
+    if (end - cool > best_len) {
+      best = cool;
+      best_len = end - cool;
+    }
 
-  file->rbuf.page = file->rbuf.pos = 0;
-  file->wbuf.page = file->wbuf.pos = 0;
-  memset(file->rbuf.data.bytes, 0, EFC_PAGE_BYTES);
-  memset(file->wbuf.data.bytes, 0, EFC_PAGE_BYTES);
+    if ((end - start + 1) / 2 > best_len) {
+      best = start;
+      best_len = (end - start + 1) / 2;
+    }
+
+    start = end;
+  }
+
+  if (!best_len) {
+    return FS_ERR_NO_SPACE_LEFT_ON_DEVICE;
+  }
 
+  *origin = best;
   return FS_ERR_NO_ERROR;
 }
 
-/* Open an existing file by its name. */
-static fs_err_t nx_fs_open_by_name(char *name, fs_fd_t fd) {
-  U32 origin;
-  fs_err_t err;
+/* Returns the number of free pages. */
+static U32 nx_fs_map_count_free(void) {
+  U32 i, used = 0;
 
-  err = nx_fs_find_file_origin(name, &origin);
-  if (err != FS_ERR_NO_ERROR) {
-    return err;
+  for (i=0; i<FS_MAP_WORDS; i++) {
+    U32 word = fs_page_map[i];
+
+    while (word) {
+      word &= word - 1;
+      used++;
+    }
   }
 
-  return nx_fs_init_fd(origin, fd);
+  return FS_PAGES - used;
+}
+
+/* Pre-erased page map.
+ *
+ * One bit per file system page, set when the page is known to read as
+ * erased flash. Such a page can be programmed without erasing it
+ * first, which halves the cost of writing it. Pages are put back into
+ * that state when wiped, and in the background by nx_fs_erase_step().
+ */
+
+static U32 fs_erased_map[FS_MAP_WORDS];
+
+/* Determines if the given page is known to be erased. */
+static bool nx_fs_pool_has(U32 page) {
+  U32 i = page - FS_PAGE_START;
+
+  return (fs_erased_map[i / 32] >> (i % 32)) & 1;
+}
+
+/* Record whether the given page is erased. */
+static void nx_fs_pool_set(U32 page, bool erased) {
+  U32 i = page - FS_PAGE_START;
+
+  if (erased) {
+    fs_erased_map[i / 32] |= ((U32)1 << (i % 32));
+  } else {
+    fs_erased_map[i / 32] &= ~((U32)1 << (i % 32));
+  }
+}
+
+/* Returns the first free page at or after @a start that is not known
+ * to be erased, or FS_PAGE_END.
+ */
+static U32 nx_fs_pool_next_dirty(U32 start) {
+  U32 i = start - FS_PAGE_START;
+
+  while (i < FS_PAGES) {
+    U32 taken = fs_page_map[i / 32] | fs_erased_map[i / 32];
+
+    /* Skip words with nothing to erase at once. */
+    if (i % 32 == 0 && taken == 0xFFFFFFFF) {
+      i += 32;
+    } else if (!((taken >> (i % 32)) & 1)) {
+      break;
+    } else {
+      i++;
+    }
+  }
+
+  return MIN(i, FS_PAGES) + FS_PAGE_START;
+}
+
+/* Rebuild the pre-erased page map by looking at the free pages. */
+static void nx_fs_pool_scan(void) {
+  U32 page, i;
+
+  memset(fs_erased_map, 0, sizeof(fs_erased_map));
+
+  for (page=FS_PAGE_START; page<FS_PAGE_END; page++) {
+    volatile U32 *data;
+
+    if (nx_fs_map_is_used(page)) {
+      continue;
+    }
+
+    data = nx_fs_get_metadata(page);
+    for (i=0; i<EFC_PAGE_WORDS && data[i] == EFC_ERASED_WORD; i++);
+
+    nx_fs_pool_set(page, i == EFC_PAGE_WORDS);
+  }
+}
+
+/* Shared page cache.
+ *
+ * File data is read and written through a few cached pages shared by
+ * all the opened files. Dirty pages are only written back to the flash
+ * when evicted or flushed, so that writes to the same page coalesce,
+ * and files opened twice share their pages.
+ *
+ * Pages written behind the cache's back, through the helpers below,
+ * have their cached copy dropped.
+ */
+typedef struct {
+  union {
+    U32 raw[EFC_PAGE_WORDS];
+    U8 bytes[EFC_PAGE_BYTES];
+  } data;
+  U32 page;   /* The cached page. */
+  U32 used;   /* Time of last use, for LRU eviction. */
+  bool valid; /* Does the entry hold a page? */
+  bool dirty; /* Was the page changed since it was read? */
+} fs_cache_entry_t;
+
+static struct {
+  fs_cache_entry_t entries[FS_CACHE_PAGES];
+  U32 clock;      /* Use counter, for the LRU timestamps. */
+  U32 hits;       /* Lookups served from the cache. */
+  U32 misses;     /* Lookups that needed a page slot. */
+  U32 writebacks; /* Dirty pages written back to the flash. */
+} fs_cache;
+
+/* Returns the cache entry holding @a page, or NULL. */
+static fs_cache_entry_t *nx_fs_cache_find(U32 page) {
+  U32 i;
+
+  for (i=0; i<FS_CACHE_PAGES; i++) {
+    if (fs_cache.entries[i].valid && fs_cache.entries[i].page == page) {
+      return &(fs_cache.entries[i]);
+    }
+  }
+
+  return NULL;
+}
+
+/* Write a dirty cached page back to the flash, in the background. */
+static void nx_fs_cache_write_back(fs_cache_entry_t *entry) {
+  if (entry->valid && entry->dirty) {
+    if (nx_fs_pool_has(entry->page)) {
+      nx_fs_pool_set(entry->page, FALSE);
+      nx__efc_program_page_async(entry->data.raw, entry->page, NULL);
+    } else {
+      nx_fs_wear_count(entry->page);
+      nx__efc_write_page_async(entry->data.raw, entry->page, NULL);
+    }
+
+    entry->dirty = FALSE;
+    fs_cache.writebacks++;
+  }
+}
+
+/* Returns the cache entry for @a page, evicting the least recently
+ * used page if needed. The page is read from the flash if @a load is
+ * TRUE, otherwise it is a fresh page and starts zeroed.
+ */
+static fs_cache_entry_t *nx_fs_cache_get(U32 page, bool load) {
+  fs_cache_entry_t *entry = nx_fs_cache_find(page);
+  U32 i;
+
+  if (entry) {
+    fs_cache.hits++;
+  } else {
+    fs_cache.misses++;
+
+    entry = &(fs_cache.entries[0]);
+    for (i=0; i<FS_CACHE_PAGES && entry->valid; i++) {
+      if (!fs_cache.entries[i].valid ||
+          fs_cache.entries[i].used < entry->used) {
+        entry = &(fs_cache.entries[i]);
+      }
+    }
+
+    nx_fs_cache_write_back(entry);
+    entry->valid = TRUE;
+    entry->dirty = FALSE;
+    entry->page = page;
+
+    if (load) {
+      nx__efc_read_page(page, entry->data.raw);
+    }
+  }
+
+  if (!load) {
+    memset(entry->data.bytes, 0, EFC_PAGE_BYTES);
+  }
+
+  entry->used = ++fs_cache.clock;
+  return entry;
+}
+
+/* Write back the cached pages of a @a len pages long region. */
+static void nx_fs_cache_write_back_range(U32 start, U32 len) {
+  U32 i;
+
+  for (i=0; i<FS_CACHE_PAGES; i++) {
+    fs_cache_entry_t *entry = &(fs_cache.entries[i]);
+
+    if (entry->page >= start && entry->page < start + len) {
+      nx_fs_cache_write_back(entry);
+    }
+  }
+}
+
+/* Drop the cached pages of a @a len pages long region, discarding
+ * their changes.
+ */
+static void nx_fs_cache_invalidate(U32 start, U32 len) {
+  U32 i;
+
+  for (i=0; i<FS_CACHE_PAGES; i++) {
+    fs_cache_entry_t *entry = &(fs_cache.entries[i]);
+
+    if (entry->page >= start && entry->page < start + len) {
+      entry->valid = FALSE;
+    }
+  }
+}
+
+/* Read a page, from the cache if it holds it. */
+static void nx_fs_read_page(U32 page, U32 *data) {
+  fs_cache_entry_t *entry = nx_fs_cache_find(page);
+
+  if (entry) {
+    memcpy(data, entry->data.raw, EFC_PAGE_BYTES);
+  } else {
+    nx__efc_read_page(page, data);
+  }
+}
+
+/* Write a page straight to the flash, dropping its cached copy. */
+static bool nx_fs_write_page(U32 *data, U32 page) {
+  nx_fs_cache_invalidate(page, 1);
+
+  if (nx_fs_pool_has(page)) {
+    nx_fs_pool_set(page, FALSE);
+    return nx__efc_program_page(data, page);
+  }
+
+  nx_fs_wear_count(page);
+  return nx__efc_write_page(data, page);
+}
+
+/* Program a page straight on the flash without erasing it first,
+ * dropping its cached copy. Bits can only be cleared that way.
+ */
+static bool nx_fs_program_page(U32 *data, U32 page) {
+  nx_fs_cache_invalidate(page, 1);
+  nx_fs_pool_set(page, FALSE);
+  return nx__efc_program_page(data, page);
+}
+
+/* Erase a page straight on the flash, dropping its cached copy. The
+ * page then goes to the pre-erased pool.
+ */
+static bool nx_fs_erase_page(U32 page) {
+  nx_fs_cache_invalidate(page, 1);
+
+  if (nx_fs_pool_has(page)) {
+    return TRUE;
+  }
+
+  nx_fs_wear_count(page);
+  if (!nx__efc_erase_page(page, EFC_ERASED_WORD)) {
+    return FALSE;
+  }
+
+  nx_fs_pool_set(page, TRUE);
+  return TRUE;
+}
+
+/* Erase the pages of the @a len pages long region at @a origin that
+ * look like a header, first page first. The others may be left for
+ * the background eraser.
+ */
+static bool nx_fs_erase_headers(U32 origin, U32 len) {
+  U32 page;
+
+  for (page = origin; page < origin + len; page++) {
+    if (nx_fs_page_has_magic(page) && !nx_fs_erase_page(page)) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* In-RAM file index.
+ *
+ * The index mirrors the extents present on the flash so that lookups
+ * and placement decisions do not have to walk the flash pages. Each
+ * extent lives in a stable slot, reachable through the order array,
+ * which keeps the slots sorted by origin page. The first extent of a
+ * file is also reachable through a name hash chain, and links to the
+ * file's continuation extents, if any.
+ */
+
+/* Number of name hash buckets. */
+#define FS_INDEX_BUCKETS 16
+
+/* Empty slot/chain marker. */
+#define FS_INDEX_NONE 0xFF
+
+/* Index entry, describing one extent of the flash. */
+typedef struct {
+  U32 hash;    /* Hash of the file name. */
+  U32 origin;  /* Extent origin page. */
+  size_t size; /* Extent payload size, kept up to date while it grows. */
+  U8 next;     /* Next slot in the hash chain or free list. */
+  U8 extent;   /* Next extent of the same file. */
+  bool head;   /* Is this the first extent of its file? */
+  bool verified; /* Was the file's checksum checked since the index
+                  * was built? */
+  bool shadow;  /* Is this a new version of a file, not committed yet?
+                 * It is not a head then, and has no extents. */
+  bool moved;   /* Is this a complete copy left by an interrupted
+                 * background move? Only set while building. */
+  U8 mapped;    /* Number of open descriptors the file was mapped
+                 * through, on its first extent. */
+  U16 reserved; /* Pages claimed past the data, while the file is open. */
+} fs_index_entry_t;
+
+static struct {
+  bool built;                            /* Has the index been built? */
+  U8 count;                              /* Number of indexed extents. */
+  U8 files;                              /* Number of indexed files. */
+  U8 free;                               /* Head of the free slot list. */
+  U32 generation;                        /* Bumped on every change,
+                                          * file data writes included. */
+  U32 headers;                           /* Headers found by the last
+                                          * build. */
+  U32 rejected;                          /* Headers it did not trust. */
+  U32 spilled;                           /* Extents left out, for lack
+                                          * of room. */
+  U8 buckets[FS_INDEX_BUCKETS];          /* Hash chain heads. */
+  U8 order[FS_MAX_EXTENTS];              /* Slots sorted by origin. */
+  fs_index_entry_t entries[FS_MAX_EXTENTS];
+} fs_index;
+
+/* One bit per file system page, set at the origin of the extents left
+ * out of the index for lack of room.
+ */
+static U32 fs_spill_map[FS_MAP_WORDS];
+
+/* Hash a file name (FNV-1a). */
+static U32 nx_fs_hash_name(const char *name) {
+  U32 hash = 2166136261UL;
+  U32 i;
+
+  for (i=0; i<FS_FILENAME_LENGTH && name[i]; i++) {
+    hash ^= (U8)name[i];
+    hash *= 16777619UL;
+  }
+
+  return hash;
+}
+
+/* Empty the index. */
+static void nx_fs_index_reset(void) {
+  U32 i;
+
+  memset(fs_index.buckets, FS_INDEX_NONE, FS_INDEX_BUCKETS);
+  for (i=0; i<FS_MAX_EXTENTS; i++) {
+    fs_index.entries[i].next = i + 1 < FS_MAX_EXTENTS ? i + 1 : FS_INDEX_NONE;
+  }
+
+  fs_index.free = 0;
+  fs_index.count = 0;
+  fs_index.files = 0;
+  fs_index.headers = 0;
+  fs_index.rejected = 0;
+  fs_index.spilled = 0;
+  fs_index.generation++;
+
+  /* Nothing is known to be erased until the pool is scanned again, so
+   * that the walk's own erases are not skipped.
+   */
+  memset(fs_page_map, 0, sizeof(fs_page_map));
+  memset(fs_erased_map, 0, sizeof(fs_erased_map));
+  memset(fs_spill_map, 0, sizeof(fs_spill_map));
+}
+
+/* Returns the position in the order array of the first file whose
+ * origin is greater or equal to @a page.
+ */
+static U32 nx_fs_index_lower_bound(U32 page) {
+  U32 lo = 0, hi = fs_index.count;
+
+  while (lo < hi) {
+    U32 mid = (lo + hi) / 2;
+
+    if (fs_index.entries[fs_index.order[mid]].origin < page) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/* Returns the index slot of the extent starting at @a origin, or
+ * FS_INDEX_NONE.
+ */
+static U8 nx_fs_index_get_slot(U32 origin) {
+  U32 pos = nx_fs_index_lower_bound(origin);
+
+  if (pos == fs_index.count ||
+      fs_index.entries[fs_index.order[pos]].origin != origin) {
+    return FS_INDEX_NONE;
+  }
+
+  return fs_index.order[pos];
+}
+
+/* Returns the index entry of the extent starting at @a origin, or NULL. */
+static fs_index_entry_t *nx_fs_index_get(U32 origin) {
+  U8 slot = nx_fs_index_get_slot(origin);
+
+  return slot == FS_INDEX_NONE ? NULL : &(fs_index.entries[slot]);
+}
+
+/* Returns the number of pages claimed by an extent: those holding its
+ * data, and those reserved for it to grow into.
+ */
+static U32 nx_fs_index_get_span(fs_index_entry_t *entry) {
+  return nx_fs_get_file_page_count(entry->size) + entry->reserved;
+}
+
+/* Returns the number of pages used by the extent starting at @a origin. */
+static U32 nx_fs_index_get_pages(U32 origin) {
+  fs_index_entry_t *entry = nx_fs_index_get(origin);
+
+  NX_ASSERT(entry != NULL);
+  return nx_fs_index_get_span(entry);
+}
+
+/* Update the size of an indexed file, and its pages in the map. Data
+ * growing past its pages uses up the extent's reserved pages first.
+ */
+static void nx_fs_index_set_size(fs_index_entry_t *entry, size_t size) {
+  U32 old_span = nx_fs_index_get_span(entry);
+  U32 old_pages = nx_fs_get_file_page_count(entry->size);
+  U32 new_pages = nx_fs_get_file_page_count(size), new_span;
+
+  if (new_pages > old_pages) {
+    entry->reserved -= MIN(entry->reserved, new_pages - old_pages);
+  }
+
+  entry->size = size;
+  new_span = nx_fs_index_get_span(entry);
+
+  if (new_span > old_span) {
+    nx_fs_map_mark(entry->origin + old_span, new_span - old_span, TRUE);
+  } else if (new_span < old_span) {
+    nx_fs_map_mark(entry->origin + new_span, old_span - new_span, FALSE);
+  }
+
+  fs_index.generation++;
+}
+
+/* Claim @a pages more pages right after an extent. */
+static void nx_fs_index_reserve(fs_index_entry_t *entry, U32 pages) {
+  nx_fs_map_mark(entry->origin + nx_fs_index_get_span(entry), pages, TRUE);
+  entry->reserved += pages;
+  fs_index.generation++;
+}
+
+/* Give back the pages reserved for an extent. */
+static void nx_fs_index_release(fs_index_entry_t *entry) {
+  nx_fs_map_mark(entry->origin + nx_fs_get_file_page_count(entry->size),
+                 entry->reserved, FALSE);
+  entry->reserved = 0;
+  fs_index.generation++;
+}
+
+/* Re-sort the order array after origins were changed. */
+static void nx_fs_index_sort(void) {
+  U32 i, j;
+
+  for (i=1; i<fs_index.count; i++) {
+    U8 slot = fs_index.order[i];
+    U32 origin = fs_index.entries[slot].origin;
+
+    for (j=i; j>0 && fs_index.entries[fs_index.order[j-1]].origin > origin; j--) {
+      fs_index.order[j] = fs_index.order[j-1];
+    }
+
+    fs_index.order[j] = slot;
+  }
+}
+
+/* Add an extent to the index. File heads are also added to their
+ * name hash chain. The slot used is returned through @a inserted, if
+ * not NULL.
+ */
+static fs_err_t nx_fs_index_insert(U32 hash, U32 origin, size_t size,
+                                   bool head, U8 *inserted) {
+  fs_index_entry_t *entry;
+  U32 pos, i;
+  U8 slot;
+
+  if (fs_index.free == FS_INDEX_NONE ||
+      (head && fs_index.files == FS_MAX_FILES)) {
+    return FS_ERR_TOO_MANY_FILES;
+  }
+
+  slot = fs_index.free;
+  entry = &(fs_index.entries[slot]);
+  fs_index.free = entry->next;
+
+  entry->hash = hash;
+  entry->origin = origin;
+  entry->size = size;
+  entry->extent = FS_INDEX_NONE;
+  entry->head = head;
+  entry->verified = FALSE;
+  entry->shadow = FALSE;
+  entry->moved = FALSE;
+  entry->mapped = 0;
+  entry->next = FS_INDEX_NONE;
+  entry->reserved = 0;
+
+  if (head) {
+    entry->next = fs_index.buckets[hash % FS_INDEX_BUCKETS];
+    fs_index.buckets[hash % FS_INDEX_BUCKETS] = slot;
+    fs_index.files++;
+  }
+
+  if (inserted) {
+    *inserted = slot;
+  }
+
+  pos = nx_fs_index_lower_bound(origin);
+  for (i=fs_index.count; i>pos; i--) {
+    fs_index.order[i] = fs_index.order[i-1];
+  }
+  fs_index.order[pos] = slot;
+  fs_index.count++;
+
+  nx_fs_map_mark(origin, nx_fs_get_file_page_count(size), TRUE);
+  fs_index.generation++;
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Remove the extent starting at @a origin from the index. Removing a
+ * file head does not remove its continuation extents.
+ */
+static void nx_fs_index_remove(U32 origin) {
+  U32 pos = nx_fs_index_lower_bound(origin);
+  fs_index_entry_t *entry;
+  U8 slot, *link;
+
+  NX_ASSERT(pos < fs_index.count);
+  slot = fs_index.order[pos];
+  entry = &(fs_index.entries[slot]);
+  NX_ASSERT(entry->origin == origin);
+
+  /* Unlink from the hash chain. */
+  if (entry->head) {
+    link = &(fs_index.buckets[entry->hash % FS_INDEX_BUCKETS]);
+    while (*link != slot) {
+      link = &(fs_index.entries[*link].next);
+    }
+    *link = entry->next;
+    fs_index.files--;
+  }
+
+  fs_index.count--;
+  for (; pos<fs_index.count; pos++) {
+    fs_index.order[pos] = fs_index.order[pos+1];
+  }
+
+  entry->next = fs_index.free;
+  fs_index.free = slot;
+
+  nx_fs_map_mark(origin, nx_fs_index_get_span(entry), FALSE);
+  fs_index.generation++;
+}
+
+/* Read the name stored in the metadata at @a page. */
+static void nx_fs_get_name_from_metadata(U32 page, union U32tochar *nameconv) {
+  volatile U32 *metadata = nx_fs_get_metadata(page);
+
+  memcpy(nameconv->integers,
+         (void *)(metadata + FS_FILENAME_OFFSET),
+         FS_FILENAME_LENGTH);
+  nameconv->chars[FS_FILENAME_LENGTH-1] = 0;
+}
+
+/* Returns the index slot of the head of the file called @a name, or
+ * FS_INDEX_NONE.
+ */
+static U8 nx_fs_index_find_head(char *name) {
+  U32 hash = nx_fs_hash_name(name);
+  U8 slot = fs_index.buckets[hash % FS_INDEX_BUCKETS];
+
+  while (slot != FS_INDEX_NONE) {
+    fs_index_entry_t *entry = &(fs_index.entries[slot]);
+
+    /* Confirm hash hits against the name stored on flash. */
+    if (entry->hash == hash) {
+      union U32tochar nameconv;
+
+      nx_fs_get_name_from_metadata(entry->origin, &nameconv);
+      if (streqn(nameconv.chars, name, FS_FILENAME_LENGTH)) {
+        return slot;
+      }
+    }
+
+    slot = entry->next;
+  }
+
+  return FS_INDEX_NONE;
+}
+
+/* Link the continuation extent in @a slot to its file, in sequence
+ * order. Returns FALSE if the extent does not belong to any file.
+ */
+static bool nx_fs_index_link_extent(U8 slot) {
+  fs_index_entry_t *entry = &(fs_index.entries[slot]);
+  union U32tochar nameconv;
+  U32 seq;
+  U8 *link;
+
+  nx_fs_get_name_from_metadata(entry->origin, &nameconv);
+  seq = nx_fs_get_extent_seq(nx_fs_get_metadata(entry->origin));
+
+  slot = nx_fs_index_find_head(nameconv.chars);
+  if (slot == FS_INDEX_NONE) {
+    return FALSE;
+  }
+
+  link = &(fs_index.entries[slot].extent);
+  while (*link != FS_INDEX_NONE) {
+    U32 other = fs_index.entries[*link].origin;
+    U32 other_seq = nx_fs_get_extent_seq(nx_fs_get_metadata(other));
+
+    if (other_seq == seq) {
+      return FALSE;
+    } else if (other_seq > seq) {
+      break;
+    }
+
+    link = &(fs_index.entries[*link].extent);
+  }
+
+  entry->extent = *link;
+  *link = entry - fs_index.entries;
+  return TRUE;
+}
+
+/* Wipe the extent of @a entry from the flash: its header, and any page
+ * of its payload that looks like one. Changes still in the cache are
+ * dropped. The extent is then removed from the index.
+ */
+static fs_err_t nx_fs_wipe_extent(fs_index_entry_t *entry) {
+  nx_fs_cache_invalidate(entry->origin, nx_fs_index_get_span(entry));
+  if (!nx_fs_erase_headers(entry->origin,
+                           nx_fs_get_file_page_count(entry->size))) {
+    return FS_ERR_FLASH_ERROR;
+  }
+
+  nx_fs_index_remove(entry->origin);
+  return FS_ERR_NO_ERROR;
+}
+
+/* Wipe the file starting at @a origin, first extent first. */
+static fs_err_t nx_fs_wipe_file(U32 origin) {
+  U8 slot = nx_fs_index_get_slot(origin);
+  fs_err_t err;
+
+  while (slot != FS_INDEX_NONE) {
+    fs_index_entry_t *entry = &(fs_index.entries[slot]);
+
+    slot = entry->extent;
+    err = nx_fs_wipe_extent(entry);
+    if (err != FS_ERR_NO_ERROR) {
+      return err;
+    }
+  }
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Compute the payload checksum of the file starting at @a origin,
+ * right from the flash.
+ */
+static U32 nx_fs_get_file_crc(U32 origin) {
+  fs_index_entry_t *entry = nx_fs_index_get(origin);
+  U32 crc = 0;
+
+  while (entry != NULL) {
+    nx_fs_cache_write_back_range(entry->origin, nx_fs_index_get_span(entry));
+    crc = nx_fs_crc_update(crc,
+      (volatile U8 *)nx_fs_get_metadata(entry->origin) + FS_FILE_METADATA_BYTES,
+      entry->size);
+
+    entry = entry->extent == FS_INDEX_NONE ?
+      NULL : &(fs_index.entries[entry->extent]);
+  }
+
+  return crc;
+}
+
+/* Growing files.
+ *
+ * Each extent of a file records its own size, and the first one the
+ * checksum of all of them. When a file grew, nx_fs_close() first
+ * writes the headers of its continuation extents whose size changed,
+ * with the growing marker and their previous size. Writing the file's
+ * first extent header next commits the new sizes, and the growing
+ * extents then get their marker back with a page program.
+ *
+ * A reset in between leaves growing extents behind. The new sizes only
+ * match the checksum of the file if its first extent header was
+ * written.
+ */
+
+/* Settle the growing continuation extents of the indexed file starting
+ * at @a origin. The ones of a file whose header was written are
+ * committed. Otherwise, they get their previous size back, and the
+ * pages past it that look like a header are wiped first.
+ */
+static fs_err_t nx_fs_settle_growth(U32 origin) {
+  fs_index_entry_t *entry = nx_fs_index_get(origin);
+  volatile U32 *metadata = nx_fs_get_metadata(origin);
+  U32 data[EFC_PAGE_WORDS];
+  U32 seq, pages, old_pages;
+  bool commit;
+  size_t size;
+  U8 slot;
+
+  for (slot = entry->extent; slot != FS_INDEX_NONE;
+       slot = fs_index.entries[slot].extent) {
+    if (nx_fs_metadata_is_growing(
+          nx_fs_get_metadata(fs_index.entries[slot].origin))) {
+      break;
+    }
+  }
+
+  if (slot == FS_INDEX_NONE) {
+    return FS_ERR_NO_ERROR;
+  }
+
+  commit = nx_fs_get_file_has_crc(metadata) &&
+    nx_fs_get_file_crc(origin) == metadata[FS_FILE_CRC_OFFSET];
+  entry->verified = commit;
+
+  for (; slot != FS_INDEX_NONE; slot = entry->extent) {
+    entry = &(fs_index.entries[slot]);
+    if (!nx_fs_metadata_is_growing(nx_fs_get_metadata(entry->origin))) {
+      continue;
+    }
+
+    nx_fs_read_page(entry->origin, data);
+    seq = data[FS_EXTENT_SEQ_OFFSET] & FS_EXTENT_SEQ_MASK;
+    size = data[FS_EXTENT_SEQ_OFFSET] >> FS_EXTENT_OLD_SIZE_SHIFT;
+
+    if (commit) {
+      data[0] = (data[0] & ~FS_FILE_ORIGIN_MASK) |
+        (FS_FILE_EXTENT_MARKER << 24);
+      data[FS_EXTENT_SEQ_OFFSET] = seq;
+      if (!nx_fs_program_page(data, entry->origin)) {
+        return FS_ERR_FLASH_ERROR;
+      }
+
+      continue;
+    }
+
+    pages = nx_fs_get_file_page_count(entry->size);
+    old_pages = nx_fs_get_file_page_count(size);
+    if (pages > old_pages &&
+        !nx_fs_erase_headers(entry->origin + old_pages, pages - old_pages)) {
+      return FS_ERR_FLASH_ERROR;
+    }
+
+    data[0] = (FS_FILE_EXTENT_MARKER << 24) + size;
+    data[FS_EXTENT_SEQ_OFFSET] = seq;
+    if (!nx_fs_write_page(data, entry->origin)) {
+      return FS_ERR_FLASH_ERROR;
+    }
+
+    nx_fs_index_set_size(entry, size);
+  }
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Extents left out of the index.
+ *
+ * The index holds at most FS_MAX_EXTENTS extents, FS_MAX_FILES of them
+ * file heads. The extents the flash walk finds past that are left out
+ * of it: the origin of each one is flagged in the map below, and its
+ * pages stay used in the page map. A file missing from the index is
+ * looked for there, and indexed again when needed, in place of files
+ * that are not opened. Nothing is moved around the flash while some
+ * extents are left out, as the index does not know all of them.
+ */
+
+/* Leave the extent at @a origin, @a size bytes long, out of the index.
+ */
+static void nx_fs_spill_add(U32 origin, size_t size) {
+  U32 i = origin - FS_PAGE_START;
+
+  fs_spill_map[i / 32] |= ((U32)1 << (i % 32));
+  nx_fs_map_mark(origin, nx_fs_get_file_page_count(size), TRUE);
+  fs_index.spilled++;
+}
+
+/* Forget the extent at @a origin left out of the index. Its pages are
+ * left as they are in the page map.
+ */
+static void nx_fs_spill_remove(U32 origin) {
+  U32 i = origin - FS_PAGE_START;
+
+  fs_spill_map[i / 32] &= ~((U32)1 << (i % 32));
+  fs_index.spilled--;
+}
+
+/* Returns the origin of the first extent left out of the index at or
+ * after @a start, or FS_PAGE_END.
+ */
+static U32 nx_fs_spill_next(U32 start) {
+  U32 i = start - FS_PAGE_START;
+
+  while (i < FS_PAGES) {
+    /* Skip empty words at once. */
+    if (i % 32 == 0 && fs_spill_map[i / 32] == 0) {
+      i += 32;
+    } else if ((fs_spill_map[i / 32] >> (i % 32)) & 1) {
+      break;
+    } else {
+      i++;
+    }
+  }
+
+  return MIN(i, FS_PAGES) + FS_PAGE_START;
+}
+
+/* Returns the origin of the first extent of the file called @a name
+ * left out of the index at or after @a start, or FS_PAGE_END. Only
+ * file heads are considered if @a head is TRUE, only continuation
+ * extents otherwise.
+ */
+static U32 nx_fs_spill_find(U32 start, char *name, bool head) {
+  union U32tochar nameconv;
+  U8 marker = head ? FS_FILE_ORIGIN_MARKER : FS_FILE_EXTENT_MARKER;
+
+  if (fs_index.spilled == 0) {
+    return FS_PAGE_END;
+  }
+
+  for (start = nx_fs_spill_next(start); start < FS_PAGE_END;
+       start = nx_fs_spill_next(start + 1)) {
+    if (nx_fs_marker_get_base(nx_fs_page_get_marker(start)) != marker) {
+      continue;
+    }
+
+    nx_fs_get_name_from_metadata(start, &nameconv);
+    if (streqn(nameconv.chars, name, FS_FILENAME_LENGTH)) {
+      break;
+    }
+  }
+
+  return start;
+}
+
+/* Wipe the extents of the file called @a name left out of the index. */
+static fs_err_t nx_fs_spill_wipe(char *name) {
+  U32 origin = FS_PAGE_START, pages;
+  bool head = TRUE;
+
+  while (TRUE) {
+    origin = nx_fs_spill_find(origin, name, head);
+    if (origin == FS_PAGE_END) {
+      if (!head) {
+        return FS_ERR_NO_ERROR;
+      }
+
+      /* Heads go first, then the continuation extents. */
+      head = FALSE;
+      origin = FS_PAGE_START;
+      continue;
+    }
+
+    pages = nx_fs_get_file_page_count(
+      nx_fs_get_file_size_from_metadata(nx_fs_get_metadata(origin)));
+    if (!nx_fs_erase_headers(origin, pages)) {
+      return FS_ERR_FLASH_ERROR;
+    }
+
+    nx_fs_spill_remove(origin);
+    nx_fs_map_mark(origin, pages, FALSE);
+  }
+}
+
+/* Leave the file whose head is @a entry out of the index. */
+static void nx_fs_spill_file(fs_index_entry_t *entry) {
+  U8 slot = entry - fs_index.entries;
+
+  while (slot != FS_INDEX_NONE) {
+    U32 origin = fs_index.entries[slot].origin;
+    size_t size = fs_index.entries[slot].size;
+
+    slot = fs_index.entries[slot].extent;
+    nx_fs_index_remove(origin);
+    nx_fs_spill_add(origin, size);
+  }
+}
+
+/* Make room in the index for @a extents more extents, @a files of them
+ * file heads, by leaving out files that are not opened. The files last
+ * on the flash go first.
+ */
+static fs_err_t nx_fs_index_make_room(U32 extents, U32 files) {
+  U32 i, j;
+
+  while (fs_index.count + extents > FS_MAX_EXTENTS ||
+         fs_index.files + files > FS_MAX_FILES) {
+    fs_index_entry_t *entry = NULL;
+
+    for (i=fs_index.count; i>0; i--) {
+      entry = &(fs_index.entries[fs_index.order[i-1]]);
+      if (!entry->head) {
+        continue;
+      }
+
+      for (j=0; j<FS_MAX_OPENED_FILES; j++) {
+        if (fdset[j].used && fdset[j].origin == entry->origin) {
+          break;
+        }
+      }
+
+      if (j == FS_MAX_OPENED_FILES) {
+        break;
+      }
+    }
+
+    if (i == 0) {
+      return FS_ERR_TOO_MANY_FILES;
+    }
+
+    nx_fs_spill_file(entry);
+  }
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Index again the file called @a name, whose head at @a origin was
+ * left out of the index. The slot of its head is returned through
+ * @a slot.
+ */
+static fs_err_t nx_fs_spill_take(U32 origin, char *name, U8 *slot) {
+  U32 hash = nx_fs_hash_name(name), extents = 1, page;
+  fs_err_t err;
+  U8 other;
+
+  for (page = nx_fs_spill_find(FS_PAGE_START, name, FALSE);
+       page < FS_PAGE_END; page = nx_fs_spill_find(page + 1, name, FALSE)) {
+    extents++;
+  }
+
+  err = nx_fs_index_make_room(extents, 1);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  nx_fs_spill_remove(origin);
+  err = nx_fs_index_insert(hash, origin,
+    nx_fs_get_file_size_from_metadata(nx_fs_get_metadata(origin)),
+    TRUE, slot);
+  NX_ASSERT(err == FS_ERR_NO_ERROR);
+
+  while ((page = nx_fs_spill_find(FS_PAGE_START, name, FALSE)) <
+         FS_PAGE_END) {
+    nx_fs_spill_remove(page);
+    err = nx_fs_index_insert(hash, page,
+      nx_fs_get_file_size_from_metadata(nx_fs_get_metadata(page)),
+      FALSE, &other);
+    NX_ASSERT(err == FS_ERR_NO_ERROR);
+
+    /* Drop a stale copy, as the index build does. */
+    if (!nx_fs_index_link_extent(other)) {
+      nx_fs_index_remove(page);
+    }
+  }
+
+  return nx_fs_settle_growth(origin);
+}
+
+/* Look for the head of the file called @a name, in the index first.
+ * A file only found among the extents left out of it is indexed
+ * again. The slot of its head, or FS_INDEX_NONE, is returned through
+ * @a slot.
+ */
+static fs_err_t nx_fs_index_lookup(char *name, U8 *slot) {
+  U32 origin;
+
+  *slot = nx_fs_index_find_head(name);
+  if (*slot != FS_INDEX_NONE) {
+    return FS_ERR_NO_ERROR;
+  }
+
+  origin = nx_fs_spill_find(FS_PAGE_START, name, TRUE);
+  if (origin == FS_PAGE_END) {
+    return FS_ERR_NO_ERROR;
+  }
+
+  return nx_fs_spill_take(origin, name, slot);
+}
+
+/* File versions.
+ *
+ * nx_fs_replace() writes the new version of a file in one extent of
+ * its own, with a shadow marker that nothing but the index build
+ * looks at. Once complete, its header is written with the pending
+ * marker, its size and its checksum. The old version is then wiped,
+ * its first page first: that erase commits the new version. Last, the
+ * new version's marker is turned into an origin marker by a page
+ * program, which only clears bits.
+ *
+ * A reset at any point leaves either the old version, or a pending
+ * one without an old version, which the next index build commits.
+ */
+
+/* Commit the pending new version of a file at @a origin, once the old
+ * version is gone. Continuation extents bearing the file's name, left
+ * by an old version that was being wiped, go first, so that they are
+ * not mistaken for the new version's. So does anything of the old
+ * version left out of the index.
+ */
+static fs_err_t nx_fs_commit_shadow(U32 origin) {
+  fs_index_entry_t *entry = nx_fs_index_get(origin);
+  U32 data[EFC_PAGE_WORDS];
+  union U32tochar name, other_name;
+  fs_err_t err;
+  U32 i = 0;
+  U8 slot;
+
+  nx_fs_get_name_from_metadata(origin, &name);
+
+  while (i < fs_index.count) {
+    fs_index_entry_t *other = &(fs_index.entries[fs_index.order[i]]);
+
+    if (!other->head && !other->shadow && other->hash == entry->hash) {
+      nx_fs_get_name_from_metadata(other->origin, &other_name);
+      if (streqn(name.chars, other_name.chars, FS_FILENAME_LENGTH)) {
+        err = nx_fs_wipe_extent(other);
+        if (err != FS_ERR_NO_ERROR) {
+          return err;
+        }
+
+        /* The index order shifted over the removed extent. */
+        continue;
+      }
+    }
+
+    i++;
+  }
+
+  err = nx_fs_spill_wipe(name.chars);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  err = nx_fs_index_make_room(0, 1);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  nx_fs_read_page(origin, data);
+  data[0] = (data[0] & ~FS_FILE_ORIGIN_MASK) | (FS_FILE_ORIGIN_MARKER << 24);
+  if (!nx_fs_program_page(data, origin)) {
+    return FS_ERR_FLASH_ERROR;
+  }
+
+  /* Index the new version as the file's head. */
+  slot = entry - fs_index.entries;
+  entry->shadow = FALSE;
+  entry->head = TRUE;
+  entry->next = fs_index.buckets[entry->hash % FS_INDEX_BUCKETS];
+  fs_index.buckets[entry->hash % FS_INDEX_BUCKETS] = slot;
+  fs_index.files++;
+  fs_index.generation++;
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Settle the new file versions found by the flash walk. One that was
+ * still being written, or whose old version is still there, is wiped.
+ * A complete one whose old version is gone is committed, if its
+ * payload matches its checksum.
+ */
+static fs_err_t nx_fs_index_settle_shadows(void) {
+  union U32tochar nameconv;
+  fs_err_t err;
+  U32 i = 0;
+
+  while (i < fs_index.count) {
+    fs_index_entry_t *entry = &(fs_index.entries[fs_index.order[i]]);
+    volatile U32 *metadata;
+    U32 origin = entry->origin;
+
+    if (!entry->shadow) {
+      i++;
+      continue;
+    }
+
+    metadata = nx_fs_get_metadata(origin);
+    nx_fs_get_name_from_metadata(origin, &nameconv);
+
+    if (nx_fs_page_get_marker(origin) == FS_FILE_PENDING_MARKER &&
+        nx_fs_index_find_head(nameconv.chars) == FS_INDEX_NONE &&
+        nx_fs_spill_find(FS_PAGE_START, nameconv.chars, TRUE) == FS_PAGE_END &&
+        nx_fs_crc_update(0, (volatile U8 *)metadata + FS_FILE_METADATA_BYTES,
+                         entry->size) == metadata[FS_FILE_CRC_OFFSET]) {
+      err = nx_fs_commit_shadow(origin);
+      entry->verified = TRUE;
+    } else {
+      err = nx_fs_wipe_extent(entry);
+    }
+
+    if (err != FS_ERR_NO_ERROR) {
+      return err;
+    }
+
+    /* Committing may have removed extents before this one. */
+    i = 0;
+  }
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Determines if the extents at @a a and @a b are two copies of the
+ * same one: extents of the same file, with the same marker and, for
+ * continuation extents, the same sequence number.
+ */
+static bool nx_fs_index_is_copy(fs_index_entry_t *a, fs_index_entry_t *b) {
+  volatile U32 *metadata = nx_fs_get_metadata(a->origin);
+  volatile U32 *other = nx_fs_get_metadata(b->origin);
+  union U32tochar name, other_name;
+  U8 marker = nx_fs_marker_get_base((metadata[0] & FS_FILE_ORIGIN_MASK) >> 24);
+
+  if (a->hash != b->hash ||
+      marker != nx_fs_marker_get_base((other[0] & FS_FILE_ORIGIN_MASK) >> 24)) {
+    return FALSE;
+  }
+
+  if (marker == FS_FILE_EXTENT_MARKER &&
+      nx_fs_get_extent_seq(metadata) != nx_fs_get_extent_seq(other)) {
+    return FALSE;
+  }
+
+  nx_fs_get_name_from_metadata(a->origin, &name);
+  nx_fs_get_name_from_metadata(b->origin, &other_name);
+  return streqn(name.chars, other_name.chars, FS_FILENAME_LENGTH);
+}
+
+/* Settle the extents found twice by the flash walk, so that a file
+ * never has two heads. A background move interrupted once its copy
+ * was complete leaves both the copy and what remains of its source:
+ * the copy wins, and gets its own marker back. Otherwise, the copy
+ * higher in the flash wins, which is the one nx_fs_move_region()
+ * completes last in both directions. New file versions are left to
+ * nx_fs_index_settle_shadows(), unless one was being moved.
+ */
+static fs_err_t nx_fs_index_settle_copies(void) {
+  U32 data[EFC_PAGE_WORDS];
+  fs_err_t err;
+  U32 i = 0, j;
+
+  while (i < fs_index.count) {
+    fs_index_entry_t *entry = &(fs_index.entries[fs_index.order[i]]);
+    fs_index_entry_t *other = NULL;
+
+    for (j=i+1; j<fs_index.count; j++) {
+      other = &(fs_index.entries[fs_index.order[j]]);
+
+      if ((entry->moved || other->moved || !entry->shadow) &&
+          nx_fs_index_is_copy(entry, other)) {
+        break;
+      }
+    }
+
+    if (j < fs_index.count) {
+      err = nx_fs_wipe_extent(entry->moved && !other->moved ? other : entry);
+      if (err != FS_ERR_NO_ERROR) {
+        return err;
+      }
+
+      /* The index order shifted over the removed extent. */
+      i = 0;
+      continue;
+    }
+
+    if (entry->moved) {
+      nx_fs_read_page(entry->origin, data);
+      data[0] &= ~(FS_FILE_MOVE_MASK << 24);
+      if (!nx_fs_program_page(data, entry->origin)) {
+        return FS_ERR_FLASH_ERROR;
+      }
+
+      entry->moved = FALSE;
+    }
+
+    i++;
+  }
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Build the index by walking the flash. This is the only place where
+ * the whole flash gets scanned, and it only reads the file headers:
+ * each one is checked before its size is used to skip to the next,
+ * and the walk goes on with the following page past a bad one. File
+ * payloads are only checked when first opened.
+ */
+static fs_err_t nx_fs_index_build(void) {
+  union U32tochar nameconv;
+  fs_err_t err;
+  U8 marker, slot;
+  U32 i;
+
+  /* The flash is the reference from now on. */
+  nx_fs_cache_write_back_range(FS_PAGE_START, FS_PAGES);
+  nx_fs_cache_invalidate(FS_PAGE_START, FS_PAGES);
+  nx_fs_index_reset();
+  nx_fs_wear_check();
+
+  /* Record the layout before anything uses the pages after the file
+   * system, unless files of an older one are still there.
+   */
+  if (!fs_wear.layout) {
+    if (!nx_fs_layout_is_clear()) {
+      return FS_ERR_OLD_LAYOUT;
+    }
+
+    nx_fs_wear_save();
+  }
+
+  for (i=FS_PAGE_START; i<FS_PAGE_END; i++) {
+    if (nx_fs_page_has_magic(i)) {
+      volatile U32 *metadata = nx_fs_get_metadata(i);
+      size_t size = nx_fs_get_file_size_from_metadata(metadata);
+
+      fs_index.headers++;
+
+      /* A header running past the end of the flash is stale. */
+      if (!nx_fs_metadata_is_valid(metadata) ||
+          i + nx_fs_get_file_page_count(size) > FS_PAGE_END) {
+        fs_index.rejected++;
+        continue;
+      }
+
+      /* A copy the background defragmentation did not complete is
+       * dropped: its source is still whole.
+       */
+      marker = nx_fs_page_get_marker(i);
+      if ((marker & FS_FILE_MOVE_MASK) == FS_FILE_MOVE_MASK) {
+        if (!nx_fs_erase_headers(i, nx_fs_get_file_page_count(size))) {
+          return FS_ERR_FLASH_ERROR;
+        }
+
+        i += nx_fs_get_file_page_count(size) - 1;
+        continue;
+      }
+
+      nx_fs_get_name_from_metadata(i, &nameconv);
+      err = nx_fs_index_insert(nx_fs_hash_name(nameconv.chars), i, size,
+        nx_fs_marker_get_base(marker) == FS_FILE_ORIGIN_MARKER, &slot);
+      if (err == FS_ERR_TOO_MANY_FILES) {
+        nx_fs_spill_add(i, size);
+      } else if (err != FS_ERR_NO_ERROR) {
+        return err;
+      } else {
+        fs_index.entries[slot].moved = (marker & FS_FILE_MOVED_FLAG) != 0;
+        marker = nx_fs_marker_get_base(marker);
+        fs_index.entries[slot].shadow = marker == FS_FILE_SHADOW_MARKER ||
+          marker == FS_FILE_PENDING_MARKER;
+      }
+
+      i += nx_fs_get_file_page_count(size) - 1;
+    }
+  }
+
+  /* Settle the moves and file replacements a reset interrupted,
+   * before the extents get linked to their file.
+   */
+  err = nx_fs_index_settle_copies();
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  err = nx_fs_index_settle_shadows();
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  /* Chain the continuation extents to their file. Orphans, left
+   * behind by an interrupted operation, are dropped and their pages
+   * reclaimed, unless their file was left out of the index.
+   */
+  i = 0;
+  while (i < fs_index.count) {
+    fs_index_entry_t *entry;
+
+    slot = fs_index.order[i];
+    entry = &(fs_index.entries[slot]);
+
+    if (!entry->head && !nx_fs_index_link_extent(slot)) {
+      U32 origin = entry->origin;
+
+      nx_fs_get_name_from_metadata(origin, &nameconv);
+      nx_fs_index_remove(origin);
+      if (nx_fs_spill_find(FS_PAGE_START, nameconv.chars, TRUE) <
+          FS_PAGE_END) {
+        nx_fs_spill_add(origin, entry->size);
+      }
+    } else {
+      i++;
+    }
+  }
+
+  /* Files are indexed whole, or not at all. */
+  i = 0;
+  while (i < fs_index.count) {
+    fs_index_entry_t *entry = &(fs_index.entries[fs_index.order[i]]);
+
+    if (entry->head && fs_index.spilled) {
+      nx_fs_get_name_from_metadata(entry->origin, &nameconv);
+      if (nx_fs_spill_find(FS_PAGE_START, nameconv.chars, FALSE) <
+          FS_PAGE_END) {
+        nx_fs_spill_file(entry);
+        i = 0;
+        continue;
+      }
+    }
+
+    i++;
+  }
+
+  /* Settle the files a reset left growing. */
+  for (i=0; i<fs_index.count; i++) {
+    fs_index_entry_t *entry = &(fs_index.entries[fs_index.order[i]]);
+
+    if (entry->head) {
+      err = nx_fs_settle_growth(entry->origin);
+      if (err != FS_ERR_NO_ERROR) {
+        return err;
+      }
+    }
+  }
+
+  nx_fs_pool_scan();
+
+  fs_index.built = TRUE;
+  return FS_ERR_NO_ERROR;
+}
+
+/* Make sure the index is built before using it. */
+static fs_err_t nx_fs_index_check(void) {
+  if (fs_index.built) {
+    return FS_ERR_NO_ERROR;
+  }
+
+  return nx_fs_index_build();
+}
+
+/* Update the index entries and the opened files after the @a len pages
+ * long region starting at @a source was moved to @a dest.
+ */
+static void nx_fs_index_shift(U32 source, U32 dest, U32 len) {
+  U32 i;
+
+  /* Opened files follow their extents. */
+  for (i=0; i<FS_MAX_OPENED_FILES; i++) {
+    fs_file_t *file = &(fdset[i]);
+    U32 origin;
+
+    if (!file->used) {
+      continue;
+    }
+
+    if (file->origin >= source && file->origin < source + len) {
+      file->origin = file->origin - source + dest;
+    }
+
+    origin = fs_index.entries[file->rbuf.extent].origin;
+    if (origin >= source && origin < source + len) {
+      file->rbuf.page = file->rbuf.page - source + dest;
+    }
+
+    origin = fs_index.entries[file->wbuf.extent].origin;
+    if (origin >= source && origin < source + len) {
+      file->wbuf.page = file->wbuf.page - source + dest;
+    }
+  }
+
+  memset(fs_page_map, 0, sizeof(fs_page_map));
+
+  for (i=0; i<fs_index.count; i++) {
+    fs_index_entry_t *entry = &(fs_index.entries[fs_index.order[i]]);
+
+    if (entry->origin >= source && entry->origin < source + len) {
+      entry->origin = entry->origin - source + dest;
+    }
+
+    /* Regions may overlap while being moved, so the page map is
+     * rebuilt rather than patched.
+     */
+    nx_fs_map_mark(entry->origin, nx_fs_index_get_span(entry), TRUE);
+  }
+
+  for (i = nx_fs_spill_next(FS_PAGE_START); i < FS_PAGE_END;
+       i = nx_fs_spill_next(i + 1)) {
+    nx_fs_map_mark(i, nx_fs_get_file_page_count(
+      nx_fs_get_file_size_from_metadata(nx_fs_get_metadata(i))), TRUE);
+  }
+
+  nx_fs_index_sort();
+  fs_index.generation++;
+}
+
+/* Determines if the given page is used by a file.
+ */
+static bool nx_fs_page_is_used(U32 page) {
+  return nx_fs_map_is_used(page);
+}
+
+/* Find a file's origin on the file system by its name.
+ */
+static fs_err_t nx_fs_find_file_origin(char *name, U32 *origin) {
+  fs_err_t err;
+  U8 slot;
+
+  err = nx_fs_index_lookup(name, &slot);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  if (slot == FS_INDEX_NONE) {
+    return FS_ERR_FILE_NOT_FOUND;
+  }
+
+  *origin = fs_index.entries[slot].origin;
+  return FS_ERR_NO_ERROR;
+}
+
+/* Finds the last file origin on the flash.
+ */
+static fs_err_t nx_fs_find_last_origin(U32 *origin) {
+  if (fs_index.count == 0) {
+    return FS_ERR_FILE_NOT_FOUND;
+  }
+
+  *origin = fs_index.entries[fs_index.order[fs_index.count-1]].origin;
+  return FS_ERR_NO_ERROR;
+}
+
+static fs_err_t nx_fs_find_next_origin(U32 start, U32 *origin) {
+  U32 pos = nx_fs_index_lower_bound(start);
+
+  if (pos == fs_index.count) {
+    return FS_ERR_FILE_NOT_FOUND;
+  }
+
+  *origin = fs_index.entries[fs_index.order[pos]].origin;
+  return FS_ERR_NO_ERROR;
+}
+
+/* Serialize a file's metadata using the provided values and returns
+ * the resulting U32s, ready to be stored on flash.
+ */
+static void nx_fs_create_metadata(fs_perm_t perms, char *name, size_t size,
+                                  U32 *metadata) {
+  union U32tochar nameconv;
+
+  memset(metadata, 0, FS_FILE_METADATA_BYTES);
+
+  memset(nameconv.chars, 0, 32);
+  memcpy(nameconv.chars, name, MIN(strlen(name), 31));
+
+  /* Magic marker. */
+  metadata[0] = (FS_FILE_ORIGIN_MARKER << 24);
+
+  /* File permissions. */
+  switch (perms) {
+    case FS_PERM_READWRITE:
+      metadata[0] += (FS_FILE_PERM_MASK_READWRITE << 20);
+      break;
+    case FS_PERM_EXECUTABLE:
+      metadata[0] += (FS_FILE_PERM_MASK_EXECUTABLE << 20);
+      break;
+    default:
+      break;
+  }
+
+  /* File size. */
+  metadata[0] += (size & FS_FILE_SIZE_MASK);
+
+  /* File name. */
+  memcpy(metadata + FS_FILENAME_OFFSET, nameconv.integers, FS_FILENAME_LENGTH);
+}
+
+/* Record the file's payload checksum in its serialized metadata. */
+static void nx_fs_set_metadata_crc(U32 *metadata, U32 crc) {
+  metadata[0] |= (FS_FILE_FLAG_CRC << 20);
+  metadata[FS_FILE_CRC_OFFSET] = crc;
+}
+
+/* Check the payload of the file starting at @a origin against its
+ * checksum, once per index build. The check is left for later while
+ * another fd has changes to the file that are not on the flash yet.
+ */
+static fs_err_t nx_fs_verify(U32 origin) {
+  fs_index_entry_t *entry = nx_fs_index_get(origin);
+  volatile U32 *metadata = nx_fs_get_metadata(origin);
+  U32 i;
+
+  if (entry->verified || !nx_fs_get_file_has_crc(metadata)) {
+    return FS_ERR_NO_ERROR;
+  }
+
+  for (i=0; i<FS_MAX_OPENED_FILES; i++) {
+    if (fdset[i].used && fdset[i].modified && fdset[i].origin == origin) {
+      return FS_ERR_NO_ERROR;
+    }
+  }
+
+  if (nx_fs_get_file_crc(origin) != metadata[FS_FILE_CRC_OFFSET]) {
+    return FS_ERR_CORRUPTED_FILE;
+  }
+
+  entry->verified = TRUE;
+  return FS_ERR_NO_ERROR;
+}
+
+/* Serialize the metadata of a file's continuation extent, @a seq
+ * being its position in the file's extent chain.
+ */
+static void nx_fs_create_extent_metadata(char *name, U32 seq, size_t size,
+                                         U32 *metadata) {
+  nx_fs_create_metadata(FS_PERM_READONLY, name, size, metadata);
+
+  metadata[0] = (FS_FILE_EXTENT_MARKER << 24) + (size & FS_FILE_SIZE_MASK);
+  metadata[FS_EXTENT_SEQ_OFFSET] = seq;
+}
+
+static fs_err_t nx_fs_move_region_backwards(U32 source, U32 dest, U32 len) {
+  U32 data[EFC_PAGE_WORDS];
+
+  while (len--) {
+    nx_fs_read_page(source, data);
+
+    if (!nx_fs_write_page(data, dest)) {
+      return FS_ERR_FLASH_ERROR;
+    }
+
+    /* Only pages that look like a header must go right away, the
+     * others are left for the background eraser.
+     */
+    if (nx_fs_word_has_magic(data[0]) && !nx_fs_erase_page(source)) {
+      return FS_ERR_FLASH_ERROR;
+    }
+
+    source++;
+    dest++;
+  }
+
+  return FS_ERR_NO_ERROR;
+}
+
+static fs_err_t nx_fs_move_region_forwards(U32 source, U32 dest, U32 len) {
+  U32 data[EFC_PAGE_WORDS];
+
+  while (len--) {
+    nx_fs_read_page(source + len, data);
+
+    if (!nx_fs_write_page(data, dest + len)) {
+      return FS_ERR_FLASH_ERROR;
+    }
+
+    if (nx_fs_word_has_magic(data[0]) && !nx_fs_erase_page(source + len)) {
+      return FS_ERR_FLASH_ERROR;
+    }
+  }
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Move a @a len long flash region starting at page @a source to @a dest.
+ * Since pages are moved one after another, regions may overlap if the
+ * destination is lower in the flash than the source, but not the other
+ * way around. Note that this is asserted anyway to avoid data loss.
+ * It is the responsibility of the caller to clean up the remaining
+ * source region of any data he doesn't want to leave there (file origin
+ * markers for example).
+ *
+ * @param source The source page number.
+ * @param dest The destination page number.
+ * @param len The region length.
+ */
+static fs_err_t nx_fs_move_region(U32 source, U32 dest, U32 len) {
+  fs_err_t err;
+
+  NX_ASSERT(source < EFC_PAGES);
+  NX_ASSERT(dest < EFC_PAGES);
+  NX_ASSERT(len < EFC_PAGES);
+
+  if (source == dest) {
+    return FS_ERR_NO_ERROR;
+  } else if (dest < source) {
+    err = nx_fs_move_region_backwards(source, dest, len);
+  } else {
+    err = nx_fs_move_region_forwards(source, dest, len);
+  }
+
+  if (err != FS_ERR_NO_ERROR) {
+    /* The region was partially moved, resync the index with the
+     * flash contents.
+     */
+    nx_fs_index_build();
+    return err;
+  }
+
+  nx_fs_index_shift(source, dest, len);
+  return FS_ERR_NO_ERROR;
+}
+
+/* Returns the index entry of the extent holding the buffer's page. */
+static fs_index_entry_t *nx_fs_buffer_get_extent(fs_buffer_t *buf) {
+  return &(fs_index.entries[buf->extent]);
+}
+
+/* Returns the file offset the buffer's cursor stands at. */
+static size_t nx_fs_buffer_get_offset(fs_buffer_t *buf) {
+  fs_index_entry_t *entry = nx_fs_buffer_get_extent(buf);
+
+  return buf->base + (buf->page - entry->origin) * EFC_PAGE_BYTES
+    + buf->pos - FS_FILE_METADATA_BYTES;
+}
+
+/* Place the buffer's cursor at @a offset in the file, without loading
+ * the buffer data. On a page or extent boundary, the cursor is left at
+ * the end of the previous page.
+ */
+static void nx_fs_buffer_locate(fs_file_t *file, fs_buffer_t *buf,
+                                size_t offset) {
+  fs_index_entry_t *entry;
+  U32 rel;
+
+  NX_ASSERT(offset <= file->size);
+
+  buf->extent = nx_fs_index_get_slot(file->origin);
+  buf->base = 0;
+  entry = nx_fs_buffer_get_extent(buf);
+
+  while (offset > buf->base + entry->size && entry->extent != FS_INDEX_NONE) {
+    buf->base += entry->size;
+    buf->extent = entry->extent;
+    entry = nx_fs_buffer_get_extent(buf);
+  }
+
+  rel = FS_FILE_METADATA_BYTES + offset - buf->base;
+  buf->page = entry->origin + rel / EFC_PAGE_BYTES;
+  buf->pos = rel % EFC_PAGE_BYTES;
+
+  if (buf->pos == 0) {
+    buf->page--;
+    buf->pos = EFC_PAGE_BYTES;
+  }
+}
+
+/* Move the buffer's cursor to the beginning of the file's next page,
+ * which may be the first page of the next extent, without loading the
+ * buffer data. Returns FALSE if the buffer is on the last page of the
+ * file.
+ */
+static bool nx_fs_buffer_next_page(fs_buffer_t *buf) {
+  fs_index_entry_t *entry = nx_fs_buffer_get_extent(buf);
+
+  if (buf->page + 1 < entry->origin +
+      nx_fs_get_file_page_count(entry->size)) {
+    buf->page++;
+    buf->pos = 0;
+  } else if (entry->extent != FS_INDEX_NONE) {
+    buf->base += entry->size;
+    buf->extent = entry->extent;
+    buf->page = nx_fs_buffer_get_extent(buf)->origin;
+    buf->pos = FS_FILE_METADATA_BYTES;
+  } else {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Relocate the extent being written to the best fitting hole that
+ * leaves room for one more page.
+ */
+static fs_err_t nx_fs_relocate(fs_file_t *file) {
+  fs_index_entry_t *entry = nx_fs_buffer_get_extent(&(file->wbuf));
+  U32 origin = entry->origin, npages, dest;
+  fs_err_t err;
+
+  npages = nx_fs_index_get_span(entry);
+
+  /* The extent's own pages can be part of the destination hole: such a
+   * hole always starts before the extent, and regions can be moved
+   * backwards over themselves.
+   */
+  nx_fs_map_mark(origin, npages, FALSE);
+  err = nx_fs_map_find_hole(npages + 1, &dest);
+  nx_fs_map_mark(origin, npages, TRUE);
+
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  /* Moving the data also updates the file's page pointers. */
+  return nx_fs_move_region(origin, dest, npages);
+}
+
+/* Start a new extent for the file to grow into. It is placed in the
+ * largest hole of the flash, so that it can keep growing for a while.
+ */
+static fs_err_t nx_fs_add_extent(fs_file_t *file) {
+  U32 metadata[EFC_PAGE_WORDS] = {0};
+  U32 origin, seq = 1;
+  fs_err_t err;
+  U8 slot, last;
+
+  /* Make sure the extent can be indexed before touching the flash. */
+  if (fs_index.count == FS_MAX_EXTENTS) {
+    return FS_ERR_TOO_MANY_FILES;
+  }
+
+  last = nx_fs_index_get_slot(file->origin);
+  while (fs_index.entries[last].extent != FS_INDEX_NONE) {
+    last = fs_index.entries[last].extent;
+    seq++;
+  }
+
+  NX_ASSERT(last == file->wbuf.extent);
+
+  err = nx_fs_map_find_largest(&origin);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  nx_fs_create_extent_metadata(file->name, seq, 0, metadata);
+  if (!nx_fs_write_page(metadata, origin)) {
+    return FS_ERR_FLASH_ERROR;
+  }
+
+  err = nx_fs_index_insert(fs_index.entries[last].hash, origin, 0, FALSE,
+                           &slot);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  fs_index.entries[last].extent = slot;
+
+  file->wbuf.base += fs_index.entries[last].size;
+  file->wbuf.extent = slot;
+  file->wbuf.page = origin;
+  file->wbuf.pos = FS_FILE_METADATA_BYTES;
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Move the write cursor to a fresh page after the end of the file,
+ * finding room for it if needed.
+ */
+static fs_err_t nx_fs_grow(fs_file_t *file) {
+  fs_index_entry_t *entry = nx_fs_buffer_get_extent(&(file->wbuf));
+  U32 page = file->wbuf.page + 1;
+  fs_err_t err;
+
+  /* Rather than moving the file's data around when the next page is
+   * taken, continue the file in a new extent. Relocating the last
+   * extent is only a fallback for when the index is full. Pages
+   * reserved for the extent are taken, but by the extent itself.
+   */
+  if (page >= entry->origin + nx_fs_index_get_span(entry) &&
+      (page >= FS_PAGE_END || nx_fs_page_is_used(page))) {
+    /* New file versions are kept in one extent. */
+    err = FS_ERR_TOO_MANY_FILES;
+    if (!file->shadow) {
+      err = nx_fs_add_extent(file);
+    }
+
+    if (err != FS_ERR_TOO_MANY_FILES) {
+      return err;
+    }
+
+    err = nx_fs_relocate(file);
+    if (err != FS_ERR_NO_ERROR) {
+      return err;
+    }
+  }
+
+  file->wbuf.page++;
+  file->wbuf.pos = 0;
+  nx_fs_cache_get(file->wbuf.page, FALSE);
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Ring logs.
+ *
+ * The pages of a ring log following its header hold records, each
+ * stored as a length byte followed by the record bytes. Each page
+ * starts with its fill level and a sequence number, the page numbered
+ * seq being the (seq % capacity)th page of the ring. Pages are filled
+ * in turn, so from the first page up to the newest, the sequence
+ * numbers increase by one, and the newest page is found by a binary
+ * search on that.
+ */
+
+/* Ring page marker, stored with the page fill level. */
+#define FS_RING_MARKER 0x52
+
+/* Mask to use on the first ring page U32 to get the page fill level. */
+#define FS_RING_FILL_MASK 0x00FFFFFF
+
+/* Sequence number offset (in U32s) in a ring page. */
+#define FS_RING_SEQ_OFFSET 1
+
+/* Ring page header size, in bytes. */
+#define FS_RING_HEADER_BYTES (2 * sizeof(U32))
+
+/* Returns the number of record pages of a ring log. */
+static U32 nx_fs_ring_get_capacity(fs_file_t *file) {
+  return nx_fs_index_get_pages(file->origin) - 1;
+}
+
+/* Returns the flash page holding the ring page numbered @a seq. */
+static U32 nx_fs_ring_get_page(fs_file_t *file, U32 seq) {
+  return file->origin + 1 + seq % nx_fs_ring_get_capacity(file);
+}
+
+/* Catch up with the pages appended to a ring log through its other
+ * descriptors.
+ */
+static void nx_fs_ring_update(fs_file_t *file) {
+  U32 i;
+
+  for (i=0; i<FS_MAX_OPENED_FILES; i++) {
+    if (fdset[i].used && fdset[i].origin == file->origin &&
+        (S32)(fdset[i].ring_seq - file->ring_seq) > 0) {
+      file->ring_seq = fdset[i].ring_seq;
+    }
+  }
+}
+
+/* Returns the sequence number of the oldest page of a ring log. */
+static U32 nx_fs_ring_get_oldest(fs_file_t *file) {
+  U32 capacity = nx_fs_ring_get_capacity(file);
+
+  return file->ring_seq >= capacity ? file->ring_seq - capacity + 1 : 0;
+}
+
+/* Returns the fill level of the given ring page data, or 0 if it does
+ * not hold the ring page numbered @a seq.
+ */
+static U32 nx_fs_ring_get_fill(U32 *data, U32 seq) {
+  U32 fill = data[0] & FS_RING_FILL_MASK;
+
+  if ((data[0] & FS_FILE_ORIGIN_MASK) >> 24 != FS_RING_MARKER ||
+      data[FS_RING_SEQ_OFFSET] != seq ||
+      fill < FS_RING_HEADER_BYTES || fill > EFC_PAGE_BYTES) {
+    return 0;
+  }
+
+  return fill;
+}
+
+/* Find the newest page of a ring log, which appending goes on with. */
+static void nx_fs_ring_locate(fs_file_t *file) {
+  U32 data[EFC_PAGE_WORDS];
+  U32 capacity = nx_fs_ring_get_capacity(file), first, low = 0, high, mid;
+
+  nx_fs_read_page(file->origin + 1, data);
+  first = data[FS_RING_SEQ_OFFSET];
+  if (first % capacity != 0 || !nx_fs_ring_get_fill(data, first)) {
+    file->ring_seq = 0;
+    return;
+  }
+
+  /* The first pages hold first, first + 1, ... up to the newest page.
+   * The following ones are older, or unused.
+   */
+  high = capacity;
+  while (high - low > 1) {
+    mid = (low + high) / 2;
+
+    nx_fs_read_page(file->origin + 1 + mid, data);
+    if (nx_fs_ring_get_fill(data, first + mid)) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+
+  file->ring_seq = first + low;
+}
+
+/* Read up to len bytes of the stored data of a file, one page span
+ * at a time.
+ */
+static fs_err_t nx_fs_read_raw(fs_file_t *file, U8 *data, size_t len,
+                               size_t *read) {
+  size_t offset, done = 0;
+
+  /* Clamp the request to what is left before the end of file. */
+  offset = nx_fs_buffer_get_offset(&(file->rbuf));
+  if (offset >= file->size) {
+    return len ? FS_ERR_END_OF_FILE : FS_ERR_NO_ERROR;
+  }
+
+  len = MIN(len, file->size - offset);
+
+  while (done < len) {
+    fs_cache_entry_t *page;
+    size_t span;
+
+    /* If needed, move on to the next page. */
+    if (file->rbuf.pos == EFC_PAGE_BYTES) {
+      if (!nx_fs_buffer_next_page(&(file->rbuf))) {
+        return FS_ERR_CORRUPTED_FILE;
+      }
+    }
+
+    page = nx_fs_cache_get(file->rbuf.page, TRUE);
+    span = MIN(len - done, EFC_PAGE_BYTES - file->rbuf.pos);
+    memcpy(data + done, page->data.bytes + file->rbuf.pos, span);
+
+    file->rbuf.pos += span;
+    done += span;
+  }
+
+  if (read) {
+    *read = done;
+  }
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Write len bytes to the stored data of a file, one page span at a
+ * time.
+ */
+static fs_err_t nx_fs_write_raw(fs_file_t *file, const U8 *data,
+                                size_t len) {
+  fs_err_t err;
+  size_t offset;
+
+  /* The file's data changes, whichever pages it touches. */
+  fs_index.generation++;
+  file->modified = TRUE;
+
+  while (len > 0) {
+    fs_cache_entry_t *page;
+    size_t span;
+
+    /* If needed, move on to the next page of the file, or find room
+     * for the file to grow.
+     */
+    if (file->wbuf.pos == EFC_PAGE_BYTES &&
+        !nx_fs_buffer_next_page(&(file->wbuf))) {
+      err = nx_fs_grow(file);
+      if (err != FS_ERR_NO_ERROR) {
+        return err;
+      }
+    }
+
+    /* Pages are only written back to the flash when evicted from the
+     * cache or flushed.
+     */
+    page = nx_fs_cache_get(file->wbuf.page, TRUE);
+    span = MIN(len, EFC_PAGE_BYTES - file->wbuf.pos);
+    memcpy(page->data.bytes + file->wbuf.pos, data, span);
+    page->dirty = TRUE;
+
+    file->wbuf.pos += span;
+    data += span;
+    len -= span;
+
+    /* Increment the size of the file if necessary. */
+    offset = nx_fs_buffer_get_offset(&(file->wbuf));
+    if (offset > file->size) {
+      file->size = offset;
+      nx_fs_index_set_size(nx_fs_buffer_get_extent(&(file->wbuf)),
+                           offset - file->wbuf.base);
+    }
+  }
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Compressed files.
+ *
+ * The stored data of a compressed file is an LZ stream (see lz.h),
+ * followed by the uncompressed size as a little endian U32, written
+ * when the file is closed. Such a file is only written from its start,
+ * once created or truncated, and read from its start: seeking decodes
+ * the data up to the new position. The codecs, which hold the LZ
+ * windows, are shared by all the opened files.
+ */
+
+/* Empty codec slot marker. */
+#define FS_CODEC_NONE 0xFF
+
+/* Size of the uncompressed size at the end of a compressed file. */
+#define FS_COMPRESSED_TRAILER_BYTES sizeof(U32)
+
+/* Codec of an opened compressed file. */
+typedef struct {
+  bool used;
+  bool encoding;   /* Is the file written rather than read? */
+  fs_err_t err;    /* Error of the last stored data access. */
+  fs_file_t *file;
+  union {
+    lz_encoder_t encoder;
+    lz_decoder_t decoder;
+  } lz;
+} fs_codec_t;
+
+static fs_codec_t fs_codecs[FS_COMPRESSED_FILES];
+
+static bool nx_fs_codec_output(void *arg, const U8 *data, U32 len) {
+  fs_codec_t *codec = arg;
+
+  codec->err = nx_fs_write_raw(codec->file, data, len);
+  return codec->err == FS_ERR_NO_ERROR;
+}
+
+static bool nx_fs_codec_input(void *arg, U8 *byte) {
+  fs_codec_t *codec = arg;
+  fs_file_t *file = codec->file;
+
+  if (nx_fs_buffer_get_offset(&(file->rbuf)) + FS_COMPRESSED_TRAILER_BYTES
+      >= file->size) {
+    return FALSE;
+  }
+
+  codec->err = nx_fs_read_raw(file, byte, 1, NULL);
+  return codec->err == FS_ERR_NO_ERROR;
+}
+
+/* Start reading a compressed file from its beginning. */
+static void nx_fs_codec_rewind(fs_file_t *file) {
+  fs_codec_t *codec = &(fs_codecs[file->codec]);
+
+  nx_fs_buffer_locate(file, &(file->rbuf), 0);
+  nx_lz_decoder_init(&(codec->lz.decoder), nx_fs_codec_input, codec);
+}
+
+/* Give an opened compressed file a codec, to write it from its start
+ * if @a encoding, or to read it.
+ */
+static fs_err_t nx_fs_codec_open(fs_file_t *file, bool encoding) {
+  U8 trailer[FS_COMPRESSED_TRAILER_BYTES];
+  fs_codec_t *codec;
+  U32 slot, i;
+
+  for (slot=0; slot<FS_COMPRESSED_FILES && fs_codecs[slot].used; slot++);
+  if (slot == FS_COMPRESSED_FILES) {
+    return FS_ERR_TOO_MANY_OPENED_FILES;
+  }
+
+  codec = &(fs_codecs[slot]);
+  codec->used = TRUE;
+  codec->encoding = encoding;
+  codec->err = FS_ERR_NO_ERROR;
+  codec->file = file;
+  file->codec = slot;
+  file->length = 0;
+
+  if (encoding) {
+    nx_lz_encoder_init(&(codec->lz.encoder), nx_fs_codec_output, codec);
+    return FS_ERR_NO_ERROR;
+  }
+
+  /* A compressed file that was never closed reads as empty. */
+  if (file->size >= FS_COMPRESSED_TRAILER_BYTES) {
+    nx_fs_buffer_locate(file, &(file->rbuf),
+                        file->size - FS_COMPRESSED_TRAILER_BYTES);
+    nx_fs_read_raw(file, trailer, sizeof(trailer), NULL);
+
+    for (i=0; i<sizeof(trailer); i++) {
+      file->length |= (U32)trailer[i] << (8 * i);
+    }
+  }
+
+  nx_fs_codec_rewind(file);
+  return FS_ERR_NO_ERROR;
+}
+
+/* Give back the codec of an opened file, if it has one. */
+static void nx_fs_codec_release(fs_file_t *file) {
+  if (file->codec != FS_CODEC_NONE) {
+    fs_codecs[file->codec].used = FALSE;
+    file->codec = FS_CODEC_NONE;
+  }
+}
+
+/* Give back the codec of an opened file, if it has one. If the file
+ * was being written, its stream is completed first.
+ */
+static fs_err_t nx_fs_codec_close(fs_file_t *file) {
+  U8 trailer[FS_COMPRESSED_TRAILER_BYTES];
+  fs_codec_t *codec;
+  U32 i;
+
+  if (file->codec == FS_CODEC_NONE) {
+    return FS_ERR_NO_ERROR;
+  }
+
+  codec = &(fs_codecs[file->codec]);
+  nx_fs_codec_release(file);
+
+  if (!codec->encoding) {
+    return FS_ERR_NO_ERROR;
+  }
+
+  if (!nx_lz_encode_finish(&(codec->lz.encoder))) {
+    return codec->err;
+  }
+
+  for (i=0; i<sizeof(trailer); i++) {
+    trailer[i] = file->length >> (8 * i);
+  }
+
+  return nx_fs_write_raw(file, trailer, sizeof(trailer));
+}
+
+static fs_err_t nx_fs_codec_write(fs_file_t *file, const U8 *data,
+                                  size_t len) {
+  fs_codec_t *codec;
+
+  if (file->codec == FS_CODEC_NONE || !fs_codecs[file->codec].encoding) {
+    return FS_ERR_UNSUPPORTED_MODE;
+  }
+
+  codec = &(fs_codecs[file->codec]);
+
+  if (!nx_lz_encode(&(codec->lz.encoder), data, len)) {
+    return codec->err;
+  }
+
+  file->length += len;
+  return FS_ERR_NO_ERROR;
+}
+
+static fs_err_t nx_fs_codec_read(fs_file_t *file, U8 *data, size_t len,
+                                 size_t *read) {
+  fs_codec_t *codec;
+  U32 done;
+
+  if (file->codec == FS_CODEC_NONE || fs_codecs[file->codec].encoding) {
+    return FS_ERR_UNSUPPORTED_MODE;
+  }
+
+  codec = &(fs_codecs[file->codec]);
+
+  if (codec->lz.decoder.pos >= file->length) {
+    return len ? FS_ERR_END_OF_FILE : FS_ERR_NO_ERROR;
+  }
+
+  len = MIN(len, file->length - codec->lz.decoder.pos);
+  if (!nx_lz_decode(&(codec->lz.decoder), data, len, &done)) {
+    return FS_ERR_CORRUPTED_FILE;
+  } else if (codec->err != FS_ERR_NO_ERROR) {
+    return codec->err;
+  } else if (done < len) {
+    /* The stream ended before the recorded size. */
+    return FS_ERR_CORRUPTED_FILE;
+  }
+
+  if (read) {
+    *read = done;
+  }
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Move the read position of a compressed file to @a position. */
+static fs_err_t nx_fs_codec_seek(fs_file_t *file, size_t position) {
+  fs_codec_t *codec;
+  U8 skipped[32];
+  fs_err_t err;
+
+  if (file->codec == FS_CODEC_NONE || fs_codecs[file->codec].encoding) {
+    return FS_ERR_UNSUPPORTED_MODE;
+  }
+
+  codec = &(fs_codecs[file->codec]);
+
+  if (position > file->length) {
+    return FS_ERR_INCORRECT_SEEK;
+  }
+
+  if (position < codec->lz.decoder.pos) {
+    nx_fs_codec_rewind(file);
+  }
+
+  while (codec->lz.decoder.pos < position) {
+    err = nx_fs_codec_read(file, skipped,
+                           MIN(sizeof(skipped),
+                               position - codec->lz.decoder.pos), NULL);
+    if (err != FS_ERR_NO_ERROR) {
+      return err;
+    }
+  }
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Initialize the file system by building its in-RAM index. */
+fs_err_t nx_fs_init(void) {
+  return nx_fs_index_build();
+}
+
+/* Initializes the @a fd fdset slot with the file's metadata.
+ */
+static fs_err_t nx_fs_init_fd(U32 origin, fs_fd_t fd) {
+  volatile U32 *metadata = nx_fs_get_metadata(origin);
+  union U32tochar nameconv;
+  fs_file_t *file;
+  U8 slot;
+
+  file = nx_fs_get_file(fd);
+  NX_ASSERT(file != NULL);
+
+  nx_fs_get_name_from_metadata(origin, &nameconv);
+
+  file->origin = origin;
+  memset(file->name, 0, FS_FILENAME_LENGTH);
+  memcpy(file->name, nameconv.chars, MIN(strlen(nameconv.chars), 31));
+  file->perms = nx_fs_get_file_perms_from_metadata(metadata);
+  file->ring = nx_fs_get_file_is_ring(metadata);
+  file->compressed = nx_fs_get_file_is_compressed(metadata);
+  file->shadow = nx_fs_page_get_marker(origin) == FS_FILE_SHADOW_MARKER;
+  file->codec = FS_CODEC_NONE;
+  file->length = 0;
+  file->modified = FALSE;
+  file->mapped = FALSE;
+
+  /* The file size is the sum of its extents' sizes. */
+  file->size = 0;
+  slot = nx_fs_index_get_slot(origin);
+  while (slot != FS_INDEX_NONE) {
+    file->size += fs_index.entries[slot].size;
+    slot = fs_index.entries[slot].extent;
+  }
+
+  nx_fs_buffer_locate(file, &(file->rbuf), 0);
+  nx_fs_buffer_locate(file, &(file->wbuf), 0);
+
+  if (file->ring) {
+    nx_fs_ring_locate(file);
+  }
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Open an existing file by its name. */
+static fs_err_t nx_fs_open_by_name(char *name, fs_fd_t fd) {
+  U32 origin;
+  fs_err_t err;
+
+  err = nx_fs_find_file_origin(name, &origin);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  return nx_fs_init_fd(origin, fd);
 }
 
 /* Create a new file using the given name. */
@@ -376,427 +2941,1237 @@ static fs_err_t nx_fs_create_by_name(char *name, fs_fd_t fd) {
   U32 metadata[EFC_PAGE_WORDS] = {0};
   U32 origin;
   fs_err_t err;
+  U8 slot;
+
+  /* Check that a file by that name does not already exists. */
+  err = nx_fs_find_file_origin(name, &origin);
+  if (err != FS_ERR_FILE_NOT_FOUND) {
+    return FS_ERR_FILE_ALREADY_EXISTS;
+  }
+
+  /* Find an origin page. */
+  if (nx_fs_find_last_origin(&origin) == FS_ERR_NO_ERROR) {
+    origin += nx_fs_index_get_pages(origin);
+  } else {
+    origin = FS_PAGE_START;
+  }
+
+  nx_fs_map_update_wear();
+  if (origin >= FS_PAGE_END || nx_fs_map_is_used(origin) ||
+      nx_fs_wear_is_hot(origin)) {
+    err = nx_fs_map_find_hole(1, &origin);
+    if (err != FS_ERR_NO_ERROR) {
+      return err;
+    }
+  }
+
+  /* Make sure the file can be indexed before touching the flash. */
+  if (fs_index.files == FS_MAX_FILES || fs_index.count == FS_MAX_EXTENTS) {
+    return FS_ERR_TOO_MANY_FILES;
+  }
+
+  /* Bootstrap the metadata to the flash page. */
+  nx_fs_create_metadata(FS_PERM_READWRITE, name, 0, metadata);
+  nx_fs_set_metadata_crc(metadata, 0);
+
+  /* Write metadata to flash. */
+  if (!nx_fs_write_page(metadata, origin)) {
+    return FS_ERR_FLASH_ERROR;
+  }
+
+  err = nx_fs_index_insert(nx_fs_hash_name(name), origin, 0, TRUE, &slot);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  fs_index.entries[slot].verified = TRUE;
+
+  return nx_fs_init_fd(origin, fd);
+}
+
+/* Empty the opened file @a fd, keeping the pages of its first extent
+ * reserved for the new data. A file rewritten in a worn region moves
+ * away from it instead.
+ */
+static fs_err_t nx_fs_truncate(fs_fd_t fd) {
+  U32 data[EFC_PAGE_WORDS];
+  fs_index_entry_t *head;
+  fs_file_t *file;
+  U32 page, end, pages;
+  U8 slot;
+
+  file = nx_fs_get_file(fd);
+  NX_ASSERT(file != NULL);
+
+  head = nx_fs_index_get(file->origin);
+
+  /* Record the empty file on the flash first. */
+  nx_fs_read_page(file->origin, data);
+  nx_fs_create_metadata(file->perms, file->name, 0, data);
+  nx_fs_set_metadata_crc(data, 0);
+  if (!nx_fs_write_page(data, file->origin)) {
+    return FS_ERR_FLASH_ERROR;
+  }
+
+  head->verified = TRUE;
+
+  /* The old data must not look like file headers once its pages are
+   * given back. The continuation extents go entirely.
+   */
+  slot = nx_fs_index_get_slot(file->origin);
+  while (slot != FS_INDEX_NONE) {
+    fs_index_entry_t *entry = &(fs_index.entries[slot]);
+
+    nx_fs_cache_invalidate(entry->origin + 1, nx_fs_index_get_span(entry) - 1);
+    end = entry->origin + nx_fs_get_file_page_count(entry->size);
+    for (page = entry->origin + 1; page < end; page++) {
+      if (nx_fs_page_has_magic(page) && !nx_fs_erase_page(page)) {
+        return FS_ERR_FLASH_ERROR;
+      }
+    }
+
+    slot = entry->extent;
+    if (entry != head) {
+      if (!nx_fs_erase_page(entry->origin)) {
+        return FS_ERR_FLASH_ERROR;
+      }
+
+      nx_fs_index_remove(entry->origin);
+    }
+  }
+
+  pages = nx_fs_index_get_span(head);
+  head->extent = FS_INDEX_NONE;
+  nx_fs_index_set_size(head, 0);
+  file->size = 0;
+
+  nx_fs_map_update_wear();
+  if (nx_fs_wear_is_hot(file->origin)) {
+    U32 dest;
+
+    nx_fs_index_release(head);
+    if (nx_fs_map_find_hole(1, &dest) == FS_ERR_NO_ERROR &&
+        !nx_fs_wear_is_hot(dest)) {
+      return nx_fs_move_region(file->origin, dest, 1);
+    }
+  }
+
+  nx_fs_index_reserve(head, pages - nx_fs_index_get_span(head));
+  return FS_ERR_NO_ERROR;
+}
+
+/* Find an available fdset slot, and reserve it. */
+static fs_err_t nx_fs_alloc_fd(fs_fd_t *fd) {
+  fs_fd_t slot = 0;
+
+  while (slot < FS_MAX_OPENED_FILES && fdset[slot].used) {
+    slot++;
+  }
+
+  if (slot == FS_MAX_OPENED_FILES) {
+    return FS_ERR_TOO_MANY_OPENED_FILES;
+  }
+
+  /* The descriptor holds no file until it is initialized. */
+  fdset[slot].used = TRUE;
+  fdset[slot].origin = 0;
+  *fd = slot;
+  return FS_ERR_NO_ERROR;
+}
+
+/* Open or create a file by its name. The associated file descriptor
+ * is returned via the fd pointer argument.
+ */
+fs_err_t nx_fs_open(char *name, fs_file_mode_t mode, fs_fd_t *fd) {
+  fs_file_t *file;
+  fs_err_t err;
+  fs_fd_t slot;
+
+  NX_ASSERT(strlen(name) > 0);
+  NX_ASSERT(strlen(name) < FS_FILENAME_LENGTH);
+
+  err = nx_fs_index_check();
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  /* First, make sure we have an avaliable slot for this file. */
+  err = nx_fs_alloc_fd(&slot);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  file = &(fdset[slot]);
+
+  switch (mode) {
+    case FS_FILE_MODE_CREATE:
+      err = nx_fs_create_by_name(name, slot);
+      break;
+    case FS_FILE_MODE_OPEN:
+      err = nx_fs_open_by_name(name, slot);
+      if (err == FS_ERR_NO_ERROR) {
+        err = nx_fs_verify(file->origin);
+      }
+
+      if (err == FS_ERR_NO_ERROR && file->compressed) {
+        err = nx_fs_codec_open(file, FALSE);
+      }
+      break;
+    case FS_FILE_MODE_TRUNCATE:
+      err = nx_fs_open_by_name(name, slot);
+      if (err == FS_ERR_FILE_NOT_FOUND) {
+        err = nx_fs_create_by_name(name, slot);
+      } else if (err == FS_ERR_NO_ERROR && file->ring) {
+        err = FS_ERR_UNSUPPORTED_MODE;
+      } else if (err == FS_ERR_NO_ERROR) {
+        /* A compressed file stays so, if a codec is available. */
+        if (file->compressed) {
+          err = nx_fs_codec_open(file, TRUE);
+        }
+
+        if (err == FS_ERR_NO_ERROR) {
+          err = nx_fs_truncate(slot);
+        }
+      }
+
+      if (err != FS_ERR_NO_ERROR) {
+        break;
+      }
+
+      nx_fs_buffer_locate(file, &(file->wbuf), 0);
+      file->rbuf = file->wbuf;
+      break;
+    case FS_FILE_MODE_APPEND:
+      err = nx_fs_open_by_name(name, slot);
+      if (err == FS_ERR_NO_ERROR) {
+        err = file->ring || file->compressed ?
+          FS_ERR_UNSUPPORTED_MODE : nx_fs_verify(file->origin);
+      }
+
+      if (err != FS_ERR_NO_ERROR) {
+        break;
+      }
+
+      /* Put writing position at the end of the file. */
+      nx_fs_buffer_locate(file, &(file->wbuf), file->size);
+
+      break;
+    default:
+      err = FS_ERR_UNSUPPORTED_MODE;
+      break;
+  }
+
+  if (err == FS_ERR_NO_ERROR) {
+    *fd = slot;
+  } else {
+    /* Otherwise release the slot that was reserved. */
+    nx_fs_codec_release(file);
+    file->used = FALSE;
+  }
+
+  return err;
+}
+
+/* Get the file size, in bytes. */
+size_t nx_fs_get_filesize(fs_fd_t fd) {
+  fs_file_t *file;
+
+  file = nx_fs_get_file(fd);
+  if (!file) {
+    return -1;
+  }
+
+  return file->compressed ? file->length : file->size;
+}
+
+/* Read up to len bytes from the given file. */
+fs_err_t nx_fs_read_buf(fs_fd_t fd, U8 *data, size_t len, size_t *read) {
+  fs_file_t *file;
+
+  if (read) {
+    *read = 0;
+  }
+
+  file = nx_fs_get_file(fd);
+  if (!file) {
+    return FS_ERR_INVALID_FD;
+  }
+
+  if (file->ring) {
+    return FS_ERR_UNSUPPORTED_MODE;
+  }
+
+  if (file->compressed) {
+    return nx_fs_codec_read(file, data, len, read);
+  }
+
+  return nx_fs_read_raw(file, data, len, read);
+}
+
+/* Map the rest of the extent under the read position of the given
+ * file, right where it lives on the flash.
+ */
+fs_err_t nx_fs_mmap(fs_fd_t fd, const U8 **data, size_t *len) {
+  fs_index_entry_t *entry;
+  fs_file_t *file;
+  size_t offset;
+
+  NX_ASSERT(data != NULL && len != NULL);
+
+  file = nx_fs_get_file(fd);
+  if (!file) {
+    return FS_ERR_INVALID_FD;
+  }
+
+  if (file->ring || file->compressed) {
+    return FS_ERR_UNSUPPORTED_MODE;
+  }
+
+  offset = nx_fs_buffer_get_offset(&(file->rbuf));
+  if (offset >= file->size) {
+    return FS_ERR_END_OF_FILE;
+  }
+
+  /* Step into the next extent if the current one was fully read. */
+  if (file->rbuf.pos == EFC_PAGE_BYTES &&
+      !nx_fs_buffer_next_page(&(file->rbuf))) {
+    return FS_ERR_CORRUPTED_FILE;
+  }
+
+  /* The file is pinned until the descriptor is closed. A background
+   * move of one of its extents starts over, and leaves it alone.
+   */
+  if (!file->mapped) {
+    file->mapped = TRUE;
+    nx_fs_index_get(file->origin)->mapped++;
+    fs_index.generation++;
+  }
+
+  /* The flash must hold the latest data. */
+  entry = nx_fs_buffer_get_extent(&(file->rbuf));
+  nx_fs_cache_write_back_range(entry->origin, nx_fs_index_get_span(entry));
+
+  *data = (const U8 *)nx_fs_get_metadata(entry->origin)
+    + FS_FILE_METADATA_BYTES + offset - file->rbuf.base;
+  *len = file->rbuf.base + entry->size - offset;
+
+  /* Move the read position past the mapped bytes. */
+  nx_fs_buffer_locate(file, &(file->rbuf), offset + *len);
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Read one byte from the given file. */
+fs_err_t nx_fs_read(fs_fd_t fd, U8 *byte) {
+  return nx_fs_read_buf(fd, byte, 1, NULL);
+}
+
+/* Write len bytes to the given file. */
+fs_err_t nx_fs_write_buf(fs_fd_t fd, const U8 *data, size_t len) {
+  fs_file_t *file;
+
+  file = nx_fs_get_file(fd);
+  if (!file) {
+    return FS_ERR_INVALID_FD;
+  }
+
+  if (file->ring) {
+    return FS_ERR_UNSUPPORTED_MODE;
+  }
+
+  if (file->compressed) {
+    return nx_fs_codec_write(file, data, len);
+  }
+
+  return nx_fs_write_raw(file, data, len);
+}
+
+/* Write one byte to the given file. */
+fs_err_t nx_fs_write(fs_fd_t fd, U8 byte) {
+  return nx_fs_write_buf(fd, &byte, 1);
+}
+
+/* Flush the cached pages of the given file. */
+fs_err_t nx_fs_flush(fs_fd_t fd) {
+  fs_index_entry_t *entry;
+  fs_file_t *file;
+
+  file = nx_fs_get_file(fd);
+  if (!file) {
+    return FS_ERR_INVALID_FD;
+  }
+
+  /* Write back the file's cached pages, and make sure they and all
+   * the pages queued before them made it to the flash.
+   */
+  entry = nx_fs_index_get(file->origin);
+  while (entry != NULL) {
+    nx_fs_cache_write_back_range(entry->origin, nx_fs_index_get_span(entry));
+    entry = entry->extent == FS_INDEX_NONE ?
+      NULL : &(fs_index.entries[entry->extent]);
+  }
+
+  if (!nx__efc_sync()) {
+    return FS_ERR_FLASH_ERROR;
+  }
+
+  return FS_ERR_NO_ERROR;
+}
+
+fs_err_t nx_fs_sync(void) {
+  nx_fs_cache_write_back_range(FS_PAGE_START, FS_PAGES);
+
+  if (fs_wear.pending > 0) {
+    nx_fs_wear_save();
+  }
+
+  if (!nx__efc_sync()) {
+    return FS_ERR_FLASH_ERROR;
+  }
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Close a file. */
+fs_err_t nx_fs_close(fs_fd_t fd) {
+  U32 data[EFC_PAGE_WORDS];
+  volatile U32 *metadata;
+  fs_index_entry_t *entry;
+  bool has_crc = TRUE, growing = FALSE;
+  fs_file_t *file;
+  fs_err_t err;
+  U32 seq = 1, crc = 0, i;
 
-  /* Check that a file by that name does not already exists. */
-  err = nx_fs_find_file_origin(name, &origin);
-  if (err != FS_ERR_FILE_NOT_FOUND) {
-    return FS_ERR_FILE_ALREADY_EXISTS;
+  file = nx_fs_get_file(fd);
+  if (!file) {
+    return FS_ERR_INVALID_FD;
+  }
+
+  /* The end of a compressed stream is only written now. If that fails,
+   * the stream is broken for good: the file is dropped, which leaves
+   * the old version of a file being replaced, and so is its
+   * descriptor.
+   */
+  err = nx_fs_codec_close(file);
+  if (err != FS_ERR_NO_ERROR) {
+    nx_fs_wipe_file(file->origin);
+    file->used = FALSE;
+    return err;
+  }
+
+  err = nx_fs_flush(fd);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  /* Ring logs never change size: their header stays as it is. */
+  if (file->ring) {
+    file->used = FALSE;
+    return FS_ERR_NO_ERROR;
+  }
+
+  /* Update the file's metadata. Each extent records its own size, and
+   * the first one the checksum of the whole file, computed again if
+   * the file was written to. The continuation extents whose size
+   * changed go first, growing, and have to be on the flash before the
+   * first extent header commits their new size (see
+   * nx_fs_settle_growth()). That header is only rewritten if that
+   * changes anything.
+   */
+  entry = nx_fs_index_get(file->origin);
+  while (entry->extent != FS_INDEX_NONE) {
+    entry = &(fs_index.entries[entry->extent]);
+    metadata = nx_fs_get_metadata(entry->origin);
+
+    if (nx_fs_get_file_size_from_metadata(metadata) != entry->size) {
+      nx_fs_read_page(entry->origin, data);
+      nx_fs_create_extent_metadata(file->name, seq, entry->size, data);
+      data[0] = (data[0] & ~FS_FILE_ORIGIN_MASK) |
+        (FS_FILE_GROWING_MARKER << 24);
+      data[FS_EXTENT_SEQ_OFFSET] |=
+        nx_fs_get_file_size_from_metadata(metadata) <<
+        FS_EXTENT_OLD_SIZE_SHIFT;
+      if (!nx_fs_write_page(data, entry->origin)) {
+        return FS_ERR_FLASH_ERROR;
+      }
+
+      growing = TRUE;
+    }
+
+    seq++;
+  }
+
+  if (growing && !nx__efc_sync()) {
+    return FS_ERR_FLASH_ERROR;
+  }
+
+  entry = nx_fs_index_get(file->origin);
+  nx_fs_read_page(file->origin, data);
+  if (file->modified) {
+    crc = nx_fs_get_file_crc(file->origin);
+    entry->verified = TRUE;
+  } else if (nx_fs_get_file_has_crc(data)) {
+    crc = data[FS_FILE_CRC_OFFSET];
+  } else {
+    has_crc = FALSE;
+  }
+
+  nx_fs_create_metadata(file->perms, file->name, entry->size, data);
+  if (has_crc) {
+    nx_fs_set_metadata_crc(data, crc);
+  }
+
+  if (file->compressed) {
+    data[0] |= FS_FILE_COMPRESSED_MASK;
+  }
+
+  if (file->shadow) {
+    data[0] = (data[0] & ~FS_FILE_ORIGIN_MASK) |
+      (FS_FILE_PENDING_MARKER << 24);
+  }
+
+  metadata = nx_fs_get_metadata(file->origin);
+  for (i=0; i<FS_FILE_METADATA_SIZE && metadata[i] == data[i]; i++);
+  if (i < FS_FILE_METADATA_SIZE && !nx_fs_write_page(data, file->origin)) {
+    return FS_ERR_FLASH_ERROR;
+  }
+
+  /* The new sizes are committed: the growing extents get their marker
+   * back, which only clears bits.
+   */
+  while (growing && entry->extent != FS_INDEX_NONE) {
+    entry = &(fs_index.entries[entry->extent]);
+
+    if (nx_fs_metadata_is_growing(nx_fs_get_metadata(entry->origin))) {
+      nx_fs_read_page(entry->origin, data);
+      data[0] = (data[0] & ~FS_FILE_ORIGIN_MASK) |
+        (FS_FILE_EXTENT_MARKER << 24);
+      data[FS_EXTENT_SEQ_OFFSET] &= FS_EXTENT_SEQ_MASK;
+      if (!nx_fs_program_page(data, entry->origin)) {
+        return FS_ERR_FLASH_ERROR;
+      }
+    }
+  }
+
+  /* Reserved pages are only kept while the file is open. */
+  entry = nx_fs_index_get(file->origin);
+  while (entry != NULL) {
+    nx_fs_index_release(entry);
+    entry = entry->extent == FS_INDEX_NONE ?
+      NULL : &(fs_index.entries[entry->extent]);
+  }
+
+  /* A new version of a file replaces the old one now. */
+  if (file->shadow) {
+    U8 slot = nx_fs_index_find_head(file->name);
+
+    if (slot != FS_INDEX_NONE) {
+      err = nx_fs_wipe_file(fs_index.entries[slot].origin);
+      if (err != FS_ERR_NO_ERROR) {
+        return err;
+      }
+    }
+
+    err = nx_fs_commit_shadow(file->origin);
+    if (err != FS_ERR_NO_ERROR) {
+      return err;
+    }
+  }
+
+  if (file->mapped) {
+    nx_fs_index_get(file->origin)->mapped--;
+  }
+
+  file->used = FALSE;
+  return FS_ERR_NO_ERROR;
+}
+
+fs_perm_t nx_fs_get_perms(fs_fd_t fd) {
+  fs_file_t *file;
+
+  file = nx_fs_get_file(fd);
+  if (!file) {
+    return FS_ERR_INVALID_FD;
+  }
+
+  return file->perms;
+}
+
+fs_err_t nx_fs_reserve(fs_fd_t fd, size_t bytes) {
+  fs_index_entry_t *entry;
+  fs_file_t *file;
+  U32 span, need, dest;
+  size_t base;
+  fs_err_t err;
+
+  file = nx_fs_get_file(fd);
+  if (!file) {
+    return FS_ERR_INVALID_FD;
+  }
+
+  if (file->ring) {
+    return FS_ERR_UNSUPPORTED_MODE;
+  }
+
+  if (bytes <= file->size) {
+    return FS_ERR_NO_ERROR;
+  }
+
+  /* Only the last extent of the file grows. */
+  entry = nx_fs_index_get(file->origin);
+  base = 0;
+  while (entry->extent != FS_INDEX_NONE) {
+    base += entry->size;
+    entry = &(fs_index.entries[entry->extent]);
+  }
+
+  span = nx_fs_index_get_span(entry);
+  need = nx_fs_get_file_page_count(bytes - base);
+  if (need <= span) {
+    return FS_ERR_NO_ERROR;
+  }
+
+  /* Claim the pages right after the extent if they are free. */
+  if (entry->origin + need <= FS_PAGE_END &&
+      nx_fs_map_next_used(entry->origin + span) >= entry->origin + need) {
+    nx_fs_index_reserve(entry, need - span);
+    return FS_ERR_NO_ERROR;
+  }
+
+  /* Otherwise, move the extent to a hole large enough for all of it.
+   * As for relocations, its own pages can be part of that hole.
+   */
+  nx_fs_map_mark(entry->origin, span, FALSE);
+  err = nx_fs_map_find_hole(need, &dest);
+  nx_fs_map_mark(entry->origin, span, TRUE);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  err = nx_fs_move_region(entry->origin, dest, span);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  nx_fs_index_reserve(entry, need - span);
+  return FS_ERR_NO_ERROR;
+}
+
+fs_err_t nx_fs_set_perms(fs_fd_t fd, fs_perm_t perms) {
+  fs_file_t *file;
+
+  file = nx_fs_get_file(fd);
+  if (!file) {
+    return FS_ERR_INVALID_FD;
+  }
+
+  file->perms = perms;
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Delete and close the given file. */
+fs_err_t nx_fs_unlink(fs_fd_t fd) {
+  fs_file_t *file;
+  fs_err_t err;
+
+  file = nx_fs_get_file(fd);
+  if (!file) {
+    return FS_ERR_INVALID_FD;
+  }
+
+  /* Remove each extent's marker and potential in-file marker-alike.
+   * Changes still in the cache are dropped.
+   */
+  err = nx_fs_wipe_file(file->origin);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  nx_fs_codec_release(file);
+  file->used = FALSE;
+  return FS_ERR_NO_ERROR;
+}
+
+fs_err_t nx_fs_soft_format(void) {
+  U32 i, j;
+
+  /* Wipe the headers a file system of an older layout left after
+   * FS_PAGE_END, and record the current one.
+   */
+  nx_fs_wear_check();
+  if (!fs_wear.layout) {
+    for (i=FS_PAGE_END; i<EFC_PAGES; i++) {
+      if (nx_fs_page_has_magic(i)) {
+        nx_fs_wear_count(i);
+        nx__efc_erase_page(i, EFC_ERASED_WORD);
+      }
+    }
+
+    nx_fs_wear_save();
+  }
+
+  for (i=FS_PAGE_START; i<FS_PAGE_END; i++) {
+    if (nx_fs_page_has_magic(i)) {
+      volatile U32 *metadata = nx_fs_get_metadata(i);
+      size_t size, npages;
+
+      size = nx_fs_get_file_size_from_metadata(metadata);
+      npages = nx_fs_get_file_page_count(size);
+      nx_display_string("erasing ");
+      nx_display_uint(npages);
+      nx_display_end_line();
+
+      for (j=i; j<i+npages && j<FS_PAGE_END; j++) {
+        nx_display_string("wiping ");
+        nx_display_uint(j);
+        nx_display_end_line();
+
+        nx_fs_erase_page(j);
+      }
+
+      i += npages - 1;
+    }
+  }
+
+  nx_fs_cache_invalidate(FS_PAGE_START, FS_PAGES);
+  nx_fs_index_reset();
+  fs_index.built = TRUE;
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Seek to the given position in the file.
+ */
+fs_err_t nx_fs_seek(fs_fd_t fd, size_t position) {
+  fs_file_t *file;
+
+  file = nx_fs_get_file(fd);
+  if (!file) {
+    return FS_ERR_INVALID_FD;
+  }
+
+  if (file->ring) {
+    return FS_ERR_UNSUPPORTED_MODE;
+  }
+
+  if (file->compressed) {
+    return nx_fs_codec_seek(file, position);
+  }
+
+  if (position > file->size) {
+    return FS_ERR_INCORRECT_SEEK;
   }
 
-  /* Find an origin page. */
-  if (nx_fs_find_last_origin(&origin) == FS_ERR_NO_ERROR) {
-    origin += nx_fs_get_file_page_count(
-        nx_fs_get_file_size_from_metadata(
-          &(FLASH_BASE_PTR[origin*EFC_PAGE_WORDS])));
-  } else {
-    origin = FS_PAGE_START;
+  nx_fs_buffer_locate(file, &(file->rbuf), position);
+
+  /* Same for wbuf ? */
+  return FS_ERR_NO_ERROR;
+}
+
+fs_err_t nx_fs_compress(fs_fd_t fd) {
+  fs_file_t *file;
+  fs_err_t err;
+
+  file = nx_fs_get_file(fd);
+  if (!file) {
+    return FS_ERR_INVALID_FD;
   }
 
-  if (origin >= EFC_PAGES) {
-    /* TODO: search for an available page on the flash. */
-
-    return FS_ERR_NO_SPACE_LEFT_ON_DEVICE;
+  /* A compressed file opened with FS_FILE_MODE_TRUNCATE is already
+   * being compressed.
+   */
+  if (file->compressed && file->codec != FS_CODEC_NONE &&
+      fs_codecs[file->codec].encoding && file->length == 0) {
+    return FS_ERR_NO_ERROR;
   }
 
-  /* Bootstrap the metadata to the flash page. */
-  nx_fs_create_metadata(FS_PERM_READWRITE, name, 0, metadata);
+  if (file->ring || file->compressed || file->size > 0) {
+    return FS_ERR_UNSUPPORTED_MODE;
+  }
 
-  /* Write metadata to flash. */
-  if (!nx__efc_write_page(metadata, origin)) {
-    return FS_ERR_FLASH_ERROR;
+  err = nx_fs_codec_open(file, TRUE);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
   }
 
-  return nx_fs_init_fd(origin, fd);
+  file->compressed = TRUE;
+  return FS_ERR_NO_ERROR;
 }
 
-/* Open or create a file by its name. The associated file descriptor
- * is returned via the fd pointer argument.
- */
-fs_err_t nx_fs_open(char *name, fs_file_mode_t mode, fs_fd_t *fd) {
+fs_err_t nx_fs_replace(char *name, fs_fd_t *fd) {
+  U32 metadata[EFC_PAGE_WORDS] = {0};
+  fs_perm_t perms = FS_PERM_READWRITE;
+  fs_index_entry_t *entry;
+  U32 origin, pages = 1, i;
   fs_file_t *file;
   fs_err_t err;
-  U8 slot = 0;
+  fs_fd_t slot;
+  U8 index_slot;
 
   NX_ASSERT(strlen(name) > 0);
   NX_ASSERT(strlen(name) < FS_FILENAME_LENGTH);
 
-  /* First, make sure we have an avaliable slot for this file. */
-  while (slot < FS_MAX_OPENED_FILES && fdset[slot].used) {
-    slot++;
+  err = nx_fs_index_check();
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
   }
 
-  if (slot == FS_MAX_OPENED_FILES) {
-    return FS_ERR_TOO_MANY_OPENED_FILES;
+  /* One new version of a file at a time. */
+  for (i=0; i<FS_MAX_OPENED_FILES; i++) {
+    if (fdset[i].used && fdset[i].shadow &&
+        streqn(fdset[i].name, name, FS_FILENAME_LENGTH)) {
+      return FS_ERR_FILE_ALREADY_EXISTS;
+    }
   }
 
-  /* Reserve it. */
-  file = &(fdset[slot]);
-  file->used = TRUE;
-
-  switch (mode) {
-    case FS_FILE_MODE_CREATE:
-      err = nx_fs_create_by_name(name, slot);
-      if (err != FS_ERR_NO_ERROR) {
-        break;
-      }
-
-      nx__efc_read_page(file->origin, file->wbuf.data.raw);
-      file->wbuf.pos = FS_FILE_METADATA_BYTES;
-      file->wbuf.page = file->origin;
-
-      file->rbuf = file->wbuf;
-      break;
-    case FS_FILE_MODE_OPEN:
-      err = nx_fs_open_by_name(name, slot);
-      if (err != FS_ERR_NO_ERROR) {
-        break;
-      }
-
-      nx__efc_read_page(file->origin, file->wbuf.data.raw);
-      file->wbuf.pos = FS_FILE_METADATA_BYTES;
-      file->wbuf.page = file->origin;
+  /* Give the new version room for as much data as the old one holds,
+   * so that a rewrite of the same size is not moved while written.
+   */
+  err = nx_fs_index_lookup(name, &index_slot);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
 
-      file->rbuf = file->wbuf;
-      break;
-    case FS_FILE_MODE_APPEND:
-      err = nx_fs_open_by_name(name, slot);
-      if (err != FS_ERR_NO_ERROR) {
-        break;
-      }
+  if (index_slot != FS_INDEX_NONE) {
+    size_t size = 0;
 
-      /* Put writing position at the end of the file. */
-      file->wbuf.page = file->origin
-        + nx_fs_get_file_page_count(file->size) - 1;
-      nx__efc_read_page(file->wbuf.page, file->wbuf.data.raw);
-      file->wbuf.pos = (FS_FILE_METADATA_BYTES + file->size) % EFC_PAGE_BYTES;
+    origin = fs_index.entries[index_slot].origin;
+    if (nx_fs_get_file_is_ring(nx_fs_get_metadata(origin))) {
+      return FS_ERR_UNSUPPORTED_MODE;
+    }
 
-      file->rbuf.page = file->origin;
-      nx__efc_read_page(file->rbuf.page, file->rbuf.data.raw);
-      file->rbuf.pos = FS_FILE_METADATA_BYTES;
+    perms = nx_fs_get_file_perms_from_metadata(nx_fs_get_metadata(origin));
+    for (; index_slot != FS_INDEX_NONE;
+         index_slot = fs_index.entries[index_slot].extent) {
+      size += fs_index.entries[index_slot].size;
+    }
 
-      break;
-    default:
-      err = FS_ERR_UNSUPPORTED_MODE;
-      break;
+    pages = nx_fs_get_file_page_count(size);
+  } else if (fs_index.files == FS_MAX_FILES) {
+    return FS_ERR_TOO_MANY_FILES;
   }
 
-  if (err == FS_ERR_NO_ERROR) {
-    *fd = slot;
-  } else {
-    /* Otherwise release the slot that was reserved. */
-    file->used = FALSE;
+  if (fs_index.count == FS_MAX_EXTENTS) {
+    return FS_ERR_TOO_MANY_FILES;
   }
 
-  return err;
-}
-
-/* Get the file size, in bytes. */
-size_t nx_fs_get_filesize(fs_fd_t fd) {
-  fs_file_t *file;
-
-  file = nx_fs_get_file(fd);
-  if (!file) {
-    return -1;
+  if (nx_fs_map_find_hole(pages, &origin) != FS_ERR_NO_ERROR) {
+    pages = 1;
+    err = nx_fs_map_find_hole(pages, &origin);
+    if (err != FS_ERR_NO_ERROR) {
+      return err;
+    }
   }
 
-  return file->size;
-}
+  err = nx_fs_alloc_fd(&slot);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
 
-/* Read one byte from the given file. */
-fs_err_t nx_fs_read(fs_fd_t fd, U8 *byte) {
-  fs_file_t *file;
+  nx_fs_create_metadata(perms, name, 0, metadata);
+  nx_fs_set_metadata_crc(metadata, 0);
+  metadata[0] = (metadata[0] & ~FS_FILE_ORIGIN_MASK) |
+    (FS_FILE_SHADOW_MARKER << 24);
 
-  file = nx_fs_get_file(fd);
-  if (!file) {
-    return FS_ERR_INVALID_FD;
+  if (!nx_fs_write_page(metadata, origin)) {
+    fdset[slot].used = FALSE;
+    return FS_ERR_FLASH_ERROR;
   }
 
-  /* Detect end of file. */
-  if ((file->rbuf.page - file->origin) * EFC_PAGE_BYTES
-      + file->rbuf.pos > FS_FILE_METADATA_BYTES + file->size) {
-    return FS_ERR_END_OF_FILE;
+  err = nx_fs_index_insert(nx_fs_hash_name(name), origin, 0, FALSE,
+                           &index_slot);
+  if (err != FS_ERR_NO_ERROR) {
+    fdset[slot].used = FALSE;
+    return err;
   }
 
-  /* If needed, update buffer. */
-  if (file->rbuf.pos == EFC_PAGE_BYTES) {
-    file->rbuf.page++;
-    file->rbuf.pos = 0;
-    memset(file->rbuf.data.bytes, 0, EFC_PAGE_BYTES);
+  entry = &(fs_index.entries[index_slot]);
+  entry->shadow = TRUE;
+  entry->verified = TRUE;
+  nx_fs_index_reserve(entry, pages - 1);
 
-    nx__efc_read_page(file->rbuf.page, file->rbuf.data.raw);
-  }
+  nx_fs_init_fd(origin, slot);
+  file = &(fdset[slot]);
+  file->modified = TRUE;
 
-  *byte = file->rbuf.data.bytes[file->rbuf.pos++];
+  *fd = slot;
   return FS_ERR_NO_ERROR;
 }
 
-/* Write one byte to the given file. */
-fs_err_t nx_fs_write(fs_fd_t fd, U8 byte) {
-  fs_file_t *file;
+fs_err_t nx_fs_ring_create(char *name, U32 pages, fs_fd_t *fd) {
+  U32 metadata[EFC_PAGE_WORDS] = {0};
+  U32 origin, page;
   fs_err_t err;
-  U32 pages;
+  fs_fd_t slot;
+  size_t size;
 
-  file = nx_fs_get_file(fd);
-  if (!file) {
-    return FS_ERR_INVALID_FD;
+  NX_ASSERT(strlen(name) > 0);
+  NX_ASSERT(strlen(name) < FS_FILENAME_LENGTH);
+  NX_ASSERT(pages >= 2);
+
+  err = nx_fs_index_check();
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  if (nx_fs_find_file_origin(name, &origin) != FS_ERR_FILE_NOT_FOUND) {
+    return FS_ERR_FILE_ALREADY_EXISTS;
   }
 
-  pages = nx_fs_get_file_page_count(file->size) - 1;
+  if (fs_index.files == FS_MAX_FILES || fs_index.count == FS_MAX_EXTENTS) {
+    return FS_ERR_TOO_MANY_FILES;
+  }
 
-  /* Check that the page we will be writing to is available,
-   * aka its either "inside" the file itself, either after but
-   * free.
-   */
-  if (file->wbuf.pos == 0 &&
-      file->wbuf.page > file->origin + pages &&
-      nx_fs_page_has_magic(file->wbuf.page)) {
-    /* If the page we want to use is not available relocate the file. */
-    err = nx_fs_relocate(file);
-    if (err != FS_ERR_NO_ERROR) {
-      return err;
+  /* The whole ring is claimed at once, in a single extent. */
+  err = nx_fs_map_find_hole(pages + 1, &origin);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  /* Pages left there by an earlier ring log must not pass for ours. */
+  for (page = origin + 1; page <= origin + pages; page++) {
+    if (nx_fs_page_get_marker(page) == FS_RING_MARKER &&
+        !nx_fs_erase_page(page)) {
+      return FS_ERR_FLASH_ERROR;
     }
   }
 
-  /* If needed, flush the write buffer to the flash and reinit it. */
-  if (file->wbuf.pos == EFC_PAGE_BYTES) {
-    err = nx_fs_flush(fd);
-    if (err != FS_ERR_NO_ERROR)
-      return err;
+  err = nx_fs_alloc_fd(&slot);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
 
-    file->wbuf.page++;
-    file->wbuf.pos = 0;
-    memset(file->wbuf.data.bytes, 0, EFC_PAGE_BYTES);
+  /* The size covers all the ring pages, so that they stay claimed. */
+  size = (pages + 1) * EFC_PAGE_BYTES - FS_FILE_METADATA_BYTES;
+  nx_fs_create_metadata(FS_PERM_READWRITE, name, size, metadata);
+  metadata[0] |= (FS_FILE_FLAG_RING << 20);
 
-    /* We now have one more page for this file (value used below). */
-    pages++;
+  if (!nx_fs_write_page(metadata, origin)) {
+    fdset[slot].used = FALSE;
+    return FS_ERR_FLASH_ERROR;
   }
 
-  file->wbuf.data.bytes[file->wbuf.pos++] = byte;
+  err = nx_fs_index_insert(nx_fs_hash_name(name), origin, size, TRUE, NULL);
+  if (err == FS_ERR_NO_ERROR) {
+    err = nx_fs_init_fd(origin, slot);
+  }
 
-  /* Increment the size of the file if necessary */
-  if (file->wbuf.page == file->origin + pages) {
-    if (file->wbuf.pos > file->size + FS_FILE_METADATA_BYTES
-        - (pages * EFC_PAGE_BYTES)) {
-      file->size++;
-    }
+  if (err != FS_ERR_NO_ERROR) {
+    fdset[slot].used = FALSE;
+    return err;
   }
 
+  *fd = slot;
   return FS_ERR_NO_ERROR;
 }
 
-/* Flush the write buffer of the given file. */
-fs_err_t nx_fs_flush(fs_fd_t fd) {
+fs_err_t nx_fs_ring_append(fs_fd_t fd, const U8 *data, size_t len) {
+  fs_cache_entry_t *page;
   fs_file_t *file;
+  U32 fill;
+
+  NX_ASSERT(len > 0 && len <= FS_RING_RECORD_MAX);
 
   file = nx_fs_get_file(fd);
   if (!file) {
     return FS_ERR_INVALID_FD;
   }
 
-  /* Write the page. */
-  if (!nx__efc_write_page(file->wbuf.data.raw, file->wbuf.page)) {
-    return FS_ERR_FLASH_ERROR;
+  if (!file->ring) {
+    return FS_ERR_UNSUPPORTED_MODE;
   }
 
-  if (file->wbuf.pos == 0) {
-    return FS_ERR_NO_ERROR;
+  fs_index.generation++;
+  nx_fs_ring_update(file);
+
+  page = nx_fs_cache_get(nx_fs_ring_get_page(file, file->ring_seq), TRUE);
+  fill = nx_fs_ring_get_fill(page->data.raw, file->ring_seq);
+
+  /* Records do not span pages. A full page goes to the flash, and the
+   * next one, the oldest of the ring, starts over.
+   */
+  if (fill + 1 + len > EFC_PAGE_BYTES) {
+    nx_fs_cache_write_back(page);
+
+    file->ring_seq++;
+    page = nx_fs_cache_get(nx_fs_ring_get_page(file, file->ring_seq), FALSE);
+    fill = 0;
+  }
+
+  if (fill == 0) {
+    memset(page->data.bytes, 0, EFC_PAGE_BYTES);
+    page->data.raw[FS_RING_SEQ_OFFSET] = file->ring_seq;
+    fill = FS_RING_HEADER_BYTES;
   }
 
-  /* Write page data. */
+  page->data.bytes[fill] = len;
+  memcpy(page->data.bytes + fill + 1, data, len);
+  fill += 1 + len;
+
+  page->data.raw[0] = (FS_RING_MARKER << 24) + fill;
+  page->dirty = TRUE;
 
   return FS_ERR_NO_ERROR;
 }
 
-/* Close a file. */
-fs_err_t nx_fs_close(fs_fd_t fd) {
-  U32 firstpage[EFC_PAGE_WORDS];
+fs_err_t nx_fs_ring_rewind(fs_fd_t fd, fs_ring_cursor_t *cursor) {
   fs_file_t *file;
-  fs_err_t err;
+
+  NX_ASSERT(cursor != NULL);
 
   file = nx_fs_get_file(fd);
   if (!file) {
     return FS_ERR_INVALID_FD;
   }
 
-  err = nx_fs_flush(fd);
-  if (err != FS_ERR_NO_ERROR) {
-    return err;
+  if (!file->ring) {
+    return FS_ERR_UNSUPPORTED_MODE;
   }
 
-  /* Update the file's metadata. */
-  nx__efc_read_page(file->origin, firstpage);
-  nx_fs_create_metadata(file->perms, file->name, file->size, firstpage);
-  if (!nx__efc_write_page(firstpage, file->origin)) {
-    return FS_ERR_FLASH_ERROR;
-  }
+  nx_fs_ring_update(file);
+  cursor->seq = nx_fs_ring_get_oldest(file);
+  cursor->pos = FS_RING_HEADER_BYTES;
 
-  file->used = FALSE;
   return FS_ERR_NO_ERROR;
 }
 
-fs_perm_t nx_fs_get_perms(fs_fd_t fd) {
+fs_err_t nx_fs_ring_read(fs_fd_t fd, fs_ring_cursor_t *cursor,
+                         U8 *data, size_t len, size_t *read) {
+  fs_cache_entry_t *page;
   fs_file_t *file;
+  U32 fill, record;
+
+  NX_ASSERT(cursor != NULL);
+
+  if (read) {
+    *read = 0;
+  }
 
   file = nx_fs_get_file(fd);
   if (!file) {
     return FS_ERR_INVALID_FD;
   }
 
-  return file->perms;
-}
+  if (!file->ring) {
+    return FS_ERR_UNSUPPORTED_MODE;
+  }
 
-fs_err_t nx_fs_set_perms(fs_fd_t fd, fs_perm_t perms) {
-  fs_file_t *file;
+  nx_fs_ring_update(file);
 
-  file = nx_fs_get_file(fd);
-  if (!file) {
-    return FS_ERR_INVALID_FD;
+  for (;;) {
+    /* Skip the pages overwritten since the cursor was last used. */
+    if ((S32)(cursor->seq - nx_fs_ring_get_oldest(file)) < 0) {
+      cursor->seq = nx_fs_ring_get_oldest(file);
+      cursor->pos = FS_RING_HEADER_BYTES;
+    }
+
+    page = nx_fs_cache_get(nx_fs_ring_get_page(file, cursor->seq), TRUE);
+    fill = nx_fs_ring_get_fill(page->data.raw, cursor->seq);
+    if (cursor->pos < fill) {
+      break;
+    }
+
+    if (cursor->seq == file->ring_seq) {
+      return FS_ERR_END_OF_FILE;
+    }
+
+    cursor->seq++;
+    cursor->pos = FS_RING_HEADER_BYTES;
   }
 
-  file->perms = perms;
+  record = page->data.bytes[cursor->pos];
+  if (record == 0 || cursor->pos + 1 + record > fill) {
+    return FS_ERR_CORRUPTED_FILE;
+  }
+
+  len = MIN(len, record);
+  memcpy(data, page->data.bytes + cursor->pos + 1, len);
+  cursor->pos += 1 + record;
+
+  if (read) {
+    *read = len;
+  }
 
   return FS_ERR_NO_ERROR;
 }
 
-/* Delete and close the given file. */
-fs_err_t nx_fs_unlink(fs_fd_t fd) {
-  fs_file_t *file;
-  U32 page, end;
+void nx_fs_get_occupation(U32 *files, U32 *used, U32 *free_pages,
+    U32 *wasted) {
+  U32 _files = 0, _used = 0, _free_pages, _wasted = 0, i;
 
-  file = nx_fs_get_file(fd);
-  if (!file) {
-    return FS_ERR_INVALID_FD;
+  nx_fs_index_check();
+
+  for (i=0; i<fs_index.count; i++) {
+    size_t size = fs_index.entries[fs_index.order[i]].size;
+    U32 pages = nx_fs_get_file_page_count(size);
+
+    _used += size;
+    _wasted += pages * EFC_PAGE_BYTES - size - FS_FILE_METADATA_BYTES;
   }
 
-  /* Remove file marker and potential in-file marker-alike. */
-  end = file->origin + nx_fs_get_file_page_count(file->size);
-  for (page = file->origin; page < end; page++) {
-    if (nx_fs_page_has_magic(page)) {
-      if (!nx__efc_erase_page(page, 0)) {
-        return FS_ERR_FLASH_ERROR;
-      }
+  _files = fs_index.files;
+
+  for (i = nx_fs_spill_next(FS_PAGE_START); i < FS_PAGE_END;
+       i = nx_fs_spill_next(i + 1)) {
+    size_t size = nx_fs_get_file_size_from_metadata(nx_fs_get_metadata(i));
+    U32 pages = nx_fs_get_file_page_count(size);
+
+    _used += size;
+    _wasted += pages * EFC_PAGE_BYTES - size - FS_FILE_METADATA_BYTES;
+    if (nx_fs_marker_get_base(nx_fs_page_get_marker(i)) ==
+        FS_FILE_ORIGIN_MARKER) {
+      _files++;
     }
   }
+  _free_pages = nx_fs_map_count_free();
 
-  file->used = FALSE;
-  return FS_ERR_NO_ERROR;
+  if (files) {
+    *files = _files;
+  }
+
+  if (used) {
+    *used = _used;
+  }
+
+  if (free_pages) {
+    *free_pages = _free_pages;
+  }
+
+  if (wasted) {
+    *wasted = _wasted;
+  }
 }
 
-fs_err_t nx_fs_soft_format(void) {
-  U32 nulldata[EFC_PAGE_WORDS] = {0};
-  U32 i, j;
+fs_err_t nx_fs_get_file_info(U32 n, char *name, size_t *size,
+                             fs_perm_t *perms, U32 *extents) {
+  union U32tochar nameconv;
+  fs_index_entry_t *entry = NULL;
+  size_t _size = 0;
+  U32 _extents = 0, origin, i;
+  fs_err_t err;
+  U8 slot;
 
-  for (i=FS_PAGE_START; i<FS_PAGE_END; i++) {
-    if (nx_fs_page_has_magic(i)) {
-      volatile U32 *metadata = &(FLASH_BASE_PTR[i*EFC_PAGE_WORDS]);
-      size_t size, npages;
+  err = nx_fs_index_check();
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
 
-      size = nx_fs_get_file_size_from_metadata(metadata);
-      npages = nx_fs_get_file_page_count(size);
-      nx_display_string("erasing ");
-      nx_display_uint(npages);
-      nx_display_end_line();
+  /* Files are numbered by the position of their first extent. */
+  for (i=0; i<fs_index.count; i++) {
+    entry = &(fs_index.entries[fs_index.order[i]]);
+    if (entry->head && n-- == 0) {
+      break;
+    }
+  }
 
-      for (j=i; j<i+npages && j<FS_PAGE_END; j++) {
-        nx_display_string("wiping ");
-        nx_display_uint(j);
-        nx_display_end_line();
+  if (i < fs_index.count) {
+    origin = entry->origin;
+    nx_fs_get_name_from_metadata(origin, &nameconv);
 
-        nx__efc_write_page(nulldata, j);
+    for (slot = entry - fs_index.entries; slot != FS_INDEX_NONE;
+         slot = fs_index.entries[slot].extent) {
+      _size += fs_index.entries[slot].size;
+      _extents++;
+    }
+  } else {
+    /* The files left out of the index come last. */
+    for (origin = nx_fs_spill_next(FS_PAGE_START); origin < FS_PAGE_END;
+         origin = nx_fs_spill_next(origin + 1)) {
+      if (nx_fs_marker_get_base(nx_fs_page_get_marker(origin)) ==
+          FS_FILE_ORIGIN_MARKER && n-- == 0) {
+        break;
       }
+    }
+
+    if (origin == FS_PAGE_END) {
+      return FS_ERR_FILE_NOT_FOUND;
+    }
+
+    nx_fs_get_name_from_metadata(origin, &nameconv);
+    for (i = origin; i < FS_PAGE_END;
+         i = nx_fs_spill_find(i + 1, nameconv.chars, FALSE)) {
+      _size += nx_fs_get_file_size_from_metadata(nx_fs_get_metadata(i));
+      _extents++;
+    }
+  }
+
+  if (name) {
+    memcpy(name, nameconv.chars, FS_FILENAME_LENGTH);
+  }
+
+  if (size) {
+    *size = _size;
+  }
+
+  if (perms) {
+    *perms = nx_fs_get_file_perms_from_metadata(nx_fs_get_metadata(origin));
+  }
 
-      i += npages - 1;
-    }
+  if (extents) {
+    *extents = _extents;
   }
 
   return FS_ERR_NO_ERROR;
 }
 
-/* Seek to the given position in the file.
- */
-fs_err_t nx_fs_seek(fs_fd_t fd, size_t position) {
-  fs_file_t *file;
-  U32 page;
-  U32 pos;
-
-  file = nx_fs_get_file(fd);
-  if (!file) {
-    return FS_ERR_INVALID_FD;
+void nx_fs_get_cache_stats(U32 *hits, U32 *misses, U32 *writebacks) {
+  if (hits) {
+    *hits = fs_cache.hits;
   }
 
-  if (position > file->size) {
-    return FS_ERR_INCORRECT_SEEK;
+  if (misses) {
+    *misses = fs_cache.misses;
   }
 
-  position += FS_FILE_METADATA_BYTES;
-
-  page = file->origin + position / EFC_PAGE_BYTES;
-  pos = position % EFC_PAGE_BYTES;
-
-  if (page != file->rbuf.page) {
-    nx__efc_read_page(page, file->rbuf.data.raw);
-    file->rbuf.page = page;
+  if (writebacks) {
+    *writebacks = fs_cache.writebacks;
   }
+}
 
-  file->rbuf.pos = pos;
+void nx_fs_get_mount_stats(U32 *headers, U32 *rejected) {
+  if (headers) {
+    *headers = fs_index.headers;
+  }
 
-  /* Same for wbuf ? */
-  return FS_ERR_NO_ERROR;
+  if (rejected) {
+    *rejected = fs_index.rejected;
+  }
 }
 
-void nx_fs_get_occupation(U32 *files, U32 *used, U32 *free_pages,
-    U32 *wasted) {
-  U32 _files = 0, _used = 0, _free_pages = 0, _wasted = 0;
-  U32 i;
-
-  for (i=FS_PAGE_START; i<FS_PAGE_END; i++) {
-    if (nx_fs_page_has_magic(i)) {
-      volatile U32 *metadata = &(FLASH_BASE_PTR[i*EFC_PAGE_WORDS]);
-      size_t size;
-      U32 pages;
+void nx_fs_get_wear_stats(U32 *counts, U32 *min, U32 *max) {
+  U32 _min = 0xFFFFFFFF, _max = 0, i;
 
-      size = nx_fs_get_file_size_from_metadata(metadata);
-      pages = nx_fs_get_file_page_count(size);
+  nx_fs_wear_check();
 
-      _files++;
-      _used += size;
-      _wasted += pages * EFC_PAGE_BYTES - size - FS_FILE_METADATA_BYTES;
+  for (i=0; i<EFC_LOCK_REGIONS; i++) {
+    bool fs_region = i >= FS_WEAR_FIRST_REGION && i <= FS_WEAR_LAST_REGION;
 
-      i += pages - 1;
-    } else {
-      _free_pages++;
+    if (counts) {
+      counts[i] = fs_region ? fs_wear.counts[i] : 0;
     }
-  }
 
-  if (files) {
-    *files = _files;
-  }
-
-  if (used) {
-    *used = _used;
+    if (fs_region) {
+      _min = MIN(_min, fs_wear.counts[i]);
+      _max = MAX(_max, fs_wear.counts[i]);
+    }
   }
 
-  if (free_pages) {
-    *free_pages = _free_pages;
+  if (min) {
+    *min = _min;
   }
 
-  if (wasted) {
-    *wasted = _wasted;
+  if (max) {
+    *max = _max;
   }
 }
 
 static fs_err_t nx_fs_find_next_hole(U32 start, U32 *origin) {
-  U32 i;
+  U32 page = nx_fs_map_next_free(start);
 
-  i = start;
-  while (i < FS_PAGE_END) {
-    if (nx_fs_page_has_magic(i)) {
-      volatile U32 *metadata = &(FLASH_BASE_PTR[i*EFC_PAGE_WORDS]);
-      i += nx_fs_get_file_page_count(nx_fs_get_file_size_from_metadata(metadata));
-    } else {
-      *origin = i;
-      return FS_ERR_NO_ERROR;
-    }
+  if (page < FS_PAGE_END) {
+    *origin = page;
+    return FS_ERR_NO_ERROR;
   }
 
   return FS_ERR_FILE_NOT_FOUND;
@@ -806,10 +4181,11 @@ void nx_fs_dump(void) {
   U32 i = FS_PAGE_START, origin = 0;
   union U32tochar nameconv;
 
+  nx_fs_index_check();
+
   while (nx_fs_find_next_origin(i, &origin) == FS_ERR_NO_ERROR) {
-    volatile U32 *metadata = &(FLASH_BASE_PTR[origin*EFC_PAGE_WORDS]);
-    size_t npages = nx_fs_get_file_page_count(
-      nx_fs_get_file_size_from_metadata(metadata));
+    volatile U32 *metadata = nx_fs_get_metadata(origin);
+    size_t npages = nx_fs_index_get_pages(origin);
 
     memcpy(nameconv.integers,
            (void *)(metadata + FS_FILENAME_OFFSET),
@@ -830,8 +4206,136 @@ void nx_fs_dump(void) {
   nx_display_string("--\n");
 }
 
+fs_err_t nx_fs_check(U32 *stale, U32 *broken) {
+  U32 _stale = 0, _broken = 0, i;
+  fs_err_t err;
+
+  /* Opened files would not survive the index being rebuilt. */
+  for (i=0; i<FS_MAX_OPENED_FILES; i++) {
+    if (fdset[i].used) {
+      return FS_ERR_TOO_MANY_OPENED_FILES;
+    }
+  }
+
+  err = nx_fs_index_build();
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  /* Headers left in free space by interrupted operations did not make
+   * it into the index. Wipe them, so that they can't come back as
+   * phantom files once the pages around them get reused.
+   */
+  for (i=FS_PAGE_START; i<FS_PAGE_END; i++) {
+    if (!nx_fs_map_is_used(i) && nx_fs_page_has_magic(i)) {
+      if (!nx_fs_erase_page(i)) {
+        return FS_ERR_FLASH_ERROR;
+      }
+
+      _stale++;
+    }
+  }
+
+  /* The continuation extents of a file are numbered from 1 up, a gap
+   * means some of its data is gone. So does a payload that no longer
+   * matches its checksum.
+   */
+  for (i=0; i<fs_index.count; i++) {
+    fs_index_entry_t *entry = &(fs_index.entries[fs_index.order[i]]);
+    U32 seq = 1;
+    U8 slot;
+
+    if (!entry->head) {
+      continue;
+    }
+
+    if (nx_fs_verify(entry->origin) != FS_ERR_NO_ERROR) {
+      _broken++;
+      continue;
+    }
+
+    for (slot = entry->extent; slot != FS_INDEX_NONE;
+         slot = fs_index.entries[slot].extent, seq++) {
+      volatile U32 *metadata =
+        nx_fs_get_metadata(fs_index.entries[slot].origin);
+
+      if (nx_fs_get_extent_seq(metadata) != seq) {
+        _broken++;
+        break;
+      }
+    }
+  }
+
+  if (stale) {
+    *stale = _stale;
+  }
+
+  if (broken) {
+    *broken = _broken;
+  }
+
+  return _broken ? FS_ERR_CORRUPTED_FILE : FS_ERR_NO_ERROR;
+}
+
 /* Defrag functions. */
 
+/* Make sure the index is built, and knows all the extents: those left
+ * out of it could be in the way of the moves. No file must be mapped.
+ */
+static fs_err_t nx_fs_defrag_check(void) {
+  fs_err_t err;
+  U32 i;
+
+  err = nx_fs_index_check();
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  if (fs_index.spilled) {
+    return FS_ERR_TOO_MANY_FILES;
+  }
+
+  /* These move every file, mapped ones included. */
+  for (i=0; i<fs_index.count; i++) {
+    if (fs_index.entries[fs_index.order[i]].mapped > 0) {
+      return FS_ERR_FILE_MAPPED;
+    }
+  }
+
+  return FS_ERR_NO_ERROR;
+}
+
+/* Determines if the extent of @a entry belongs to a mapped file, which
+ * must stay where it is.
+ */
+static bool nx_fs_index_is_pinned(fs_index_entry_t *entry) {
+  union U32tochar nameconv;
+  U8 slot;
+
+  if (entry->head || entry->shadow) {
+    return entry->mapped > 0;
+  }
+
+  nx_fs_get_name_from_metadata(entry->origin, &nameconv);
+  slot = nx_fs_index_find_head(nameconv.chars);
+  return slot != FS_INDEX_NONE && fs_index.entries[slot].mapped > 0;
+}
+
+/* Background defragmentation state. An extent is copied to its new
+ * place one page at a time, its first page last, and the index is only
+ * switched over once the copy is complete. Until then, the flash and
+ * the index both still describe the extent at its old place, so the
+ * copy can be abandoned at any time.
+ */
+static struct {
+  bool moving;    /* Is an extent being copied? */
+  U32 generation; /* Index generation the copy is valid for. */
+  U32 source;     /* Origin of the extent being copied. */
+  U32 dest;       /* Where the extent is copied to. */
+  U32 len;        /* Length of the extent, in pages. */
+  U32 copied;     /* Number of pages copied so far. */
+} fs_defrag;
+
 /* Simple defragmentation function: tries to concatenate data blocks at
  * the beginning of the flash.
  *
@@ -851,6 +4355,11 @@ fs_err_t nx_fs_defrag_simple_zone(U32 zone_start, U32 zone_end) {
   NX_ASSERT(zone_end <= FS_PAGE_END);
   NX_ASSERT(zone_start <= zone_end);
 
+  err = nx_fs_defrag_check();
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
   i = zone_start;
   nx_display_string("<<  ");
   nx_display_uint(i);
@@ -876,6 +4385,7 @@ fs_err_t nx_fs_defrag_simple_zone(U32 zone_start, U32 zone_end) {
     NX_ASSERT(hole_length > 0);
 
     /* Search for the best block to move. */
+    best_block_origin = best_block_size = 0;
     do {
       if (nx_fs_find_next_hole(next_file, &end_of_block) != FS_ERR_NO_ERROR) {
         /* No free space after */
@@ -963,6 +4473,11 @@ fs_err_t nx_fs_defrag_for_file_by_name(char *name) {
   U32 origin;
   fs_err_t err;
 
+  err = nx_fs_index_check();
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
   err = nx_fs_find_file_origin(name, &origin);
   if (err == FS_ERR_NO_ERROR) {
     return nx_fs_defrag_for_file_by_origin(origin);
@@ -994,8 +4509,8 @@ static fs_err_t nx_fs_swap_regions(U32 start1, U32 dest1, U32 len1,
 
   for (i=0, j=0; i<len1; i++, j++) {
     if (j < len2) {
-      nx__efc_read_page(start2 + j, data);
-      nx__efc_erase_page(start2 + j, 0);
+      nx_fs_read_page(start2 + j, data);
+      nx_fs_erase_page(start2 + j);
     }
 
     err = nx_fs_move_region(start1 + i, dest1 + i, 1);
@@ -1003,19 +4518,26 @@ static fs_err_t nx_fs_swap_regions(U32 start1, U32 dest1, U32 len1,
       return err;
     }
 
-    if (j < len2 && !nx__efc_write_page(data, start1 + j)) {
+    if (j < len2 && !nx_fs_write_page(data, start1 + j)) {
       return FS_ERR_FLASH_ERROR;
     }
   }
 
+  /* The second region was moved by hand, let the index follow. */
+  nx_fs_index_shift(start2, start1, len2);
+
   return FS_ERR_NO_ERROR;
 }
 
 fs_err_t nx_fs_defrag_for_file_by_origin(U32 origin) {
   U32 next_origin=0, next_hole, last_origin, last_npages, npages;
-  volatile U32 *metadata;
   fs_err_t err;
 
+  err = nx_fs_defrag_check();
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
   /* First, trivial case: the file is already at the end of the flash.
    * If it still has free space after him, job's done. Otherwise, launch
    * a defrag simple.
@@ -1025,13 +4547,8 @@ fs_err_t nx_fs_defrag_for_file_by_origin(U32 origin) {
     return err;
   }
 
-  metadata = &(FLASH_BASE_PTR[origin*EFC_PAGE_WORDS]);
-  npages = nx_fs_get_file_page_count(
-    nx_fs_get_file_size_from_metadata(metadata));
-
-  metadata = &(FLASH_BASE_PTR[last_origin*EFC_PAGE_WORDS]);
-  last_npages = nx_fs_get_file_page_count(
-    nx_fs_get_file_size_from_metadata(metadata));
+  npages = nx_fs_index_get_pages(origin);
+  last_npages = nx_fs_index_get_pages(last_origin);
 
   if (origin == last_origin) {
     nx_display_string("case1\n");
@@ -1084,32 +4601,32 @@ fs_err_t nx_fs_defrag_for_file_by_origin(U32 origin) {
 }
 
 static fs_err_t nx_fs_defrag_pull_file_to(U32 origin, U32 dest) {
-  volatile U32 *metadata;
-  size_t size;
-
-  metadata = &(FLASH_BASE_PTR[origin*EFC_PAGE_WORDS]);
-  size = nx_fs_get_file_size_from_metadata(metadata);
-
-  return nx_fs_move_region(origin, dest,
-    nx_fs_get_file_page_count(size));
+  return nx_fs_move_region(origin, dest, nx_fs_index_get_pages(origin));
 }
 
 static U32 nx_fs_defrag_get_mean_space(void) {
   U32 files, used, free_pages, wasted;
 
-  /* Get the number of files and freepages. */
+  /* Get the number of freepages. The space is shared between extents
+   * rather than files, since each extent gets moved on its own.
+   */
   nx_fs_get_occupation(&files, &used, &free_pages, &wasted);
-  if (!files) {
+  if (!fs_index.count) {
     return 0;
   }
 
-  return free_pages / files;
+  return free_pages / fs_index.count;
 }
 
 fs_err_t nx_fs_defrag_best_overall(void) {
   U32 next_origin = 0, mean_space_per_file = 0, i;
   fs_err_t err;
 
+  err = nx_fs_defrag_check();
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
   mean_space_per_file = nx_fs_defrag_get_mean_space();
 
   /* Nothing to do here, move on */
@@ -1135,13 +4652,10 @@ fs_err_t nx_fs_defrag_best_overall(void) {
 
   /* Then, iterate on all files to set a proper space after them. */
   while (i < FS_PAGE_END) {
-    if (nx_fs_page_has_magic(i)) {
-      volatile U32 *metadata;
-      size_t size, npages, hole_size;
+    if (nx_fs_index_get(i) != NULL) {
+      size_t npages, hole_size;
 
-      metadata = &(FLASH_BASE_PTR[i*EFC_PAGE_WORDS]);
-      size = nx_fs_get_file_size_from_metadata(metadata);
-      npages = nx_fs_get_file_page_count(size);
+      npages = nx_fs_index_get_pages(i);
 
       /* No file left after this one, job's done. */
       if (nx_fs_find_next_origin(i + npages, &next_origin) != FS_ERR_NO_ERROR) {
@@ -1297,3 +4811,252 @@ fs_err_t nx_fs_defrag_best_overall(void) {
   return FS_ERR_NO_ERROR;
 }
 
+
+/* Start copying the extent at @a source to @a dest in the background. */
+static void nx_fs_defrag_begin(U32 source, U32 dest) {
+  fs_defrag.moving = TRUE;
+  fs_defrag.generation = fs_index.generation;
+  fs_defrag.source = source;
+  fs_defrag.dest = dest;
+  fs_defrag.len = nx_fs_index_get_pages(source);
+  fs_defrag.copied = 0;
+
+  /* Copies are made from the flash, and checked against it when
+   * switching over.
+   */
+  nx_fs_cache_write_back_range(source, fs_defrag.len);
+}
+
+/* Pick the next extent to move in the background. The lowest hole of
+ * the flash is filled with the last extent that fits in it. If none
+ * does, the extent right after the hole is moved out of the way, which
+ * makes the hole larger. The extents of mapped files are never moved:
+ * a hole they close that no extent fits in is left for the next one.
+ *
+ * If no hole at all can take that extent, it is slid over the hole in
+ * one go instead, as its old and new places overlap. The number of
+ * pages moved that way is returned through @a moved.
+ */
+static fs_err_t nx_fs_defrag_plan(U32 *moved) {
+  U32 hole, next, pages, dest, i;
+  fs_err_t err;
+
+  /* Extents left out of the index are not moved. */
+  if (fs_index.spilled) {
+    return FS_ERR_NO_ERROR;
+  }
+
+  for (hole = nx_fs_map_next_free(FS_PAGE_START); ;
+       hole = nx_fs_map_next_free(next + pages)) {
+    next = nx_fs_map_next_used(hole);
+    if (next >= FS_PAGE_END) {
+      /* The flash is compact. */
+      return FS_ERR_NO_ERROR;
+    }
+
+    for (i=fs_index.count; i>0; i--) {
+      fs_index_entry_t *entry = &(fs_index.entries[fs_index.order[i-1]]);
+
+      if (entry->origin < next) {
+        break;
+      }
+
+      if (nx_fs_index_get_span(entry) <= next - hole &&
+          !nx_fs_index_is_pinned(entry)) {
+        nx_fs_defrag_begin(entry->origin, hole);
+        return FS_ERR_NO_ERROR;
+      }
+    }
+
+    pages = nx_fs_index_get_pages(next);
+    if (!nx_fs_index_is_pinned(nx_fs_index_get(next))) {
+      break;
+    }
+  }
+
+  if (nx_fs_map_find_hole(pages, &dest) == FS_ERR_NO_ERROR) {
+    nx_fs_defrag_begin(next, dest);
+    return FS_ERR_NO_ERROR;
+  }
+
+  err = nx_fs_move_region(next, hole, pages);
+  if (err == FS_ERR_NO_ERROR) {
+    *moved = pages;
+  }
+
+  return err;
+}
+
+/* Complete the current background move. The extent's first page,
+ * which carries its header, is copied with both move flags set in its
+ * marker, then the pages whose first word was held back. Clearing the
+ * copying flag commits the copy: from then on, the index build keeps
+ * it over its source. The old header is erased next, once no other
+ * source page looks like a header, and the copy last gets the extent's
+ * own marker back.
+ */
+static fs_err_t nx_fs_defrag_switch(void) {
+  U32 data[EFC_PAGE_WORDS];
+  U32 source = fs_defrag.source, dest = fs_defrag.dest, i;
+  bool ok = TRUE;
+  U8 marker;
+
+  fs_defrag.moving = FALSE;
+
+  nx_fs_read_page(source, data);
+  marker = nx_fs_marker_get_base((data[0] & FS_FILE_ORIGIN_MASK) >> 24);
+  data[0] = (data[0] & ~FS_FILE_ORIGIN_MASK) |
+    ((U32)(marker | FS_FILE_MOVE_MASK) << 24);
+  if (!nx_fs_write_page(data, dest)) {
+    nx_fs_erase_headers(dest, fs_defrag.len);
+    return FS_ERR_FLASH_ERROR;
+  }
+
+  for (i=1; i<fs_defrag.len; i++) {
+    if (nx_fs_page_has_magic(source + i)) {
+      nx_fs_read_page(source + i, data);
+      if (!nx_fs_write_page(data, dest + i)) {
+        nx_fs_erase_headers(dest, fs_defrag.len);
+        return FS_ERR_FLASH_ERROR;
+      }
+    }
+  }
+
+  nx_fs_read_page(dest, data);
+  data[0] &= ~((U32)FS_FILE_COPYING_FLAG << 24);
+  if (!nx_fs_program_page(data, dest)) {
+    nx_fs_erase_headers(dest, fs_defrag.len);
+    return FS_ERR_FLASH_ERROR;
+  }
+
+  /* The copy is committed. The held-back words of the source are
+   * cleared before its header goes, so that none is left looking like
+   * a header. From here on, a failure is settled by the next index
+   * build, and the index already follows the copy.
+   */
+  for (i=1; ok && i<fs_defrag.len; i++) {
+    if (nx_fs_page_has_magic(source + i)) {
+      nx_fs_read_page(source + i, data);
+      data[0] = 0;
+      ok = nx_fs_program_page(data, source + i);
+    }
+  }
+
+  ok = ok && nx_fs_erase_page(source);
+
+  if (ok) {
+    nx_fs_read_page(dest, data);
+    data[0] &= ~((U32)FS_FILE_MOVED_FLAG << 24);
+    ok = nx_fs_program_page(data, dest);
+  }
+
+  nx_fs_index_shift(source, dest, fs_defrag.len);
+  return ok ? FS_ERR_NO_ERROR : FS_ERR_FLASH_ERROR;
+}
+
+fs_err_t nx_fs_defrag_step(U32 budget, bool *done) {
+  U32 data[EFC_PAGE_WORDS];
+  fs_err_t err;
+
+  NX_ASSERT(done != NULL);
+  *done = FALSE;
+
+  err = nx_fs_index_check();
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  while (budget > 0) {
+    /* Anything that changed the flash since the copy started may have
+     * touched the extent or its destination: start over.
+     */
+    if (fs_defrag.moving && fs_defrag.generation != fs_index.generation) {
+      fs_defrag.moving = FALSE;
+    }
+
+    if (!fs_defrag.moving) {
+      U32 moved = 0;
+
+      err = nx_fs_defrag_plan(&moved);
+      if (err != FS_ERR_NO_ERROR) {
+        return err;
+      }
+
+      if (!fs_defrag.moving && !moved) {
+        *done = TRUE;
+        return FS_ERR_NO_ERROR;
+      }
+
+      budget -= MIN(budget, moved);
+      continue;
+    }
+
+    if (fs_defrag.copied + 1 < fs_defrag.len) {
+      U32 page = fs_defrag.copied + 1;
+
+      nx_fs_read_page(fs_defrag.source + page, data);
+
+      /* Free pages must never look like a file header. The first word
+       * of such a page is only copied when switching over.
+       */
+      if (nx_fs_word_has_magic(data[0])) {
+        data[0] = 0;
+      }
+
+      if (!nx_fs_write_page(data, fs_defrag.dest + page)) {
+        fs_defrag.moving = FALSE;
+        return FS_ERR_FLASH_ERROR;
+      }
+
+      fs_defrag.copied++;
+    } else {
+      err = nx_fs_defrag_switch();
+      if (err != FS_ERR_NO_ERROR) {
+        return err;
+      }
+    }
+
+    budget--;
+  }
+
+  return FS_ERR_NO_ERROR;
+}
+
+fs_err_t nx_fs_erase_step(U32 budget, bool *done) {
+  U32 page = FS_PAGE_START;
+  fs_err_t err;
+
+  NX_ASSERT(done != NULL);
+  *done = FALSE;
+
+  err = nx_fs_index_check();
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  while (budget > 0) {
+    page = nx_fs_pool_next_dirty(page);
+    if (page == FS_PAGE_END) {
+      *done = TRUE;
+      return FS_ERR_NO_ERROR;
+    }
+
+    /* Leave alone the pages a background move is copying to, and the
+     * fresh pages of growing files, which may only be in the cache.
+     */
+    if ((fs_defrag.moving && page >= fs_defrag.dest &&
+         page < fs_defrag.dest + fs_defrag.len) ||
+        nx_fs_cache_find(page)) {
+      page++;
+      continue;
+    }
+
+    if (!nx_fs_erase_page(page)) {
+      return FS_ERR_FLASH_ERROR;
+    }
+
+    budget--;
+  }
+
+  return FS_ERR_NO_ERROR;
+}
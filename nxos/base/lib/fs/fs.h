@@ -28,9 +28,27 @@
  * system: open(), read(), write(), seek(), flush() and close(). Note that reading and
  * writing use two different pointers. A seek() will move both of them.
  *
- * The file system also tries to minimize stress on the flash by progressively moving files
- * needing more space towards the end of the flash medium. This relocation process happens
- * automatically and may make one write operation rather costly (in terms of time).
+ * A file is stored as one or more extents, each being a run of contiguous flash pages
+ * starting with a metadata header. When a file needs to grow over another one, it is
+ * continued in a new extent rather than being moved around, so appending data stays
+ * cheap. Files are only relocated as a fallback, when no more extents can be indexed.
+ *
+ * The erases of each lock region of the flash are counted, and new files, extents and
+ * moved data are kept away from the regions that were erased much more than the
+ * others, which levels the wear of the flash.
+ *
+ * Ring logs are files of a fixed capacity holding records rather than a byte stream.
+ * Records are appended in place, and once the ring is full each new page of records
+ * overwrites the oldest one, so a ring log never grows nor moves while it is written.
+ *
+ * A file can be marked compressed with nx_fs_compress() before its first byte is
+ * written. Its bytes then go through an LZ codec (see lz.h) on their way to and from
+ * the page cache. Compressed files are written from their start only, and seeking in
+ * them decompresses the file up to the new position.
+ *
+ * nx_fs_replace() writes a new version of a file next to the old one, which is only
+ * wiped once the new one is complete. A reset at any point leaves one version or the
+ * other, never a mix of both nor no file at all.
  *
  * For more information, refer to the file system design document.
  */
@@ -39,8 +57,26 @@
 /** File-system first page number. */
 #define FS_PAGE_START 128
 
-/** File-system last page number. */
-#define FS_PAGE_END 1024
+/** File-system last page number. The pages after it, up to the end of
+ * the flash, hold the key/value store and the wear table.
+ */
+#define FS_PAGE_END (FS_WEAR_PAGE_START - FS_KV_PAGES)
+
+/** Number of pages set aside after the file system for the key/value
+ * store (see kv.h).
+ */
+#define FS_KV_PAGES 16
+
+/** First page of the wear table, at the end of the flash. */
+#define FS_WEAR_PAGE_START (EFC_PAGES - FS_WEAR_PAGES)
+
+/** Number of pages holding the wear table. They are written in turn. */
+#define FS_WEAR_PAGES 2
+
+/** Number of erases a lock region may be ahead of the least erased
+ * one before the file system avoids placing data in it.
+ */
+#define FS_WEAR_SLACK 128
 
 /** Maximum number of files that can be stored by the filesystem.
  * The lack of dynamic memory allocator makes this a hardcoded
@@ -48,6 +84,34 @@
  */
 #define FS_MAX_OPENED_FILES 8
 
+/** Number of flash pages held by the page cache shared by all the
+ * opened files. Each one costs EFC_PAGE_BYTES of RAM.
+ */
+#define FS_CACHE_PAGES 4
+
+/** Maximum number of compressed files that can be opened at once.
+ * Each one holds an LZ codec, about 1.6KB of RAM.
+ */
+#define FS_COMPRESSED_FILES 2
+
+/** Maximum number of files the file system index can hold. A flash
+ * holding more, or more extents than FS_MAX_EXTENTS, still mounts: the
+ * files that do not fit are left out of the index, and looked for on
+ * the flash when opened. No new file can be created then.
+ */
+#define FS_MAX_FILES 64
+
+/** Maximum number of extents the file system can hold, over all
+ * files. Each file is made of at least one extent. This bounds the
+ * size of the in-RAM file index built by nx_fs_init().
+ */
+#define FS_MAX_EXTENTS 96
+
+/** Maximum size of a ring log record, in bytes. Records do not span
+ * flash pages, and each page of a ring log has an 8 bytes header.
+ */
+#define FS_RING_RECORD_MAX (EFC_PAGE_BYTES - 9)
+
 /** Filename length, in U32s. */
 #define FS_FILENAME_SIZE 8
 
@@ -68,6 +132,9 @@ typedef enum {
   FS_ERR_FLASH_ERROR,
   FS_ERR_NO_SPACE_LEFT_ON_DEVICE,
   FS_ERR_INCORRECT_SEEK,
+  FS_ERR_TOO_MANY_FILES,
+  FS_ERR_FILE_MAPPED,
+  FS_ERR_OLD_LAYOUT,
 } fs_err_t;
 
 /** File permission modes. */
@@ -82,18 +149,17 @@ typedef enum {
   FS_FILE_MODE_OPEN,
   FS_FILE_MODE_APPEND,
   FS_FILE_MODE_CREATE,
+  FS_FILE_MODE_TRUNCATE,
 } fs_file_mode_t;
 
-/** File I/O buffer. */
+/** File I/O position. The data itself goes through the file system's
+ * shared page cache.
+ */
 typedef struct {
-  union {
-    U32 raw[EFC_PAGE_WORDS];
-    U8 bytes[EFC_PAGE_BYTES];
-  } data;    /**< The buffer data, accessible in its raw (U32) form or byte
-              * per byte.
-              */
-  U32 page;  /**< The flash page this buffer is related to. */
-  U32 pos;   /**< In-data cursor. */
+  U32 page;  /**< The flash page this position is in. */
+  U32 pos;   /**< In-page cursor. */
+  U8 extent; /**< Index slot of the extent holding the page. */
+  size_t base; /**< File offset of the extent's first byte. */
 } fs_buffer_t;
 
 /** File description structure, read from the file's metadata
@@ -107,28 +173,90 @@ typedef struct {
 
   fs_perm_t perms;               /**< File permissions. */
 
-  fs_buffer_t rbuf;              /**< Read buffer. */
-  fs_buffer_t wbuf;              /**< Write buffer. */
+  fs_buffer_t rbuf;              /**< Read position. */
+  fs_buffer_t wbuf;              /**< Write position. */
+
+  bool modified;                 /**< Was the file written to since
+                                  * it was opened? */
+
+  bool ring;                     /**< Is the file a ring log? */
+  U32 ring_seq;                  /**< Sequence number of the ring log
+                                  * page records are appended to. */
+
+  bool compressed;               /**< Is the file compressed? */
+  U8 codec;                      /**< The file's codec slot, if it is
+                                  * being read or written. */
+  size_t length;                 /**< Uncompressed size of a
+                                  * compressed file. */
+
+  bool shadow;                   /**< Is this a new version of a file,
+                                  * replacing the old one when
+                                  * closed? */
+
+  bool mapped;                   /**< Was the file mapped through this
+                                  * descriptor? */
 } fs_file_t;
 
+/** Ring log read position. Several readers can go through the same
+ * ring log, each with its own cursor.
+ */
+typedef struct {
+  U32 seq; /**< Sequence number of the ring log page being read. */
+  U32 pos; /**< In-page offset of the next record. */
+} fs_ring_cursor_t;
+
 /** File descriptor type. */
 typedef U8 fs_fd_t;
 
 /** Initializes the file system.
  *
- * @return An @a fs_err_t error describing the outcome of the operation.
+ * This walks the flash once to build the in-RAM file index, which is
+ * then used by all the file lookups and placement decisions. If the
+ * application kernel does not call it, the first file system
+ * operation does.
+ *
+ * Only the file headers are read, and each one is checked before it
+ * is trusted: the files behind bad headers are left out. File payloads
+ * are checked against their checksum when first opened.
+ *
+ * The first mount records the flash layout in the wear table. Before
+ * that, a file reaching past @a FS_PAGE_END comes from an older layout,
+ * which gave the file system the pages now holding the key/value store
+ * and the wear table. The file system does not mount over it, so that
+ * the file is not lost silently, and the key/value store must not be
+ * used either. Defragment the flash with the older firmware first,
+ * which packs the files at the start of the flash, or wipe it with
+ * nx_fs_soft_format().
+ *
+ * @return @a FS_ERR_OLD_LAYOUT if files of an older layout reach past
+ * @a FS_PAGE_END, or an @a fs_err_t error describing the outcome of the
+ * operation.
  */
 fs_err_t nx_fs_init(void);
 
 /** Open a file.
+ *
+ * With @a FS_FILE_MODE_TRUNCATE, an existing file is emptied, but the
+ * pages of its first extent stay reserved for it until it is closed,
+ * so that rewriting it does not have to move it. A missing file is
+ * created.
+ *
+ * Opening an existing file for the first time since the file system
+ * was initialized reads it whole, to check it against the checksum
+ * recorded when it was last closed. A file that fails the check can
+ * still be opened with @a FS_FILE_MODE_TRUNCATE.
  *
  * @param name The name of the file to open.
  * @param mode The requested file mode.
  * @param fd A pointer to the file descriptor to use.
+ * @return FS_ERR_CORRUPTED_FILE if the file fails its checksum,
+ * FS_ERR_TOO_MANY_FILES if the file is left out of the index and the
+ * files that are opened leave no room for it.
  */
 fs_err_t nx_fs_open(char *name, fs_file_mode_t mode, fs_fd_t *fd);
 
-/** Get the file size.
+/** Get the file size. This is the uncompressed size of a compressed
+ * file.
  *
  * @param fd The file descriptor.
  * @return The file size as a @a size_t.
@@ -150,12 +278,108 @@ fs_err_t nx_fs_read(fs_fd_t fd, U8 *byte);
  */
 fs_err_t nx_fs_write(fs_fd_t fd, U8 byte);
 
-/** Flush a file's write buffer. */
+/** Read up to @a len bytes from a file.
+ *
+ * Data is copied page span by page span from the page cache,
+ * crossing page boundaries as needed. This is much cheaper than
+ * calling nx_fs_read() once per byte.
+ *
+ * @param fd The descriptor for the file to read from.
+ * @param data The buffer to copy the read bytes to.
+ * @param len The maximum number of bytes to read.
+ * @param read A pointer to a @a size_t receiving the number of bytes
+ * actually read. May be NULL.
+ * @return An @a fs_err_t describing the outcome of the operation. @a
+ * FS_ERR_END_OF_FILE is only returned if no byte could be read.
+ */
+fs_err_t nx_fs_read_buf(fs_fd_t fd, U8 *data, size_t len, size_t *read);
+
+/** Map a file's payload directly from the flash.
+ *
+ * The flash is memory-mapped, so a file's bytes can be used in place
+ * without being copied through the page cache. The returned pointer
+ * covers the bytes from the file's read position up to the end of the
+ * extent holding them, metadata header excluded, and the read
+ * position is moved past them. A contiguous file is thus mapped in
+ * one call; a file made of several extents needs one call per extent.
+ *
+ * The mapping is only valid until the file gets moved, which may
+ * happen whenever the file is written to. The file's cached changes
+ * are written to the flash before it is mapped, but later writes are
+ * not visible through the mapping until they are flushed.
+ *
+ * Until the descriptor is closed, the file is pinned: the background
+ * defragmentation leaves its extents where they are, and the other
+ * defragmentation functions return @a FS_ERR_FILE_MAPPED.
+ *
+ * @param fd The descriptor for the file to map.
+ * @param data A pointer receiving the address of the mapped bytes.
+ * @param len A pointer receiving the number of mapped bytes.
+ * @return An @a fs_err_t describing the outcome of the operation. @a
+ * FS_ERR_END_OF_FILE is returned once the whole file was mapped, and
+ * @a FS_ERR_UNSUPPORTED_MODE for compressed files, which can only be
+ * read through nx_fs_read_buf().
+ */
+fs_err_t nx_fs_mmap(fs_fd_t fd, const U8 **data, size_t *len);
+
+/** Write @a len bytes to a file.
+ *
+ * Data is written page span by page span into the page cache, and only
+ * reaches the flash when its page is evicted or flushed, so that small
+ * writes to the same page coalesce. The file is given a new extent if
+ * it needs to grow over another file.
+ *
+ * @param fd The descriptor for the file to write to.
+ * @param data The bytes to write to the file.
+ * @param len The number of bytes to write.
+ * @return An @a fs_err_t describing the outcome of the operation.
+ */
+fs_err_t nx_fs_write_buf(fs_fd_t fd, const U8 *data, size_t len);
+
+/** Reserve room for a file to grow up to @a bytes.
+ *
+ * The pages the file needs to reach that size are claimed right away,
+ * as one contiguous range after its current data, moving the end of
+ * the file to a large enough hole if needed. Writes up to that size
+ * then never need to move the file or give it a new extent.
+ *
+ * The reservation lasts until the file is closed. Unused pages are
+ * then given back.
+ *
+ * @param fd The descriptor for the file.
+ * @param bytes The file size to reserve room for.
+ * @return An @a fs_err_t describing the outcome of the operation.
+ */
+fs_err_t nx_fs_reserve(fs_fd_t fd, size_t bytes);
+
+/** Flush a file's cached pages to the flash.
+ *
+ * Pages evicted from the cache are written to the flash in the
+ * background. Flushing writes back the file's remaining dirty pages,
+ * waits for all of them to land, and reports any error.
+ */
 fs_err_t nx_fs_flush(fs_fd_t fd);
 
+/** Write everything the file system holds in RAM back to the flash:
+ * the cached pages of all files, and the wear table. Call this before
+ * powering off.
+ *
+ * @return An @a fs_err_t describing the outcome of the operation.
+ */
+fs_err_t nx_fs_sync(void);
+
 /** Close the file, flushing any data left to be written and sync
  * its metadata.
  *
+ * The new size of the file is committed by the write of its first
+ * page. A reset before that leaves the file as it was when last
+ * closed, whichever of its extents the data went to.
+ *
+ * If the end of a compressed stream cannot be written, for instance
+ * because the flash is full, the file is deleted and the descriptor
+ * released anyway. A file being replaced with nx_fs_replace() keeps
+ * its old version.
+ *
  * @param fd The file descpriptor.
  * @return An @a fs_err_t describing the outcome of the operation.
  */
@@ -183,10 +407,16 @@ fs_err_t nx_fs_set_perms(fs_fd_t fd, fs_perm_t perms);
 fs_err_t nx_fs_unlink(fs_fd_t fd);
 
 /** Soft format the flash by wiping all present files.
+ *
+ * This includes the files an older layout left after @a FS_PAGE_END,
+ * until the current layout is recorded (see nx_fs_init()).
  */
 fs_err_t nx_fs_soft_format(void);
 
 /** Seek to a given position in a file.
+ *
+ * In a compressed file, this decompresses the file from its start up
+ * to @a position, and is only supported if the file is being read.
  *
  * @param fd The file descpriptor.
  * @param position The position to seek to, in bytes.
@@ -194,6 +424,101 @@ fs_err_t nx_fs_soft_format(void);
  */
 fs_err_t nx_fs_seek(fs_fd_t fd, size_t position);
 
+/** Mark a file as compressed. This must be done before anything is
+ * written to it, typically right after opening it with @a
+ * FS_FILE_MODE_TRUNCATE or @a FS_FILE_MODE_CREATE. Bytes written are
+ * then compressed on their way to the flash, and decompressed when
+ * read back. Compressed files can not be appended to, nor mapped.
+ *
+ * @param fd The descriptor of the empty file.
+ * @return FS_ERR_TOO_MANY_OPENED_FILES if FS_COMPRESSED_FILES
+ * compressed files are already opened.
+ */
+fs_err_t nx_fs_compress(fs_fd_t fd);
+
+/** Start writing a new version of a file, replacing it atomically.
+ *
+ * The new version is written into free pages, as a single extent: it
+ * is moved to a larger hole, rather than given a new extent, when it
+ * outgrows its place. Room for the size of the old version is claimed
+ * up front. Until the new version is closed, the old one is left
+ * untouched, and can still be opened and read.
+ *
+ * Closing the new version commits it: its header is written, the old
+ * version is wiped, its first page first, and the new version's
+ * header is switched to a regular file header with a page program.
+ * The old version's pages then go to the pre-erased pool. If the
+ * file system is initialized again after a reset in between, the new
+ * version is kept if the old one was wiped, and dropped otherwise.
+ * Unlinking the new version instead abandons it.
+ *
+ * The old version must not be opened when the new one is closed. A
+ * missing file is created, with read-write permissions; an existing
+ * one keeps its permissions.
+ *
+ * @param name The name of the file to replace.
+ * @param fd A pointer to the file descriptor to use.
+ * @return FS_ERR_FILE_ALREADY_EXISTS if the file is already being
+ * replaced, FS_ERR_UNSUPPORTED_MODE for ring logs.
+ */
+fs_err_t nx_fs_replace(char *name, fs_fd_t *fd);
+
+/** Create a ring log, and open it.
+ *
+ * All the pages of the ring log are claimed at once. Records are then
+ * appended with nx_fs_ring_append() and read with nx_fs_ring_read();
+ * the byte stream functions return @a FS_ERR_UNSUPPORTED_MODE on ring
+ * logs. An existing ring log is opened with nx_fs_open() in @a
+ * FS_FILE_MODE_OPEN, which only reads a few of its pages to find where
+ * appending goes on. It should only be appended to through one
+ * descriptor at a time.
+ *
+ * @param name The name of the ring log.
+ * @param pages The number of flash pages holding records, at least 2.
+ * @param fd A pointer to the file descriptor to use.
+ * @return An @a fs_err_t describing the outcome of the operation.
+ */
+fs_err_t nx_fs_ring_create(char *name, U32 pages, fs_fd_t *fd);
+
+/** Append a record to a ring log.
+ *
+ * The record goes to the page cache, as other file writes do. When it
+ * does not fit in the current page, that page is written back to the
+ * flash in the background, and the oldest page of the ring log is
+ * reused, dropping the records it held.
+ *
+ * @param fd The descriptor of the ring log.
+ * @param data The record bytes.
+ * @param len The record size, from 1 to FS_RING_RECORD_MAX bytes.
+ * @return An @a fs_err_t describing the outcome of the operation.
+ */
+fs_err_t nx_fs_ring_append(fs_fd_t fd, const U8 *data, size_t len);
+
+/** Place a cursor on the oldest record of a ring log.
+ *
+ * @param fd The descriptor of the ring log.
+ * @param cursor The cursor to move.
+ * @return An @a fs_err_t describing the outcome of the operation.
+ */
+fs_err_t nx_fs_ring_rewind(fs_fd_t fd, fs_ring_cursor_t *cursor);
+
+/** Read the record under a cursor, and move the cursor to the next
+ * one. A cursor overtaken by the writer goes on from the oldest
+ * record still in the ring log.
+ *
+ * @param fd The descriptor of the ring log.
+ * @param cursor The read position.
+ * @param data The buffer to copy the record to. Longer records are
+ * truncated.
+ * @param len The size of the buffer.
+ * @param read A pointer to a @a size_t receiving the number of bytes
+ * copied. May be NULL.
+ * @return An @a fs_err_t describing the outcome of the operation. @a
+ * FS_ERR_END_OF_FILE is returned once the newest record was read.
+ */
+fs_err_t nx_fs_ring_read(fs_fd_t fd, fs_ring_cursor_t *cursor,
+                         U8 *data, size_t len, size_t *read);
+
 /** Compute file system occupation level and statistics. Values
  * are returned to the provided pointers, if they are not NULL.
  *
@@ -205,16 +530,77 @@ fs_err_t nx_fs_seek(fs_fd_t fd, size_t position);
 void nx_fs_get_occupation(U32 *files, U32 *used, U32 *free_pages,
                           U32 *wasted);
 
+/** Get information about a file. Files are numbered from 0, in flash
+ * order, the files left out of the index (see FS_MAX_FILES) last.
+ * Values are returned to the provided pointers, if they are not NULL.
+ *
+ * @param n The number of the file.
+ * @param name The file name, FS_FILENAME_LENGTH bytes.
+ * @param size The file size. For a compressed file, this is the
+ * size it takes in the flash.
+ * @param perms The file permissions.
+ * @param extents The number of extents the file is made of.
+ * @return FS_ERR_FILE_NOT_FOUND if there are @a n files or less.
+ */
+fs_err_t nx_fs_get_file_info(U32 n, char *name, size_t *size,
+                             fs_perm_t *perms, U32 *extents);
+
+/** Get the page cache statistics. Values are returned to the provided
+ * pointers, if they are not NULL.
+ *
+ * @param hits The number of page lookups served from the cache.
+ * @param misses The number of page lookups that took a cache slot.
+ * @param writebacks The number of dirty pages written to the flash.
+ */
+void nx_fs_get_cache_stats(U32 *hits, U32 *misses, U32 *writebacks);
+
+/** Get the statistics of the last walk of the flash, done when the
+ * file system was initialized or checked. Values are returned to the
+ * provided pointers, if they are not NULL.
+ *
+ * @param headers The number of file headers found.
+ * @param rejected The number of those that were not trusted.
+ */
+void nx_fs_get_mount_stats(U32 *headers, U32 *rejected);
+
+/** Get the flash wear statistics. Values are returned to the provided
+ * pointers, if they are not NULL.
+ *
+ * Erase counts are kept in RAM and saved every few dozen erases, so
+ * the last few erases before a reset may not be counted.
+ *
+ * @param counts An array of EFC_LOCK_REGIONS erase counts, one per
+ * lock region of the flash. Regions without file system pages read 0.
+ * @param min The lowest erase count of the file system regions.
+ * @param max The highest erase count of the file system regions.
+ */
+void nx_fs_get_wear_stats(U32 *counts, U32 *min, U32 *max);
+
 /** Dumps the index of the filesystem as <page>:<filename>.
  */
 void nx_fs_dump(void);
 
+/** Check the file system, rebuilding its index from the flash.
+ *
+ * File headers left in free space by interrupted operations are
+ * wiped. Files missing some of their extents, or failing their
+ * checksum, are only reported. No file may be opened.
+ *
+ * @param stale The number of stale headers wiped, if not NULL.
+ * @param broken The number of broken files, if not NULL.
+ * @return FS_ERR_CORRUPTED_FILE if some files are broken.
+ */
+fs_err_t nx_fs_check(U32 *stale, U32 *broken);
+
 /** Perform a simple defragmentation of the flash filesystem on the
  * given zone of the flash.
  *
  * @param zone_start Beginning of the zone to defragment.
  * @param zone_end End of the zone.
  * @return A @a fs_err_t describing the outcome of the operation.
+ * Like the other defragmentation functions, this returns
+ * FS_ERR_TOO_MANY_FILES while some files are left out of the index,
+ * and FS_ERR_FILE_MAPPED while a file is mapped (see nx_fs_mmap()).
  */
 fs_err_t nx_fs_defrag_simple_zone(U32 zone_start, U32 zone_end);
 
@@ -255,6 +641,41 @@ fs_err_t nx_fs_defrag_for_file_by_origin(U32 origin);
  */
 fs_err_t nx_fs_defrag_best_overall(void);
 
+/** Advance the background defragmentation of the flash by at most
+ * @a budget page moves.
+ *
+ * The flash is compacted towards its beginning, a little at a time, so
+ * that this can be called from an idle loop or a timer without
+ * freezing the system. Between calls, the flash and the file system
+ * are consistent, and all file operations can be used: a move that
+ * gets in their way is simply restarted. A reset in the middle of a
+ * move leaves the extent at either its old place or its new one.
+ *
+ * An extent that can only be slid over the hole before it is moved in
+ * one go, which may exceed the budget. Nothing is moved while some
+ * files are left out of the index (see FS_MAX_FILES), and the extents
+ * of mapped files are left where they are (see nx_fs_mmap()).
+ *
+ * @param budget The maximum number of pages to move.
+ * @param done Set to TRUE once the flash is compact.
+ * @return A @a fs_err_t describing the outcome of the operation.
+ */
+fs_err_t nx_fs_defrag_step(U32 budget, bool *done);
+
+/** Erase at most @a budget free pages ahead of time.
+ *
+ * Writing an erased page skips the erase step, which takes about half
+ * of the time of a page write. The pages freed by file operations are
+ * not erased right away, to keep that cost out of them. Like
+ * nx_fs_defrag_step(), this is meant to be called from an idle loop or
+ * a low priority task.
+ *
+ * @param budget The maximum number of pages to erase.
+ * @param done Set to TRUE once there is nothing left to erase.
+ * @return A @a fs_err_t describing the outcome of the operation.
+ */
+fs_err_t nx_fs_erase_step(U32 budget, bool *done);
+
 /*@}*/
 /*@}*/
 
@@ -0,0 +1,733 @@
+/* Copyright (c) 2008 the NxOS developers
+ *
+ * See AUTHORS for a full list of the developers.
+ *
+ * Redistribution of this file is permitted under
+ * the terms of the GNU Public License (GPL) version 2.
+ */
+
+#include "base/at91sam7s256.h"
+
+#include "base/types.h"
+#include "base/nxt.h"
+#include "base/assert.h"
+#include "base/util.h"
+#include "base/drivers/_efc.h"
+
+#include "base/lib/kv/kv.h"
+
+/* Number of pages of a bank. */
+#define KV_BANK_PAGES (KV_PAGES / 2)
+
+/* Size of a bank, in bytes. */
+#define KV_BANK_BYTES (KV_BANK_PAGES * EFC_PAGE_BYTES)
+
+/* Bank marker, stored with the bank generation in the bank's first
+ * U32.
+ */
+#define KV_BANK_MARKER 0x56
+
+/* Mask to use on the bank header to get the bank generation. */
+#define KV_BANK_GENERATION_MASK 0x00FFFFFF
+
+/* Size of the bank header, in bytes. */
+#define KV_BANK_HEADER_BYTES sizeof(U32)
+
+/* Record marker, stored with the key length and the value size in the
+ * record's first U32.
+ */
+#define KV_RECORD_MARKER 0x4B
+
+/* Value size of the records removing a key. */
+#define KV_RECORD_TOMBSTONE 0xFFFF
+
+/* Size of a record header: the marker U32 and the checksum U32. */
+#define KV_RECORD_HEADER_BYTES (2 * sizeof(U32))
+
+/* Offset (in U32s) of the checksum in a record. */
+#define KV_RECORD_CHECKSUM_OFFSET 1
+
+/* Number of name hash buckets. */
+#define KV_INDEX_BUCKETS 8
+
+/* Empty slot/chain marker. */
+#define KV_INDEX_NONE 0xFF
+
+/* Rounds a size up to a whole number of U32s. */
+#define KV_ALIGN(x) (((x) + sizeof(U32) - 1) & ~(sizeof(U32) - 1))
+
+/* Index entry, pointing to the latest record of a key. */
+typedef struct {
+  U32 hash;   /* Hash of the key. */
+  U16 offset; /* Offset of the record in the active bank, in bytes. */
+  U8 next;    /* Next slot in the hash chain or free list. */
+} kv_index_entry_t;
+
+static struct {
+  bool built;       /* Has the index been built? */
+  U8 bank;          /* The active bank. */
+  U32 generation;   /* Generation of the active bank. */
+  U32 tail;         /* Offset of the next record in the active bank. */
+  U32 compactions;  /* Number of compactions since boot. */
+  U8 count;         /* Number of indexed keys. */
+  U8 free;          /* Head of the free slot list. */
+  U8 buckets[KV_INDEX_BUCKETS];
+  kv_index_entry_t entries[KV_MAX_KEYS];
+} kv_store;
+
+/* Hash a key (FNV-1a). */
+static U32 nx_kv_hash(const char *key) {
+  U32 hash = 2166136261UL;
+
+  while (*key) {
+    hash ^= (U8)*key++;
+    hash *= 16777619UL;
+  }
+
+  return hash;
+}
+
+/* Returns the first flash page of a bank. */
+static U32 nx_kv_bank_page(U8 bank) {
+  return KV_PAGE_START + bank * KV_BANK_PAGES;
+}
+
+/* Returns the data at @a offset in @a bank, right on the flash.
+ * Queued flash writes are waited for first, as the flash cannot be
+ * read while it is being programmed.
+ */
+static volatile U32 *nx_kv_get_data(U8 bank, U32 offset) {
+  nx__efc_wait();
+  return FLASH_BASE_PTR + nx_kv_bank_page(bank) * EFC_PAGE_WORDS +
+    offset / sizeof(U32);
+}
+
+/* Record accessors. */
+static U32 nx_kv_record_key_length(volatile U32 *record) {
+  return (record[0] >> 16) & 0xFF;
+}
+
+static U32 nx_kv_record_value_size(volatile U32 *record) {
+  return record[0] & 0xFFFF;
+}
+
+static bool nx_kv_record_is_tombstone(volatile U32 *record) {
+  return nx_kv_record_value_size(record) == KV_RECORD_TOMBSTONE;
+}
+
+static U32 nx_kv_record_size(U32 key_len, U32 value_size) {
+  if (value_size == KV_RECORD_TOMBSTONE) {
+    value_size = 0;
+  }
+
+  return KV_RECORD_HEADER_BYTES + KV_ALIGN(key_len) + KV_ALIGN(value_size);
+}
+
+static U32 nx_kv_record_get_size(volatile U32 *record) {
+  return nx_kv_record_size(nx_kv_record_key_length(record),
+                           nx_kv_record_value_size(record));
+}
+
+static volatile U8 *nx_kv_record_key(volatile U32 *record) {
+  return (volatile U8 *)(record + 2);
+}
+
+static volatile U8 *nx_kv_record_value(volatile U32 *record) {
+  return nx_kv_record_key(record) + KV_ALIGN(nx_kv_record_key_length(record));
+}
+
+/* Checksum of a record, stored in its second U32. */
+static U32 nx_kv_record_checksum(volatile U32 *record) {
+  U32 sum = record[0], i;
+
+  for (i=2; i<nx_kv_record_get_size(record) / sizeof(U32); i++) {
+    sum += record[i];
+  }
+
+  return ~sum;
+}
+
+/* Determines if a valid record of at most @a room bytes starts at
+ * @a record.
+ */
+static bool nx_kv_record_is_valid(volatile U32 *record, U32 room) {
+  U32 key_len = nx_kv_record_key_length(record);
+  U32 value_size = nx_kv_record_value_size(record);
+
+  return (record[0] >> 24) == KV_RECORD_MARKER &&
+    key_len > 0 && key_len <= KV_KEY_LENGTH &&
+    (value_size <= KV_VALUE_MAX || value_size == KV_RECORD_TOMBSTONE) &&
+    nx_kv_record_size(key_len, value_size) <= room &&
+    record[KV_RECORD_CHECKSUM_OFFSET] == nx_kv_record_checksum(record);
+}
+
+/* Determines if the record holds @a key. */
+static bool nx_kv_record_has_key(volatile U32 *record, const char *key) {
+  volatile U8 *bytes = nx_kv_record_key(record);
+  U32 i, len = nx_kv_record_key_length(record);
+
+  for (i=0; i<len; i++) {
+    if (key[i] != bytes[i]) {
+      return FALSE;
+    }
+  }
+
+  return key[len] == '\0';
+}
+
+/* Serialize a record to @a record, which must have room for it. */
+static void nx_kv_record_create(const char *key, const void *value,
+                                U32 value_size, U32 *record) {
+  U32 key_len = strlen(key);
+  U8 *bytes = (U8 *)(record + 2);
+
+  memset(bytes, 0, nx_kv_record_size(key_len, value_size) -
+         KV_RECORD_HEADER_BYTES);
+  memcpy(bytes, key, key_len);
+  if (value_size != KV_RECORD_TOMBSTONE) {
+    memcpy(bytes + KV_ALIGN(key_len), value, value_size);
+  }
+
+  record[0] = (KV_RECORD_MARKER << 24) | (key_len << 16) | value_size;
+  record[KV_RECORD_CHECKSUM_OFFSET] = nx_kv_record_checksum(record);
+}
+
+/* In-RAM index.
+ *
+ * Each key is reachable through a hash chain. The keys themselves are
+ * only stored in the records, on the flash.
+ */
+
+/* Empty the index. */
+static void nx_kv_index_reset(void) {
+  U8 i;
+
+  kv_store.count = 0;
+  kv_store.free = 0;
+  memset(kv_store.buckets, KV_INDEX_NONE, sizeof(kv_store.buckets));
+
+  for (i=0; i<KV_MAX_KEYS; i++) {
+    kv_store.entries[i].next = i + 1 < KV_MAX_KEYS ? i + 1 : KV_INDEX_NONE;
+  }
+}
+
+/* Returns the index slot of @a key, or KV_INDEX_NONE. */
+static U8 nx_kv_index_find(const char *key, U32 hash) {
+  U8 slot = kv_store.buckets[hash % KV_INDEX_BUCKETS];
+
+  while (slot != KV_INDEX_NONE) {
+    kv_index_entry_t *entry = &(kv_store.entries[slot]);
+
+    if (entry->hash == hash &&
+        nx_kv_record_has_key(nx_kv_get_data(kv_store.bank, entry->offset),
+                             key)) {
+      return slot;
+    }
+
+    slot = entry->next;
+  }
+
+  return KV_INDEX_NONE;
+}
+
+/* Point the index at the record of @a key found at @a offset. */
+static kv_err_t nx_kv_index_set(const char *key, U32 hash, U32 offset) {
+  U8 slot = nx_kv_index_find(key, hash);
+
+  if (slot == KV_INDEX_NONE) {
+    if (kv_store.free == KV_INDEX_NONE) {
+      return KV_ERR_TOO_MANY_KEYS;
+    }
+
+    slot = kv_store.free;
+    kv_store.free = kv_store.entries[slot].next;
+
+    kv_store.entries[slot].hash = hash;
+    kv_store.entries[slot].next = kv_store.buckets[hash % KV_INDEX_BUCKETS];
+    kv_store.buckets[hash % KV_INDEX_BUCKETS] = slot;
+    kv_store.count++;
+  }
+
+  kv_store.entries[slot].offset = offset;
+  return KV_ERR_NO_ERROR;
+}
+
+/* Remove @a key from the index. */
+static void nx_kv_index_remove(const char *key, U32 hash) {
+  U8 *link = &(kv_store.buckets[hash % KV_INDEX_BUCKETS]);
+  U8 slot = nx_kv_index_find(key, hash);
+
+  if (slot == KV_INDEX_NONE) {
+    return;
+  }
+
+  while (*link != slot) {
+    link = &(kv_store.entries[*link].next);
+  }
+
+  *link = kv_store.entries[slot].next;
+  kv_store.entries[slot].next = kv_store.free;
+  kv_store.free = slot;
+  kv_store.count--;
+}
+
+/* Apply the record found at @a offset of the active bank. */
+static kv_err_t nx_kv_index_apply(U32 offset) {
+  volatile U32 *record = nx_kv_get_data(kv_store.bank, offset);
+  char key[KV_KEY_LENGTH + 1];
+  U32 i, len = nx_kv_record_key_length(record);
+
+  for (i=0; i<len; i++) {
+    key[i] = nx_kv_record_key(record)[i];
+  }
+  key[len] = '\0';
+
+  if (nx_kv_record_is_tombstone(record)) {
+    nx_kv_index_remove(key, nx_kv_hash(key));
+    return KV_ERR_NO_ERROR;
+  }
+
+  return nx_kv_index_set(key, nx_kv_hash(key), offset);
+}
+
+/* Flash banks. */
+
+/* Returns the generation of a bank, or 0 if it holds no valid bank. */
+static U32 nx_kv_bank_generation(U8 bank) {
+  U32 header = nx_kv_get_data(bank, 0)[0];
+
+  if ((header >> 24) != KV_BANK_MARKER) {
+    return 0;
+  }
+
+  return header & KV_BANK_GENERATION_MASK;
+}
+
+/* Erase the pages of a bank that are not erased yet. */
+static bool nx_kv_bank_erase(U8 bank) {
+  U32 page, i;
+
+  for (page=0; page<KV_BANK_PAGES; page++) {
+    volatile U32 *data = nx_kv_get_data(bank, page * EFC_PAGE_BYTES);
+
+    for (i=0; i<EFC_PAGE_WORDS && data[i] == EFC_ERASED_WORD; i++);
+
+    if (i < EFC_PAGE_WORDS &&
+        !nx__efc_erase_page(nx_kv_bank_page(bank) + page, EFC_ERASED_WORD)) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* Program the header of an erased bank, making it the active one. */
+static bool nx_kv_bank_activate(U8 bank, U32 generation) {
+  U32 data[EFC_PAGE_WORDS];
+
+  nx__efc_read_page(nx_kv_bank_page(bank), data);
+  data[0] = (KV_BANK_MARKER << 24) | (generation & KV_BANK_GENERATION_MASK);
+
+  if (!nx__efc_program_page(data, nx_kv_bank_page(bank))) {
+    return FALSE;
+  }
+
+  kv_store.bank = bank;
+  kv_store.generation = generation;
+  kv_store.tail = KV_BANK_HEADER_BYTES;
+  return TRUE;
+}
+
+/* Returns where a record of @a size bytes goes if appended at @a
+ * offset. Records do not span pages.
+ */
+static U32 nx_kv_place(U32 offset, U32 size) {
+  if (offset % EFC_PAGE_BYTES + size > EFC_PAGE_BYTES) {
+    offset += EFC_PAGE_BYTES - offset % EFC_PAGE_BYTES;
+  }
+
+  return offset;
+}
+
+/* Find the first record at or after @a offset in the log of @a bank.
+ * The end of a page is left unused when the next record does not fit,
+ * and the rest of a page holding a broken record is lost: @a tail is
+ * moved past such pages.
+ *
+ * @return FALSE at the end of the log.
+ */
+static bool nx_kv_log_next(U8 bank, U32 *offset, U32 *tail) {
+  while (*offset + KV_RECORD_HEADER_BYTES <= KV_BANK_BYTES) {
+    U32 end = (*offset / EFC_PAGE_BYTES + 1) * EFC_PAGE_BYTES;
+    volatile U32 *record = nx_kv_get_data(bank, *offset);
+
+    if (*offset + KV_RECORD_HEADER_BYTES > end ||
+        record[0] == EFC_ERASED_WORD) {
+      *offset = end;
+    } else if (!nx_kv_record_is_valid(record, end - *offset)) {
+      *offset = *tail = end;
+    } else {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/* Build the index by reading the active bank's log. */
+static kv_err_t nx_kv_index_build(void) {
+  U32 gen0, gen1, offset;
+  kv_err_t err;
+
+  nx_kv_index_reset();
+  kv_store.built = TRUE;
+
+  gen0 = nx_kv_bank_generation(0);
+  gen1 = nx_kv_bank_generation(1);
+
+  /* An unformatted store starts empty. */
+  if (gen0 == 0 && gen1 == 0) {
+    if (!nx_kv_bank_erase(0) || !nx_kv_bank_erase(1) ||
+        !nx_kv_bank_activate(0, 1)) {
+      kv_store.built = FALSE;
+      return KV_ERR_FLASH_ERROR;
+    }
+
+    return KV_ERR_NO_ERROR;
+  }
+
+  /* A compaction may have been interrupted before the old bank was
+   * erased: the newest bank wins.
+   */
+  kv_store.bank = gen1 > gen0 ? 1 : 0;
+  kv_store.generation = MAX(gen0, gen1);
+  kv_store.tail = offset = KV_BANK_HEADER_BYTES;
+
+  while (nx_kv_log_next(kv_store.bank, &offset, &kv_store.tail)) {
+    err = nx_kv_index_apply(offset);
+    if (err != KV_ERR_NO_ERROR) {
+      return err;
+    }
+
+    offset += nx_kv_record_get_size(nx_kv_get_data(kv_store.bank, offset));
+    kv_store.tail = offset;
+  }
+
+  return KV_ERR_NO_ERROR;
+}
+
+/* Make sure the index is built before using it. */
+static kv_err_t nx_kv_index_check(void) {
+  if (kv_store.built) {
+    return KV_ERR_NO_ERROR;
+  }
+
+  return nx_kv_index_build();
+}
+
+/* Returns the index entry pointing at @a offset, or NULL. */
+static kv_index_entry_t *nx_kv_index_find_offset(U32 offset) {
+  U8 bucket, slot;
+
+  for (bucket=0; bucket<KV_INDEX_BUCKETS; bucket++) {
+    for (slot = kv_store.buckets[bucket]; slot != KV_INDEX_NONE;
+         slot = kv_store.entries[slot].next) {
+      if (kv_store.entries[slot].offset == offset) {
+        return &(kv_store.entries[slot]);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/* Copy the live records to the other bank, which becomes the active
+ * one. They are copied in log order, so that they never take more
+ * room than they did. The new bank header is only programmed once all
+ * the records are in place, so an interrupted compaction leaves the
+ * old bank active.
+ */
+static kv_err_t nx_kv_compact(void) {
+  U8 old_bank = kv_store.bank, new_bank = 1 - old_bank;
+  U32 data[EFC_PAGE_WORDS], source = KV_BANK_HEADER_BYTES, lost = 0;
+  U32 offset = KV_BANK_HEADER_BYTES, page = 0;
+
+  if (!nx_kv_bank_erase(new_bank)) {
+    return KV_ERR_FLASH_ERROR;
+  }
+
+  /* Records are gathered a page at a time, and each page programmed
+   * once full. The header of the first page is left erased.
+   */
+  memset(data, 0xFF, sizeof(data));
+
+  while (nx_kv_log_next(old_bank, &source, &lost)) {
+    volatile U32 *record = nx_kv_get_data(old_bank, source);
+    kv_index_entry_t *entry = nx_kv_index_find_offset(source);
+    U32 size = nx_kv_record_get_size(record), i;
+
+    if (entry != NULL) {
+      offset = nx_kv_place(offset, size);
+      if (offset / EFC_PAGE_BYTES != page) {
+        if (!nx__efc_program_page(data, nx_kv_bank_page(new_bank) + page)) {
+          kv_store.built = FALSE;
+          return KV_ERR_FLASH_ERROR;
+        }
+
+        memset(data, 0xFF, sizeof(data));
+        page = offset / EFC_PAGE_BYTES;
+      }
+
+      for (i=0; i<size / sizeof(U32); i++) {
+        data[(offset % EFC_PAGE_BYTES) / sizeof(U32) + i] = record[i];
+      }
+
+      entry->offset = offset;
+      offset += size;
+    }
+
+    source += size;
+  }
+
+  if (!nx__efc_program_page(data, nx_kv_bank_page(new_bank) + page) ||
+      !nx_kv_bank_activate(new_bank, kv_store.generation + 1) ||
+      !nx_kv_bank_erase(old_bank)) {
+    /* The index may point to either bank by now. */
+    kv_store.built = FALSE;
+    return KV_ERR_FLASH_ERROR;
+  }
+
+  kv_store.tail = offset;
+  kv_store.compactions++;
+  return KV_ERR_NO_ERROR;
+}
+
+/* Returns where the log of the active bank would end once compacted.
+ * This walks the log the way nx_kv_compact() does, without copying.
+ */
+static U32 nx_kv_compacted_tail(void) {
+  U32 source = KV_BANK_HEADER_BYTES, lost = 0;
+  U32 offset = KV_BANK_HEADER_BYTES;
+
+  while (nx_kv_log_next(kv_store.bank, &source, &lost)) {
+    U32 size = nx_kv_record_get_size(nx_kv_get_data(kv_store.bank, source));
+
+    if (nx_kv_index_find_offset(source) != NULL) {
+      offset = nx_kv_place(offset, size) + size;
+    }
+
+    source += size;
+  }
+
+  return offset;
+}
+
+/* Append a record to the log, compacting the log first if it is full,
+ * and point the index at it.
+ */
+static kv_err_t nx_kv_append(const char *key, U32 hash, const void *value,
+                             U32 value_size) {
+  U32 data[EFC_PAGE_WORDS], size, offset, page;
+  kv_err_t err;
+
+  size = nx_kv_record_size(strlen(key), value_size);
+  offset = nx_kv_place(kv_store.tail, size);
+
+  if (offset + size > KV_BANK_BYTES) {
+    /* A tombstone only hides the older records of its key. Compacting
+     * without the key drops them all, so no tombstone is needed.
+     */
+    if (value_size == KV_RECORD_TOMBSTONE) {
+      nx_kv_index_remove(key, hash);
+      err = nx_kv_compact();
+      if (err != KV_ERR_NO_ERROR) {
+        /* The key may still be on the flash. */
+        kv_store.built = FALSE;
+      }
+      return err;
+    }
+
+    /* Do not wear a bank out for a record that still won't fit. */
+    offset = nx_kv_place(nx_kv_compacted_tail(), size);
+    if (offset + size > KV_BANK_BYTES) {
+      return KV_ERR_NO_SPACE_LEFT;
+    }
+
+    err = nx_kv_compact();
+    if (err != KV_ERR_NO_ERROR) {
+      return err;
+    }
+
+    offset = nx_kv_place(kv_store.tail, size);
+    if (offset + size > KV_BANK_BYTES) {
+      return KV_ERR_NO_SPACE_LEFT;
+    }
+  }
+
+  /* The record goes to erased flash, so the page is programmed
+   * without being erased, along with its older records.
+   */
+  page = nx_kv_bank_page(kv_store.bank) + offset / EFC_PAGE_BYTES;
+  nx__efc_read_page(page, data);
+  nx_kv_record_create(key, value, value_size,
+                      data + (offset % EFC_PAGE_BYTES) / sizeof(U32));
+
+  if (!nx__efc_program_page(data, page)) {
+    kv_store.built = FALSE;
+    return KV_ERR_FLASH_ERROR;
+  }
+
+  kv_store.tail = offset + size;
+
+  if (value_size == KV_RECORD_TOMBSTONE) {
+    nx_kv_index_remove(key, hash);
+    return KV_ERR_NO_ERROR;
+  }
+
+  return nx_kv_index_set(key, hash, offset);
+}
+
+kv_err_t nx_kv_init(void) {
+  return nx_kv_index_build();
+}
+
+kv_err_t nx_kv_get(const char *key, void *value, size_t len, size_t *read) {
+  volatile U32 *record;
+  U32 size, i;
+  kv_err_t err;
+  U8 slot;
+
+  NX_ASSERT(key != NULL);
+
+  err = nx_kv_index_check();
+  if (err != KV_ERR_NO_ERROR) {
+    return err;
+  }
+
+  slot = nx_kv_index_find(key, nx_kv_hash(key));
+  if (slot == KV_INDEX_NONE) {
+    return KV_ERR_KEY_NOT_FOUND;
+  }
+
+  record = nx_kv_get_data(kv_store.bank, kv_store.entries[slot].offset);
+  size = nx_kv_record_value_size(record);
+
+  for (i=0; i<MIN(len, size); i++) {
+    ((U8 *)value)[i] = nx_kv_record_value(record)[i];
+  }
+
+  if (read) {
+    *read = size;
+  }
+
+  return KV_ERR_NO_ERROR;
+}
+
+kv_err_t nx_kv_set(const char *key, const void *value, size_t len) {
+  volatile U32 *record;
+  U32 hash, i;
+  kv_err_t err;
+  U8 slot;
+
+  NX_ASSERT(key != NULL);
+  NX_ASSERT(strlen(key) > 0 && strlen(key) <= KV_KEY_LENGTH);
+  NX_ASSERT(len <= KV_VALUE_MAX);
+
+  err = nx_kv_index_check();
+  if (err != KV_ERR_NO_ERROR) {
+    return err;
+  }
+
+  hash = nx_kv_hash(key);
+  slot = nx_kv_index_find(key, hash);
+
+  if (slot == KV_INDEX_NONE) {
+    /* Check before writing anything. */
+    if (kv_store.count == KV_MAX_KEYS) {
+      return KV_ERR_TOO_MANY_KEYS;
+    }
+  } else {
+    /* Setting the same value again is free. */
+    record = nx_kv_get_data(kv_store.bank, kv_store.entries[slot].offset);
+    if (nx_kv_record_value_size(record) == len) {
+      for (i=0; i<len && nx_kv_record_value(record)[i] == ((const U8 *)value)[i];
+           i++);
+
+      if (i == len) {
+        return KV_ERR_NO_ERROR;
+      }
+    }
+  }
+
+  return nx_kv_append(key, hash, value, len);
+}
+
+kv_err_t nx_kv_delete(const char *key) {
+  kv_err_t err;
+  U32 hash;
+
+  NX_ASSERT(key != NULL);
+
+  err = nx_kv_index_check();
+  if (err != KV_ERR_NO_ERROR) {
+    return err;
+  }
+
+  hash = nx_kv_hash(key);
+  if (nx_kv_index_find(key, hash) == KV_INDEX_NONE) {
+    return KV_ERR_KEY_NOT_FOUND;
+  }
+
+  return nx_kv_append(key, hash, NULL, KV_RECORD_TOMBSTONE);
+}
+
+kv_err_t nx_kv_get_key(U32 n, char *key) {
+  U8 bucket, slot;
+  kv_err_t err;
+
+  NX_ASSERT(key != NULL);
+
+  err = nx_kv_index_check();
+  if (err != KV_ERR_NO_ERROR) {
+    return err;
+  }
+
+  for (bucket=0; bucket<KV_INDEX_BUCKETS; bucket++) {
+    for (slot = kv_store.buckets[bucket]; slot != KV_INDEX_NONE;
+         slot = kv_store.entries[slot].next) {
+      volatile U32 *record;
+      U32 i, len;
+
+      if (n-- > 0) {
+        continue;
+      }
+
+      record = nx_kv_get_data(kv_store.bank, kv_store.entries[slot].offset);
+      len = nx_kv_record_key_length(record);
+      for (i=0; i<len; i++) {
+        key[i] = nx_kv_record_key(record)[i];
+      }
+      key[len] = '\0';
+
+      return KV_ERR_NO_ERROR;
+    }
+  }
+
+  return KV_ERR_KEY_NOT_FOUND;
+}
+
+void nx_kv_get_stats(U32 *keys, U32 *free_bytes, U32 *compactions) {
+  nx_kv_index_check();
+
+  if (keys) {
+    *keys = kv_store.count;
+  }
+
+  if (free_bytes) {
+    *free_bytes = KV_BANK_BYTES - kv_store.tail;
+  }
+
+  if (compactions) {
+    *compactions = kv_store.compactions;
+  }
+}
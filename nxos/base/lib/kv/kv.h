@@ -0,0 +1,135 @@
+/** @file kv.h
+ *  @brief Flash key/value store.
+ *
+ * A log-structured store for small settings in the on-board flash.
+ */
+
+/* Copyright (c) 2008 the NxOS developers
+ *
+ * See AUTHORS for a full list of the developers.
+ *
+ * Redistribution of this file is permitted under
+ * the terms of the GNU Public License (GPL) version 2.
+ */
+
+#ifndef __NXOS_BASE_LIB_KV_H__
+#define __NXOS_BASE_LIB_KV_H__
+
+#include "base/types.h"
+#include "base/drivers/_efc.h"
+#include "base/lib/fs/fs.h"
+
+/** @addtogroup lib */
+/*@{*/
+
+/** @defgroup kv Flash key/value store
+ *
+ * The key/value store keeps small values, such as calibration data or
+ * pairing keys, in a range of flash pages set aside from the file
+ * system. It is a log of records: setting a key appends a record with
+ * the new value, programmed into erased flash without erasing it
+ * first, so that an update costs one page program. An in-RAM hash
+ * index, built from the log on first use, points to the latest record
+ * of each key.
+ *
+ * The pages are split in two banks. Records are appended to the active
+ * one, and only when it is full are the live records copied to the
+ * other bank, which then becomes the active one.
+ */
+/*@{*/
+
+/** First flash page of the store. */
+#define KV_PAGE_START FS_PAGE_END
+
+/** Number of flash pages of the store. */
+#define KV_PAGES FS_KV_PAGES
+
+/** Maximum number of keys the store can hold. This bounds the size of
+ * the in-RAM index.
+ */
+#define KV_MAX_KEYS 32
+
+/** Maximum key length, in bytes. */
+#define KV_KEY_LENGTH 16
+
+/** Maximum value size, in bytes. A record never spans flash pages. */
+#define KV_VALUE_MAX (EFC_PAGE_BYTES - 3 * sizeof(U32) - KV_KEY_LENGTH)
+
+/** Key/value store errors. */
+typedef enum {
+  KV_ERR_NO_ERROR = 0,
+  KV_ERR_KEY_NOT_FOUND,
+  KV_ERR_TOO_MANY_KEYS,
+  KV_ERR_NO_SPACE_LEFT,
+  KV_ERR_FLASH_ERROR,
+} kv_err_t;
+
+/** Initializes the key/value store.
+ *
+ * This reads the log once to build the in-RAM index, and formats the
+ * store if it holds no valid bank. If the application kernel does not
+ * call it, the first store operation does.
+ *
+ * @return A @a kv_err_t describing the outcome of the operation.
+ */
+kv_err_t nx_kv_init(void);
+
+/** Get the value of a key.
+ *
+ * @param key The key, a string of up to KV_KEY_LENGTH characters.
+ * @param value The buffer to copy the value to. Longer values are
+ * truncated.
+ * @param len The size of the buffer.
+ * @param read A pointer to a @a size_t receiving the full size of the
+ * value. May be NULL.
+ * @return A @a kv_err_t describing the outcome of the operation.
+ */
+kv_err_t nx_kv_get(const char *key, void *value, size_t len, size_t *read);
+
+/** Set the value of a key.
+ *
+ * The new record is programmed right away, and nothing is written if
+ * the key already has that value. When the active bank is full, the
+ * store is compacted first. If the live keys leave no room for the
+ * record even then, KV_ERR_NO_SPACE_LEFT is returned without
+ * compacting.
+ *
+ * @param key The key, a string of up to KV_KEY_LENGTH characters.
+ * @param value The value bytes.
+ * @param len The value size, up to KV_VALUE_MAX bytes.
+ * @return A @a kv_err_t describing the outcome of the operation.
+ */
+kv_err_t nx_kv_set(const char *key, const void *value, size_t len);
+
+/** Remove a key from the store.
+ *
+ * This works even when the store is full: if there is no room left to
+ * record the removal, the store is compacted without the key.
+ *
+ * @param key The key to remove.
+ * @return A @a kv_err_t describing the outcome of the operation.
+ */
+kv_err_t nx_kv_delete(const char *key);
+
+/** Get a key of the store. Keys are numbered from 0, in no particular
+ * order.
+ *
+ * @param n The number of the key.
+ * @param key A buffer of KV_KEY_LENGTH + 1 bytes receiving the key.
+ * @return KV_ERR_KEY_NOT_FOUND if there are @a n keys or less.
+ */
+kv_err_t nx_kv_get_key(U32 n, char *key);
+
+/** Get the store statistics. Values are returned to the provided
+ * pointers, if they are not NULL.
+ *
+ * @param keys The number of keys.
+ * @param free_bytes The room left in the active bank.
+ * @param compactions The number of compactions since boot.
+ */
+void nx_kv_get_stats(U32 *keys, U32 *free_bytes, U32 *compactions);
+
+/*@}*/
+/*@}*/
+
+#endif /* __NXOS_BASE_LIB_KV_H__ */
@@ -0,0 +1,228 @@
+/* Copyright (c) 2008 the NxOS developers
+ *
+ * See AUTHORS for a full list of the developers.
+ *
+ * Redistribution of this file is permitted under
+ * the terms of the GNU Public License (GPL) version 2.
+ */
+
+#include "base/types.h"
+#include "base/assert.h"
+#include "base/util.h"
+
+#include "base/lib/lz/lz.h"
+
+/* Returns the encoder's byte at stream position @a pos. */
+#define LZ_BYTE(enc, pos) ((enc)->buffer[(pos) & (LZ_BUFFER_SIZE - 1)])
+
+void nx_lz_encoder_init(lz_encoder_t *enc, lz_output_t output, void *arg) {
+  NX_ASSERT(output != NULL);
+
+  memset(enc->hash, 0, sizeof(enc->hash));
+  enc->pos = enc->end = 0;
+  enc->group_len = 1;
+  enc->items = 0;
+  enc->failed = FALSE;
+  enc->group[0] = 0;
+  enc->output = output;
+  enc->arg = arg;
+}
+
+/* Hash the 3 bytes at stream position @a pos. */
+static U32 nx_lz_hash(lz_encoder_t *enc, U32 pos) {
+  U32 key = LZ_BYTE(enc, pos) << 16 | LZ_BYTE(enc, pos + 1) << 8 |
+    LZ_BYTE(enc, pos + 2);
+
+  return (U32)(key * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Record the 3 bytes at @a pos in the hash table, and returns the
+ * position the last ones with the same hash were at.
+ */
+static U32 nx_lz_hash_insert(lz_encoder_t *enc, U32 pos) {
+  U32 hash = nx_lz_hash(enc, pos);
+  U32 last = pos - (U16)(pos - enc->hash[hash]);
+
+  enc->hash[hash] = pos;
+  return last;
+}
+
+/* Add an item to the group, outputting it once full. */
+static bool nx_lz_emit(lz_encoder_t *enc, bool reference, U32 value) {
+  if (reference) {
+    enc->group[0] |= 1 << enc->items;
+    enc->group[enc->group_len++] = value & 0xFF;
+    enc->group[enc->group_len++] = value >> 8;
+  } else {
+    enc->group[enc->group_len++] = value;
+  }
+
+  if (++enc->items < 8) {
+    return TRUE;
+  }
+
+  /* The group is started over even if the output fails, so that it
+   * never overflows. The stream is broken anyway: the encoder then
+   * refuses to go on.
+   */
+  enc->items = 0;
+  if (!enc->output(enc->arg, enc->group, enc->group_len)) {
+    enc->failed = TRUE;
+  }
+
+  enc->group[0] = 0;
+  enc->group_len = 1;
+  return !enc->failed;
+}
+
+/* Encode the item at the encoder's position. */
+static bool nx_lz_encode_item(lz_encoder_t *enc) {
+  U32 avail = MIN(enc->end - enc->pos, LZ_MATCH_MAX);
+  U32 len = 0, distance = 0, last, i;
+
+  if (avail >= LZ_MATCH_MIN) {
+    last = nx_lz_hash_insert(enc, enc->pos);
+    distance = enc->pos - last;
+
+    /* The hash table only keeps the low bits of the positions, and
+     * entries may be stale: the candidate is checked byte by byte, as
+     * long as it is still in the window.
+     */
+    if (distance > 0 && distance <= LZ_WINDOW_SIZE && distance <= enc->pos) {
+      while (len < avail &&
+             LZ_BYTE(enc, last + len) == LZ_BYTE(enc, enc->pos + len)) {
+        len++;
+      }
+    }
+  }
+
+  if (len < LZ_MATCH_MIN) {
+    enc->pos++;
+    return nx_lz_emit(enc, FALSE, LZ_BYTE(enc, enc->pos - 1));
+  }
+
+  /* The matched bytes go to the hash table too, so that later matches
+   * can start in them.
+   */
+  for (i=1; i<len && enc->pos + i + LZ_MATCH_MIN <= enc->end; i++) {
+    nx_lz_hash_insert(enc, enc->pos + i);
+  }
+
+  enc->pos += len;
+  return nx_lz_emit(enc, TRUE, (distance - 1) << LZ_LENGTH_BITS |
+                    (len - LZ_MATCH_MIN));
+}
+
+bool nx_lz_encode(lz_encoder_t *enc, const U8 *data, U32 len) {
+  if (enc->failed) {
+    return FALSE;
+  }
+
+  while (len > 0) {
+    /* Keep the window behind the encoder's position. */
+    while (len > 0 && enc->end - enc->pos < LZ_BUFFER_SIZE - LZ_WINDOW_SIZE) {
+      LZ_BYTE(enc, enc->end) = *data++;
+      enc->end++;
+      len--;
+    }
+
+    /* Only encode with enough bytes ahead for the longest match. */
+    while (enc->end - enc->pos >= LZ_MATCH_MAX) {
+      if (!nx_lz_encode_item(enc)) {
+        return FALSE;
+      }
+    }
+  }
+
+  return TRUE;
+}
+
+bool nx_lz_encode_finish(lz_encoder_t *enc) {
+  if (enc->failed) {
+    return FALSE;
+  }
+
+  while (enc->pos < enc->end) {
+    if (!nx_lz_encode_item(enc)) {
+      return FALSE;
+    }
+  }
+
+  if (enc->items == 0) {
+    return TRUE;
+  }
+
+  enc->items = 0;
+  if (!enc->output(enc->arg, enc->group, enc->group_len)) {
+    enc->failed = TRUE;
+  }
+
+  return !enc->failed;
+}
+
+void nx_lz_decoder_init(lz_decoder_t *dec, lz_input_t input, void *arg) {
+  NX_ASSERT(input != NULL);
+
+  dec->pos = 0;
+  dec->flags = dec->items = 0;
+  dec->copy_len = dec->copy_distance = 0;
+  dec->input = input;
+  dec->arg = arg;
+}
+
+bool nx_lz_decode(lz_decoder_t *dec, U8 *data, U32 len, U32 *done) {
+  U32 n = 0;
+  U8 byte, high;
+
+  while (n < len) {
+    if (dec->copy_len > 0) {
+      byte = dec->window[(dec->pos - dec->copy_distance) &
+                         (LZ_WINDOW_SIZE - 1)];
+      dec->copy_len--;
+    } else {
+      if (dec->items == 0) {
+        if (!dec->input(dec->arg, &(dec->flags))) {
+          break;
+        }
+
+        dec->items = 8;
+      }
+
+      dec->items--;
+
+      /* The end of the stream can only come in place of an item. */
+      if (!dec->input(dec->arg, &byte)) {
+        break;
+      }
+
+      if (dec->flags & 1) {
+        dec->flags >>= 1;
+
+        if (!dec->input(dec->arg, &high)) {
+          *done = n;
+          return FALSE;
+        }
+
+        dec->copy_distance = (high << 8 | byte) >> LZ_LENGTH_BITS;
+        dec->copy_distance++;
+        dec->copy_len = (byte & ((1 << LZ_LENGTH_BITS) - 1)) + LZ_MATCH_MIN;
+
+        if (dec->copy_distance > dec->pos) {
+          *done = n;
+          return FALSE;
+        }
+
+        continue;
+      }
+
+      dec->flags >>= 1;
+    }
+
+    dec->window[dec->pos & (LZ_WINDOW_SIZE - 1)] = byte;
+    dec->pos++;
+    data[n++] = byte;
+  }
+
+  *done = n;
+  return TRUE;
+}
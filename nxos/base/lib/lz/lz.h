@@ -0,0 +1,159 @@
+/** @file lz.h
+ *  @brief Streaming LZ compression.
+ *
+ * A small LZSS codec, with a bounded window, for streams that are
+ * produced and consumed a little at a time.
+ */
+
+/* Copyright (c) 2008 the NxOS developers
+ *
+ * See AUTHORS for a full list of the developers.
+ *
+ * Redistribution of this file is permitted under
+ * the terms of the GNU Public License (GPL) version 2.
+ */
+
+#ifndef __NXOS_BASE_LIB_LZ_H__
+#define __NXOS_BASE_LIB_LZ_H__
+
+#include "base/types.h"
+
+/** @addtogroup lib */
+/*@{*/
+
+/** @defgroup lz LZ compression
+ *
+ * The compressed stream is a sequence of groups, each made of a flag
+ * byte followed by up to 8 items. Bit @a n of the flag byte tells
+ * whether the item @a n is a literal byte, or a 2 bytes (little
+ * endian) reference to earlier data: the low LZ_LENGTH_BITS bits hold
+ * the match length minus LZ_MATCH_MIN, and the other bits the match
+ * distance minus 1. Only the last group may be short.
+ *
+ * Matches reach back LZ_WINDOW_SIZE bytes at most, which bounds the
+ * RAM both sides need. The encoder looks a match up with a single
+ * hash probe, so it is fast rather than thorough.
+ */
+/*@{*/
+
+/** Bits of a reference holding the match length. */
+#define LZ_LENGTH_BITS 7
+
+/** Shortest match worth a reference. */
+#define LZ_MATCH_MIN 3
+
+/** Longest match a reference can hold. */
+#define LZ_MATCH_MAX (LZ_MATCH_MIN + (1 << LZ_LENGTH_BITS) - 1)
+
+/** How far back references can reach. */
+#define LZ_WINDOW_SIZE (1 << (16 - LZ_LENGTH_BITS))
+
+/** Encoder buffer size, holding the window and the bytes yet to be
+ * encoded.
+ */
+#define LZ_BUFFER_SIZE (2 * LZ_WINDOW_SIZE)
+
+/** Number of encoder hash table entries, as a power of 2. */
+#define LZ_HASH_BITS 8
+
+/** Number of encoder hash table entries. */
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+/** Compressed output callback.
+ *
+ * @param arg The encoder's callback argument.
+ * @param data The compressed bytes.
+ * @param len The number of bytes.
+ * @return FALSE to stop the encoder.
+ */
+typedef bool (*lz_output_t)(void *arg, const U8 *data, U32 len);
+
+/** Compressed input callback.
+ *
+ * @param arg The decoder's callback argument.
+ * @param byte Where to store the next compressed byte.
+ * @return FALSE at the end of the stream.
+ */
+typedef bool (*lz_input_t)(void *arg, U8 *byte);
+
+/** Encoder state. */
+typedef struct {
+  U8 buffer[LZ_BUFFER_SIZE]; /**< Recent and pending bytes, by stream
+                              * position modulo the buffer size. */
+  U16 hash[LZ_HASH_SIZE];    /**< Last stream position (low bits) of
+                              * each 3 bytes hash. */
+  U32 pos;                   /**< Stream position of the next byte to
+                              * encode. */
+  U32 end;                   /**< Stream position past the last byte
+                              * received. */
+  U8 group[1 + 2 * 8];       /**< Group being built. */
+  U8 group_len;              /**< Bytes in the group. */
+  U8 items;                  /**< Items in the group. */
+  bool failed;               /**< Has the output callback failed? */
+  lz_output_t output;        /**< Compressed output. */
+  void *arg;                 /**< Output callback argument. */
+} lz_encoder_t;
+
+/** Decoder state. */
+typedef struct {
+  U8 window[LZ_WINDOW_SIZE]; /**< Recent output, by stream position
+                              * modulo the window size. */
+  U32 pos;                   /**< Number of bytes decoded. */
+  U8 flags;                  /**< Item kinds left in the group. */
+  U8 items;                  /**< Items left in the group. */
+  U16 copy_len;              /**< Bytes left to copy from the
+                              * current reference. */
+  U16 copy_distance;         /**< Distance of the current reference. */
+  lz_input_t input;          /**< Compressed input. */
+  void *arg;                 /**< Input callback argument. */
+} lz_decoder_t;
+
+/** Start a compressed stream.
+ *
+ * @param enc The encoder state.
+ * @param output The callback receiving the compressed bytes.
+ * @param arg The callback argument.
+ */
+void nx_lz_encoder_init(lz_encoder_t *enc, lz_output_t output, void *arg);
+
+/** Compress bytes. They are kept until enough follow them to look for
+ * a match, and compressed groups are output as they are completed.
+ *
+ * @param enc The encoder state.
+ * @param data The bytes to compress.
+ * @param len The number of bytes.
+ * @return FALSE if the output callback failed, now or before.
+ */
+bool nx_lz_encode(lz_encoder_t *enc, const U8 *data, U32 len);
+
+/** End a compressed stream, compressing and outputting everything
+ * still pending.
+ *
+ * @param enc The encoder state.
+ * @return FALSE if the output callback failed, now or before.
+ */
+bool nx_lz_encode_finish(lz_encoder_t *enc);
+
+/** Start reading a compressed stream.
+ *
+ * @param dec The decoder state.
+ * @param input The callback providing the compressed bytes.
+ * @param arg The callback argument.
+ */
+void nx_lz_decoder_init(lz_decoder_t *dec, lz_input_t input, void *arg);
+
+/** Decompress bytes.
+ *
+ * @param dec The decoder state.
+ * @param data The buffer to decompress to.
+ * @param len The size of the buffer.
+ * @param done The number of bytes decompressed, which is less than
+ * @a len at the end of the stream.
+ * @return FALSE if the stream is corrupted.
+ */
+bool nx_lz_decode(lz_decoder_t *dec, U8 *data, U32 len, U32 *done);
+
+/*@}*/
+/*@}*/
+
+#endif /* __NXOS_BASE_LIB_LZ_H__ */
@@ -12,6 +12,9 @@
 #include "base/util.h"
 
 #include "base/lib/memalloc/memalloc.h"
+#ifdef NX_MEMALLOC_TRACE
+#include "base/lib/tracing/tracing.h"
+#endif
 
 /* This is really ugly and I should be taken out and shot for even doing
  * it. But as far as I can tell, GNU ld doesn't do link-time inlining,
@@ -22,14 +25,118 @@
 #define printf(fmt, ...) /* Nothing, we don't printf. */
 #include "base/lib/memalloc/_tlsf.c.inc"
 
+#ifdef NX_MEMALLOC_STATS
+
+#if REAL_FLI != MEMALLOC_STATS_CLASSES
+#error "The free block histogram must have one entry per TLSF class"
+#endif
+
+/* The accounting kept as the allocator runs. The free block figures
+ * are only computed when the accounting is retrieved.
+ */
+static memalloc_stats_t memalloc_stats;
+
+/* Account for an allocation of @a size bytes, requested from @a caller. */
+static void nx_memalloc_account(void *caller, U32 size) {
+  memalloc_caller_stats_t *entry;
+  U32 used = get_used_size(mp), i;
+
+  memalloc_stats.allocs++;
+  if (used > memalloc_stats.peak)
+    memalloc_stats.peak = used;
+
+  /* The last entry takes the callers there is no room for. */
+  for (i=0; i<MEMALLOC_STATS_CALLERS - 1; i++) {
+    entry = &memalloc_stats.callers[i];
+    if (entry->caller == caller || entry->caller == NULL)
+      break;
+  }
+
+  entry = &memalloc_stats.callers[i];
+  if (i < MEMALLOC_STATS_CALLERS - 1)
+    entry->caller = caller;
+  entry->allocs++;
+  entry->bytes += size;
+}
+
+#define MEMALLOC_ACCOUNT_ALLOC(size) \
+  nx_memalloc_account(__builtin_return_address(0), size)
+#define MEMALLOC_ACCOUNT_FREE(ptr) \
+  do { if (ptr) memalloc_stats.frees++; } while (0)
+
+#else
+
+#define MEMALLOC_ACCOUNT_ALLOC(size)
+#define MEMALLOC_ACCOUNT_FREE(ptr)
+
+#endif /* NX_MEMALLOC_STATS */
+
+#ifdef NX_MEMALLOC_TRACE
+
+static bool memalloc_tracing = FALSE;
+
+/* The size of the main pool, recorded when tracing starts. */
+static U32 memalloc_pool_size = 0;
+
+/* Append an operation to the trace, stopping when it is full rather
+ * than failing on the tracer's assertion.
+ */
+static void nx_memalloc_trace_add(memalloc_trace_op_t op, U32 size,
+                                  U32 ptr, U32 old) {
+  memalloc_trace_record_t record;
+
+  if (!memalloc_tracing)
+    return;
+
+  if (nx_tracing_get_free() < sizeof(record)) {
+    memalloc_tracing = FALSE;
+    return;
+  }
+
+  record.op = op;
+  record.size = size;
+  record.ptr = ptr;
+  record.old = old;
+  nx_tracing_add_data((U8*)&record, sizeof(record));
+}
+
+#define MEMALLOC_TRACE(op, size, ptr, old) \
+  nx_memalloc_trace_add(op, size, (U32)(ptr), (U32)(old))
+
+void nx_memalloc_trace(bool enable) {
+  memalloc_tracing = enable;
+  if (enable)
+    nx_memalloc_trace_add(MEMALLOC_TRACE_START, memalloc_pool_size,
+                          get_used_size(mp), 0);
+}
+
+#else
+
+#define MEMALLOC_TRACE(op, size, ptr, old)
+
+#endif /* NX_MEMALLOC_TRACE */
+
 inline void nx_memalloc_init_full(void *mem_pool, U32 mem_pool_size) {
   size_t size = init_memory_pool(mem_pool_size, mem_pool);
   NX_ASSERT_MSG(size > 0, "Failed to init\nmemory allocator");
+
+#ifdef NX_MEMALLOC_STATS
+  memset(&memalloc_stats, 0, sizeof(memalloc_stats));
+  memalloc_stats.peak = get_used_size(mp);
+#endif
+#ifdef NX_MEMALLOC_TRACE
+  memalloc_pool_size = mem_pool_size;
+#endif
 }
 
+/* Host builds have no userspace region, they provide their own pool
+ * to nx_memalloc_init_full().
+ */
+#ifndef NX_HOST_BUILD
 void nx_memalloc_init(void) {
   nx_memalloc_init_full(NX_USERSPACE_START, NX_USERSPACE_SIZE);
 }
+#endif
 
 U32 nx_memalloc_used(void) {
   return get_used_size(mp);
@@ -42,21 +149,125 @@ void nx_memalloc_destroy(void) {
 void *nx_malloc(U32 size) {
   void *ret = malloc_ex(size, mp);
   NX_ASSERT_MSG(ret != NULL, "Out of memory");
+  MEMALLOC_ACCOUNT_ALLOC(size);
+  MEMALLOC_TRACE(MEMALLOC_TRACE_MALLOC, size, ret, NULL);
   return ret;
 }
 
 void *nx_calloc(U32 nelem, U32 elem_size) {
   void *ret = calloc_ex(nelem, elem_size, mp);
   NX_ASSERT_MSG(ret != NULL, "Out of memory");
+  MEMALLOC_ACCOUNT_ALLOC(nelem * elem_size);
+  MEMALLOC_TRACE(MEMALLOC_TRACE_CALLOC, nelem * elem_size, ret, NULL);
   return ret;
 }
 
 void *nx_realloc(void *ptr, U32 size) {
   void *ret = realloc_ex(ptr, size, mp);
   NX_ASSERT_MSG(ret != NULL, "Out of memory");
+  MEMALLOC_ACCOUNT_ALLOC(size);
+  MEMALLOC_TRACE(MEMALLOC_TRACE_REALLOC, size, ret, ptr);
   return ret;
 }
 
 void nx_free(void *ptr) {
+  MEMALLOC_ACCOUNT_FREE(ptr);
+  MEMALLOC_TRACE(MEMALLOC_TRACE_FREE, 0, ptr, NULL);
   free_ex(ptr, mp);
 }
+
+#ifdef NX_MEMALLOC_STATS
+void nx_memalloc_get_stats(memalloc_stats_t *stats) {
+  tlsf_t *tlsf = (tlsf_t *)mp;
+  bhdr_t *b;
+  int fl, sl;
+
+  if (mp == NULL) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+
+  memcpy(stats, &memalloc_stats, sizeof(*stats));
+  stats->used = get_used_size(mp);
+  stats->largest_free = 0;
+
+  /* Walk the free lists the bitmaps say are not empty. */
+  for (fl=0; fl<REAL_FLI; fl++) {
+    stats->free_blocks[fl] = 0;
+    if (!(tlsf->fl_bitmap & (1 << fl)))
+      continue;
+
+    for (sl=0; sl<MAX_SLI; sl++) {
+      if (!(tlsf->sl_bitmap[fl] & (1 << sl)))
+        continue;
+
+      for (b = tlsf->matrix[fl][sl]; b != NULL; b = b->ptr.free_ptr.next) {
+        stats->free_blocks[fl]++;
+        stats->largest_free = MAX(stats->largest_free, b->size & BLOCK_SIZE);
+      }
+    }
+  }
+}
+#endif
+
+/* TLSF arenas are pools of their own. Setting one up makes it TLSF's
+ * default pool, which must remain the main pool.
+ */
+static void nx_arena_init_tlsf(arena_t *arena) {
+  char *main_pool = mp;
+  size_t size;
+
+  destroy_memory_pool(arena->start);
+  size = init_memory_pool(arena->size, arena->start);
+  mp = main_pool;
+
+  NX_ASSERT_MSG(size > 0 && size != (size_t)-1, "Failed to init\narena");
+}
+
+void nx_arena_init(arena_t *arena, const char *name, arena_kind_t kind,
+                   void *mem, U32 mem_size) {
+  NX_ASSERT(((unsigned long)mem & PTR_MASK) == 0);
+
+  arena->name = name;
+  arena->kind = kind;
+  arena->start = mem;
+  arena->size = mem_size;
+  nx_arena_reset(arena);
+}
+
+void *nx_arena_alloc(arena_t *arena, U32 size) {
+  U32 left = arena->size - (U32)(arena->top - arena->start);
+  void *ret = NULL;
+
+  if (arena->kind == ARENA_TLSF) {
+    ret = malloc_ex(size, arena->start);
+  } else if (ROUNDUP_SIZE(size) <= left) {
+    ret = arena->top;
+    arena->top += ROUNDUP_SIZE(size);
+  }
+
+  NX_ASSERT_MSG(ret != NULL, "Out of arena\nmemory");
+  return ret;
+}
+
+void nx_arena_free(arena_t *arena, void *ptr) {
+  if (arena->kind == ARENA_TLSF)
+    free_ex(ptr, arena->start);
+}
+
+void nx_arena_reset(arena_t *arena) {
+  if (arena->kind == ARENA_TLSF) {
+    nx_arena_init_tlsf(arena);
+  } else {
+    /* The first block is aligned like the following ones. */
+    arena->top = arena->start + (-(unsigned long)arena->start & MEM_ALIGN);
+    NX_ASSERT(arena->top <= arena->start + arena->size);
+  }
+}
+
+U32 nx_arena_used(arena_t *arena) {
+  if (arena->kind == ARENA_TLSF)
+    return get_used_size(arena->start);
+
+  return arena->top - arena->start;
+}
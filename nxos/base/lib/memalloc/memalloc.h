@@ -31,6 +31,20 @@
  * other functions of the allocator assume that the allocator is
  * initialized.
  *
+ * Besides the main pool, memory can be handed out from arenas, each
+ * over its own region of memory. An arena can be reset in constant
+ * time, releasing all its blocks at once: a scratch arena reset at
+ * every iteration of a control loop replaces freeing its blocks one by
+ * one.
+ *
+ * When the system is built with @a NX_MEMALLOC_STATS defined (@c scons
+ * @c memstats=1), the allocator also keeps usage accounting for the
+ * main pool, see nx_memalloc_get_stats(). Without it, the accounting
+ * compiles out entirely. Likewise, @a NX_MEMALLOC_TRACE (@c scons @c
+ * memtrace=1) builds in a recorder that logs the main pool's
+ * operations to the data tracer, for the host's @c memreplay tool to
+ * replay.
+ *
  * @warning The memory allocator is @b not safe for concurrent
  * access. You must provide your own locking around it if you are
  * going to use it from concurrent contexts. Also be aware that this
@@ -133,6 +147,182 @@ void nx_free(void *ptr);
 
 /*@}*/
 
+/** @name Arenas */
+/*@{*/
+
+/** Kinds of arenas. */
+typedef enum {
+  ARENA_TLSF = 0, /**< A TLSF pool, whose blocks can be freed one by
+                   * one. The pool's bookkeeping takes about 3kB of the
+                   * arena's memory. */
+  ARENA_BUMP,     /**< A bump pointer region. Blocks are carved one
+                   * after the other, and only released by resetting
+                   * the arena. */
+} arena_kind_t;
+
+/** An arena. */
+typedef struct {
+  const char *name;  /**< Name of the arena, for reports. */
+  arena_kind_t kind; /**< Kind of the arena. */
+  U8 *start;         /**< Start of the arena's memory. */
+  U32 size;          /**< Size of the arena's memory. */
+  U8 *top;           /**< First free byte of a bump arena. */
+} arena_t;
+
+/** Create an arena over @a mem_size bytes at @a mem.
+ *
+ * @param arena The arena to create.
+ * @param name The name of the arena.
+ * @param kind The kind of arena.
+ * @param mem The memory the arena hands out, word aligned. It may come
+ * from nx_malloc().
+ * @param mem_size The size of the memory.
+ */
+void nx_arena_init(arena_t *arena, const char *name, arena_kind_t kind,
+                   void *mem, U32 mem_size);
+
+/** Allocate a block of @a size bytes from @a arena.
+ *
+ * @param arena The arena.
+ * @param size The number of bytes to allocate.
+ * @return A pointer to the block, 8 bytes aligned. Its content is
+ * undefined.
+ */
+void *nx_arena_alloc(arena_t *arena, U32 size);
+
+/** Return a block to @a arena.
+ *
+ * Blocks of bump arenas are only released by nx_arena_reset(), so this
+ * does nothing for them.
+ *
+ * @param arena The arena the block was allocated from.
+ * @param ptr A pointer returned by nx_arena_alloc(), or NULL.
+ */
+void nx_arena_free(arena_t *arena, void *ptr);
+
+/** Release all the blocks of @a arena at once.
+ *
+ * The cost of a reset does not depend on the number of blocks, nor on
+ * the size of the arena. None of the arena's blocks may be used
+ * afterwards.
+ *
+ * @param arena The arena.
+ */
+void nx_arena_reset(arena_t *arena);
+
+/** Return the amount of memory used in @a arena.
+ *
+ * @param arena The arena.
+ * @return The amount of memory used, in bytes, overhead included.
+ */
+U32 nx_arena_used(arena_t *arena);
+
+/*@}*/
+
+#ifdef NX_MEMALLOC_STATS
+
+/** @name Usage accounting
+ *
+ * Only available when @a NX_MEMALLOC_STATS is defined.
+ */
+/*@{*/
+
+/** Number of TLSF size classes in the free block histogram. */
+#define MEMALLOC_STATS_CLASSES 24
+
+/** Number of callers the accounting keeps apart. */
+#define MEMALLOC_STATS_CALLERS 16
+
+/** Allocations made from one call site. */
+typedef struct {
+  void *caller; /**< Return address of the allocation call. */
+  U32 allocs;   /**< Number of allocations. */
+  U32 bytes;    /**< Number of bytes requested. */
+} memalloc_caller_stats_t;
+
+/** Usage accounting of the main pool. */
+typedef struct {
+  U32 used;         /**< Memory used, as nx_memalloc_used(). */
+  U32 peak;         /**< Highest memory use since the allocator was
+                     * initialized. */
+  U32 largest_free; /**< Size of the largest free block, which bounds
+                     * the largest allocation that can succeed. */
+  U32 allocs;       /**< Number of allocations. */
+  U32 frees;        /**< Number of blocks freed. */
+  U32 free_blocks[MEMALLOC_STATS_CLASSES]; /**< Number of free blocks
+                     * by TLSF size class. Class 0 holds blocks under
+                     * 128 bytes, and class @a n the blocks of
+                     * 2^(n+6) to 2^(n+7)-1 bytes. */
+  memalloc_caller_stats_t callers[MEMALLOC_STATS_CALLERS]; /**<
+                     * Allocations by call site, in order of first
+                     * allocation. Unused entries have a NULL caller,
+                     * and the last entry adds up the call sites the
+                     * others had no room for. */
+} memalloc_stats_t;
+
+/** Retrieve the usage accounting of the main pool.
+ *
+ * The free block figures are computed by walking the free blocks, so
+ * this takes time in proportion to their number.
+ *
+ * @param stats Where to store the accounting. It is zeroed if the
+ * allocator is not initialized.
+ */
+void nx_memalloc_get_stats(memalloc_stats_t *stats);
+
+/*@}*/
+
+#endif /* NX_MEMALLOC_STATS */
+
+/** @name Operation tracing
+ *
+ * The recorder is only available when @a NX_MEMALLOC_TRACE is
+ * defined. The trace format is always defined, for the tools reading
+ * traces.
+ */
+/*@{*/
+
+/** Traced operations. */
+typedef enum {
+  MEMALLOC_TRACE_START = 0, /**< Tracing started: @a size is the size
+                             * of the pool, @a ptr the amount of it
+                             * used. */
+  MEMALLOC_TRACE_MALLOC,    /**< nx_malloc(size) returned @a ptr. */
+  MEMALLOC_TRACE_CALLOC,    /**< nx_calloc() of @a size bytes in all
+                             * returned @a ptr. */
+  MEMALLOC_TRACE_REALLOC,   /**< nx_realloc(old, size) returned @a
+                             * ptr. */
+  MEMALLOC_TRACE_FREE,      /**< nx_free(ptr). */
+} memalloc_trace_op_t;
+
+/** A trace record, as stored in the trace in the brick's (little
+ * endian) byte order.
+ */
+typedef struct {
+  U32 op;   /**< The operation, a memalloc_trace_op_t. */
+  U32 size; /**< The size requested. */
+  U32 ptr;  /**< The address of the block allocated or freed. */
+  U32 old;  /**< The address of the block reallocated. */
+} memalloc_trace_record_t;
+
+#ifdef NX_MEMALLOC_TRACE
+
+/** Start or stop recording the main pool's operations.
+ *
+ * The records are appended to the data tracer, which must be
+ * initialized first. Recording stops by itself when the trace buffer
+ * is full. Blocks allocated before recording starts are unknown to
+ * the replay, so it is best started right after the allocator is
+ * initialized, with the trace buffer allocated elsewhere.
+ *
+ * @param enable TRUE to start recording, FALSE to stop.
+ */
+void nx_memalloc_trace(bool enable);
+
+#endif /* NX_MEMALLOC_TRACE */
+
+/*@}*/
+
 /*@}*/
 /*@}*/
 
@@ -0,0 +1,185 @@
+/* Copyright (c) 2008 the NxOS developers
+ *
+ * See AUTHORS for a full list of the developers.
+ *
+ * Redistribution of this file is permitted under
+ * the terms of the GNU Public License (GPL) version 2.
+ */
+
+#include "base/types.h"
+#include "base/assert.h"
+#include "base/util.h"
+#include "base/interrupts.h"
+#include "base/lib/memalloc/memalloc.h"
+
+#include "base/lib/memalloc/pool.h"
+
+/* A block of objects added by nx_pool_grow(). Its objects follow it. */
+struct pool_extra {
+  struct pool_extra *next;
+  U32 class; /* The index of the class the objects belong to. */
+  U32 count; /* The number of objects. */
+};
+
+/* Return the class @a ptr was allocated from, or NULL. Must be called
+ * with interrupts disabled.
+ */
+static pool_class_t *pool_find_class(pool_t *pool, U8 *ptr) {
+  struct pool_extra *extra;
+  U32 i;
+
+  /* The classes are contiguous, the object's address tells its class. */
+  for (i=0; i<pool->classes; i++) {
+    pool_class_t *class = &pool->class[i];
+
+    if (ptr >= class->start &&
+        ptr < class->start + class->size * class->count)
+      return class;
+  }
+
+  for (extra = pool->extra; extra != NULL; extra = extra->next) {
+    pool_class_t *class = &pool->class[extra->class];
+    U8 *start = (U8*)(extra + 1);
+
+    if (ptr >= start && ptr < start + class->size * extra->count)
+      return class;
+  }
+
+  return NULL;
+}
+
+void nx_pool_init(pool_t *pool, const U32 *sizes, const U32 *counts,
+                  U32 classes) {
+  U32 total = 0, i, j;
+  U8 *ptr;
+
+  NX_ASSERT(classes > 0 && classes <= POOL_MAX_CLASSES);
+
+  for (i=0; i<classes; i++) {
+    pool_class_t *class = &pool->class[i];
+
+    /* Free objects hold the list link, and must stay word aligned. */
+    class->size = (MAX(sizes[i], sizeof(void*)) + 3) & ~3;
+    class->count = counts[i];
+    NX_ASSERT(i == 0 || class->size >= pool->class[i-1].size);
+    total += class->size * class->count;
+  }
+
+  pool->block = nx_malloc(total);
+  pool->classes = classes;
+  pool->extra = NULL;
+
+  /* Carve the classes one after the other from the block. */
+  ptr = pool->block;
+  for (i=0; i<classes; i++) {
+    pool_class_t *class = &pool->class[i];
+
+    class->start = ptr;
+    class->available = class->count;
+    class->free = NULL;
+    for (j=0; j<class->count; j++) {
+      *(void**)ptr = class->free;
+      class->free = ptr;
+      ptr += class->size;
+    }
+  }
+}
+
+void *nx_pool_alloc(pool_t *pool, U32 size) {
+  void *ptr = NULL;
+  U32 i;
+
+  nx_interrupts_disable();
+
+  for (i=0; i<pool->classes; i++) {
+    pool_class_t *class = &pool->class[i];
+
+    if (class->size >= size && class->free != NULL) {
+      ptr = class->free;
+      class->free = *(void**)ptr;
+      class->available--;
+      break;
+    }
+  }
+
+  nx_interrupts_enable();
+
+  return ptr;
+}
+
+void nx_pool_free(pool_t *pool, void *ptr) {
+  pool_class_t *class;
+
+  if (ptr == NULL)
+    return;
+
+  nx_interrupts_disable();
+
+  class = pool_find_class(pool, ptr);
+  if (class != NULL) {
+    *(void**)ptr = class->free;
+    class->free = ptr;
+    class->available++;
+  }
+
+  nx_interrupts_enable();
+
+  NX_ASSERT_MSG(class != NULL, "Object not\nfrom pool");
+}
+
+void nx_pool_grow(pool_t *pool, U32 size, U32 count) {
+  struct pool_extra *extra;
+  pool_class_t *class;
+  U8 *ptr;
+  U32 i;
+
+  for (i=0; i<pool->classes && pool->class[i].size < size; i++);
+  NX_ASSERT(i < pool->classes && count > 0);
+  class = &pool->class[i];
+
+  extra = nx_malloc(sizeof(*extra) + class->size * count);
+  extra->class = i;
+  extra->count = count;
+
+  /* Chain the new objects first, so that interrupts are only disabled
+   * to splice them into the free list.
+   */
+  ptr = (U8*)(extra + 1);
+  for (i=1; i<count; i++) {
+    *(void**)ptr = ptr + class->size;
+    ptr += class->size;
+  }
+
+  nx_interrupts_disable();
+  *(void**)ptr = class->free;
+  class->free = extra + 1;
+  class->available += count;
+  extra->next = pool->extra;
+  pool->extra = extra;
+  nx_interrupts_enable();
+}
+
+U32 nx_pool_available(pool_t *pool, U32 size) {
+  U32 available = 0, i;
+
+  nx_interrupts_disable();
+  for (i=0; i<pool->classes; i++) {
+    if (pool->class[i].size >= size)
+      available += pool->class[i].available;
+  }
+  nx_interrupts_enable();
+
+  return available;
+}
+
+void nx_pool_destroy(pool_t *pool) {
+  while (pool->extra != NULL) {
+    struct pool_extra *next = pool->extra->next;
+
+    nx_free(pool->extra);
+    pool->extra = next;
+  }
+  nx_free(pool->block);
+  pool->block = NULL;
+  pool->classes = 0;
+}
@@ -0,0 +1,126 @@
+/** @file pool.h
+ *  @brief Fixed-size object pools.
+ */
+
+/* Copyright (c) 2008 the NxOS developers
+ *
+ * See AUTHORS for a full list of the developers.
+ *
+ * Redistribution of this file is permitted under
+ * the terms of the GNU Public License (GPL) version 2.
+ */
+
+#ifndef __NXOS_BASE_LIB_MEMALLOC_POOL_H__
+#define __NXOS_BASE_LIB_MEMALLOC_POOL_H__
+
+#include "base/types.h"
+
+/** @addtogroup lib */
+/*@{*/
+
+/** @defgroup pool Object pools
+ *
+ * An object pool hands out objects of a few fixed sizes, from a single
+ * block taken from the memory allocator when the pool is created. Each
+ * object size, or class, has its own free list, so allocating and
+ * freeing an object is a list push or pop.
+ *
+ * Unlike the memory allocator, a pool is safe for concurrent access:
+ * its free lists are only touched with interrupts disabled, so objects
+ * can be allocated and freed from interrupt handlers.
+ *
+ * A pool that runs out of objects can be given more with
+ * nx_pool_grow(). The new objects come from a separate block, so the
+ * objects already handed out stay where they are.
+ *
+ * @note The memory allocator must be initialized before a pool is
+ * created.
+ */
+/*@{*/
+
+/** Maximum number of object sizes in a pool. */
+#define POOL_MAX_CLASSES 4
+
+/** Free objects of one size. */
+typedef struct {
+  U32 size;      /**< Object size in bytes, a multiple of 4. */
+  U32 count;     /**< Number of objects of the class. */
+  U32 available; /**< Number of free objects. */
+  U8 *start;     /**< First object of the class. */
+  void *free;    /**< Free list, linked through the objects' first
+                  * word. */
+} pool_class_t;
+
+/** Object pool. */
+typedef struct {
+  U8 *block;                             /**< The pool's memory. */
+  U32 classes;                           /**< Number of classes. */
+  pool_class_t class[POOL_MAX_CLASSES];  /**< The classes, by
+                                          * increasing size. */
+  struct pool_extra *extra;              /**< Blocks added by
+                                          * nx_pool_grow(). */
+} pool_t;
+
+/** Create a pool.
+ *
+ * @param pool The pool to create.
+ * @param sizes The object size of each class, in increasing order.
+ * Sizes are rounded up to a multiple of 4 bytes.
+ * @param counts The number of objects of each class.
+ * @param classes The number of classes, at most @a POOL_MAX_CLASSES.
+ */
+void nx_pool_init(pool_t *pool, const U32 *sizes, const U32 *counts,
+                  U32 classes);
+
+/** Allocate an object of at least @a size bytes.
+ *
+ * The object comes from the smallest class it fits in with free
+ * objects left. Its content is undefined.
+ *
+ * @param pool The pool.
+ * @param size The number of bytes needed.
+ * @return A pointer to the object, or NULL if no class can provide it.
+ */
+void *nx_pool_alloc(pool_t *pool, U32 size);
+
+/** Return an object to its pool.
+ *
+ * @param pool The pool the object was allocated from.
+ * @param ptr A pointer returned by nx_pool_alloc(), or NULL.
+ */
+void nx_pool_free(pool_t *pool, void *ptr);
+
+/** Add @a count objects to the smallest class of at least @a size bytes.
+ *
+ * The objects are taken from a new block from the memory allocator,
+ * then added to the class's free list with interrupts disabled. Like
+ * the memory allocator, this must not be called from an interrupt
+ * handler, or concurrently with another allocation.
+ *
+ * @param pool The pool.
+ * @param size The object size. A class of at least that size must exist.
+ * @param count The number of objects to add.
+ *
+ * @note nx_pool_free() looks objects of the grown blocks up in a list,
+ * so grow a pool by large steps rather than one object at a time.
+ */
+void nx_pool_grow(pool_t *pool, U32 size, U32 count);
+
+/** Return the number of free objects of at least @a size bytes.
+ *
+ * @param pool The pool.
+ * @param size The object size.
+ * @return The number of objects nx_pool_alloc() can still provide.
+ */
+U32 nx_pool_available(pool_t *pool, U32 size);
+
+/** Release a pool's memory to the memory allocator.
+ *
+ * @param pool The pool. None of its objects may be used afterwards.
+ */
+void nx_pool_destroy(pool_t *pool);
+
+/*@}*/
+/*@}*/
+
+#endif /* __NXOS_BASE_LIB_MEMALLOC_POOL_H__ */
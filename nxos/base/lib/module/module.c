@@ -0,0 +1,122 @@
+/* Copyright (c) 2008 the NxOS developers
+ *
+ * See AUTHORS for a full list of the developers.
+ *
+ * Redistribution of this file is permitted under
+ * the terms of the GNU Public License (GPL) version 2.
+ */
+
+#include "base/types.h"
+#include "base/assert.h"
+#include "base/util.h"
+#include "base/display.h"
+#include "base/drivers/avr.h"
+#include "base/drivers/motors.h"
+#include "base/drivers/sound.h"
+#include "base/drivers/systick.h"
+#include "base/lib/fs/fs.h"
+
+#include "base/lib/module/module.h"
+
+static const module_api_t module_api = {
+  nx_display_clear,
+  nx_display_string,
+  nx_display_uint,
+  nx_display_end_line,
+  nx_systick_get_ms,
+  nx_systick_wait_ms,
+  nx_avr_get_button,
+  nx_motors_rotate_angle,
+  nx_motors_stop,
+  nx_sound_freq,
+};
+
+/* Check a mapped module image of @a len bytes. */
+static bool nx_module_header_is_valid(const module_header_t *header,
+                                      size_t len) {
+  U32 entry = header->entry & ~1;
+
+  if (len < sizeof(module_header_t) ||
+      header->magic != MODULE_MAGIC ||
+      header->abi != MODULE_ABI_VERSION ||
+      header->header_size != sizeof(module_header_t) ||
+      header->image_size != len) {
+    return FALSE;
+  }
+
+  /* The entry point must be in the code, and ARM code word aligned. */
+  return entry >= sizeof(module_header_t) && entry < len &&
+    ((header->entry & 1) || (entry & 3) == 0);
+}
+
+module_err_t nx_module_load(char *name, module_t *module) {
+  const U8 *data;
+  size_t len;
+  fs_err_t err;
+
+  NX_ASSERT(module != NULL);
+
+  if (nx_fs_open(name, FS_FILE_MODE_OPEN, &(module->fd)) !=
+      FS_ERR_NO_ERROR) {
+    return MODULE_ERR_FILE_ERROR;
+  }
+
+  if (nx_fs_get_perms(module->fd) != FS_PERM_EXECUTABLE) {
+    nx_fs_close(module->fd);
+    return MODULE_ERR_NOT_EXECUTABLE;
+  }
+
+  /* A single mapping must cover the whole file. */
+  err = nx_fs_mmap(module->fd, &data, &len);
+  if (err != FS_ERR_NO_ERROR || len != nx_fs_get_filesize(module->fd)) {
+    nx_fs_close(module->fd);
+    return err == FS_ERR_NO_ERROR || err == FS_ERR_UNSUPPORTED_MODE ?
+      MODULE_ERR_NOT_CONTIGUOUS : MODULE_ERR_FILE_ERROR;
+  }
+
+  module->header = (const module_header_t *)data;
+  if (!nx_module_header_is_valid(module->header, len)) {
+    nx_fs_close(module->fd);
+    return MODULE_ERR_BAD_HEADER;
+  }
+
+  return MODULE_ERR_NO_ERROR;
+}
+
+module_err_t nx_module_run(module_t *module, void *ram, U32 ram_size,
+                           const char *args, S32 *status) {
+  const U8 *image = (const U8 *)module->header;
+  module_entry_t entry;
+  module_env_t env;
+  S32 ret;
+
+  if (module->header->ram_size > ram_size) {
+    return MODULE_ERR_NOT_ENOUGH_RAM;
+  }
+
+  if (ram_size > 0) {
+    memset(ram, 0, ram_size);
+  }
+
+  env.api = &module_api;
+  env.image = image;
+  env.ram = ram;
+  env.ram_size = ram_size;
+  env.args = args ? args : "";
+
+  /* The Thumb bit of the entry offset carries over to the address, so
+   * that calling through the pointer switches state as needed.
+   */
+  entry = (module_entry_t)(image + module->header->entry);
+  ret = entry(&env);
+
+  if (status) {
+    *status = ret;
+  }
+
+  return MODULE_ERR_NO_ERROR;
+}
+
+void nx_module_unload(module_t *module) {
+  nx_fs_close(module->fd);
+}
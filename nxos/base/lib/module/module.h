@@ -0,0 +1,165 @@
+/** @file module.h
+ *  @brief Execute-in-place modules.
+ *
+ * Run position-independent code stored in the flash file system.
+ */
+
+/* Copyright (c) 2008 the NxOS developers
+ *
+ * See AUTHORS for a full list of the developers.
+ *
+ * Redistribution of this file is permitted under
+ * the terms of the GNU Public License (GPL) version 2.
+ */
+
+#ifndef __NXOS_BASE_LIB_MODULE_H__
+#define __NXOS_BASE_LIB_MODULE_H__
+
+#include "base/types.h"
+#include "base/drivers/avr.h"
+#include "base/lib/fs/fs.h"
+
+/** @addtogroup lib */
+/*@{*/
+
+/** @defgroup module Execute-in-place modules
+ *
+ * A module is a file with the @a FS_PERM_EXECUTABLE permission, whose
+ * payload is a module image. The on-board flash is memory-mapped, so a
+ * module stored as a single extent is run right where it lies in the
+ * flash: loading it only checks its header, nothing is copied to RAM.
+ *
+ * A module image starts with a module_header_t, followed by the
+ * module's code and read-only data. The image is linked at address 0
+ * and must be position-independent without any relocation: code and
+ * constants are reached PC-relative (@c -fpie, with the data relative
+ * to the text, and no GOT entries), and the module has no writable
+ * static data. The RAM it needs is given to it by the loader, and the
+ * kernel services it may use are reached through the module_api_t
+ * table, since the module is not linked against the kernel.
+ *
+ * The payload of a file is 8 bytes aligned in the flash, so the image
+ * header and the code it is followed by are word aligned.
+ */
+/*@{*/
+
+/** Module image magic number, "NXMD" in flash byte order. */
+#define MODULE_MAGIC 0x444D584E
+
+/** Version of the entry ABI described by module_header_t,
+ * module_env_t and module_api_t. Modules built for another version are
+ * refused.
+ */
+#define MODULE_ABI_VERSION 1
+
+/** Module errors. */
+typedef enum {
+  MODULE_ERR_NO_ERROR = 0,
+  MODULE_ERR_FILE_ERROR,
+  MODULE_ERR_NOT_EXECUTABLE,
+  MODULE_ERR_NOT_CONTIGUOUS,
+  MODULE_ERR_BAD_HEADER,
+  MODULE_ERR_NOT_ENOUGH_RAM,
+} module_err_t;
+
+/** Module image header, at the start of the file. All offsets are from
+ * the start of the header.
+ */
+typedef struct {
+  U32 magic;       /**< MODULE_MAGIC. */
+  U16 abi;         /**< MODULE_ABI_VERSION. */
+  U16 header_size; /**< sizeof(module_header_t). */
+  U32 entry;       /**< Offset of the entry point. Bit 0 is set for a
+                    * Thumb entry point. */
+  U32 image_size;  /**< Size of the image, header included. */
+  U32 ram_size;    /**< Bytes of RAM the module needs. */
+} module_header_t;
+
+/** Kernel services a module may call. */
+typedef struct {
+  void (*display_clear)(void);
+  void (*display_string)(const char *str);
+  void (*display_uint)(U32 val);
+  void (*display_end_line)(void);
+  U32 (*systick_get_ms)(void);
+  void (*systick_wait_ms)(U32 ms);
+  nx_avr_button_t (*avr_get_button)(void);
+  void (*motors_rotate_angle)(U8 motor, S8 speed, U32 angle, bool brake);
+  void (*motors_stop)(U8 motor, bool brake);
+  void (*sound_freq)(U32 freq, U32 ms);
+} module_api_t;
+
+/** Module environment, given to the module's entry point. */
+typedef struct {
+  const module_api_t *api; /**< The kernel services. */
+  const U8 *image;         /**< Where the module image is mapped. */
+  void *ram;               /**< The module's RAM, zeroed. */
+  U32 ram_size;            /**< Size of the module's RAM. */
+  const char *args;        /**< Arguments string, may be empty. */
+} module_env_t;
+
+/** Module entry point.
+ *
+ * The entry point is called with the AAPCS calling convention, in the
+ * caller's processor mode, and with interrupts as the caller left
+ * them. It receives its environment in r0 and returns a status in r0,
+ * which the loader hands back to its caller. Thumb entry points need a
+ * kernel built with ARM/Thumb interworking.
+ *
+ * @param env The module environment, valid until the entry point
+ * returns.
+ * @return The module's status.
+ */
+typedef S32 (*module_entry_t)(const module_env_t *env);
+
+/** Loaded module. */
+typedef struct {
+  fs_fd_t fd;                    /**< The module file, open while the
+                                  * module is loaded. */
+  const module_header_t *header; /**< The mapped image. */
+} module_t;
+
+/** Load a module.
+ *
+ * The file must have the @a FS_PERM_EXECUTABLE permission, and be
+ * stored as a single extent, not compressed. Its header is checked,
+ * and the module is then run in place by nx_module_run().
+ *
+ * Opening the file for the first time since the file system was
+ * initialized checks its payload against its checksum; later loads
+ * only map it.
+ *
+ * @param name The name of the module file.
+ * @param module The module to load.
+ * @return A @a module_err_t describing the outcome of the operation.
+ */
+module_err_t nx_module_load(char *name, module_t *module);
+
+/** Run a loaded module.
+ *
+ * The module's image stays mapped while it is loaded, which pins its
+ * file: the background defragmentation leaves it where it is, and the
+ * other defragmentation functions refuse to run. The module must still
+ * not write to its own file, which could move it.
+ *
+ * @param module The loaded module.
+ * @param ram The RAM given to the module. It is zeroed first.
+ * @param ram_size The size of @a ram, at least the header's @a
+ * ram_size.
+ * @param args The arguments string passed to the module.
+ * @param status A pointer receiving the module's status. May be NULL.
+ * @return A @a module_err_t describing the outcome of the operation.
+ */
+module_err_t nx_module_run(module_t *module, void *ram, U32 ram_size,
+                           const char *args, S32 *status);
+
+/** Unload a module, closing its file.
+ *
+ * @param module The loaded module.
+ */
+void nx_module_unload(module_t *module);
+
+/*@}*/
+/*@}*/
+
+#endif /* __NXOS_BASE_LIB_MODULE_H__ */
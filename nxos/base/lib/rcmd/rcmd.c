@@ -15,6 +15,7 @@
 #include "base/drivers/sound.h"
 #include "base/drivers/systick.h"
 #include "base/lib/fs/fs.h"
+#include "base/lib/module/module.h"
 #include "base/lib/rcmd/rcmd.h"
 
 static rcmd_err_t nx_rcmd_move(char *line);
@@ -34,6 +35,19 @@ typedef struct {
   rcmd_err_t (* actuator)(char*);
 } rcmd_command_def;
 
+/* State of a file being parsed. The file contents are read in place
+ * from the flash, one extent at a time. Compressed files can not be
+ * mapped, and are read through the buffer instead.
+ */
+typedef struct {
+  fs_fd_t fd;
+  const U8 *data;
+  size_t pos;
+  size_t len;
+  bool buffered;
+  U8 buffer[RCMD_BUF_LEN];
+} rcmd_reader_t;
+
 static rcmd_command_def rcmd_commands[] = {
   { "move",  4, nx_rcmd_move },
   { "print", 2, nx_rcmd_print },
@@ -53,8 +67,12 @@ static char *rcmd_err_str[RCMD_ERR_N_ERRS] = {
   "File I/O error.",
   "Parser reached end of file.",
   "Command not found.",
+  "Module could not run.",
 };
 
+/* RAM of the modules run by exec. Modules run one at a time. */
+static U32 rcmd_module_ram[RCMD_MODULE_RAM / sizeof(U32)];
+
 static void nx_rcmd_tokenize(char *line, char sep, int *ntokens, int *indices) {
   size_t len;
   U32 i;
@@ -204,6 +222,8 @@ static rcmd_err_t nx_rcmd_play(char *line) {
 
 static rcmd_err_t nx_rcmd_exec(char *line) {
   int ntokens, indices[RCMD_MAX_TOKENS];
+  module_t module;
+  module_err_t err;
   char *filename;
 
   nx_rcmd_tokenize(line, RCMD_TOKEN_SEPARATOR, &ntokens, indices);
@@ -214,10 +234,20 @@ static rcmd_err_t nx_rcmd_exec(char *line) {
 
   filename = line + indices[1];
 
-  /* Open the requested file and branch execution. */
-  nx_display_string("exec:");
-  nx_display_string(filename);
-  nx_display_end_line();
+  /* Map the requested module and branch execution, in place. */
+  err = nx_module_load(filename, &module);
+  if (err == MODULE_ERR_NO_ERROR) {
+    err = nx_module_run(&module, rcmd_module_ram, sizeof(rcmd_module_ram),
+                        "", NULL);
+    nx_module_unload(&module);
+  }
+
+  if (err != MODULE_ERR_NO_ERROR) {
+    nx_display_string("exec:");
+    nx_display_uint(err);
+    nx_display_end_line();
+    return RCMD_ERR_EXEC_ERROR;
+  }
 
   return RCMD_ERR_NO_ERROR;
 }
@@ -248,31 +278,45 @@ static rcmd_err_t nx_rcmd_nop(char *line) {
   return RCMD_ERR_NO_ERROR;
 }
 
-static rcmd_err_t nx_rcmd_readline(fs_fd_t fd, char *line) {
+static rcmd_err_t nx_rcmd_readline(rcmd_reader_t *reader, char *line) {
   fs_err_t err;
   U32 i = 0;
-  U8 *buf = (U8 *)line;
 
   while (i < RCMD_BUF_LEN - 2) {
-    err = nx_fs_read(fd, &(buf[i]));
-
-    if (err == FS_ERR_END_OF_FILE) {
-      buf[i] = 0;
-      return RCMD_ERR_END_OF_FILE;
-    } else if (err != FS_ERR_NO_ERROR) {
-      nx_display_uint(err);
-      nx_display_end_line();
-      return RCMD_ERR_READ_ERROR;
+    /* Map the next extent of the file when the current one runs dry. */
+    if (reader->pos == reader->len) {
+      reader->pos = 0;
+      err = FS_ERR_UNSUPPORTED_MODE;
+      if (!reader->buffered) {
+        err = nx_fs_mmap(reader->fd, &(reader->data), &(reader->len));
+      }
+
+      if (err == FS_ERR_UNSUPPORTED_MODE) {
+        reader->buffered = TRUE;
+        reader->data = reader->buffer;
+        err = nx_fs_read_buf(reader->fd, reader->buffer,
+                             sizeof(reader->buffer), &(reader->len));
+      }
+
+      if (err == FS_ERR_END_OF_FILE) {
+        line[i] = 0;
+        return RCMD_ERR_END_OF_FILE;
+      } else if (err != FS_ERR_NO_ERROR) {
+        nx_display_uint(err);
+        nx_display_end_line();
+        return RCMD_ERR_READ_ERROR;
+      }
     }
 
-    if (buf[i] == '\n') {
+    line[i] = reader->data[reader->pos++];
+    if (line[i] == '\n') {
       break;
     }
 
     i++;
   }
 
-  buf[i] = 0;
+  line[i] = 0;
   return RCMD_ERR_NO_ERROR;
 }
 
@@ -338,18 +382,21 @@ rcmd_err_t nx_rcmd_do(const char *line) {
 void nx_rcmd_parse(char *file) {
   rcmd_err_t err, result;
   fs_err_t fserr;
-  fs_fd_t fd;
+  rcmd_reader_t reader;
   int n = 0;
 
-  fserr = nx_fs_open(file, FS_FILE_MODE_OPEN, &fd);
+  fserr = nx_fs_open(file, FS_FILE_MODE_OPEN, &(reader.fd));
   if (fserr != FS_ERR_NO_ERROR) {
     nx_rcmd_error(RCMD_ERR_READ_ERROR, file, 0);
     return;
   }
 
+  reader.pos = reader.len = 0;
+  reader.buffered = FALSE;
+
   do {
     char line[RCMD_BUF_LEN] = {0};
-    err = nx_rcmd_readline(fd, line);
+    err = nx_rcmd_readline(&reader, line);
     if (err == RCMD_ERR_READ_ERROR) {
       break;
     }
@@ -365,6 +412,6 @@ void nx_rcmd_parse(char *file) {
     }
   } while (err == RCMD_ERR_NO_ERROR);
 
-  nx_fs_close(fd);
+  nx_fs_close(reader.fd);
   return;
 }
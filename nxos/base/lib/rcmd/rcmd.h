@@ -42,6 +42,9 @@
 /** Commented line mark character. */
 #define RCMD_COMMENT_CHAR '#'
 
+/** Bytes of RAM given to the modules run by the @c exec command. */
+#define RCMD_MODULE_RAM 1024
+
 /** Recognized commands. */
 typedef enum {
   RCMD_CMD_MOVE,
@@ -60,6 +63,7 @@ typedef enum {
   RCMD_ERR_READ_ERROR,
   RCMD_ERR_END_OF_FILE,
   RCMD_ERR_COMMAND_NOT_FOUND,
+  RCMD_ERR_EXEC_ERROR,
   RCMD_ERR_N_ERRS,
 } rcmd_err_t;
 
@@ -66,3 +66,7 @@ U8 *nx_tracing_get_start() {
 U32 nx_tracing_get_size() {
   return trace.cur - trace.start;
 }
+
+U32 nx_tracing_get_free() {
+  return trace.end - trace.cur;
+}
@@ -78,6 +78,12 @@ U8 *nx_tracing_get_start(void);
  */
 U32 nx_tracing_get_size(void);
 
+/** Get the space left in the trace buffer.
+ *
+ * @return The number of bytes that can still be added to the trace.
+ */
+U32 nx_tracing_get_free(void);
+
 /*@}*/
 /*@}*/
 
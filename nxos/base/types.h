@@ -21,10 +21,20 @@ typedef unsigned char U8; /**< Unsigned 8-bit integer. */
 typedef signed char S8; /**< Signed 8-bit integer. */
 typedef unsigned short U16; /**< Unsigned 16-bit integer. */
 typedef signed short S16; /**< Signed 16-bit integer. */
+#ifdef NX_HOST_BUILD
+/* Host builds may run on LP64 systems, where longs are 64 bits wide,
+ * and share size_t with the C library.
+ */
+#include <stddef.h>
+
+typedef unsigned int U32;
+typedef signed int S32;
+#else
 typedef unsigned long U32; /**< Unsigned 32-bit integer. */
 typedef signed long S32; /**< Signed 32-bit integer. */
 
 typedef U32 size_t; /**< Abstract size type, needed by the memory allocator. */
+#endif
 
 typedef U8 bool; /**< Boolean data type. */
 
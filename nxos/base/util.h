@@ -45,6 +45,10 @@ double pow(double a, double b);
 
 int sqrti(int a);
 
+#ifdef NX_HOST_BUILD
+/* Host builds use the C library's string functions. */
+#include <string.h>
+#else
 /** Copy @a len bytes from @a src to @a dest.
  *
  * @param dest Destination of the copy.
@@ -69,6 +73,7 @@ void memset(void *dest, const U8 val, U32 len);
  * @return The length in bytes of the string.
  */
 U32 strlen(const char *str);
+#endif
 
 /** Compare two string prefixes for equality.
  *
@@ -92,6 +97,7 @@ bool streqn(const char *a, const char *b, U32 n);
  */
 bool streq(const char *a, const char *b);
 
+#ifndef NX_HOST_BUILD
 /** Locate leftmost instance of character @a c in string @a s.
  *
  * @param s The string to search.
@@ -109,6 +115,7 @@ char *strchr(const char *s, const char c);
  * there is none.
  */
 char *strrchr(const char *s, const char c);
+#endif
 
 /** Convert a string to the unsigned integer it represents, if possible.
  *
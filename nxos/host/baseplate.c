@@ -0,0 +1,63 @@
+/* Copyright (c) 2008 the NxOS developers
+ *
+ * See AUTHORS for a full list of the developers.
+ *
+ * Redistribution of this file is permitted under
+ * the terms of the GNU Public License (GPL) version 2.
+ */
+
+/* Host versions of the few baseplate services used by the flash driver
+ * and the file system, so that they can be built as they are into host
+ * tools.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "base/types.h"
+#include "base/assert.h"
+#include "base/interrupts.h"
+#include "base/display.h"
+#include "base/util.h"
+
+/* There are no interrupts to mask: the simulated flash controller only
+ * moves when polled.
+ */
+void nx_interrupts_disable(void) {
+}
+
+void nx_interrupts_enable(void) {
+}
+
+void nx_assert_error(const char *file, const int line,
+                     const char *expr, const char *msg) {
+  fflush(stdout);
+  fprintf(stderr, "%s:%d: assertion failed: %s (%s)\n",
+          file, line, expr, msg);
+  abort();
+}
+
+/* The display is the standard output. */
+void nx_display_string(const char *str) {
+  fputs(str, stdout);
+}
+
+void nx_display_uint(U32 val) {
+  printf("%u", val);
+}
+
+void nx_display_end_line(void) {
+  putchar('\n');
+}
+
+bool streqn(const char *a, const char *b, U32 n) {
+  NX_ASSERT(a != NULL && b != NULL);
+
+  return strncmp(a, b, n) == 0;
+}
+
+bool streq(const char *a, const char *b) {
+  NX_ASSERT(a != NULL && b != NULL);
+
+  return strcmp(a, b) == 0;
+}
@@ -0,0 +1,1029 @@
+/* Copyright (c) 2008 the NxOS developers
+ *
+ * See AUTHORS for a full list of the developers.
+ *
+ * Redistribution of this file is permitted under
+ * the terms of the GNU Public License (GPL) version 2.
+ */
+
+/* Host tool to build, inspect and benchmark flash file system images.
+ *
+ * The file system code is the one running on the brick, built on top
+ * of the simulated flash controller. An image holds the file system
+ * part of the flash, from page FS_PAGE_START to the end of the flash
+ * including the key/value store and the wear table, in the brick's
+ * (little endian) byte order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "base/types.h"
+#include "base/util.h"
+#include "base/drivers/_efc.h"
+#include "base/drivers/_efc_sim.h"
+#include "base/lib/fs/fs.h"
+
+/* Size of an image, in bytes. */
+#define IMAGE_BYTES ((EFC_PAGES - FS_PAGE_START) * EFC_PAGE_BYTES)
+
+/* Where the image lives in the simulated flash. */
+#define IMAGE_BASE ((void *)(nx__efc_sim_flash + \
+                             FS_PAGE_START * EFC_PAGE_WORDS))
+
+/* Number of page moves per background defragmentation step. */
+#define DEFRAG_BUDGET 8
+
+/* Number of pages erased per background erase step. */
+#define ERASE_BUDGET 8
+
+/* Default file size used by the benchmark. */
+#define BENCH_BYTES 4096
+
+/* Number of small files created by the benchmark. */
+#define BENCH_SMALL_FILES 8
+
+/* Capacity of the benchmark's ring log, in pages. */
+#define BENCH_RING_PAGES 8
+
+/* Size of the benchmark's ring log records. */
+#define BENCH_RING_RECORD 32
+
+/* Number of times each throughput benchmark runs, so that the host
+ * time is long enough to measure.
+ */
+#define BENCH_IO_ROUNDS 50
+
+static const char *fs_errors[] = {
+  "no error",
+  "not formatted",
+  "file not found",
+  "file already exists",
+  "too many opened files",
+  "invalid file descriptor",
+  "end of file",
+  "unsupported mode",
+  "corrupted file",
+  "flash error",
+  "no space left on device",
+  "incorrect seek",
+  "too many files",
+  "file mapped",
+  "old flash layout",
+};
+
+static const char *perm_names[] = { "ro", "rw", "rx" };
+
+static const char *program;
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: %s IMAGE COMMAND [ARGS]\n"
+          "\n"
+          "  mkfs               create an empty image\n"
+          "  ls                 list the files\n"
+          "  put [-z] FILE [NAME]\n"
+          "                     store a host file in the image, compressed\n"
+          "                     with -z\n"
+          "  get NAME [FILE]    extract a file from the image\n"
+          "  rm NAME            remove a file\n"
+          "  chmod NAME PERM    set the permissions of a file: ro, rw, or rx\n"
+          "                     for an executable module\n"
+          "  fsck               check the image, wiping stale headers\n"
+          "  defrag             compact the image\n"
+          "  erase              erase the free pages ahead of time\n"
+          "  wear               show the erase counts of the flash\n"
+          "  bench [BYTES]      measure the flash cost of file operations,\n"
+          "                     and the throughput of the byte and block\n"
+          "                     calls, on a scratch copy of the image\n"
+          "  crash [BYTES]      cut the power at each step of an append, on\n"
+          "                     a scratch copy of the image, and check that\n"
+          "                     the file is left whole\n",
+          program);
+  exit(2);
+}
+
+static void fail(const char *what, fs_err_t err) {
+  fprintf(stderr, "%s: %s: %s\n", program, what, fs_errors[err]);
+  exit(1);
+}
+
+static void load_image(const char *path) {
+  FILE *f = fopen(path, "rb");
+
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+
+  if (fread(IMAGE_BASE, 1, IMAGE_BYTES, f) != IMAGE_BYTES ||
+      fgetc(f) != EOF) {
+    fprintf(stderr, "%s: %s: not a %u bytes image\n",
+            program, path, (U32)IMAGE_BYTES);
+    exit(1);
+  }
+
+  fclose(f);
+}
+
+static void save_image(const char *path) {
+  fs_err_t err;
+  FILE *f;
+
+  /* Let the cached pages, the wear table and queued writes land
+   * first.
+   */
+  err = nx_fs_sync();
+  if (err != FS_ERR_NO_ERROR) {
+    fail("save", err);
+  }
+
+  f = fopen(path, "wb");
+  if (!f || fwrite(IMAGE_BASE, 1, IMAGE_BYTES, f) != IMAGE_BYTES ||
+      fclose(f) != 0) {
+    perror(path);
+    exit(1);
+  }
+}
+
+/* Return the last component of a path, which is the default file name
+ * of put and get.
+ */
+static const char *base_name(const char *path) {
+  const char *slash = strrchr(path, '/');
+
+  return slash ? slash + 1 : path;
+}
+
+static void check_name(const char *name) {
+  if (strlen(name) == 0 || strlen(name) >= FS_FILENAME_LENGTH) {
+    fprintf(stderr, "%s: %s: names are 1 to %u characters long\n",
+            program, name, (U32)FS_FILENAME_LENGTH - 1);
+    exit(1);
+  }
+}
+
+static void cmd_ls(void) {
+  char name[FS_FILENAME_LENGTH];
+  U32 files, used, free_pages, extents, i;
+  fs_perm_t perms;
+  size_t size;
+
+  for (i=0;
+       nx_fs_get_file_info(i, name, &size, &perms, &extents) ==
+         FS_ERR_NO_ERROR;
+       i++) {
+    printf("%-31s %7u %s %2u\n", name, (U32)size, perm_names[perms], extents);
+  }
+
+  nx_fs_get_occupation(&files, &used, &free_pages, NULL);
+  printf("%u files, %u bytes used, %u pages free\n", files, used, free_pages);
+}
+
+static void cmd_wear(void) {
+  U32 counts[EFC_LOCK_REGIONS], min, max, i;
+
+  nx_fs_get_wear_stats(counts, &min, &max);
+
+  for (i=0; i<EFC_LOCK_REGIONS; i++) {
+    if (counts[i] > 0) {
+      printf("pages %4u-%4u %8u erases\n", i * EFC_PAGES / EFC_LOCK_REGIONS,
+             (i + 1) * EFC_PAGES / EFC_LOCK_REGIONS - 1, counts[i]);
+    }
+  }
+
+  printf("min %u, max %u\n", min, max);
+}
+
+static void cmd_put(const char *path, const char *name, bool compress) {
+  FILE *f = fopen(path, "rb");
+  U8 buf[EFC_PAGE_BYTES];
+  size_t len, total = 0;
+  fs_err_t err;
+  fs_fd_t fd;
+
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+
+  check_name(name);
+
+  /* An existing file is only replaced once the new one is complete. */
+  err = nx_fs_replace((char *)name, &fd);
+  if (err != FS_ERR_NO_ERROR) {
+    fail(name, err);
+  }
+
+  if (compress) {
+    err = nx_fs_compress(fd);
+    if (err != FS_ERR_NO_ERROR) {
+      fail(name, err);
+    }
+  }
+
+  /* Claim the space up front, so that the file stays in one extent if
+   * there is a large enough hole. The compressed size is not known
+   * ahead.
+   */
+  if (!compress && fseek(f, 0, SEEK_END) == 0) {
+    long host_size = ftell(f);
+
+    if (host_size > 0) {
+      nx_fs_reserve(fd, host_size);
+    }
+
+    rewind(f);
+  }
+
+  while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+    err = nx_fs_write_buf(fd, buf, len);
+    if (err != FS_ERR_NO_ERROR) {
+      fail(name, err);
+    }
+
+    total += len;
+  }
+
+  fclose(f);
+
+  err = nx_fs_close(fd);
+  if (err != FS_ERR_NO_ERROR) {
+    fail(name, err);
+  }
+
+  printf("%s: %u bytes\n", name, (U32)total);
+}
+
+static void cmd_get(const char *name, const char *path) {
+  U8 buf[EFC_PAGE_BYTES];
+  size_t read;
+  fs_err_t err;
+  fs_fd_t fd;
+  FILE *f;
+
+  check_name(name);
+
+  err = nx_fs_open((char *)name, FS_FILE_MODE_OPEN, &fd);
+  if (err != FS_ERR_NO_ERROR) {
+    fail(name, err);
+  }
+
+  f = fopen(path, "wb");
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+
+  while ((err = nx_fs_read_buf(fd, buf, sizeof(buf), &read)) ==
+         FS_ERR_NO_ERROR) {
+    fwrite(buf, 1, read, f);
+  }
+
+  if (err != FS_ERR_END_OF_FILE) {
+    fail(name, err);
+  }
+
+  if (fclose(f) != 0) {
+    perror(path);
+    exit(1);
+  }
+
+  nx_fs_close(fd);
+}
+
+static void cmd_rm(const char *name) {
+  fs_err_t err;
+  fs_fd_t fd;
+
+  check_name(name);
+
+  err = nx_fs_open((char *)name, FS_FILE_MODE_OPEN, &fd);
+  if (err == FS_ERR_NO_ERROR) {
+    err = nx_fs_unlink(fd);
+  }
+
+  if (err != FS_ERR_NO_ERROR) {
+    fail(name, err);
+  }
+}
+
+static void cmd_chmod(const char *name, const char *perm) {
+  fs_err_t err;
+  fs_fd_t fd;
+  U32 i;
+
+  check_name(name);
+
+  for (i=0; i<3 && !streq(perm, perm_names[i]); i++);
+  if (i == 3) {
+    usage();
+  }
+
+  err = nx_fs_open((char *)name, FS_FILE_MODE_OPEN, &fd);
+  if (err == FS_ERR_NO_ERROR) {
+    err = nx_fs_set_perms(fd, (fs_perm_t)i);
+    if (err == FS_ERR_NO_ERROR) {
+      err = nx_fs_close(fd);
+    } else {
+      nx_fs_close(fd);
+    }
+  }
+
+  if (err != FS_ERR_NO_ERROR) {
+    fail(name, err);
+  }
+}
+
+static fs_err_t cmd_fsck(void) {
+  U32 stale, broken, rejected;
+  fs_err_t err;
+
+  err = nx_fs_check(&stale, &broken);
+  if (err != FS_ERR_NO_ERROR && err != FS_ERR_CORRUPTED_FILE) {
+    fail("fsck", err);
+  }
+
+  nx_fs_get_mount_stats(NULL, &rejected);
+  printf("%u bad headers, %u stale headers wiped, %u broken files\n",
+         rejected, stale, broken);
+  return err;
+}
+
+static fs_err_t defrag(void) {
+  fs_err_t err;
+  bool done;
+
+  do {
+    err = nx_fs_defrag_step(DEFRAG_BUDGET, &done);
+  } while (err == FS_ERR_NO_ERROR && !done);
+
+  return err;
+}
+
+static void cmd_defrag(void) {
+  U32 start = nx__efc_sim.commands;
+  fs_err_t err;
+
+  err = defrag();
+  if (err != FS_ERR_NO_ERROR) {
+    fail("defrag", err);
+  }
+
+  printf("%u pages written\n", nx__efc_sim.commands - start);
+}
+
+static fs_err_t erase(void) {
+  fs_err_t err;
+  bool done;
+
+  do {
+    err = nx_fs_erase_step(ERASE_BUDGET, &done);
+  } while (err == FS_ERR_NO_ERROR && !done);
+
+  return err;
+}
+
+static void cmd_erase(void) {
+  U32 start = nx__efc_sim.commands;
+  fs_err_t err;
+
+  err = erase();
+  if (err != FS_ERR_NO_ERROR) {
+    fail("erase", err);
+  }
+
+  printf("%u pages erased\n", nx__efc_sim.commands - start);
+}
+
+/* Benchmark. Each operation is reported with the flash commands it
+ * issued, and the time the flash controller was modelled busy for.
+ */
+
+static struct {
+  U32 commands;
+  U32 erases;
+  U32 busy_us;
+  U32 hits;
+  U32 misses;
+} bench_start;
+
+static void bench_begin(void) {
+  bench_start.commands = nx__efc_sim.commands;
+  bench_start.erases = nx__efc_sim.erases;
+  bench_start.busy_us = nx__efc_sim.busy_us;
+  nx_fs_get_cache_stats(&bench_start.hits, &bench_start.misses, NULL);
+}
+
+static void bench_end(const char *what, fs_err_t err) {
+  U32 hits, misses, busy_us;
+
+  /* The operation is only over once its writes have landed. */
+  nx__efc_wait();
+
+  nx_fs_get_cache_stats(&hits, &misses, NULL);
+  busy_us = nx__efc_sim.busy_us - bench_start.busy_us;
+
+  printf("%-16s %7u %7u %6u.%03u %6u %6u",
+         what, nx__efc_sim.commands - bench_start.commands,
+         nx__efc_sim.erases - bench_start.erases,
+         busy_us / 1000, busy_us % 1000,
+         hits - bench_start.hits, misses - bench_start.misses);
+
+  if (err != FS_ERR_NO_ERROR) {
+    printf("  (%s)", fs_errors[err]);
+  }
+
+  putchar('\n');
+}
+
+/* Write @a len bytes to @a name in chunks of @a chunk bytes. */
+static fs_err_t bench_write(char *name, fs_file_mode_t mode, size_t len,
+                            size_t chunk) {
+  U8 buf[EFC_PAGE_BYTES];
+  fs_err_t err;
+  size_t i;
+  fs_fd_t fd;
+
+  for (i=0; i<sizeof(buf); i++) {
+    buf[i] = i;
+  }
+
+  err = nx_fs_open(name, mode, &fd);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  for (i=0; i<len && err == FS_ERR_NO_ERROR; i+=chunk) {
+    err = nx_fs_write_buf(fd, buf, MIN(chunk, len - i));
+  }
+
+  if (err != FS_ERR_NO_ERROR) {
+    nx_fs_close(fd);
+    return err;
+  }
+
+  return nx_fs_close(fd);
+}
+
+/* Write @a len bytes of text to @a name, compressed or not. */
+static fs_err_t bench_write_text(char *name, size_t len, bool compress) {
+  static const char *words[] = { "forward ", "left ", "right ", "stop ",
+                                 "wait 100 ", "speed 75 ", "turn 90\n" };
+  fs_err_t err;
+  size_t i, n;
+  U32 word = 0;
+  fs_fd_t fd;
+
+  err = nx_fs_open(name, FS_FILE_MODE_TRUNCATE, &fd);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  if (compress) {
+    err = nx_fs_compress(fd);
+  }
+
+  for (i=0; i<len && err == FS_ERR_NO_ERROR; i+=n) {
+    /* Vary the word sequence, as a script would. */
+    word = (word * 5 + 3) % 7;
+    n = MIN(strlen(words[word]), len - i);
+    err = nx_fs_write_buf(fd, (const U8 *)words[word], n);
+  }
+
+  if (err != FS_ERR_NO_ERROR) {
+    nx_fs_close(fd);
+    return err;
+  }
+
+  return nx_fs_close(fd);
+}
+
+/* Replace @a name with @a len bytes, written in pages. */
+static fs_err_t bench_replace(char *name, size_t len) {
+  U8 buf[EFC_PAGE_BYTES];
+  fs_err_t err;
+  size_t i;
+  fs_fd_t fd;
+
+  memset(buf, 0x5A, sizeof(buf));
+
+  err = nx_fs_replace(name, &fd);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  for (i=0; i<len && err == FS_ERR_NO_ERROR; i+=sizeof(buf)) {
+    err = nx_fs_write_buf(fd, buf, MIN(sizeof(buf), len - i));
+  }
+
+  if (err != FS_ERR_NO_ERROR) {
+    nx_fs_unlink(fd);
+    return err;
+  }
+
+  return nx_fs_close(fd);
+}
+
+static fs_err_t bench_read(char *name) {
+  U8 buf[EFC_PAGE_BYTES];
+  size_t read;
+  fs_err_t err;
+  fs_fd_t fd;
+
+  err = nx_fs_open(name, FS_FILE_MODE_OPEN, &fd);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  while ((err = nx_fs_read_buf(fd, buf, sizeof(buf), &read)) ==
+         FS_ERR_NO_ERROR);
+
+  nx_fs_close(fd);
+  return err == FS_ERR_END_OF_FILE ? FS_ERR_NO_ERROR : err;
+}
+
+/* Write @a len bytes to @a name one byte at a time. */
+static fs_err_t bench_write_bytes(char *name, size_t len) {
+  fs_err_t err;
+  size_t i;
+  fs_fd_t fd;
+
+  err = nx_fs_open(name, FS_FILE_MODE_TRUNCATE, &fd);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  for (i=0; i<len && err == FS_ERR_NO_ERROR; i++) {
+    err = nx_fs_write(fd, i);
+  }
+
+  if (err != FS_ERR_NO_ERROR) {
+    nx_fs_close(fd);
+    return err;
+  }
+
+  return nx_fs_close(fd);
+}
+
+/* Read @a name one byte at a time. */
+static fs_err_t bench_read_bytes(char *name) {
+  fs_err_t err;
+  fs_fd_t fd;
+  U8 byte;
+
+  err = nx_fs_open(name, FS_FILE_MODE_OPEN, &fd);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  while ((err = nx_fs_read(fd, &byte)) == FS_ERR_NO_ERROR);
+
+  nx_fs_close(fd);
+  return err == FS_ERR_END_OF_FILE ? FS_ERR_NO_ERROR : err;
+}
+
+static U32 now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000U + ts.tv_nsec / 1000;
+}
+
+/* Write or read a @a len bytes file BENCH_IO_ROUNDS times, one byte
+ * or one page at a time, and print the throughput. The time is the
+ * host's, which includes the file system code and the simulation,
+ * plus the modelled flash time.
+ */
+static void bench_io(const char *what, bool write, bool block, size_t len) {
+  U32 host_us, busy_us, i;
+  fs_err_t err = FS_ERR_NO_ERROR;
+  double total_us;
+
+  busy_us = nx__efc_sim.busy_us;
+  host_us = now_us();
+
+  for (i=0; i<BENCH_IO_ROUNDS && err == FS_ERR_NO_ERROR; i++) {
+    if (write && block) {
+      err = bench_write(".io", FS_FILE_MODE_TRUNCATE, len, EFC_PAGE_BYTES);
+    } else if (write) {
+      err = bench_write_bytes(".io", len);
+    } else if (block) {
+      err = bench_read(".io");
+    } else {
+      err = bench_read_bytes(".io");
+    }
+  }
+
+  nx__efc_wait();
+  host_us = now_us() - host_us;
+  busy_us = nx__efc_sim.busy_us - busy_us;
+  total_us = MAX(host_us + busy_us, 1);
+
+  printf("%-16s %7u %6u.%03u %6u.%03u %10.0f", what,
+         (U32)len * BENCH_IO_ROUNDS, host_us / 1000, host_us % 1000,
+         busy_us / 1000, busy_us % 1000,
+         len * BENCH_IO_ROUNDS * 1000000.0 / total_us);
+
+  if (err != FS_ERR_NO_ERROR) {
+    printf("  (%s)", fs_errors[err]);
+  }
+
+  putchar('\n');
+}
+
+static fs_err_t bench_unlink(char *name) {
+  fs_err_t err;
+  fs_fd_t fd;
+
+  err = nx_fs_open(name, FS_FILE_MODE_OPEN, &fd);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  return nx_fs_unlink(fd);
+}
+
+/* Append @a len bytes worth of records to a new ring log. */
+static fs_err_t bench_ring_append(char *name, size_t len) {
+  U8 buf[BENCH_RING_RECORD];
+  fs_err_t err;
+  size_t i;
+  fs_fd_t fd;
+
+  for (i=0; i<sizeof(buf); i++) {
+    buf[i] = i;
+  }
+
+  err = nx_fs_ring_create(name, BENCH_RING_PAGES, &fd);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  for (i=0; i<len && err == FS_ERR_NO_ERROR; i+=sizeof(buf)) {
+    err = nx_fs_ring_append(fd, buf, sizeof(buf));
+  }
+
+  if (err != FS_ERR_NO_ERROR) {
+    nx_fs_close(fd);
+    return err;
+  }
+
+  return nx_fs_close(fd);
+}
+
+static fs_err_t bench_ring_read(char *name) {
+  U8 buf[FS_RING_RECORD_MAX];
+  fs_ring_cursor_t cursor;
+  fs_err_t err;
+  fs_fd_t fd;
+
+  err = nx_fs_open(name, FS_FILE_MODE_OPEN, &fd);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  err = nx_fs_ring_rewind(fd, &cursor);
+  while (err == FS_ERR_NO_ERROR) {
+    err = nx_fs_ring_read(fd, &cursor, buf, sizeof(buf), NULL);
+  }
+
+  nx_fs_close(fd);
+  return err == FS_ERR_END_OF_FILE ? FS_ERR_NO_ERROR : err;
+}
+
+static void cmd_bench(size_t len) {
+  char name[] = ".bench0";
+  fs_err_t err = FS_ERR_NO_ERROR;
+  U32 i;
+
+  printf("%-16s %7s %7s %10s %6s %6s\n",
+         "operation", "writes", "erases", "flash ms", "hits", "misses");
+
+  bench_begin();
+  bench_end("create", bench_write(".bench", FS_FILE_MODE_CREATE,
+                                  len, EFC_PAGE_BYTES));
+
+  bench_begin();
+  bench_end("append bytes", bench_write(".bench", FS_FILE_MODE_APPEND,
+                                        len / 4, 1));
+
+  bench_begin();
+  bench_end("append blocks", bench_write(".bench", FS_FILE_MODE_APPEND,
+                                         len / 4, 64));
+
+  bench_begin();
+  bench_end("read", bench_read(".bench"));
+
+  bench_begin();
+  bench_end("rewrite", bench_write(".bench", FS_FILE_MODE_TRUNCATE,
+                                   len, EFC_PAGE_BYTES));
+
+  bench_begin();
+  bench_end("replace", bench_replace(".bench", len));
+
+  bench_begin();
+  bench_end("write text", bench_write_text(".text", len, FALSE));
+
+  bench_begin();
+  bench_end("write compressed", bench_write_text(".lz", len, TRUE));
+
+  bench_begin();
+  bench_end("read compressed", bench_read(".lz"));
+
+  bench_begin();
+  bench_end("ring append", bench_ring_append(".ring", 4 * len));
+
+  bench_begin();
+  bench_end("ring read", bench_ring_read(".ring"));
+
+  bench_begin();
+  bench_end("pre-erase", erase());
+
+  bench_begin();
+  for (i=0; i<BENCH_SMALL_FILES && err == FS_ERR_NO_ERROR; i++) {
+    name[6] = '0' + i;
+    err = bench_write(name, FS_FILE_MODE_CREATE, 64, 64);
+  }
+  bench_end("create small", err);
+
+  bench_begin();
+  for (i=0; i<BENCH_SMALL_FILES; i+=2) {
+    name[6] = '0' + i;
+    err = bench_unlink(name);
+  }
+  bench_end("unlink small", err);
+
+
+  bench_begin();
+  bench_end("defrag", defrag());
+
+  bench_begin();
+  err = bench_unlink(".bench");
+  if (err == FS_ERR_NO_ERROR) {
+    err = bench_unlink(".ring");
+  }
+  if (err == FS_ERR_NO_ERROR) {
+    err = bench_unlink(".text");
+  }
+  if (err == FS_ERR_NO_ERROR) {
+    err = bench_unlink(".lz");
+  }
+
+  for (i=1; i<BENCH_SMALL_FILES && err == FS_ERR_NO_ERROR; i+=2) {
+    name[6] = '0' + i;
+    err = bench_unlink(name);
+  }
+  bench_end("unlink all", err);
+
+  /* Per-byte calls against the block calls. */
+  printf("\n%-16s %7s %10s %10s %10s\n",
+         "operation", "bytes", "host ms", "flash ms", "bytes/s");
+  bench_io("write bytes", TRUE, FALSE, len);
+  bench_io("write blocks", TRUE, TRUE, len);
+  bench_io("read bytes", FALSE, FALSE, len);
+  bench_io("read blocks", FALSE, TRUE, len);
+  bench_unlink(".io");
+}
+
+/* Power cut test. An append to a file is run over and over from the
+ * same image, the flash losing power one command later each time. The
+ * file must then be found whole once the flash is mounted again: as it
+ * was, or with all of the bytes appended.
+ */
+
+/* The power cut test file, and a file right after it. */
+#define CRASH_FILE ".crash"
+#define CRASH_BLOCKER ".crash1"
+
+/* Size of the power cut test writes. */
+#define CRASH_CHUNK 100
+
+/* The image the power cut test starts from each time. */
+static U32 crash_image[EFC_PAGES * EFC_PAGE_WORDS];
+
+/* Returns the byte at @a offset in the power cut test file. */
+static U8 crash_byte(size_t offset) {
+  return (offset * 7) ^ (offset >> 8);
+}
+
+/* Write @a len bytes to the power cut test file, which holds @a size
+ * bytes, in chunks that do not line up with the pages.
+ */
+static fs_err_t crash_write(fs_file_mode_t mode, size_t size, size_t len) {
+  U8 buf[CRASH_CHUNK];
+  fs_err_t err;
+  size_t i, j, n;
+  fs_fd_t fd;
+
+  err = nx_fs_open(CRASH_FILE, mode, &fd);
+  if (err != FS_ERR_NO_ERROR) {
+    return err;
+  }
+
+  for (i=0; i<len && err == FS_ERR_NO_ERROR; i+=n) {
+    n = MIN(sizeof(buf), len - i);
+    for (j=0; j<n; j++) {
+      buf[j] = crash_byte(size + i + j);
+    }
+
+    err = nx_fs_write_buf(fd, buf, n);
+  }
+
+  if (err != FS_ERR_NO_ERROR) {
+    nx_fs_close(fd);
+    return err;
+  }
+
+  return nx_fs_close(fd);
+}
+
+/* Returns the size of the power cut test file, or 0 if it does not
+ * hold what it should.
+ */
+static size_t crash_check(void) {
+  U8 buf[EFC_PAGE_BYTES];
+  size_t read, size = 0, i;
+  fs_err_t err;
+  fs_fd_t fd;
+
+  if (nx_fs_open(CRASH_FILE, FS_FILE_MODE_OPEN, &fd) != FS_ERR_NO_ERROR) {
+    return 0;
+  }
+
+  while ((err = nx_fs_read_buf(fd, buf, sizeof(buf), &read)) ==
+         FS_ERR_NO_ERROR) {
+    for (i=0; i<read; i++) {
+      if (buf[i] != crash_byte(size + i)) {
+        err = FS_ERR_CORRUPTED_FILE;
+      }
+    }
+
+    size += read;
+  }
+
+  nx_fs_close(fd);
+  return err == FS_ERR_END_OF_FILE ? size : 0;
+}
+
+/* Reset the brick with the flash as it is, and mount it again. What the
+ * file system held in RAM is lost: its cached pages are only written
+ * back by the first mount, while the flash has no power.
+ */
+static fs_err_t crash_reset(void) {
+  nx__efc_sim.power_cut = nx__efc_sim.commands + 1;
+  nx_fs_init();
+
+  nx__efc_sim_reset(1);
+  nx__efc_init();
+  return nx_fs_init();
+}
+
+/* Start again from the power cut test image. */
+static fs_err_t crash_restore(void) {
+  memcpy((void *)nx__efc_sim_flash, crash_image, sizeof(crash_image));
+  return crash_reset();
+}
+
+static void cmd_crash(size_t len) {
+  U32 cut, commands, lost = 0, complete = 0, stale, broken;
+  size_t size = len + len / 2, found;
+  fs_err_t err;
+
+  /* The file gets a continuation extent first, which the append grows
+   * along with its first one.
+   */
+  err = crash_write(FS_FILE_MODE_CREATE, 0, len);
+  if (err == FS_ERR_NO_ERROR) {
+    err = bench_write(CRASH_BLOCKER, FS_FILE_MODE_CREATE, 64, 64);
+  }
+  if (err == FS_ERR_NO_ERROR) {
+    err = crash_write(FS_FILE_MODE_APPEND, len, len / 2);
+  }
+  if (err == FS_ERR_NO_ERROR) {
+    err = nx_fs_sync();
+  }
+  if (err != FS_ERR_NO_ERROR) {
+    fail("crash", err);
+  }
+
+  memcpy(crash_image, (void *)nx__efc_sim_flash, sizeof(crash_image));
+
+  commands = nx__efc_sim.commands;
+  err = crash_write(FS_FILE_MODE_APPEND, size, len);
+  if (err == FS_ERR_NO_ERROR) {
+    err = nx_fs_sync();
+  }
+  if (err != FS_ERR_NO_ERROR) {
+    fail("crash", err);
+  }
+
+  commands = nx__efc_sim.commands - commands;
+
+  for (cut=1; cut<=commands; cut++) {
+    err = crash_restore();
+    if (err != FS_ERR_NO_ERROR) {
+      fail("crash", err);
+    }
+
+    nx__efc_sim.power_cut = nx__efc_sim.commands + cut;
+    crash_write(FS_FILE_MODE_APPEND, size, len);
+    nx_fs_sync();
+
+    err = crash_reset();
+    found = crash_check();
+    if (err == FS_ERR_NO_ERROR) {
+      err = nx_fs_check(&stale, &broken);
+    }
+
+    if (err != FS_ERR_NO_ERROR || (found != size && found != size + len)) {
+      fprintf(stderr, "%s: power cut at command %u of %u: %s, %u bytes\n",
+              program, cut, commands, fs_errors[err], (U32)found);
+      exit(1);
+    }
+
+    if (found == size) {
+      lost++;
+    } else {
+      complete++;
+    }
+  }
+
+  printf("%u power cuts: %u appends lost, %u complete\n",
+         commands, lost, complete);
+}
+
+int main(int argc, char *argv[]) {
+  const char *image, *cmd;
+  fs_err_t err;
+
+  program = base_name(argv[0]);
+  if (argc < 3) {
+    usage();
+  }
+
+  image = argv[1];
+  cmd = argv[2];
+  argc -= 3;
+  argv += 3;
+
+  /* An erased flash is an empty file system. */
+  if (streq(cmd, "mkfs") && argc == 0) {
+    memset(IMAGE_BASE, 0xFF, IMAGE_BYTES);
+  } else {
+    load_image(image);
+  }
+
+  nx__efc_sim_reset(1);
+  nx__efc_init();
+
+  if (streq(cmd, "mkfs")) {
+    save_image(image);
+    return 0;
+  }
+
+  err = nx_fs_init();
+  if (err != FS_ERR_NO_ERROR) {
+    fail(image, err);
+  }
+
+  if (streq(cmd, "ls") && argc == 0) {
+    cmd_ls();
+  } else if (streq(cmd, "put") && argc >= 2 && streq(argv[0], "-z") &&
+             argc <= 3) {
+    cmd_put(argv[1], argc == 3 ? argv[2] : base_name(argv[1]), TRUE);
+    save_image(image);
+  } else if (streq(cmd, "put") && (argc == 1 || argc == 2)) {
+    cmd_put(argv[0], argc == 2 ? argv[1] : base_name(argv[0]), FALSE);
+    save_image(image);
+  } else if (streq(cmd, "get") && (argc == 1 || argc == 2)) {
+    cmd_get(argv[0], argc == 2 ? argv[1] : base_name(argv[0]));
+  } else if (streq(cmd, "rm") && argc == 1) {
+    cmd_rm(argv[0]);
+    save_image(image);
+  } else if (streq(cmd, "chmod") && argc == 2) {
+    cmd_chmod(argv[0], argv[1]);
+    save_image(image);
+  } else if (streq(cmd, "fsck") && argc == 0) {
+    err = cmd_fsck();
+    save_image(image);
+    return err == FS_ERR_NO_ERROR ? 0 : 1;
+  } else if (streq(cmd, "defrag") && argc == 0) {
+    cmd_defrag();
+    save_image(image);
+  } else if (streq(cmd, "wear") && argc == 0) {
+    cmd_wear();
+  } else if (streq(cmd, "erase") && argc == 0) {
+    cmd_erase();
+    save_image(image);
+  } else if (streq(cmd, "bench") && argc <= 1) {
+    cmd_bench(argc == 1 ? (size_t)strtoul(argv[0], NULL, 0) : BENCH_BYTES);
+  } else if (streq(cmd, "crash") && argc <= 1) {
+    cmd_crash(argc == 1 ? (size_t)strtoul(argv[0], NULL, 0) : BENCH_BYTES);
+  } else {
+    usage();
+  }
+
+  return 0;
+}
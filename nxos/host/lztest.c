@@ -0,0 +1,228 @@
+/* Copyright (c) 2008 the NxOS developers
+ *
+ * See AUTHORS for a full list of the developers.
+ *
+ * Redistribution of this file is permitted under
+ * the terms of the GNU Public License (GPL) version 2.
+ */
+
+/* Host tests of the LZ codec.
+ *
+ * Each input is compressed with the data handed to the encoder in
+ * chunks of several sizes, then decompressed with output buffers of
+ * several sizes, and must come back unchanged. The inputs include
+ * incompressible bytes, which must not grow by more than the group
+ * flag bytes, and the tests cut the encoder's output short to check
+ * that a failure mid-stream stops the encoder cleanly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "base/types.h"
+#include "base/util.h"
+#include "base/lib/lz/lz.h"
+
+/* Largest input tested. */
+#define INPUT_MAX (8 * LZ_BUFFER_SIZE)
+
+/* Worst case size of the compressed stream of @a len bytes, all
+ * literals: one flag byte per group of 8.
+ */
+#define LZ_BOUND(len) ((len) + ((len) + 7) / 8)
+
+/* A compressed stream, written by the encoder and read back by the
+ * decoder.
+ */
+typedef struct {
+  U8 data[LZ_BOUND(INPUT_MAX)];
+  U32 len;   /* Bytes written. */
+  U32 pos;   /* Bytes read. */
+  U32 limit; /* Bytes the output accepts before failing. */
+  U32 calls; /* Output calls made after the first failure. */
+  bool failed;
+} stream_t;
+
+static U8 input[INPUT_MAX];
+static U8 output[INPUT_MAX];
+
+static U32 failures = 0;
+
+#define CHECK(cond, name, what) do {                                    \
+    if (!(cond)) {                                                      \
+      printf("FAIL %s: %s\n", name, what);                              \
+      failures++;                                                       \
+      return;                                                           \
+    }                                                                   \
+  } while (0)
+
+static bool stream_output(void *arg, const U8 *data, U32 len) {
+  stream_t *s = arg;
+
+  if (s->failed) {
+    s->calls++;
+    return FALSE;
+  }
+
+  /* The output either takes a whole group or fails. */
+  if (s->len + len > s->limit) {
+    s->failed = TRUE;
+    return FALSE;
+  }
+
+  memcpy(s->data + s->len, data, len);
+  s->len += len;
+  return TRUE;
+}
+
+static bool stream_input(void *arg, U8 *byte) {
+  stream_t *s = arg;
+
+  if (s->pos == s->len) {
+    return FALSE;
+  }
+
+  *byte = s->data[s->pos++];
+  return TRUE;
+}
+
+/* Compress @a len input bytes into @a s, @a chunk bytes at a time.
+ * Returns FALSE if the encoder failed.
+ */
+static bool compress(stream_t *s, U32 len, U32 chunk) {
+  static lz_encoder_t enc;
+  U32 i, n;
+
+  s->len = s->pos = s->calls = 0;
+  s->failed = FALSE;
+  nx_lz_encoder_init(&enc, stream_output, s);
+
+  for (i=0; i<len; i+=n) {
+    n = MIN(chunk, len - i);
+    if (!nx_lz_encode(&enc, input + i, n)) {
+      /* A failed encoder stays failed. */
+      return nx_lz_encode(&enc, input, 1) || nx_lz_encode_finish(&enc);
+    }
+  }
+
+  return nx_lz_encode_finish(&enc);
+}
+
+/* Decompress @a s into the output, @a chunk bytes at a time. Returns
+ * the number of bytes decompressed, or -1 if the stream is corrupted.
+ */
+static S32 decompress(stream_t *s, U32 chunk) {
+  static lz_decoder_t dec;
+  U32 total = 0, done;
+
+  s->pos = 0;
+  nx_lz_decoder_init(&dec, stream_input, s);
+
+  do {
+    if (!nx_lz_decode(&dec, output + total,
+                      MIN(chunk, INPUT_MAX - total), &done)) {
+      return -1;
+    }
+    total += done;
+  } while (done == chunk && total < INPUT_MAX);
+
+  return total;
+}
+
+/* Round trip the first @a len input bytes. */
+static void test_round_trip(const char *name, U32 len, bool incompressible) {
+  static const U32 chunks[] = { 1, 7, 100, LZ_MATCH_MAX, INPUT_MAX };
+  static stream_t s;
+  U32 i, j;
+
+  for (i=0; i<sizeof(chunks)/sizeof(chunks[0]); i++) {
+    s.limit = sizeof(s.data);
+    CHECK(compress(&s, len, chunks[i]), name, "encoder failed");
+    CHECK(s.len <= LZ_BOUND(len), name, "stream over its bound");
+    if (incompressible) {
+      CHECK(s.len >= len, name, "random bytes got compressed");
+    }
+
+    for (j=0; j<sizeof(chunks)/sizeof(chunks[0]); j++) {
+      CHECK(decompress(&s, chunks[j]) == (S32)len, name, "wrong size");
+      CHECK(memcmp(input, output, len) == 0, name, "wrong bytes");
+    }
+  }
+
+  printf("%-14s %6u -> %6u bytes\n", name, len, s.len);
+}
+
+/* Cut the encoder's output after @a limit bytes. */
+static void test_output_failure(const char *name, U32 len, U32 limit) {
+  static stream_t s;
+  S32 decoded;
+
+  s.limit = limit;
+  CHECK(!compress(&s, len, 100), name, "encoder ignored the failure");
+  CHECK(s.failed, name, "output never failed");
+  CHECK(s.calls == 0, name, "output called after it failed");
+
+  /* Only whole groups were written: they are a clean prefix. */
+  decoded = decompress(&s, INPUT_MAX);
+  CHECK(decoded >= 0, name, "written part corrupted");
+  CHECK(memcmp(input, output, decoded) == 0, name, "wrong prefix");
+
+  printf("%-14s %6u -> %6u bytes, %u decoded\n", name, len, s.len,
+         (U32)decoded);
+}
+
+/* Fill the input with pseudo-random bytes. */
+static void fill_random(U32 seed) {
+  U32 i;
+
+  for (i=0; i<INPUT_MAX; i++) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    input[i] = seed;
+  }
+}
+
+/* Fill the input with text-like lines. */
+static void fill_text(void) {
+  static const char *words[] = {
+    "motor ", "forward ", "wait ", "100 ", "sensor ", "touch ",
+    "beep ", "440\n", "stop\n", "# comment\n",
+  };
+  U32 i = 0, w = 0, n;
+
+  while (i < INPUT_MAX) {
+    n = MIN(strlen(words[w % 10]), INPUT_MAX - i);
+    memcpy(input + i, words[w % 10], n);
+    i += n;
+    w = w * 7 + 3;
+  }
+}
+
+int main(void) {
+  test_round_trip("empty", 0, FALSE);
+
+  memset(input, 'a', INPUT_MAX);
+  test_round_trip("one byte", 1, FALSE);
+  test_round_trip("run", INPUT_MAX, FALSE);
+
+  fill_text();
+  test_round_trip("text", INPUT_MAX, FALSE);
+  test_round_trip("short text", LZ_MATCH_MAX + 1, FALSE);
+  test_output_failure("text cut", INPUT_MAX, 100);
+
+  fill_random(1);
+  test_round_trip("random", INPUT_MAX, TRUE);
+  test_round_trip("random window", LZ_WINDOW_SIZE + 1, TRUE);
+  test_output_failure("random cut", INPUT_MAX, LZ_BUFFER_SIZE);
+  test_output_failure("random no room", 10, 0);
+
+  if (failures > 0) {
+    printf("%u failures\n", failures);
+    return 1;
+  }
+
+  printf("all passed\n");
+  return 0;
+}
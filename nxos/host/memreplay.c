@@ -0,0 +1,403 @@
+/* Copyright (c) 2008 the NxOS developers
+ *
+ * See AUTHORS for a full list of the developers.
+ *
+ * Redistribution of this file is permitted under
+ * the terms of the GNU Public License (GPL) version 2.
+ */
+
+/* Host tool to replay memory allocator traces.
+ *
+ * A trace is recorded on the brick by a kernel built with memtrace=1
+ * (see nx_memalloc_trace()), and is a sequence of
+ * memalloc_trace_record_t in the brick's (little endian) byte order.
+ * The replay runs the trace's operations through the allocator code
+ * running on the brick, and reports how long each kind of operation
+ * took, how much memory the trace needed at its peak, and how
+ * fragmented the pool was.
+ *
+ * The host's pointers may be wider than the brick's, which makes TLSF
+ * block headers larger. The figures measured on the host pool are
+ * reported as such, along with the requested bytes, which do not
+ * depend on the host, and an estimate of what the brick used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <time.h>
+
+#include "base/types.h"
+#include "base/assert.h"
+#include "base/util.h"
+#include "base/lib/memalloc/memalloc.h"
+
+/* Size of TLSF block headers on the brick. */
+#define BRICK_BLOCK_OVERHEAD 8
+
+/* Number of operation kinds, the start record included. */
+#define OPS (MEMALLOC_TRACE_FREE + 1)
+
+static const char *op_names[OPS] = {
+  "start", "malloc", "calloc", "realloc", "free",
+};
+
+static const char *program;
+
+/* Where an out of memory assertion returns to. */
+static jmp_buf replay_failed;
+static const char *replay_error;
+
+/* A block of the replay, by its address on the brick. */
+typedef struct {
+  U32 addr;
+  U32 size;
+  void *ptr;
+} block_t;
+
+/* The live blocks, in an open addressing hash table. */
+static struct {
+  block_t *slots;
+  U32 mask;
+} blocks;
+
+/* Replay totals. */
+static struct {
+  U32 payload;          /* Bytes requested by the live blocks. */
+  U32 live;             /* Number of live blocks. */
+  U32 brick;            /* Estimated brick usage of the live blocks. */
+  U32 peak_payload;
+  U32 peak_live;
+  U32 peak_brick;
+  U32 peak_used;        /* Peak usage of the host pool. */
+  memalloc_stats_t at_peak;
+  U32 unknown;          /* Operations on blocks allocated before the
+                         * trace started. */
+} totals;
+
+/* Latencies of each kind of operation, in nanoseconds. */
+static struct {
+  U32 *ns;
+  U32 count;
+} latencies[OPS];
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: %s [-s POOL_BYTES] TRACE\n"
+          "\n"
+          "Replay a memory allocator trace recorded on the brick. The pool\n"
+          "is as large as the brick's, unless given with -s.\n",
+          program);
+  exit(2);
+}
+
+void nx_assert_error(const char *file, const int line,
+                     const char *expr, const char *msg) {
+  /* Running out of memory is a replay result, not a bug. */
+  if (strcmp(msg, "Out of memory") == 0) {
+    replay_error = msg;
+    longjmp(replay_failed, 1);
+  }
+
+  fflush(stdout);
+  fprintf(stderr, "%s:%d: assertion failed: %s (%s)\n",
+          file, line, expr, msg);
+  abort();
+}
+
+static U32 read_u32(const U8 *data) {
+  return data[0] | data[1] << 8 | data[2] << 16 | (U32)data[3] << 24;
+}
+
+/* Estimate the brick memory a block of @a size bytes takes. TLSF rounds
+ * large requests up to its second level granularity, and all of them
+ * to 8 bytes, and adds its block header.
+ */
+static U32 brick_cost(U32 size) {
+  U32 bits = 0, round;
+
+  size = MAX(size, 8);
+  if (size >= 128) {
+    while ((size >> bits) > 1)
+      bits++;
+    round = (1 << (bits - 5)) - 1;
+    size = (size + round) & ~round;
+  }
+
+  return ((size + 7) & ~7) + BRICK_BLOCK_OVERHEAD;
+}
+
+static block_t *block_find(U32 addr) {
+  U32 i = (addr >> 3) * 2654435761U & blocks.mask;
+
+  while (blocks.slots[i].ptr != NULL) {
+    if (blocks.slots[i].addr == addr)
+      return &blocks.slots[i];
+    i = (i + 1) & blocks.mask;
+  }
+
+  return NULL;
+}
+
+static void block_add(U32 addr, U32 size, void *ptr) {
+  U32 i = (addr >> 3) * 2654435761U & blocks.mask;
+
+  while (blocks.slots[i].ptr != NULL)
+    i = (i + 1) & blocks.mask;
+
+  blocks.slots[i].addr = addr;
+  blocks.slots[i].size = size;
+  blocks.slots[i].ptr = ptr;
+
+  totals.payload += size;
+  totals.brick += brick_cost(size);
+  totals.live++;
+}
+
+/* Remove a block, shifting back the entries that probed past it. */
+static void block_remove(block_t *block) {
+  U32 i = block - blocks.slots, j = i, home;
+
+  totals.payload -= block->size;
+  totals.brick -= brick_cost(block->size);
+  totals.live--;
+
+  while (1) {
+    blocks.slots[i].ptr = NULL;
+
+    do {
+      j = (j + 1) & blocks.mask;
+      if (blocks.slots[j].ptr == NULL)
+        return;
+      home = (blocks.slots[j].addr >> 3) * 2654435761U & blocks.mask;
+    } while (((j - home) & blocks.mask) < ((j - i) & blocks.mask));
+
+    blocks.slots[i] = blocks.slots[j];
+    i = j;
+  }
+}
+
+static U32 now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+/* Replay one record, timing the allocator call. */
+static void replay_record(const memalloc_trace_record_t *record) {
+  block_t *old = NULL;
+  void *ptr = NULL;
+  U32 start, end;
+
+  if (record->op == MEMALLOC_TRACE_FREE || record->op ==
+      MEMALLOC_TRACE_REALLOC) {
+    old = block_find(record->op == MEMALLOC_TRACE_FREE ?
+                     record->ptr : record->old);
+    if (old == NULL && (record->op == MEMALLOC_TRACE_FREE ?
+                        record->ptr : record->old) != 0) {
+      totals.unknown++;
+    }
+  }
+
+  start = now_ns();
+  switch (record->op) {
+  case MEMALLOC_TRACE_MALLOC:
+    ptr = nx_malloc(record->size);
+    break;
+  case MEMALLOC_TRACE_CALLOC:
+    ptr = nx_calloc(1, record->size);
+    break;
+  case MEMALLOC_TRACE_REALLOC:
+    ptr = nx_realloc(old ? old->ptr : NULL, record->size);
+    break;
+  case MEMALLOC_TRACE_FREE:
+    if (old != NULL)
+      nx_free(old->ptr);
+    break;
+  }
+  end = now_ns();
+
+  latencies[record->op].ns[latencies[record->op].count++] = end - start;
+
+  if (old != NULL)
+    block_remove(old);
+  if (ptr != NULL)
+    block_add(record->ptr, record->size, ptr);
+
+  totals.peak_payload = MAX(totals.peak_payload, totals.payload);
+  totals.peak_live = MAX(totals.peak_live, totals.live);
+  totals.peak_brick = MAX(totals.peak_brick, totals.brick);
+  if (nx_memalloc_used() > totals.peak_used) {
+    totals.peak_used = nx_memalloc_used();
+    nx_memalloc_get_stats(&totals.at_peak);
+  }
+}
+
+/* Replay one record, and return FALSE if the pool ran out of memory. */
+static bool replay(const memalloc_trace_record_t *record) {
+  if (setjmp(replay_failed) != 0)
+    return FALSE;
+
+  replay_record(record);
+  return TRUE;
+}
+
+static int compare_u32(const void *a, const void *b) {
+  U32 x = *(const U32 *)a, y = *(const U32 *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void report_latencies(void) {
+  U32 op;
+
+  printf("%-10s %8s %8s %8s %8s %8s\n",
+         "operation", "count", "min ns", "p50 ns", "p99 ns", "max ns");
+
+  for (op=MEMALLOC_TRACE_MALLOC; op<OPS; op++) {
+    U32 *ns = latencies[op].ns, count = latencies[op].count;
+
+    if (count == 0)
+      continue;
+
+    qsort(ns, count, sizeof(*ns), compare_u32);
+    printf("%-10s %8u %8u %8u %8u %8u\n", op_names[op], count, ns[0],
+           ns[count / 2], ns[count * 99 / 100], ns[count - 1]);
+  }
+}
+
+static void report_pool(const char *what, const memalloc_stats_t *stats,
+                        U32 pool_size) {
+  U32 free_bytes = pool_size - stats->used, i;
+
+  printf("%-10s %u bytes used, largest free block %u of %u free bytes",
+         what, stats->used, stats->largest_free, free_bytes);
+  if (free_bytes > 0) {
+    printf(" (%u%% fragmented)",
+           100 - (U32)(100.0 * stats->largest_free / free_bytes));
+  }
+  printf("\n%-10s free blocks by class:", "");
+
+  for (i=0; i<MEMALLOC_STATS_CLASSES; i++) {
+    if (stats->free_blocks[i] > 0)
+      printf(" %u:%u", i, stats->free_blocks[i]);
+  }
+  putchar('\n');
+}
+
+int main(int argc, char *argv[]) {
+  memalloc_trace_record_t record;
+  memalloc_stats_t stats;
+  U32 pool_size = 0, brick_pool, brick_used, records, i;
+  long len;
+  U8 *trace;
+  void *pool;
+  FILE *f;
+
+  program = argv[0];
+  if (argc == 4 && strcmp(argv[1], "-s") == 0) {
+    pool_size = strtoul(argv[2], NULL, 0);
+    argv += 2;
+    argc -= 2;
+  }
+  if (argc != 2) {
+    usage();
+  }
+
+  f = fopen(argv[1], "rb");
+  if (!f || fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0 ||
+      fseek(f, 0, SEEK_SET) != 0) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  trace = malloc(len);
+  if (trace == NULL || fread(trace, 1, len, f) != (size_t)len) {
+    perror(argv[1]);
+    return 1;
+  }
+  fclose(f);
+
+  records = len / sizeof(record);
+  if (len % sizeof(record) != 0 || records == 0 ||
+      read_u32(trace) != MEMALLOC_TRACE_START) {
+    fprintf(stderr, "%s: %s: not a memory allocator trace\n",
+            program, argv[1]);
+    return 1;
+  }
+
+  brick_pool = read_u32(trace + 4);
+  brick_used = read_u32(trace + 8);
+  if (pool_size == 0) {
+    pool_size = brick_pool;
+  }
+
+  for (i=0; i<OPS; i++) {
+    latencies[i].ns = malloc(records * sizeof(U32));
+    if (latencies[i].ns == NULL) {
+      perror(program);
+      return 1;
+    }
+  }
+
+  /* At most half full, for short probe sequences. */
+  for (blocks.mask = 15; blocks.mask < 2 * records; blocks.mask = 2 *
+         blocks.mask + 1);
+  blocks.slots = calloc(blocks.mask + 1, sizeof(block_t));
+
+  pool = malloc(pool_size);
+  if (pool == NULL || blocks.slots == NULL) {
+    perror(program);
+    return 1;
+  }
+  nx_memalloc_init_full(pool, pool_size);
+
+  /* The brick's control structure is the usage it started from. */
+  totals.brick = totals.peak_brick = brick_used;
+
+  printf("%-10s %u records\n", "trace", records);
+  printf("%-10s %u bytes, %u used at start on the brick\n",
+         "pool", pool_size, brick_used);
+
+  for (i=1; i<records; i++) {
+    const U8 *data = trace + i * sizeof(record);
+
+    record.op = read_u32(data);
+    record.size = read_u32(data + 4);
+    record.ptr = read_u32(data + 8);
+    record.old = read_u32(data + 12);
+
+    if (record.op == MEMALLOC_TRACE_START || record.op >= OPS) {
+      fprintf(stderr, "%s: record %u: unknown operation %u\n",
+              program, i, record.op);
+      return 1;
+    }
+
+    if (!replay(&record)) {
+      printf("%-10s %s at record %u (%s of %u bytes)\n", "failed",
+             replay_error, i, op_names[record.op], record.size);
+      break;
+    }
+  }
+
+  putchar('\n');
+  report_latencies();
+
+  putchar('\n');
+  printf("%-10s %u bytes requested in %u blocks\n", "peak",
+         totals.peak_payload, totals.peak_live);
+  printf("%-10s %u bytes used on the brick (estimated)\n", "",
+         totals.peak_brick);
+  report_pool("host peak", &totals.at_peak, pool_size);
+
+  nx_memalloc_get_stats(&stats);
+  report_pool("host end", &stats, pool_size);
+
+  if (totals.unknown > 0) {
+    printf("%u operations on blocks allocated before the trace were "
+           "skipped\n", totals.unknown);
+  }
+
+  return i < records ? 1 : 0;
+}
@@ -15,6 +15,9 @@
 
 #include "marvin/scheduler.h"
 
+/** Largest object a task may allocate with mv__scheduler_alloc(). */
+#define MV_OBJECT_SIZE 16
+
 /** Initialize the scheduler. */
 void mv__scheduler_init(void);
 
@@ -46,4 +49,25 @@ void mv__scheduler_task_unblock(mv_task_t *task);
  */
 void mv__scheduler_task_suspend(U32 time);
 
+/** Allocate an object of @a size bytes for the current task.
+ *
+ * The object comes from a pool holding an object per task, for the
+ * bookkeeping of a blocked task, such as its semaphore wait queue
+ * entry. Allocating and freeing are constant time, and the object may
+ * be freed from interrupt context.
+ *
+ * @param size The object size, at most @a MV_OBJECT_SIZE bytes.
+ * @return A pointer to the object. Its content is undefined.
+ *
+ * @note The pool is created by mv__scheduler_init(), and grows as
+ * tasks are created.
+ */
+void *mv__scheduler_alloc(U32 size);
+
+/** Free an object allocated by mv__scheduler_alloc().
+ *
+ * @param ptr A pointer to the object.
+ */
+void mv__scheduler_free(void *ptr);
+
 #endif /* __NXOS_MARVIN__SCHEDULER_H__ */
@@ -6,7 +6,9 @@
  * the terms of the GNU Public License (GPL) version 2.
  */
 
+#include "base/nxt.h"
 #include "base/types.h"
+#include "base/util.h"
 #include "base/display.h"
 #include "base/lib/memalloc/memalloc.h"
 #include "base/drivers/systick.h"
@@ -18,6 +20,10 @@
 
 static mv_sem_t *beep_res;
 
+/* The tasks, whose stack high-water marks are displayed. */
+#define N_TASKS 4
+static mv_task_t *tasks[N_TASKS], *load_task;
+
 static void beep_consumer(void) {
   while(1) {
     mv_semaphore_dec(beep_res);
@@ -32,10 +38,35 @@ static void beep_producer(void) {
   }
 }
 
-U32 sleep_iter = 0, sleep_time = 0, wakeup_time = 0;
+/* Number of sleeps averaged by the sleep benchmark. */
+#define BENCH_SAMPLES 64
+
+#define CYCLES_PER_MS (NXT_CLOCK_FREQ / 1000)
+
+/* Average cycles to put a task to sleep, and to wake it up, and the
+ * worst wakeup.
+ */
+U32 sleep_iter = 0, sleep_cycles = 0, wakeup_cycles = 0, wakeup_max = 0;
+
+static volatile bool bench_sleeping = FALSE;
+static volatile U32 bench_switch_cycles;
+
+/* Background load of the benchmark: keeps the CPU busy at the lowest
+ * priority, so that the benchmark task is always woken up over a
+ * running task. Also notes when it takes over from the sleeping task.
+ */
+static void bench_load(void) {
+  while(1) {
+    if (bench_sleeping) {
+      bench_switch_cycles = nx_systick_get_cycles();
+      bench_sleeping = FALSE;
+    }
+  }
+}
 
 static void test_display(void) {
-  U32 counter = 0;
+  mv_task_t *idle = mv_scheduler_get_idle_task();
+  U32 counter = 0, i;
   nx_display_clear();
   while(1) {
     counter++;
@@ -44,19 +75,66 @@ static void test_display(void) {
     nx_display_end_line();
     nx_display_hex(sleep_iter);
     nx_display_end_line();
-    nx_display_uint(sleep_time);
+    nx_display_uint(sleep_cycles);
     nx_display_string(" / ");
-    nx_display_uint(wakeup_time);
+    nx_display_uint(wakeup_cycles);
+    nx_display_string("   ");
+    nx_display_end_line();
+    nx_display_uint(wakeup_max);
+    nx_display_string("   ");
+    nx_display_end_line();
+
+    /* Stack used by each task, by the load and by the idle task. */
+    for (i=0; i<N_TASKS; i++) {
+      nx_display_uint(mv_scheduler_get_stack_usage(tasks[i]));
+      nx_display_string(" ");
+    }
+    nx_display_end_line();
+    nx_display_uint(mv_scheduler_get_stack_usage(load_task));
+    nx_display_string(" ");
+    nx_display_uint(mv_scheduler_get_stack_usage(idle));
+    nx_display_string("/");
+    nx_display_uint(mv_scheduler_get_stack_size(idle));
+
+    mv_time_sleep(100);
   }
 }
 
+/* Measure the cycles a sleep and a wakeup cost, under load. A sleep is
+ * timed from the call to mv_time_sleep() until the load task runs in
+ * place of the sleeping task, and a wakeup from the tick the alarm
+ * expires on until the task runs again, preempting the load. Samples
+ * where a tick came before the alarm was set are dropped.
+ */
 static void test_sleep(void) {
+  U32 sleep_total = 0, wakeup_total = 0, worst = 0, samples = 0;
+
   while(1) {
-    mv_time_sleep(100);
-    sleep_time = nx_systick_get_ms();
-    mv_time_sleep(100);
-    wakeup_time = nx_systick_get_ms();
-    sleep_iter++;
+    U32 start, end, deadline;
+
+    mv_time_sleep(10);
+
+    deadline = (nx_systick_get_ms() + 1) * CYCLES_PER_MS;
+    bench_sleeping = TRUE;
+    start = nx_systick_get_cycles();
+    mv_time_sleep(1);
+    end = nx_systick_get_cycles();
+
+    if (bench_sleeping || end - deadline >= CYCLES_PER_MS) {
+      bench_sleeping = FALSE;
+      continue;
+    }
+
+    sleep_total += bench_switch_cycles - start;
+    wakeup_total += end - deadline;
+    worst = MAX(worst, end - deadline);
+    if (++samples == BENCH_SAMPLES) {
+      sleep_cycles = sleep_total / BENCH_SAMPLES;
+      wakeup_cycles = wakeup_total / BENCH_SAMPLES;
+      wakeup_max = worst;
+      sleep_total = wakeup_total = worst = samples = 0;
+      sleep_iter++;
+    }
   }
 }
 
@@ -64,9 +142,10 @@ void main(void) {
   nx_memalloc_init();
   mv__scheduler_init();
   beep_res = mv_semaphore_create(0);
-  mv_scheduler_create_task(beep_consumer, 512);
-  mv_scheduler_create_task(beep_producer, 512);
-  mv_scheduler_create_task(test_display, 512);
-  mv_scheduler_create_task(test_sleep, 512);
+  tasks[0] = mv_scheduler_create_task(beep_consumer, 512, 2);
+  tasks[1] = mv_scheduler_create_task(beep_producer, 512, 2);
+  tasks[2] = mv_scheduler_create_task(test_display, 512, 1);
+  tasks[3] = mv_scheduler_create_task(test_sleep, 512, MV_PRIORITY_HIGH);
+  load_task = mv_scheduler_create_task(bench_load, 512, MV_PRIORITY_LOW);
   mv__scheduler_run();
 }
@@ -8,11 +8,13 @@
 
 #include "base/core.h"
 #include "base/assert.h"
+#include "base/util.h"
 #include "base/interrupts.h"
 #include "base/display.h"
 #include "base/drivers/systick.h"
 #include "base/drivers/avr.h"
 #include "base/lib/memalloc/memalloc.h"
+#include "base/lib/memalloc/pool.h"
 #include "base/asm_decls.h"
 
 #include "marvin/_task.h"
@@ -21,21 +23,32 @@
 #include "marvin/_scheduler.h"
 
 /* Time in milliseconds (actually in number of systick callbacks)
- * between context switches.
+ * between context switches of tasks of the same priority.
  */
 #define TASK_EXECUTION_QUANTUM 2
 
-/* An alarm calendar entry. */
-struct mv_alarm_entry {
-  U32 wakeup_time;
-  mv_task_t *task;
-  struct mv_alarm_entry *prev, *next;
-};
+/* Longest time in milliseconds the scheduler callbacks are held off
+ * while the idle task runs, so that the cancel button still works.
+ */
+#define IDLE_MAX_HOLD 100
+
+/* Task stacks are painted with this pattern when created, so that the
+ * deepest point a stack ever reached shows as the last overwritten word.
+ */
+#define STACK_PAINT 0xDEADBEEF
+
+/* The lowest word of each stack holds this canary. It is checked every
+ * time the task is switched out, to catch overflows early.
+ */
+#define STACK_CANARY 0xC0DEFEED
 
 /* A task descriptor. */
 struct mv_task {
   U32 *stack_base; /* The stack base (allocated pointer). */
   U32 *stack_current; /* The current position of the stack pointer. */
+  U32 stack_size; /* The stack size in bytes. */
+  U32 priority; /* The static priority, higher runs first. */
+  U32 wakeup_time; /* The time a suspended task wakes up at. */
 
   /** Task state. */
   enum {
@@ -51,16 +64,41 @@ struct mv_task {
 
 /* The state of the scheduler. */
 static struct {
-  struct mv_task *tasks_ready; /* All the ready tasks waiting for CPU time. */
+  /* The ready tasks waiting for CPU time, by priority. */
+  struct mv_task *tasks_ready[MV_PRIORITY_LEVELS];
+  U32 ready_priorities; /* Bit N is set when tasks_ready[N] is not empty. */
+  bool preempt; /* A task of higher priority than the current one woke. */
   struct mv_task *tasks_blocked; /* Unschedulable tasks. */
 
   struct mv_task *task_current; /* The task currently consuming CPU. */
   struct mv_task *task_idle; /* The idle task. */
+  nx_closure_t idle_hook; /* Background work run by the idle task. */
 
-  struct mv_alarm_entry *alarms_pending; /* A list of pending wakeup calls. */
+  /* The suspended tasks, as a binary min-heap on their wakeup time. */
+  struct mv_task **alarms;
+  U32 alarms_count; /* The number of suspended tasks. */
 
   U32 last_context_switch; /* The time of the last context switch. */
-} sched_state = { NULL, NULL, NULL, NULL, NULL, 0 };
+  U32 tasks_count; /* The number of tasks, not counting the idle task. */
+} sched_state = { { NULL }, 0, FALSE, NULL, NULL, NULL, NULL, NULL, 0, 0, 0 };
+
+/* The highest bit set in each 4-bit value. The ARM7TDMI has no count
+ * leading zeros instruction, so the highest ready priority is found
+ * with two lookups instead.
+ */
+#if MV_PRIORITY_LEVELS > 8
+# error "The ready priorities lookup only handles 8 priorities"
+#endif
+static const U8 highest_bit[16] = {
+  0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3,
+};
+
+/* The objects tasks hold while they are blocked, such as semaphore
+ * handles. They may be freed in interrupt context, where the memory
+ * allocator cannot be used.
+ */
+static pool_t sched_pool;
+static U32 sched_pool_count; /* The number of objects in sched_pool. */
 
 /* The scheduler lock count. This is a recursive mutex that protects
  * the data in sched_state.
@@ -76,19 +114,95 @@ static enum {
   CMD_DIE,   /* The preempted tasks asked to be killed. */
 } task_command = CMD_NONE;
 
-/* Decide on the next task to run. */
+/* Add @a task to the ready list of its priority. */
+static inline void ready_add(mv_task_t *task) {
+  mv_list_add_tail(sched_state.tasks_ready[task->priority], task);
+  sched_state.ready_priorities |= 1 << task->priority;
+}
+
+/* Remove @a task from the ready list of its priority. */
+static inline void ready_remove(mv_task_t *task) {
+  mv_list_remove(sched_state.tasks_ready[task->priority], task);
+  if (mv_list_is_empty(sched_state.tasks_ready[task->priority]))
+    sched_state.ready_priorities &= ~(1 << task->priority);
+}
+
+/* Decide on the next task to run: the next one in turn among the ready
+ * tasks of highest priority.
+ */
 static inline void reschedule(void) {
-  if (mv_list_is_empty(sched_state.tasks_ready)) {
+  U32 ready = sched_state.ready_priorities;
+
+  sched_state.preempt = FALSE;
+
+  if (ready == 0) {
     sched_state.task_current = sched_state.task_idle;
   } else {
-    sched_state.task_current = mv_list_get_head(sched_state.tasks_ready);
-    mv_list_rotate_forward(sched_state.tasks_ready);
+    U32 prio = (ready >> 4) ? 4 + highest_bit[ready >> 4] : highest_bit[ready];
+    sched_state.task_current = mv_list_get_head(sched_state.tasks_ready[prio]);
+    mv_list_rotate_forward(sched_state.tasks_ready[prio]);
+  }
+}
+
+/* Check that @a task did not overflow its stack. */
+static inline void check_stack(mv_task_t *task) {
+  NX_ASSERT_MSG(task->stack_base[0] == STACK_CANARY &&
+                task->stack_current > task->stack_base,
+                "Stack overflow");
+}
+
+/* The alarms heap keeps the task that wakes up first in alarms[0]. The
+ * children of alarms[i] are alarms[2i+1] and alarms[2i+2], and wake up
+ * no earlier than it. Adding and expiring an alarm take O(log n) moves.
+ * The heap has room for every task, and grows as tasks are created.
+ */
+
+/* Add @a task to the alarms, to wake up at its wakeup time. */
+static inline void alarm_add(mv_task_t *task) {
+  mv_task_t **heap = sched_state.alarms;
+  U32 i = sched_state.alarms_count++;
+
+  NX_ASSERT(i < sched_state.tasks_count);
+
+  /* Move the parents that wake up later down, until the task fits. */
+  while (i > 0) {
+    U32 parent = (i - 1) / 2;
+
+    if (heap[parent]->wakeup_time <= task->wakeup_time)
+      break;
+    heap[i] = heap[parent];
+    i = parent;
   }
+  heap[i] = task;
+}
+
+/* Remove and return the task that wakes up first. */
+static inline mv_task_t *alarm_pop(void) {
+  mv_task_t **heap = sched_state.alarms;
+  mv_task_t *first = heap[0];
+  mv_task_t *last = heap[--sched_state.alarms_count];
+  U32 count = sched_state.alarms_count, i = 0, child;
+
+  /* Move the last task down from the root, swapping it with its
+   * earliest child until it wakes up no later than its children.
+   */
+  while ((child = 2*i + 1) < count) {
+    if (child + 1 < count &&
+        heap[child + 1]->wakeup_time < heap[child]->wakeup_time)
+      child++;
+    if (last->wakeup_time <= heap[child]->wakeup_time)
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+
+  return first;
 }
 
 /* Destroy the task that was just preempted. */
 static inline void destroy_running_task(void) {
-  mv_list_remove(sched_state.tasks_ready, sched_state.task_current);
+  ready_remove(sched_state.task_current);
   nx_free(sched_state.task_current->stack_base);
   nx_free(sched_state.task_current);
   sched_state.task_current = NULL;
@@ -135,23 +249,36 @@ static void scheduler_cb(void) {
   }
 
   /* Wake up tasks that have scheduled alarms. */
-  while (!mv_list_is_empty(sched_state.alarms_pending) &&
-         sched_state.alarms_pending->wakeup_time <= time) {
-    struct mv_alarm_entry *a = sched_state.alarms_pending;
-    mv_list_remove(sched_state.alarms_pending, sched_state.alarms_pending);
-    mv__scheduler_task_unblock(a->task);
-    nx_free(a);
-  }
+  while (sched_state.alarms_count > 0 &&
+         sched_state.alarms[0]->wakeup_time <= time)
+    mv__scheduler_task_unblock(alarm_pop());
+
+  /* A woken task of higher priority runs right away. */
+  if (sched_state.preempt)
+    need_reschedule = TRUE;
 
   /* Task switching time? */
   if (need_reschedule) {
-    if (sched_state.task_current != NULL)
+    if (sched_state.task_current != NULL) {
       sched_state.task_current->stack_current = mv__task_get_stack();
+      check_stack(sched_state.task_current);
+    }
     reschedule();
     mv__task_set_stack(sched_state.task_current->stack_current);
     sched_state.last_context_switch = nx_systick_get_ms();
   }
 
+  /* Only an alarm can wake a task up while the idle task runs. Skip the
+   * scheduler ticks until the next one is due.
+   */
+  if (sched_state.task_current == sched_state.task_idle) {
+    U32 wakeup = time + IDLE_MAX_HOLD;
+
+    if (sched_state.alarms_count > 0)
+      wakeup = MIN(wakeup, sched_state.alarms[0]->wakeup_time);
+    nx_systick_hold_scheduler(wakeup);
+  }
+
   sched_lock = 0;
 }
 
@@ -165,14 +292,22 @@ static void task_shutdown(void) {
 /* Build a new task descriptor for a task that will run the given
  * function when activated.
  */
-static mv_task_t *new_task(nx_closure_t func, U32 stack_size) {
+static mv_task_t *new_task(nx_closure_t func, U32 stack_size,
+                           U32 priority) {
   mv_task_t *t;
   nx_task_stack_t *s;
+  U32 i;
 
   NX_ASSERT_MSG((stack_size & 0x3) == 0, "Stack must be\n4-byte aligned");
+  NX_ASSERT_MSG(stack_size > sizeof(*s) + sizeof(U32), "Stack too small");
 
   t = nx_calloc(1, sizeof(*t));
-  t->stack_base = nx_calloc(1, stack_size);
+  t->stack_base = nx_malloc(stack_size);
+  t->stack_size = stack_size;
+  t->priority = priority;
+  for (i=1; i<stack_size/sizeof(U32); i++)
+    t->stack_base[i] = STACK_PAINT;
+  t->stack_base[0] = STACK_CANARY;
   t->stack_current = (U32*) ((U32)t->stack_base + stack_size - sizeof(*s));
   s = (nx_task_stack_t*)t->stack_current;
   s->pc = (U32) func;
@@ -191,7 +326,9 @@ static mv_task_t *new_task(nx_closure_t func, U32 stack_size) {
 
 /* The idle task is where the scheduler first starts up, with interrupt
  * handling disabled. So we reenable it before getting on with out
- * Important Work: doing nothing.
+ * Important Work: doing nothing, with the processor stopped between
+ * interrupts. A task woken up by an alarm preempts the idle task from
+ * the scheduler callback, so there is no need to yield.
  */
 static void task_idle(void) {
   mv_scheduler_yield(FALSE);
@@ -203,16 +340,34 @@ static void task_idle(void) {
      */
     if (mv_list_is_empty(sched_state.tasks_blocked))
       NX_FAIL("All tasks dead");
-    mv_scheduler_yield(FALSE);
+    /* A task woken up while the hook runs must not preempt it, as it
+     * may use what the hook is in the middle of using.
+     */
+    if (sched_state.idle_hook) {
+      mv_scheduler_lock();
+      sched_state.idle_hook();
+      mv_scheduler_unlock();
+    }
+    nx_core_idle();
   }
 }
 
 void mv__scheduler_init(void) {
-  sched_state.task_idle = new_task(task_idle, 128);
+  /* A blocked task waits on a single semaphore at a time, so it never
+   * holds more than one pool object. The pool grows as tasks are
+   * created.
+   */
+  U32 size = MV_OBJECT_SIZE;
+
+  sched_pool_count = 1;
+  nx_pool_init(&sched_pool, &size, &sched_pool_count, 1);
+
+  sched_state.task_idle = new_task(task_idle, MV_IDLE_STACK_SIZE, 0);
   /* The idle task doesn't start with a rolled up task state. Rewind its
-   * current stack position.
+   * current stack position to the top of the stack.
    */
-  sched_state.task_idle->stack_current += sizeof(nx_task_stack_t);
+  sched_state.task_idle->stack_current +=
+    sizeof(nx_task_stack_t) / sizeof(U32);
   sched_state.task_current = sched_state.task_idle;
 }
 
@@ -226,7 +381,7 @@ void mv__scheduler_run(void) {
 void mv__scheduler_task_block(void) {
   mv_scheduler_lock();
   NX_ASSERT(sched_state.task_current->state == READY);
-  mv_list_remove(sched_state.tasks_ready, sched_state.task_current);
+  ready_remove(sched_state.task_current);
   sched_state.task_current->state = BLOCKED;
   mv_list_add_tail(sched_state.tasks_blocked, sched_state.task_current);
   mv_scheduler_unlock();
@@ -237,40 +392,25 @@ void mv__scheduler_task_unblock(mv_task_t *task) {
   NX_ASSERT(task->state == BLOCKED);
   mv_list_remove(sched_state.tasks_blocked, task);
   task->state = READY;
-  mv_list_add_tail(sched_state.tasks_ready, task);
+  ready_add(task);
+
+  /* The idle task, and a task that just died, have no priority. */
+  if (sched_state.task_current == NULL ||
+      sched_state.task_current == sched_state.task_idle ||
+      task->priority > sched_state.task_current->priority)
+    sched_state.preempt = TRUE;
   mv_scheduler_unlock();
 }
 
 void mv__scheduler_task_suspend(U32 time) {
-  struct mv_alarm_entry *a;
-  mv_scheduler_lock();
-  NX_ASSERT(sched_state.task_current->state == READY);
+  mv_task_t *task = sched_state.task_current;
 
-  /* Prepare the alarm descriptor. */
-  a = nx_calloc(1, sizeof(*a));
-  a->wakeup_time = nx_systick_get_ms() + time;
-  a->task = sched_state.task_current;
+  mv_scheduler_lock();
+  NX_ASSERT(task->state == READY);
 
+  task->wakeup_time = nx_systick_get_ms() + time;
   mv__scheduler_task_block();
-
-  /* If the alarm list is empty, the initialization is
-   * trivial. Otherwise, we need to locate the correct place in the list
-   * for a sorted insertion.
-   */
-  if (mv_list_is_empty(sched_state.alarms_pending)) {
-    mv_list_init_singleton(sched_state.alarms_pending, a);
-  } else if (a->wakeup_time <= sched_state.alarms_pending->wakeup_time) {
-    mv_list_add_head(sched_state.alarms_pending, a);
-  } else if (a->wakeup_time >= sched_state.alarms_pending->prev->wakeup_time) {
-    mv_list_add_tail(sched_state.alarms_pending, a);
-  } else {
-    struct mv_alarm_entry *ptr = sched_state.alarms_pending;
-
-    while(ptr->next->wakeup_time < a->wakeup_time)
-      ptr = ptr->next;
-
-    mv_list_insert_after(ptr, a);
-  }
+  alarm_add(task);
 
   /* The alarm is programmed and the task configured to block. It will
    * be preempted when the scheduler completely unlocks.
@@ -278,11 +418,44 @@ void mv__scheduler_task_suspend(U32 time) {
   mv_scheduler_unlock();
 }
 
-void mv_scheduler_create_task(nx_closure_t func, U32 stack) {
-  mv_task_t *t = new_task(func, stack);
+void *mv__scheduler_alloc(U32 size) {
+  void *ptr = nx_pool_alloc(&sched_pool, size);
+  NX_ASSERT_MSG(ptr != NULL, "Out of task\nobjects");
+  return ptr;
+}
+
+void mv__scheduler_free(void *ptr) {
+  nx_pool_free(&sched_pool, ptr);
+}
+
+mv_task_t *mv_scheduler_create_task(nx_closure_t func, U32 stack,
+                                    U32 priority) {
+  mv_task_t *t;
+
+  NX_ASSERT(priority < MV_PRIORITY_LEVELS);
+
   mv_scheduler_lock();
-  mv_list_add_tail(sched_state.tasks_ready, t);
+  t = new_task(func, stack, priority);
+
+  /* Every task may be suspended at once. The scheduler callback does
+   * not look at the alarms while the scheduler is locked, so the heap
+   * may move.
+   */
+  sched_state.alarms = nx_realloc(sched_state.alarms,
+                                  (sched_state.tasks_count + 1) *
+                                  sizeof(mv_task_t *));
+  ready_add(t);
+  sched_state.tasks_count++;
+
+  /* Double the pool when the tasks outnumber its objects, so that it
+   * only grows in a few blocks.
+   */
+  if (sched_state.tasks_count > sched_pool_count) {
+    nx_pool_grow(&sched_pool, MV_OBJECT_SIZE, sched_pool_count);
+    sched_pool_count *= 2;
+  }
   mv_scheduler_unlock();
+  return t;
 }
 
 void mv_scheduler_yield(bool unlock) {
@@ -293,10 +466,37 @@ void mv_scheduler_yield(bool unlock) {
   nx_systick_call_scheduler();
 }
 
+void mv_scheduler_set_idle_hook(nx_closure_t hook) {
+  mv_scheduler_lock();
+  sched_state.idle_hook = hook;
+  mv_scheduler_unlock();
+}
+
 mv_task_t *mv_scheduler_get_current_task(void) {
   return sched_state.task_current;
 }
 
+mv_task_t *mv_scheduler_get_idle_task(void) {
+  return sched_state.task_idle;
+}
+
+U32 mv_scheduler_get_stack_size(mv_task_t *task) {
+  return task->stack_size;
+}
+
+U32 mv_scheduler_get_stack_usage(mv_task_t *task) {
+  U32 i = 1;
+
+  /* The stack grows down: the first word above the canary that lost
+   * its paint marks the deepest point reached.
+   */
+  while (i < task->stack_size/sizeof(U32) &&
+         task->stack_base[i] == STACK_PAINT)
+    i++;
+
+  return task->stack_size - i*sizeof(U32);
+}
+
 void mv_scheduler_lock(void) {
   /* Because the lock prevents the scheduler from preempting the task,
    * there is no need for fancy atomic operations here.
@@ -308,7 +508,7 @@ void mv_scheduler_unlock(void) {
   if (sched_lock == 1) {
     U32 delta = nx_systick_get_ms() - sched_state.last_context_switch;
     if (sched_state.task_current->state == BLOCKED ||
-        delta >= TASK_EXECUTION_QUANTUM) {
+        sched_state.preempt || delta >= TASK_EXECUTION_QUANTUM) {
       nx_systick_mask_scheduler();
       task_command = CMD_YIELD;
       sched_lock--;
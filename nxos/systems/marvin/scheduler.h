@@ -17,22 +17,53 @@
 
 typedef struct mv_task mv_task_t;
 
+/** Number of task priorities. */
+#define MV_PRIORITY_LEVELS 8
+
+/** Lowest task priority. It still runs ahead of the idle task. */
+#define MV_PRIORITY_LOW 0
+
+/** Highest task priority. */
+#define MV_PRIORITY_HIGH (MV_PRIORITY_LEVELS - 1)
+
+/** Size of the idle task's stack, in bytes. The idle hook runs on it:
+ * nx_fs_defrag_step() and the flash driver calls below it take a
+ * little under 900 bytes.
+ */
+#define MV_IDLE_STACK_SIZE 1024
+
 /** Create a new task executing @a func, with @a stack bytes of stack.
  *
  * The task is placed in the ready state and enqueued for CPU time.
  *
+ * The scheduler always runs a ready task of the highest priority, and
+ * tasks of the same priority share the CPU in turn. When a task of
+ * higher priority than the running one is woken up, it preempts the
+ * running task at once. A task of lower priority only runs when all
+ * the tasks above it are blocked.
+ *
+ * The stack is painted with a known pattern, so that
+ * mv_scheduler_get_stack_usage() can later tell how much of it the
+ * task used. Its lowest word holds a canary, checked each time the
+ * task is switched out: a task that overflowed its stack stops the
+ * brick with a "Stack overflow" assertion.
+ *
  * @param func The function the new task should execute.
  * @param stack The size of the task stack in bytes.
+ * @param priority The task priority, from @a MV_PRIORITY_LOW to
+ * @a MV_PRIORITY_HIGH.
+ * @return A handle to the new task.
  *
  * @warning The stack should have sizeof(nx_task_stack_t) bytes
  * available for task switching at all times.
  *
- * @warning Currently this function can only be run before the scheduler
- * starts up.
+ * @note Tasks may be created before the scheduler starts, or by a
+ * running task, but not from an interrupt handler.
  *
  * @note The usual size for the task stack is 1k, ie. 1024 bytes.
  */
-void mv_scheduler_create_task(nx_closure_t func, U32 stack);
+mv_task_t *mv_scheduler_create_task(nx_closure_t func, U32 stack,
+                                    U32 priority);
 
 /** Explicitely yield the CPU.
  *
@@ -44,12 +75,62 @@ void mv_scheduler_create_task(nx_closure_t func, U32 stack);
  */
 void mv_scheduler_yield(bool unlock);
 
+/** Set the function the idle task runs when no task is ready.
+ *
+ * This is meant for short background work, such as defragmenting the
+ * flash a few pages at a time with nx_fs_defrag_step(), or erasing free
+ * pages ahead of time with nx_fs_erase_step(). The hook is run each
+ * time the idle task wakes up, that is after every interrupt, so at
+ * least once per millisecond. Between runs, the processor is stopped.
+ *
+ * The hook runs with the scheduler locked, on the idle task's stack of
+ * @a MV_IDLE_STACK_SIZE bytes. A task woken up meanwhile, by an alarm
+ * or an interrupt, only runs once the hook returns. Since no other
+ * task is ready when the hook starts, the hook and the tasks never
+ * interrupt each other in the middle of using a driver or library.
+ * Keep each run short, as it delays these wakeups.
+ *
+ * @param hook The function to run, or NULL to run nothing.
+ */
+void mv_scheduler_set_idle_hook(nx_closure_t hook);
+
 /** Return a handle to the current task.
  *
  * @return The mv_task_t handle of the current task.
  */
 mv_task_t *mv_scheduler_get_current_task(void);
 
+/** Return a handle to the idle task.
+ *
+ * The idle hook runs on the idle task's stack.
+ *
+ * @return The mv_task_t handle of the idle task.
+ */
+mv_task_t *mv_scheduler_get_idle_task(void);
+
+/** Return the stack size of @a task.
+ *
+ * @param task The task.
+ * @return The size of the task stack in bytes.
+ */
+U32 mv_scheduler_get_stack_size(mv_task_t *task);
+
+/** Return the high-water mark of @a task's stack.
+ *
+ * This is the most stack the task has used since it was created,
+ * including the space its context takes when it is switched out. Run
+ * a task through its worst case, then compare this with
+ * mv_scheduler_get_stack_size() to size its stack.
+ *
+ * @param task The task.
+ * @return The number of stack bytes used so far.
+ *
+ * @note The measure relies on the task overwriting the stack paint. A
+ * task that writes the paint pattern itself to the stack, or that
+ * reserves stack it never writes, may read a little low.
+ */
+U32 mv_scheduler_get_stack_usage(mv_task_t *task);
+
 /** Increment the scheduler lock.
  *
  * The scheduler lock is recursive. If you lock it N times, you must
@@ -29,7 +29,7 @@ struct mv_sem {
 };
 
 static struct sem_task_handle *make_sem_task_handle(mv_task_t *task) {
-  struct sem_task_handle *h = nx_calloc(1, sizeof(*h));
+  struct sem_task_handle *h = mv__scheduler_alloc(sizeof(*h));
   h->task = task;
   return h;
 }
@@ -86,7 +86,7 @@ void mv_semaphore_inc(mv_sem_t *sem) {
   if (sem->count <= 0) {
     struct sem_task_handle *h = mv_list_pop_head(sem->blocked_tasks);
     mv__scheduler_task_unblock(h->task);
-    nx_free(h);
+    mv__scheduler_free(h);
   }
 
   mv_scheduler_unlock();
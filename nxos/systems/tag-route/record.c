@@ -26,16 +26,11 @@ void record(char *filename) {
     if (nx_gui_text_menu_yesno("Overwrite?")) {
       nx_display_clear();
 
-      nx_fs_open(filename, FS_FILE_MODE_OPEN, &fd);
-      if (nx_fs_unlink(fd) != FS_ERR_NO_ERROR) {
+      /* Rewrite the route in place, in the room the old one used. */
+      if (nx_fs_open(filename, FS_FILE_MODE_TRUNCATE, &fd) != FS_ERR_NO_ERROR) {
         nx_display_string("Erase error.\n");
         return;
       }
-
-      if (nx_fs_open(filename, FS_FILE_MODE_CREATE, &fd) != FS_ERR_NO_ERROR) {
-        nx_display_string("Create error.\n");
-        return;
-      }
     } else {
       nx_display_string("Aborting.\n");
       return;
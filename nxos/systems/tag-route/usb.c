@@ -64,7 +64,6 @@ void usb_recv(void) {
 fs_err_t usb_recv_to(fs_fd_t fd) {
   U8 buf[RCMD_BUF_LEN];
   fs_err_t err;
-  size_t i;
 
   do {
     memset(buf, 0, RCMD_BUF_LEN);
@@ -74,11 +73,9 @@ fs_err_t usb_recv_to(fs_fd_t fd) {
       continue;
     }
 
-    for (i=0; i<strlen((char *)buf); i++) {
-      err = nx_fs_write(fd, buf[i]);
-      if (err != FS_ERR_NO_ERROR) {
-        return err;
-      }
+    err = nx_fs_write_buf(fd, buf, strlen((char *)buf));
+    if (err != FS_ERR_NO_ERROR) {
+      return err;
     }
 
     err = nx_fs_write(fd, (U8)'\n');
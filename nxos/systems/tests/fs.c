@@ -15,11 +15,16 @@
 #include "base/drivers/_efc.h"
 #include "base/drivers/systick.h"
 #include "base/lib/fs/fs.h"
+#include "base/lib/kv/kv.h"
+#include "base/lib/module/module.h"
 #include "fs.h"
 
 #define TEST_ZONE_START 128
 #define TEST_ZONE_END 256
 
+/* Amount of data moved by the I/O benchmarks. */
+#define BENCH_BYTES 4096
+
 union U32tochar {
   U32 integers[8];
   char chars[32];
@@ -80,7 +85,7 @@ void fs_test_dump(void) {
 }
 
 void fs_test_infos(void) {
-  U32 files = 0, used = 0, free_pages = 0, wasted = 0;
+  U32 files = 0, used = 0, free_pages = 0, wasted = 0, min = 0, max = 0;
 
   nx_display_clear();
   nx_display_string("- FS stats -\n\n");
@@ -98,6 +103,13 @@ void fs_test_infos(void) {
 
   nx_display_uint(wasted);
   nx_display_string("B wasted.\n");
+
+  nx_fs_get_wear_stats(NULL, &min, &max);
+  nx_display_string("Wear: ");
+  nx_display_uint(min);
+  nx_display_string("-");
+  nx_display_uint(max);
+  nx_display_end_line();
 }
 
 void fs_test_defrag_empty(void) {
@@ -163,6 +175,11 @@ static void spawn_file_at(char *name, U32 origin, size_t size) {
   memcpy(metadata+2, nameconv.integers, 32);
 
   nx__efc_write_page(metadata, origin);
+
+  /* The file was written behind the file system's back, rebuild its
+   * index.
+   */
+  nx_fs_init();
 }
 
 void fs_test_defrag_for_file(void) {
@@ -231,3 +248,598 @@ void fs_test_defrag_best_overall(void) {
 
   destroy();
 }
+
+/* Defragments the flash in small steps, writing to a file between
+ * two of them.
+ */
+void fs_test_defrag_step(void) {
+  U32 steps = 0;
+  bool done = FALSE;
+  fs_fd_t fd;
+
+  setup();
+
+  nx_display_clear();
+  nx_display_string("Starting...\n");
+
+  spawn_file("test1", 1000);  // 128:test1 (5 pages - removed)
+  spawn_file("test2", 2000);  // 133:test2 (8 pages)
+  spawn_file("test3", 300);   // 141:test3 (2 pages)
+  remove_file("test1");
+
+  while (!done) {
+    if (nx_fs_defrag_step(2, &done) != FS_ERR_NO_ERROR) {
+      nx_display_string("Error!\n");
+      break;
+    }
+
+    /* Writes may happen between steps. */
+    if (steps++ == 3 &&
+        nx_fs_open("test3", FS_FILE_MODE_APPEND, &fd) == FS_ERR_NO_ERROR) {
+      nx_fs_write(fd, 'C');
+      nx_fs_close(fd);
+    }
+  }
+
+  nx_display_string("Steps: ");
+  nx_display_uint(steps);
+  nx_display_end_line();
+  while (nx_avr_get_button() != BUTTON_OK);
+  nx_systick_wait_ms(500);
+
+  nx_display_clear();
+  nx_fs_dump();
+  while (nx_avr_get_button() != BUTTON_OK);
+  nx_systick_wait_ms(500);
+
+  destroy();
+}
+
+/* Times writing a file over freed pages, before and after erasing
+ * them ahead of time.
+ */
+void fs_test_erase_step(void) {
+  U32 start, pages = 0;
+  bool done = FALSE;
+
+  setup();
+
+  nx_display_clear();
+  nx_display_string("Starting...\n");
+
+  spawn_file("test1", 2000);  // 128:test1 (8 pages - removed)
+  remove_file("test1");
+
+  start = nx_systick_get_ms();
+  spawn_file("test2", 2000);  // 128:test2 (8 pages - removed)
+  nx_display_string("Dirty: ");
+  nx_display_uint(nx_systick_get_ms() - start);
+  nx_display_string("ms\n");
+  remove_file("test2");
+
+  while (!done) {
+    if (nx_fs_erase_step(1, &done) != FS_ERR_NO_ERROR) {
+      nx_display_string("Error!\n");
+      break;
+    }
+
+    pages++;
+  }
+
+  start = nx_systick_get_ms();
+  spawn_file("test3", 2000);  // 128:test3 (8 pages)
+  nx_display_string("Erased: ");
+  nx_display_uint(nx_systick_get_ms() - start);
+  nx_display_string("ms\n");
+
+  nx_display_string("Steps: ");
+  nx_display_uint(pages);
+  nx_display_end_line();
+  while (nx_avr_get_button() != BUTTON_OK);
+  nx_systick_wait_ms(500);
+
+  destroy();
+}
+
+static void bench_display(char *what, U32 ms) {
+  nx_display_string(what);
+  nx_display_uint(ms ? BENCH_BYTES * 1000 / ms : 0);
+  nx_display_string("B/s\n");
+}
+
+/* Compares the throughput of the per-byte, block and mapped I/O paths. */
+void fs_test_bench_block_io(void) {
+  U8 buf[EFC_PAGE_BYTES];
+  const U8 *mapped;
+  U32 start, i, j;
+  size_t read;
+  fs_fd_t fd;
+
+  setup();
+
+  nx_display_clear();
+  nx_display_string("- FS I/O bench -\n\n");
+
+  /* Per-byte path. */
+  start = nx_systick_get_ms();
+  nx_fs_open("bench1", FS_FILE_MODE_CREATE, &fd);
+  for (i=0; i<BENCH_BYTES; i++) {
+    nx_fs_write(fd, i);
+  }
+  nx_fs_close(fd);
+  bench_display("wr1: ", nx_systick_get_ms() - start);
+
+  start = nx_systick_get_ms();
+  nx_fs_open("bench1", FS_FILE_MODE_OPEN, &fd);
+  while (nx_fs_read(fd, buf) == FS_ERR_NO_ERROR);
+  nx_fs_close(fd);
+  bench_display("rd1: ", nx_systick_get_ms() - start);
+
+  /* Block path. */
+  for (i=0; i<EFC_PAGE_BYTES; i++) {
+    buf[i] = i;
+  }
+
+  start = nx_systick_get_ms();
+  nx_fs_open("bench2", FS_FILE_MODE_CREATE, &fd);
+  for (i=0; i<BENCH_BYTES; i+=EFC_PAGE_BYTES) {
+    nx_fs_write_buf(fd, buf, EFC_PAGE_BYTES);
+  }
+  nx_fs_close(fd);
+  bench_display("wrN: ", nx_systick_get_ms() - start);
+
+  start = nx_systick_get_ms();
+  nx_fs_open("bench2", FS_FILE_MODE_OPEN, &fd);
+  while (nx_fs_read_buf(fd, buf, EFC_PAGE_BYTES, &read) == FS_ERR_NO_ERROR);
+  nx_fs_close(fd);
+  bench_display("rdN: ", nx_systick_get_ms() - start);
+
+  /* Mapped path, reading the bytes in place. */
+  start = nx_systick_get_ms();
+  nx_fs_open("bench2", FS_FILE_MODE_OPEN, &fd);
+  i = 0;
+  while (nx_fs_mmap(fd, &mapped, &read) == FS_ERR_NO_ERROR) {
+    for (j=0; j<read && mapped[j] == (U8)(i + j); j++);
+
+    i += j;
+    if (j != read) {
+      break;
+    }
+  }
+  nx_fs_close(fd);
+  bench_display("map: ", nx_systick_get_ms() - start);
+
+  if (i != BENCH_BYTES) {
+    nx_display_string("map mismatch\n");
+  }
+
+  nx_fs_get_cache_stats(&i, &j, &start);
+  nx_display_string("hit/miss: ");
+  nx_display_uint(i);
+  nx_display_string("/");
+  nx_display_uint(j);
+  nx_display_end_line();
+
+  while (nx_avr_get_button() != BUTTON_OK);
+  nx_systick_wait_ms(500);
+
+  destroy();
+}
+
+/* Appends to a file followed by another one, which gives the first
+ * file a new extent instead of relocating it.
+ */
+void fs_test_append_extents(void) {
+  U32 start, i;
+  fs_fd_t fd;
+
+  setup();
+
+  nx_display_clear();
+  nx_display_string("Starting...\n");
+
+  spawn_file("test1", 200);  // 128:test1 (1 page)
+  spawn_file("test2", 10);   // 129:test2 (1 page)
+
+  start = nx_systick_get_ms();
+  nx_fs_open("test1", FS_FILE_MODE_APPEND, &fd);
+  for (i=0; i<100; i++) {
+    nx_fs_write(fd, 'B');
+  }
+  nx_fs_close(fd);
+
+  nx_display_string("Append: ");
+  nx_display_uint(nx_systick_get_ms() - start);
+  nx_display_string("ms\n");
+  while (nx_avr_get_button() != BUTTON_OK);
+  nx_systick_wait_ms(500);
+
+  nx_display_clear();
+  nx_fs_dump();
+  while (nx_avr_get_button() != BUTTON_OK);
+  nx_systick_wait_ms(500);
+
+  destroy();
+}
+
+/* Reserves room for a file followed by another one, so that appending
+ * to it neither relocates it nor gives it a new extent. It is then
+ * rewritten in place.
+ */
+void fs_test_reserve(void) {
+  U32 start, i;
+  fs_fd_t fd;
+
+  setup();
+
+  nx_display_clear();
+  nx_display_string("Starting...\n");
+
+  spawn_file("test1", 200);  // 128:test1 (1 page)
+  spawn_file("test2", 10);   // 129:test2 (1 page)
+
+  start = nx_systick_get_ms();
+  nx_fs_open("test1", FS_FILE_MODE_APPEND, &fd);
+  nx_fs_reserve(fd, 2000);
+  for (i=200; i<2000; i++) {
+    nx_fs_write(fd, 'R');
+  }
+  nx_fs_close(fd);
+
+  nx_display_string("Reserved: ");
+  nx_display_uint(nx_systick_get_ms() - start);
+  nx_display_string("ms\n");
+
+  start = nx_systick_get_ms();
+  nx_fs_open("test1", FS_FILE_MODE_TRUNCATE, &fd);
+  for (i=0; i<2000; i++) {
+    nx_fs_write(fd, 'T');
+  }
+  nx_fs_close(fd);
+
+  nx_display_string("Rewrite: ");
+  nx_display_uint(nx_systick_get_ms() - start);
+  nx_display_string("ms\n");
+  while (nx_avr_get_button() != BUTTON_OK);
+  nx_systick_wait_ms(500);
+
+  nx_display_clear();
+  nx_fs_dump();
+  while (nx_avr_get_button() != BUTTON_OK);
+  nx_systick_wait_ms(500);
+
+  destroy();
+}
+
+void fs_test_ring(void) {
+  fs_ring_cursor_t cursor;
+  U32 record, start, first = 0, count = 0;
+  fs_fd_t fd;
+
+  setup();
+
+  nx_display_clear();
+  nx_display_string("Starting...\n");
+
+  /* 4 pages of 49 records of 4 bytes each, gone around twice. */
+  start = nx_systick_get_ms();
+  nx_fs_ring_create("ring", 4, &fd);
+  for (record=0; record<420; record++) {
+    nx_fs_ring_append(fd, (U8 *)&record, sizeof(record));
+  }
+  nx_fs_close(fd);
+
+  nx_display_string("Append: ");
+  nx_display_uint(nx_systick_get_ms() - start);
+  nx_display_string("ms\n");
+
+  /* The newest records come back in order. */
+  nx_fs_open("ring", FS_FILE_MODE_OPEN, &fd);
+  nx_fs_ring_rewind(fd, &cursor);
+  while (nx_fs_ring_read(fd, &cursor, (U8 *)&record, sizeof(record),
+                         NULL) == FS_ERR_NO_ERROR) {
+    if (count == 0) {
+      first = record;
+    }
+
+    NX_ASSERT(record == first + count);
+    count++;
+  }
+
+  NX_ASSERT(first + count == 420);
+  nx_display_string("Kept: ");
+  nx_display_uint(first);
+  nx_display_string("-");
+  nx_display_uint(first + count - 1);
+  nx_display_end_line();
+
+  nx_fs_unlink(fd);
+  while (nx_avr_get_button() != BUTTON_OK);
+  nx_systick_wait_ms(500);
+
+  destroy();
+}
+
+/* Writes the same text plain and compressed, compares the flash pages
+ * they take, and reads the compressed one back.
+ */
+void fs_test_compress(void) {
+  const char *line = "forward 50\nleft 90\nforward 20\nright 45\n";
+  U32 free_before, free_plain, free_compressed, start, i;
+  char buf[64];
+  size_t read, total = 0;
+  fs_fd_t fd;
+
+  setup();
+
+  nx_display_clear();
+  nx_display_string("Starting...\n");
+
+  nx_fs_get_occupation(NULL, NULL, &free_before, NULL);
+  nx_fs_open("plain", FS_FILE_MODE_CREATE, &fd);
+  for (i=0; i<100; i++) {
+    nx_fs_write_buf(fd, (const U8 *)line, strlen(line));
+  }
+  nx_fs_close(fd);
+  nx_fs_get_occupation(NULL, NULL, &free_plain, NULL);
+
+  start = nx_systick_get_ms();
+  nx_fs_open("packed", FS_FILE_MODE_CREATE, &fd);
+  NX_ASSERT(nx_fs_compress(fd) == FS_ERR_NO_ERROR);
+  for (i=0; i<100; i++) {
+    nx_fs_write_buf(fd, (const U8 *)line, strlen(line));
+  }
+  nx_fs_close(fd);
+  nx_fs_get_occupation(NULL, NULL, &free_compressed, NULL);
+
+  nx_display_string("Write: ");
+  nx_display_uint(nx_systick_get_ms() - start);
+  nx_display_string("ms\n");
+
+  nx_display_string("Pages: ");
+  nx_display_uint(free_before - free_plain);
+  nx_display_string(" -> ");
+  nx_display_uint(free_plain - free_compressed);
+  nx_display_end_line();
+
+  start = nx_systick_get_ms();
+  nx_fs_open("packed", FS_FILE_MODE_OPEN, &fd);
+  NX_ASSERT(nx_fs_get_filesize(fd) == 100 * strlen(line));
+  while (nx_fs_read_buf(fd, (U8 *)buf, strlen(line), &read) ==
+         FS_ERR_NO_ERROR) {
+    NX_ASSERT(read == strlen(line) && streqn(buf, line, read));
+    total += read;
+  }
+  NX_ASSERT(total == 100 * strlen(line));
+
+  nx_display_string("Read: ");
+  nx_display_uint(nx_systick_get_ms() - start);
+  nx_display_string("ms\n");
+
+  nx_fs_unlink(fd);
+  nx_fs_open("plain", FS_FILE_MODE_OPEN, &fd);
+  nx_fs_unlink(fd);
+
+  while (nx_avr_get_button() != BUTTON_OK);
+  nx_systick_wait_ms(500);
+
+  destroy();
+}
+
+/* Replaces a file, checking that the old version stays readable until
+ * the new one is closed, and that an abandoned version goes away.
+ */
+void fs_test_replace(void) {
+  U32 value, start, i;
+  fs_fd_t fd, old;
+
+  setup();
+
+  nx_display_clear();
+  nx_display_string("Starting...\n");
+
+  nx_fs_open("config", FS_FILE_MODE_CREATE, &fd);
+  for (i=0; i<200; i++) {
+    nx_fs_write_buf(fd, (const U8 *)&i, sizeof(i));
+  }
+  nx_fs_close(fd);
+
+  start = nx_systick_get_ms();
+  NX_ASSERT(nx_fs_replace("config", &fd) == FS_ERR_NO_ERROR);
+  for (i=0; i<200; i++) {
+    value = i * 2;
+    nx_fs_write_buf(fd, (const U8 *)&value, sizeof(value));
+  }
+
+  nx_fs_open("config", FS_FILE_MODE_OPEN, &old);
+  nx_fs_seek(old, 100 * sizeof(U32));
+  nx_fs_read_buf(old, (U8 *)&value, sizeof(value), NULL);
+  NX_ASSERT(value == 100);
+  nx_fs_close(old);
+
+  NX_ASSERT(nx_fs_close(fd) == FS_ERR_NO_ERROR);
+
+  nx_display_string("Replace: ");
+  nx_display_uint(nx_systick_get_ms() - start);
+  nx_display_string("ms\n");
+
+  nx_fs_open("config", FS_FILE_MODE_OPEN, &fd);
+  nx_fs_seek(fd, 100 * sizeof(U32));
+  nx_fs_read_buf(fd, (U8 *)&value, sizeof(value), NULL);
+  NX_ASSERT(value == 200);
+  nx_fs_close(fd);
+
+  /* An abandoned version leaves the file as it was. */
+  nx_fs_replace("config", &fd);
+  nx_fs_write_buf(fd, (const U8 *)&start, sizeof(start));
+  nx_fs_unlink(fd);
+
+  nx_fs_open("config", FS_FILE_MODE_OPEN, &fd);
+  NX_ASSERT(nx_fs_get_filesize(fd) == 200 * sizeof(U32));
+  nx_fs_unlink(fd);
+
+  while (nx_avr_get_button() != BUTTON_OK);
+  nx_systick_wait_ms(500);
+
+  destroy();
+}
+
+/* Runs a hand-assembled module in place, and times its loading. */
+void fs_test_module(void) {
+  U32 image[] = {
+    MODULE_MAGIC,
+    MODULE_ABI_VERSION | sizeof(module_header_t) << 16,
+    sizeof(module_header_t),     /* entry */
+    sizeof(module_header_t) + 8, /* image_size */
+    16,                          /* ram_size */
+    0xE590000C,                  /* ldr r0, [r0, #12] (env->ram_size) */
+    0xE12FFF1E,                  /* bx lr */
+  };
+  const module_header_t *header;
+  U32 ram[16], start, i;
+  bool done = FALSE;
+  module_t module;
+  S32 status;
+  fs_fd_t fd;
+
+  setup();
+
+  nx_display_clear();
+  nx_display_string("Starting...\n");
+
+  spawn_file("test1", 1000);  // 128:test1 (5 pages - removed)
+  nx_fs_open("module", FS_FILE_MODE_CREATE, &fd);
+  nx_fs_write_buf(fd, (const U8 *)image, sizeof(image));
+  nx_fs_close(fd);
+  NX_ASSERT(nx_module_load("module", &module) == MODULE_ERR_NOT_EXECUTABLE);
+
+  nx_fs_open("module", FS_FILE_MODE_OPEN, &fd);
+  nx_fs_set_perms(fd, FS_PERM_EXECUTABLE);
+  nx_fs_close(fd);
+
+  start = nx_systick_get_ms();
+  for (i=0; i<100; i++) {
+    NX_ASSERT(nx_module_load("module", &module) == MODULE_ERR_NO_ERROR);
+    nx_module_unload(&module);
+  }
+
+  nx_display_string("Load: ");
+  nx_display_uint((nx_systick_get_ms() - start) * 10);
+  nx_display_string("us\n");
+
+  NX_ASSERT(nx_module_load("module", &module) == MODULE_ERR_NO_ERROR);
+  NX_ASSERT(nx_module_run(&module, ram, 8, NULL, &status) ==
+            MODULE_ERR_NOT_ENOUGH_RAM);
+  NX_ASSERT(nx_module_run(&module, ram, sizeof(ram), NULL, &status) ==
+            MODULE_ERR_NO_ERROR);
+  NX_ASSERT(status == sizeof(ram));
+
+  /* A loaded module stays where it is. */
+  header = module.header;
+  remove_file("test1");
+  NX_ASSERT(nx_fs_defrag_simple() == FS_ERR_FILE_MAPPED);
+  while (!done) {
+    NX_ASSERT(nx_fs_defrag_step(2, &done) == FS_ERR_NO_ERROR);
+  }
+  NX_ASSERT(module.header == header);
+  NX_ASSERT(nx_module_run(&module, ram, sizeof(ram), NULL, &status) ==
+            MODULE_ERR_NO_ERROR);
+  nx_module_unload(&module);
+
+  nx_display_string("Status: ");
+  nx_display_uint(status);
+  nx_display_end_line();
+
+  nx_fs_open("module", FS_FILE_MODE_OPEN, &fd);
+  nx_fs_unlink(fd);
+
+  while (nx_avr_get_button() != BUTTON_OK);
+  nx_systick_wait_ms(500);
+
+  destroy();
+}
+
+/* Number of mounts timed for each file count. */
+#define BENCH_MOUNTS 10
+
+/* Times the mount-time walk of the flash as the file count grows, and
+ * the first open of a file, which checks its payload.
+ */
+void fs_test_bench_mount(void) {
+  char name[] = "mount00";
+  U32 files = 0, start, count, rejected, i;
+  fs_fd_t fd;
+
+  setup();
+
+  nx_display_clear();
+  nx_display_string("- FS mount bench -\n\n");
+
+  for (count=0; count<=32; count=count ? count*2 : 4) {
+    for (; files<count; files++) {
+      name[5] = '0' + files / 10;
+      name[6] = '0' + files % 10;
+      spawn_file(name, 512);
+    }
+
+    start = nx_systick_get_ms();
+    for (i=0; i<BENCH_MOUNTS; i++) {
+      nx_fs_init();
+    }
+
+    nx_fs_get_mount_stats(NULL, &rejected);
+    NX_ASSERT(rejected == 0);
+
+    nx_display_uint(count);
+    nx_display_string(" files: ");
+    nx_display_uint((nx_systick_get_ms() - start) * 1000 / BENCH_MOUNTS);
+    nx_display_string("us\n");
+  }
+
+  start = nx_systick_get_ms();
+  NX_ASSERT(nx_fs_open("mount00", FS_FILE_MODE_OPEN, &fd)
+            == FS_ERR_NO_ERROR);
+  nx_display_string("1st open: ");
+  nx_display_uint(nx_systick_get_ms() - start);
+  nx_display_string("ms\n");
+  nx_fs_close(fd);
+
+  while (nx_avr_get_button() != BUTTON_OK);
+  nx_systick_wait_ms(500);
+
+  destroy();
+}
+
+void fs_test_kv(void) {
+  U32 value, start, compactions, i;
+  size_t read;
+
+  nx_display_clear();
+  nx_display_string("Starting...\n");
+
+  /* Updates are page programs, and only the odd one compacts. */
+  start = nx_systick_get_ms();
+  for (i=0; i<500; i++) {
+    NX_ASSERT(nx_kv_set("counter", &i, sizeof(i)) == KV_ERR_NO_ERROR);
+  }
+
+  nx_display_string("Update: ");
+  nx_display_uint((nx_systick_get_ms() - start) / 500);
+  nx_display_string("ms\n");
+
+  NX_ASSERT(nx_kv_get("counter", &value, sizeof(value), &read)
+            == KV_ERR_NO_ERROR);
+  NX_ASSERT(read == sizeof(value) && value == 499);
+
+  nx_kv_get_stats(NULL, NULL, &compactions);
+  nx_display_string("Compactions: ");
+  nx_display_uint(compactions);
+  nx_display_end_line();
+
+  NX_ASSERT(nx_kv_delete("counter") == KV_ERR_NO_ERROR);
+  NX_ASSERT(nx_kv_get("counter", &value, sizeof(value), NULL)
+            == KV_ERR_KEY_NOT_FOUND);
+
+  while (nx_avr_get_button() != BUTTON_OK);
+  nx_systick_wait_ms(500);
+}
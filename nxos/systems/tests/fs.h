@@ -15,6 +15,17 @@ void fs_test_defrag_empty(void);
 void fs_test_defrag_simple(void);
 void fs_test_defrag_for_file(void);
 void fs_test_defrag_best_overall(void);
+void fs_test_defrag_step(void);
+void fs_test_erase_step(void);
+void fs_test_bench_block_io(void);
+void fs_test_bench_mount(void);
+void fs_test_append_extents(void);
+void fs_test_reserve(void);
+void fs_test_ring(void);
+void fs_test_compress(void);
+void fs_test_replace(void);
+void fs_test_module(void);
+void fs_test_kv(void);
 
 #endif /* __NXOS_TESTS_FS_H__ */
 
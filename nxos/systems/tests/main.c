@@ -31,5 +31,6 @@ void main(void) {
   //tests_usb_hardcore();
   //tests_radar();
   //tests_util();
+  //tests_fs_bench();
   tests_defrag();
 }
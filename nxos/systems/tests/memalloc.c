@@ -0,0 +1,190 @@
+/* Copyright (c) 2008 the NxOS developers
+ *
+ * See AUTHORS for a full list of the developers.
+ *
+ * Redistribution of this file is permitted under
+ * the terms of the GNU Public License (GPL) version 2.
+ */
+
+#include "base/types.h"
+#include "base/assert.h"
+#include "base/display.h"
+#include "base/drivers/avr.h"
+#include "base/drivers/systick.h"
+#include "base/drivers/usb.h"
+#include "base/lib/memalloc/memalloc.h"
+#include "base/lib/memalloc/pool.h"
+#include "base/lib/tracing/tracing.h"
+#include "memalloc.h"
+
+#define SCRATCH_SIZE 1024
+#define HEAP_SIZE 8192
+
+/* Room for 256 allocator trace records. */
+#define TRACE_SIZE 4096
+
+void mem_test_arenas(void) {
+  arena_t scratch, heap;
+  U8 *scratch_mem = nx_malloc(SCRATCH_SIZE);
+  U8 *heap_mem = nx_malloc(HEAP_SIZE);
+  U32 scratch_base, heap_base, start, i;
+  void *a, *b;
+
+  nx_display_clear();
+  nx_display_string("Arenas...\n");
+
+  nx_arena_init(&scratch, "scratch", ARENA_BUMP, scratch_mem, SCRATCH_SIZE);
+  nx_arena_init(&heap, "heap", ARENA_TLSF, heap_mem, HEAP_SIZE);
+  scratch_base = nx_arena_used(&scratch);
+  heap_base = nx_arena_used(&heap);
+
+  /* A bump arena carves aligned blocks back to back. */
+  a = nx_arena_alloc(&scratch, 5);
+  b = nx_arena_alloc(&scratch, 12);
+  NX_ASSERT(((U32)a & 7) == 0 && (U8*)b == (U8*)a + 8);
+  NX_ASSERT(nx_arena_used(&scratch) == scratch_base + 8 + 16);
+
+  /* Freeing a TLSF arena block gives its memory back. */
+  a = nx_arena_alloc(&heap, 100);
+  b = nx_arena_alloc(&heap, 200);
+  nx_arena_free(&heap, a);
+  nx_arena_free(&heap, b);
+  NX_ASSERT(nx_arena_used(&heap) == heap_base);
+
+  /* Resets release everything at once, at a cost that does not depend
+   * on the number of blocks.
+   */
+  for (i=0; i<64; i++) {
+    nx_arena_alloc(&scratch, 8);
+    nx_arena_alloc(&heap, 64);
+  }
+
+  start = nx_systick_get_cycles();
+  nx_arena_reset(&scratch);
+  nx_display_string("Bump: ");
+  nx_display_uint(nx_systick_get_cycles() - start);
+  nx_display_string("cyc\n");
+
+  start = nx_systick_get_cycles();
+  nx_arena_reset(&heap);
+  nx_display_string("TLSF: ");
+  nx_display_uint(nx_systick_get_cycles() - start);
+  nx_display_string("cyc\n");
+
+  NX_ASSERT(nx_arena_used(&scratch) == scratch_base);
+  NX_ASSERT(nx_arena_used(&heap) == heap_base);
+
+  nx_free(heap_mem);
+  nx_free(scratch_mem);
+
+  while (nx_avr_get_button() != BUTTON_OK);
+  nx_systick_wait_ms(500);
+}
+
+void mem_test_pool(void) {
+  U32 sizes[2] = { 12, 32 }, counts[2] = { 4, 2 };
+  void *objects[6];
+  pool_t pool;
+  U32 i;
+
+  nx_display_clear();
+  nx_display_string("Pool...\n");
+
+  nx_pool_init(&pool, sizes, counts, 2);
+  NX_ASSERT(nx_pool_available(&pool, 1) == 6);
+  NX_ASSERT(nx_pool_available(&pool, 16) == 2);
+
+  /* Small objects spill over into the larger class once theirs is
+   * empty.
+   */
+  for (i=0; i<6; i++) {
+    objects[i] = nx_pool_alloc(&pool, 8);
+    NX_ASSERT(objects[i] != NULL);
+  }
+  NX_ASSERT(nx_pool_alloc(&pool, 8) == NULL);
+
+  nx_pool_free(&pool, objects[5]);
+  NX_ASSERT(nx_pool_alloc(&pool, 32) == objects[5]);
+  NX_ASSERT(nx_pool_alloc(&pool, 33) == NULL);
+
+  for (i=0; i<6; i++)
+    nx_pool_free(&pool, objects[i]);
+  NX_ASSERT(nx_pool_available(&pool, 1) == 6);
+
+  /* Grown objects go back to the class they were added to. */
+  nx_pool_grow(&pool, 8, 2);
+  NX_ASSERT(nx_pool_available(&pool, 16) == 2);
+  for (i=0; i<6; i++) {
+    objects[i] = nx_pool_alloc(&pool, 12);
+    NX_ASSERT(objects[i] != NULL);
+  }
+  NX_ASSERT(nx_pool_available(&pool, 1) == 2);
+  for (i=0; i<6; i++)
+    nx_pool_free(&pool, objects[i]);
+  NX_ASSERT(nx_pool_available(&pool, 1) == 8);
+  NX_ASSERT(nx_pool_available(&pool, 16) == 2);
+
+  nx_pool_destroy(&pool);
+
+  nx_display_string("Ok\n");
+  nx_systick_wait_ms(1000);
+}
+
+#ifdef NX_MEMALLOC_STATS
+void mem_test_stats(void) {
+  memalloc_stats_t stats;
+  U32 i;
+
+  nx_memalloc_get_stats(&stats);
+
+  nx_display_clear();
+  nx_display_string("Used: ");
+  nx_display_uint(stats.used);
+  nx_display_string("\nPeak: ");
+  nx_display_uint(stats.peak);
+  nx_display_string("\nLargest: ");
+  nx_display_uint(stats.largest_free);
+  nx_display_string("\nAllocs: ");
+  nx_display_uint(stats.allocs);
+  nx_display_string("\nFrees: ");
+  nx_display_uint(stats.frees);
+  nx_display_end_line();
+
+  /* The classes with free blocks, and how many. */
+  for (i=0; i<MEMALLOC_STATS_CLASSES; i++) {
+    if (stats.free_blocks[i] > 0) {
+      nx_display_uint(i);
+      nx_display_string(":");
+      nx_display_uint(stats.free_blocks[i]);
+      nx_display_string(" ");
+    }
+  }
+
+  while (nx_avr_get_button() != BUTTON_OK);
+  nx_systick_wait_ms(500);
+}
+
+/* Sent over USB, so it must stay valid until the transfer is done. */
+static memalloc_stats_t usb_stats;
+
+void mem_test_send_stats(void) {
+  nx_memalloc_get_stats(&usb_stats);
+  nx_usb_write((U8 *)&usb_stats, sizeof(usb_stats));
+  while (!nx_usb_data_written());
+}
+#endif
+
+#ifdef NX_MEMALLOC_TRACE
+/* The trace buffer is taken from the pool before recording starts, so
+ * that the replay does not see it.
+ */
+void mem_test_trace_start(void) {
+  nx_tracing_init(nx_malloc(TRACE_SIZE), TRACE_SIZE);
+  nx_memalloc_trace(TRUE);
+}
+
+void mem_test_send_trace(void) {
+  nx_usb_write(nx_tracing_get_start(), nx_tracing_get_size());
+  while (!nx_usb_data_written());
+}
+#endif
@@ -0,0 +1,23 @@
+/* Copyright (c) 2008 the NxOS developers
+ *
+ * See AUTHORS for a full list of the developers.
+ *
+ * Redistribution of this file is permitted under
+ * the terms of the GNU Public License (GPL) version 2.
+ */
+
+#ifndef __NXOS_TESTS_MEMALLOC_H__
+#define __NXOS_TESTS_MEMALLOC_H__
+
+void mem_test_arenas(void);
+void mem_test_pool(void);
+#ifdef NX_MEMALLOC_STATS
+void mem_test_stats(void);
+void mem_test_send_stats(void);
+#endif
+#ifdef NX_MEMALLOC_TRACE
+void mem_test_trace_start(void);
+void mem_test_send_trace(void);
+#endif
+
+#endif /* __NXOS_TESTS_MEMALLOC_H__ */
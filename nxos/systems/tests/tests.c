@@ -25,9 +25,11 @@
 #include "base/drivers/radar.h"
 #include "base/drivers/bt.h"
 #include "base/drivers/_uart.h"
+#include "base/lib/memalloc/memalloc.h"
 
 #include "tests/tests.h"
 #include "tests/fs.h"
+#include "tests/memalloc.h"
 
 static bool test_silent = FALSE;
 
@@ -544,6 +546,14 @@ static int tests_command(char *buffer) {
     tests_bt2();
   else if (streq(buffer, "all"))
     tests_all();
+#ifdef NX_MEMALLOC_STATS
+  else if (streq(buffer, "memstats"))
+    mem_test_send_stats();
+#endif
+#ifdef NX_MEMALLOC_TRACE
+  else if (streq(buffer, "memtrace"))
+    mem_test_send_trace();
+#endif
   else if (streq(buffer, "halt"))
     return 2;
   else if (streq(buffer, "Al"))
@@ -861,6 +871,13 @@ void tests_fs(void) {
   fs_test_infos();
   nx_systick_wait_ms(2000);
   fs_test_dump();
+  fs_test_append_extents();
+  fs_test_reserve();
+  fs_test_ring();
+  fs_test_compress();
+  fs_test_replace();
+  fs_test_module();
+  fs_test_kv();
   goodbye();
 }
 
@@ -870,6 +887,32 @@ void tests_defrag(void) {
   //fs_test_defrag_empty();
   //fs_test_defrag_for_file();
   fs_test_defrag_best_overall();
+  fs_test_defrag_step();
+  fs_test_erase_step();
+  goodbye();
+}
+
+void tests_fs_bench(void) {
+  hello();
+  fs_test_bench_block_io();
+  fs_test_bench_mount();
+  goodbye();
+}
+
+void tests_memalloc(void) {
+  hello();
+  nx_memalloc_init();
+#ifdef NX_MEMALLOC_TRACE
+  mem_test_trace_start();
+#endif
+  mem_test_arenas();
+  mem_test_pool();
+#ifdef NX_MEMALLOC_TRACE
+  nx_memalloc_trace(FALSE);
+#endif
+#ifdef NX_MEMALLOC_STATS
+  mem_test_stats();
+#endif
   goodbye();
 }
 
@@ -885,6 +928,7 @@ void tests_all(void) {
   tests_sysinfo();
   tests_radar();
   tests_fs();
+  tests_memalloc();
 
   test_silent = FALSE;
   goodbye();
@@ -26,6 +26,8 @@ void tests_bt(void);
 void tests_bt2(void);
 void tests_fs(void);
 void tests_defrag(void);
+void tests_fs_bench(void);
+void tests_memalloc(void);
 
 void tests_all(void);
 